@@ -4,19 +4,23 @@
 #include "likely/RuntimeError.h"
 #include "likely/AbsBinning.h"
 #include "likely/CovarianceMatrix.h"
+#include "likely/MappedCovarianceMatrix.h"
+#include "likely/KroneckerCovarianceMatrix.h"
+#include "likely/MappedFile.h"
+#include "likely/PackedKernels.h"
 
 #include "boost/foreach.hpp"
 #include "boost/format.hpp"
 #include "boost/lexical_cast.hpp"
 
 #include <iostream>
+#include <algorithm>
 
 namespace local = likely;
 
 local::BinnedData::BinnedData(BinnedGrid const &grid)
-: _grid(grid)
+: _grid(grid), _bins(new Bins(grid.getNBinsTotal())), _data(new std::vector<double>())
 {
-    _offset.resize(_grid.getNBinsTotal(),EMPTY_BIN);
     _weight = 1;
     _weighted = false;
     _finalized = false;
@@ -32,7 +36,7 @@ void local::BinnedData::cloneCovariance() {
     if(hasCovariance()) {
         // Release our reference to the original covariance matrix and reset our
         // smart pointer to a copy of the original covariance matrix.
-        _covariance.reset(new CovarianceMatrix(*_covariance));
+        _covariance.reset(_covariance->clone());
     }
 }
 
@@ -48,14 +52,17 @@ local::BinnedData& local::BinnedData::add(BinnedData const& other, double weight
     if(0 == weight) return *this;
     // Do we have any data yet?
     if(0 == getNBinsWithData()) {
+        if(weight < 0) {
+            throw RuntimeError("BinnedData::add: cannot subtract from an empty dataset.");
+        }
         // If we are empty, then we only require that the other dataset have the same binning.
         if(!isCongruent(other,true)) {
             throw RuntimeError("BinnedData::add: datasets have different binning.");
         }
-        // Initialize each occupied bin of the other dataset to zero contents in our dataset.
-        for(IndexIterator iter = other.begin(); iter != other.end(); ++iter) {
-            setData(*iter,0);
-        }
+        // Share the other dataset's bins and initialize each one to zero contents in our dataset.
+        _bins = other._bins;
+        _data.reset(new std::vector<double>(other.getNBinsWithData(),0));
+        _dataCache.reset();
         // If the other dataset has a covariance matrix, initialize ours now.
         if(other.hasCovariance()) {
             _covariance.reset(new CovarianceMatrix(getNBinsWithData()));
@@ -80,19 +87,29 @@ local::BinnedData& local::BinnedData::add(BinnedData const& other, double weight
             throw RuntimeError("BinnedData::add: cannot modify shared covariance.");
         }
     }
-    // Add the weighted _data vectors, element by element, and save the result in our _data.
     _setWeighted(true,true); // flushes any cached data
     other._setWeighted(true);
-    for(int offset = 0; offset < _data.size(); ++offset) {
-        _data[offset] += weight*other._data[offset];
-    }
+    // Add Cinv matrices (or scalar weights) first, since these can fail and should then leave
+    // our weighted data unchanged.
     if(hasCovariance()) {
-        // Add Cinv matrices and save the result as our new Cinv matrix.
-        _covariance->addInverse(*other._covariance,weight);        
+        if(weight > 0) {
+            _covariance->addInverse(*other._covariance,weight);
+        }
+        else {
+            _covariance->subtractInverse(*other._covariance,-weight);
+        }
     }
     else {
+        if(_weight + other._weight*weight <= 0) {
+            throw RuntimeError("BinnedData::add: result has a non-positive weight.");
+        }
         _weight += other._weight*weight;
     }
+    // Add the weighted _data vectors and save the result in our _data. Once both datasets are
+    // weighted, e.g., for compressed resampler observations, this does not allocate any memory.
+    std::vector<double> &data(_changesData());
+    std::vector<double> const &otherData(*other._data);
+    if(data.size() > 0) addScaled(&otherData[0],weight,&data[0],data.size());
     return *this;
 }
 
@@ -107,7 +124,7 @@ void local::BinnedData::_setWeighted(bool weighted, bool flushCache) const {
     // Are we already in the desired state?
     if(weighted != _weighted) {
         // Do we have a cached result we can use?
-        if(_dataCache.size() > 0) {
+        if(_dataCache) {
             // Enable argument-dependent lookup (ADL)
             using std::swap;
             swap(_data,_dataCache);
@@ -115,41 +132,44 @@ void local::BinnedData::_setWeighted(bool weighted, bool flushCache) const {
         else {
 #ifdef PARANOID_DATA_CACHE
             // Save the original state of our cache.
-            std::vector<double> saveCache = _dataCache;
+            std::vector<double> saveCache;
+            if(_dataCache) saveCache = *_dataCache;
 #endif
-            // Copy the original data to our cache (unless we are going to flush it below)
+            // Share the original data with our cache (unless we are going to flush it below),
+            // so that the transformation below writes to a new copy.
             if(!flushCache) _dataCache = _data;
-        
+            std::vector<double> &data(_changesData());
+
             // Do the appropriate transformation of our data vector.
             if(weighted) {
                 if(hasCovariance() && getNBinsWithData() > 0) {
                     // Change data to Cinv.data
-                    _covariance->multiplyByInverseCovariance(_data);
+                    _covariance->multiplyByInverseCovariance(data);
                 }
                 else if(_weight != 1) {
                     // Scale data by _weight, which plays the role of Cinv.
-                    for(int offset = 0; offset < _data.size(); ++offset) _data[offset] *= _weight;
+                    for(int offset = 0; offset < data.size(); ++offset) data[offset] *= _weight;
                 }
             }
             else {
                 if(hasCovariance() && getNBinsWithData() > 0) {
                     // Change Cinv.data to data = C.Cinv.data
-                    _covariance->multiplyByCovariance(_data);
+                    _covariance->multiplyByCovariance(data);
                 }
                 else if(_weight != 1) {
                     // Scale data by 1/_weight, which plays the role of C.
-                    for(int offset = 0; offset < _data.size(); ++offset) _data[offset] /= _weight;
+                    for(int offset = 0; offset < data.size(); ++offset) data[offset] /= _weight;
                 }
             }
 #ifdef PARANOID_DATA_CACHE
             // If we have a saved cache, was it actually valid?
             if(saveCache.size() > 0) {
-                assert(saveCache.size() == _data.size());
-                for(int offset = 0; offset < _data.size(); ++offset) {
-                    double eps = std::fabs(_data[offset] - saveCache[offset]);
+                assert(saveCache.size() == data.size());
+                for(int offset = 0; offset < data.size(); ++offset) {
+                    double eps = std::fabs(data[offset] - saveCache[offset]);
                     if(eps > 1e-8) {
                         std::cerr << "Invalid BinnedData cache: " << offset << ' '
-                            << _data[offset] << " != " << saveCache[offset] << " (eps = "
+                            << data[offset] << " != " << saveCache[offset] << " (eps = "
                             << eps << ")" << std::endl;
                         assert(false);
                         break;
@@ -161,10 +181,18 @@ void local::BinnedData::_setWeighted(bool weighted, bool flushCache) const {
         // Record our new state.
         _weighted = weighted;
     }
-    // Flush the cache now, if requested. We use resize instead of swapping with an empty vector
-    // since we are likely to need at least as much capacity in future, and the overhead of
-    // this cache is small compared with a covariance matrix.
-    if(flushCache) _dataCache.resize(0);
+    // Flush the cache now, if requested.
+    if(flushCache) _dataCache.reset();
+}
+
+std::vector<double> &local::BinnedData::_changesData() const {
+    if(!_data.unique()) _data.reset(new std::vector<double>(*_data));
+    return *_data;
+}
+
+local::BinnedData::Bins &local::BinnedData::_changesBins() {
+    if(!_bins.unique()) _bins.reset(new Bins(*_bins));
+    return *_bins;
 }
 
 bool local::BinnedData::isCongruent(BinnedData const& other, bool onlyBinning, bool ignoreCovariance) const {
@@ -172,8 +200,12 @@ bool local::BinnedData::isCongruent(BinnedData const& other, bool onlyBinning, b
     if(!onlyBinning) {
         // [2] List (not set, i.e., order matters) of bins with data must be the same.
         if(other.getNBinsWithData() != getNBinsWithData()) return false;
-        for(int offset = 0; offset < _index.size(); ++offset) {
-            if(other._index[offset] != _index[offset]) return false;
+        // Datasets that share their bins are trivially congruent.
+        if(other._bins != _bins) {
+            std::vector<int> const &index(_bins->index), &otherIndex(other._bins->index);
+            for(int offset = 0; offset < index.size(); ++offset) {
+                if(otherIndex[offset] != index[offset]) return false;
+            }
         }
         if(!ignoreCovariance) {
             // [3] Both must have or not have an associated covariance matrix.
@@ -185,22 +217,22 @@ bool local::BinnedData::isCongruent(BinnedData const& other, bool onlyBinning, b
 }
 
 int local::BinnedData::getIndexAtOffset(int offset) const {
-    if(offset < 0 || offset >= _index.size()) {
+    if(offset < 0 || offset >= getNBinsWithData()) {
         throw RuntimeError("BinnedData::getIndexAtOffset: invalid offset.");
     }
-    return _index[offset];
+    return _bins->index[offset];
 }
 
 int local::BinnedData::getOffsetForIndex(int index) const {
     if(!hasData(index)) {
         throw RuntimeError("BinnedData::getOffsetForIndex: no data at index.");
     }
-    return _offset[index];
+    return _bins->offset.getOffset(index);
 }
 
 bool local::BinnedData::hasData(int index) const {
     _grid.checkIndex(index);
-    return !(_offset[index] == EMPTY_BIN);
+    return !(_bins->offset.getOffset(index) == BinnedOffsetMap::EMPTY_BIN);
 }
 
 double local::BinnedData::getData(int index, bool weighted) const {
@@ -208,13 +240,13 @@ double local::BinnedData::getData(int index, bool weighted) const {
         throw RuntimeError("BinnedData::getData: bin is empty.");
     }
     _setWeighted(weighted);
-    return _data[_offset[index]];
+    return (*_data)[_bins->offset.getOffset(index)];
 }
 
 void local::BinnedData::setData(int index, double value, bool weighted) {
     _setWeighted(weighted,true); // flushes any cached data
     if(hasData(index)) {
-        _data[_offset[index]] = value;
+        _changesData()[_bins->offset.getOffset(index)] = value;
     }
     else {
         if(hasCovariance()) {
@@ -223,9 +255,10 @@ void local::BinnedData::setData(int index, double value, bool weighted) {
         if(isFinalized()) {
             throw RuntimeError("BinnedData::setData: object is finalized.");
         }
-        _offset[index] = _index.size();
-        _index.push_back(index);
-        _data.push_back(value);
+        Bins &bins(_changesBins());
+        bins.offset.setOffset(index,bins.index.size());
+        bins.index.push_back(index);
+        _changesData().push_back(value);
     }
 }
 
@@ -234,7 +267,7 @@ void local::BinnedData::addData(int index, double offset, bool weighted) {
         throw RuntimeError("BinnedData::addData: bin is empty.");        
     }
     _setWeighted(weighted,true); // flushes any cached data
-    _data[_offset[index]] += offset;
+    _changesData()[_bins->offset.getOffset(index)] += offset;
 }
 
 double local::BinnedData::getCovariance(int index1, int index2) const {
@@ -244,7 +277,7 @@ double local::BinnedData::getCovariance(int index1, int index2) const {
     if(!hasData(index1) || !hasData(index2)) {
         throw RuntimeError("BinnedData::getCovariance: bin is empty.");
     }
-    return _covariance->getCovariance(_offset[index1],_offset[index2]);
+    return _covariance->getCovariance(_bins->offset.getOffset(index1),_bins->offset.getOffset(index2));
 }
 
 double local::BinnedData::getInverseCovariance(int index1, int index2) const {
@@ -254,7 +287,7 @@ double local::BinnedData::getInverseCovariance(int index1, int index2) const {
     if(!hasData(index1) || !hasData(index2)) {
         throw RuntimeError("BinnedData::getInverseCovariance: bin is empty.");
     }
-    return _covariance->getInverseCovariance(_offset[index1],_offset[index2]);
+    return _covariance->getInverseCovariance(_bins->offset.getOffset(index1),_bins->offset.getOffset(index2));
 }
 
 void local::BinnedData::setCovariance(int index1, int index2, double value) {
@@ -273,7 +306,7 @@ void local::BinnedData::setCovariance(int index1, int index2, double value) {
     }
     // Note that we do not call _setWeighted here, so we are changing the meaning
     // of _data in a way that depends on the current value of _weighted.
-    _covariance->setCovariance(_offset[index1],_offset[index2],value);
+    _covariance->setCovariance(_bins->offset.getOffset(index1),_bins->offset.getOffset(index2),value);
 }
 
 void local::BinnedData::setInverseCovariance(int index1, int index2, double value) {
@@ -292,7 +325,53 @@ void local::BinnedData::setInverseCovariance(int index1, int index2, double valu
     }
     // Note that we do not call _setWeighted here, so we are changing the meaning
     // of _data in a way that depends on the current value of _weighted.
-    _covariance->setInverseCovariance(_offset[index1],_offset[index2],value);
+    _covariance->setInverseCovariance(_bins->offset.getOffset(index1),_bins->offset.getOffset(index2),value);
+}
+
+void local::BinnedData::adoptData(std::vector<int> &indices, std::vector<double> &values) {
+    if(isFinalized()) {
+        throw RuntimeError("BinnedData::adoptData: object is finalized.");
+    }
+    if(getNBinsWithData() > 0) {
+        throw RuntimeError("BinnedData::adoptData: object already has data.");
+    }
+    if(indices.size() != values.size()) {
+        throw RuntimeError("BinnedData::adoptData: indices and values have different sizes.");
+    }
+    // Build our new bins before changing anything.
+    boost::shared_ptr<Bins> bins(new Bins(_grid.getNBinsTotal()));
+    for(int offset = 0; offset < indices.size(); ++offset) {
+        int index(indices[offset]);
+        _grid.checkIndex(index);
+        if(bins->offset.getOffset(index) != BinnedOffsetMap::EMPTY_BIN) {
+            throw RuntimeError("BinnedData::adoptData: duplicate index.");
+        }
+        bins->offset.setOffset(index,offset);
+    }
+    bins->index.swap(indices);
+    std::vector<int>().swap(indices);
+    _bins = bins;
+    _data.reset(new std::vector<double>());
+    _data->swap(values);
+    _dataCache.reset();
+    _weighted = false;
+}
+
+void local::BinnedData::adoptCovariance(std::vector<double> &packed, bool inverse) {
+    if(isFinalized()) {
+        throw RuntimeError("BinnedData::adoptCovariance: object is finalized.");
+    }
+    if(0 == getNBinsWithData()) {
+        throw RuntimeError("BinnedData::adoptCovariance: no bins with data.");
+    }
+    CovarianceMatrixPtr covariance(new CovarianceMatrix(getNBinsWithData()));
+    if(inverse) {
+        covariance->adoptInverseCovariance(packed);
+    }
+    else {
+        covariance->adoptCovariance(packed);
+    }
+    _covariance = covariance;
 }
 
 void local::BinnedData::transformCovariance(CovarianceMatrixPtr D) {
@@ -332,37 +411,27 @@ int local::BinnedData::projectOntoModes(int nkeep) {
     if(0 == nkeep || nkeep >= size || nkeep <= -size) {
         throw RuntimeError("BinnedData::projectOntoModes: invalid value of nkeep.");
     }
-    // Do the eigenmode analysis.
+    // Do the eigenmode analysis, only solving for the modes we keep.
     std::vector<double> eigenvalues,eigenvectors;
-    _covariance->getEigenModes(eigenvalues,eigenvectors);
-    // What range of modes are we projecting onto?
-    int index1,index2,ndrop;
-    if(nkeep > 0) {
-        index1 = 0;
-        index2 = nkeep;
-        ndrop = size - nkeep;
-    }
-    else {
-        index1 = size + nkeep;
-        index2 = size;
-        ndrop = size + nkeep;
-    }
+    _covariance->getEigenModes(nkeep,eigenvalues,eigenvectors);
+    int nmodes(eigenvalues.size()), ndrop(size - nmodes);
     // Prepare to change our data vector.
     unweightData();
     std::vector<double> projected(size,0);
     // Loop over modes
-    for(int index = index1; index < index2; ++index) {
+    for(int index = 0; index < nmodes; ++index) {
         // Calculate the dot product of this mode with our data vector.
         double dotprod(0);
         for(int bin = 0; bin < size; ++bin) {
-            dotprod += _data[bin]*eigenvectors[index*size+bin];
+            dotprod += (*_data)[bin]*eigenvectors[index*size+bin];
         }
         // Update our projected vector.
         for(int bin = 0; bin < size; ++bin) {
             projected[bin] += dotprod*eigenvectors[index*size+bin];
         }
     }
-    _data = projected;
+    _data.reset(new std::vector<double>());
+    _data->swap(projected);
     return ndrop;
 }
 
@@ -390,11 +459,38 @@ void local::BinnedData::shareCovarianceMatrix(BinnedData const &other) {
     _covariance = other._covariance;
 }
 
+void local::BinnedData::setSeparableCovariance(
+std::vector<CovarianceMatrixCPtr> const &axisCovariances) {
+    if(isFinalized()) {
+        throw RuntimeError("BinnedData::setSeparableCovariance: object is finalized.");
+    }
+    int nAxes(_grid.getNAxes());
+    if(axisCovariances.size() != nAxes) {
+        throw RuntimeError("BinnedData::setSeparableCovariance: expected one covariance per axis.");
+    }
+    for(int axis = 0; axis < nAxes; ++axis) {
+        if(!axisCovariances[axis] ||
+        axisCovariances[axis]->getSize() != _grid.getAxisBinning(axis)->getNBins()) {
+            throw RuntimeError("BinnedData::setSeparableCovariance: axis covariance has the wrong size.");
+        }
+    }
+    // Our covariance is indexed by offset, so offsets must coincide with global indices.
+    if(getNBinsWithData() != _grid.getNBinsTotal()) {
+        throw RuntimeError("BinnedData::setSeparableCovariance: every bin must have data.");
+    }
+    for(int offset = 0; offset < getNBinsWithData(); ++offset) {
+        if(_bins->index[offset] != offset) {
+            throw RuntimeError("BinnedData::setSeparableCovariance: bins were not filled in index order.");
+        }
+    }
+    _covariance.reset(new KroneckerCovarianceMatrix(axisCovariances));
+}
+
 bool local::BinnedData::compress(bool weighted) const {
     // Get our data vector into the requested format (weighted/unweighted)
     _setWeighted(weighted);
     // Drop any storage used by our cache of the alternate format.
-    std::vector<double>().swap(_dataCache);
+    _dataCache.reset();
     // Compress our covariance matrix, if any.
     return _covariance.get() ? _covariance->compress() : false;
 }
@@ -408,9 +504,10 @@ bool local::BinnedData::isCompressed() const {
 }
 
 std::size_t local::BinnedData::getMemoryUsage(bool includeCovariance) const {
-    std::size_t size = sizeof(*this) +
-        sizeof(int)*(_offset.capacity() + _index.capacity()) +
-        sizeof(double)*(_data.capacity() + _dataCache.capacity());
+    // Vectors that are shared with other objects are included in the usage of each object.
+    std::size_t size = sizeof(*this) + _bins->offset.getMemoryUsage() +
+        sizeof(int)*_bins->index.capacity() + sizeof(double)*_data->capacity();
+    if(_dataCache) size += sizeof(double)*_dataCache->capacity();
     if(hasCovariance() && includeCovariance) size += _covariance->getMemoryUsage();
     return size;
 }
@@ -424,29 +521,31 @@ void local::BinnedData::prune(std::set<int> const &keep) {
     std::set<int> offsets;
     BOOST_FOREACH(int index, keep) {
         _grid.checkIndex(index);
-        offsets.insert(_offset[index]);
+        offsets.insert(_bins->offset.getOffset(index));
     }
     // Are we actually removing anything?
     int newSize(offsets.size());
     if(newSize == getNBinsWithData()) return;
-    // Reset our vector of offset for each index with data.
-    _offset.assign(_grid.getNBinsTotal(),EMPTY_BIN);
+    // Reset our map of offset for each index with data.
+    Bins &bins(_changesBins());
+    bins.offset.clear();
     // Shift our (unweighted) data vector elements down to compress out any elements
     // we are not keeping. We are using the fact that std::set guarantees that iteration
     // follows sort order, from smallest to largest key value.
     unweightData();
+    std::vector<double> &data(_changesData());
     int newOffset(0);
     BOOST_FOREACH(int oldOffset, offsets) {
         // oldOffset >= newOffset so we will never clobber an element that we still need
         assert(oldOffset >= newOffset);
-        int index = _index[oldOffset];
-        _offset[index] = newOffset;
-        _index[newOffset] = index;
-        _data[newOffset] = _data[oldOffset];
+        int index = bins.index[oldOffset];
+        bins.offset.setOffset(index,newOffset);
+        bins.index[newOffset] = index;
+        data[newOffset] = data[oldOffset];
         newOffset++;
     }
-    _index.resize(newSize);
-    _data.resize(newSize);
+    bins.index.resize(newSize);
+    data.resize(newSize);
     // Prune our covariance matrix, if any.
     if(hasCovariance()) {
         if(!isCovarianceModifiable()) cloneCovariance();
@@ -470,6 +569,45 @@ double local::BinnedData::chiSquare(std::vector<double> pred) const {
     return hasCovariance() ? _covariance->chiSquare(pred) : unweighted*_weight;
 }
 
+double local::BinnedData::chiSquare(std::vector<double> const &pred, std::vector<double> const &jacobian,
+std::vector<double> &gradient, std::vector<double> *hessian) const {
+    int nbins(getNBinsWithData());
+    if(pred.size() != nbins) {
+        throw RuntimeError("BinnedData::chiSquare: prediction vector has wrong size.");
+    }
+    if(0 == jacobian.size() || 0 != jacobian.size() % nbins) {
+        throw RuntimeError("BinnedData::chiSquare: jacobian has wrong size.");
+    }
+    int npar(jacobian.size()/nbins);
+    // Store the residuals followed by the Jacobian columns, and multiply them all by Cinv.
+    _setWeighted(false);
+    std::vector<double> weighted(nbins*(npar+1));
+    for(int k = 0; k < nbins; ++k) weighted[k] = pred[k] - (*_data)[k];
+    std::copy(jacobian.begin(),jacobian.end(),weighted.begin()+nbins);
+    if(hasCovariance()) {
+        _covariance->multiplyByInverseCovariance(&weighted[0],npar+1);
+    }
+    else {
+        for(int k = 0; k < weighted.size(); ++k) weighted[k] *= _weight;
+    }
+    // chi2 = r.Cinv.r and its gradient is 2 Jt.Cinv.r
+    double const *residual(&weighted[0]);
+    double chi2(0);
+    for(int k = 0; k < nbins; ++k) chi2 += (pred[k] - (*_data)[k])*residual[k];
+    gradient.resize(npar);
+    for(int p = 0; p < npar; ++p) gradient[p] = 2*dotProduct(&jacobian[p*nbins],residual,nbins);
+    if(hessian) {
+        hessian->resize((npar*(npar+1))/2);
+        for(int col = 0; col < npar; ++col) {
+            double const *weightedColumn(&weighted[(col+1)*nbins]);
+            for(int row = 0; row <= col; ++row) {
+                (*hessian)[row + (col*(col+1))/2] = 2*dotProduct(&jacobian[row*nbins],weightedColumn,nbins);
+            }
+        }
+    }
+    return chi2;
+}
+
 void local::BinnedData::getDecorrelatedWeights(std::vector<double> const &pred,
 std::vector<double> &dweights) const {
     int nbins(getNBinsWithData());
@@ -544,28 +682,98 @@ void local::BinnedData::saveInverseCovariance(std::ostream &os, double scale) co
     }
 }
 
+void local::BinnedData::saveBinary(std::string const &filename) const {
+    // Save the unweighted data in the same order as our index map.
+    std::vector<double> data;
+    data.reserve(getNBinsWithData());
+    for(IndexIterator iter = begin(); iter != end(); ++iter) data.push_back(getData(*iter));
+    MappedFileContents contents;
+    contents.ndata = getNBinsWithData();
+    contents.nbins = _grid.getNBinsTotal();
+    if(contents.ndata > 0) {
+        contents.index = &_bins->index[0];
+        contents.data = &data[0];
+    }
+    if(hasCovariance()) {
+        _covariance->saveBinary(filename,contents);
+    }
+    else {
+        MappedFile::write(filename,contents);
+    }
+}
+
+void local::BinnedData::loadBinary(std::string const &filename) {
+    if(isFinalized()) {
+        throw RuntimeError("BinnedData::loadBinary: object is finalized.");
+    }
+    if(getNBinsWithData() > 0) {
+        throw RuntimeError("BinnedData::loadBinary: object already has data.");
+    }
+    MappedFileCPtr file(new MappedFile(filename));
+    MappedFileContents const &contents(file->getContents());
+    if(contents.nbins != _grid.getNBinsTotal()) {
+        throw RuntimeError("BinnedData::loadBinary: file does not match our grid.");
+    }
+    std::vector<int> indices(contents.index,contents.index + contents.ndata);
+    std::vector<double> values(contents.data,contents.data + contents.ndata);
+    adoptData(indices,values);
+    if(contents.size > 0) {
+        setCovarianceMatrix(CovarianceMatrixPtr(new MappedCovarianceMatrix(file)));
+    }
+}
+
 local::BinnedDataPtr local::BinnedData::sample(RandomPtr random) const {
     // Create a new dataset with the same binning.
     bool binningOnly(true);
     BinnedDataPtr sampled(this->clone(binningOnly));
     // Fill the new dataset with noise sampled from our covariance.
-    _covariance->sample(sampled->_data,random);
-    // Copy our data vector book-keeping arrays to the sampled dataset.
-    sampled->_offset = _offset;
-    sampled->_index = _index;
+    _covariance->sample(sampled->_changesData(),random);
+    // Share our data vector book-keeping arrays with the sampled dataset.
+    sampled->_bins = _bins;
     // Add our (unweighted) data vector to the sampled noise.
     _setWeighted(false);
     // sampled was constructed with _weighted = false and empty _dataCache so
     // the next line shouldn't actually do anything
     sampled->unweightData();
-    for(int offset = 0; offset < _data.size(); ++offset) {
-        sampled->_data[offset] += _data[offset];
+    std::vector<double> &sampledData(sampled->_changesData());
+    for(int offset = 0; offset < sampledData.size(); ++offset) {
+        sampledData[offset] += (*_data)[offset];
     }
     // Copy our covariance matrix to the sampled data.
     sampled->setCovarianceMatrix(_covariance);
     return sampled;
 }
 
+std::vector<local::BinnedDataPtr> local::BinnedData::sample(int nsample, RandomPtr random) const {
+    if(nsample <= 0) {
+        throw RuntimeError("BinnedData::sample: expected nsample > 0.");
+    }
+    if(!hasCovariance()) {
+        throw RuntimeError("BinnedData::sample: no covariance matrix available.");
+    }
+    // Generate all of the noise vectors at once.
+    int ndata(getNBinsWithData());
+    boost::shared_array<double> noise = _covariance->sample(nsample,random);
+    // Add our (unweighted) data vector to each noise vector.
+    _setWeighted(false);
+    std::vector<BinnedDataPtr> samples;
+    samples.reserve(nsample);
+    bool binningOnly(true);
+    for(int n = 0; n < nsample; ++n) {
+        BinnedDataPtr sampled(this->clone(binningOnly));
+        sampled->_bins = _bins;
+        double const *delta(noise.get() + n*ndata);
+        std::vector<double> &sampledData(sampled->_changesData());
+        sampledData.resize(ndata);
+        for(int offset = 0; offset < ndata; ++offset) {
+            sampledData[offset] = (*_data)[offset] + delta[offset];
+        }
+        sampled->setCovarianceMatrix(_covariance);
+        samples.push_back(sampled);
+    }
+    return samples;
+}
+
 double local::BinnedData::getScalarWeight() const {
     return hasCovariance() ? std::exp(-_covariance->getLogDeterminant()/getNBinsWithData()) : _weight;
 }
@@ -573,7 +781,7 @@ double local::BinnedData::getScalarWeight() const {
 std::string local::BinnedData::getMemoryState() const {
     std::string state = boost::str(boost::format("%6d %s%c ")
         % getMemoryUsage(false) % (_weighted ? "CinvD" : "    D")
-        % (_dataCache.size() > 0 ? '+':'-')); // +/- indicates if complement to data is cached
+        % (_dataCache ? '+':'-')); // +/- indicates if complement to data is cached
     if(hasCovariance()) {
         state += boost::str(boost::format("refcount %2d ") % _covariance.use_count());
         state += _covariance->getMemoryState();
@@ -5,6 +5,7 @@
 
 #include "likely/types.h"
 #include "likely/BinnedGrid.h"
+#include "likely/BinnedOffsetMap.h"
 
 #include "boost/smart_ptr.hpp"
 
@@ -21,7 +22,8 @@ namespace likely {
     // the getIndex method. BinnedData may be copied (using the default copy constructor or
     // the provided assignment operator), in which case the copy will have smart pointers
     // the the same underlying binning objects and covariance matrix (if one is present in
-    // the original).
+    // the original). A copy also shares the original's list of bins with data and its data
+    // vector until either object changes them, so copying is inexpensive.
 	class BinnedData {
 	public:
 	    // Creates a new dataset for the specified grid.
@@ -64,8 +66,12 @@ namespace likely {
         BinnedData& operator+=(BinnedData const &other);
         // Adds another congruent binned dataset to our dataset with an arbitrary weight.
         // Note that using weights different from 1 will generally produce an incorrect
-        // covariance matrix. For some common cases of correctly weighted combinations,
-        // use a BinnedDataResampler.
+        // covariance matrix, except that a weight of -1 removes, up to round-off, a dataset that
+        // was previously added. A negative weight uses CovarianceMatrix::subtractInverse, so
+        // the resulting covariance is only validated when it is next decomposed, e.g., by
+        // getData(), which then throws a RuntimeError if round-off has spoiled it. Throws a
+        // RuntimeError, leaving this dataset unchanged, if a scalar weight would not be positive.
+        // For some common cases of correctly weighted combinations, use a BinnedDataResampler.
         virtual BinnedData& add(BinnedData const &other, double weight = 1);
         // Tests if another binned dataset is "congruent" with ours. Congruence requires:
         // [1] identical binning specifications along each axis
@@ -174,6 +180,18 @@ namespace likely {
         // not of getData(...,weighted=true). Use the unweightData() method for more control of this.
         void setCovariance(int index1, int index2, double value);
         void setInverseCovariance(int index1, int index2, double value);
+        // Fills this object, which must not have any data yet, with the values provided for
+        // each of the specified global indices, in order, or throws a RuntimeError without
+        // changing anything. All indices are validated at once and the values are adopted
+        // without being copied, so both input vectors are empty on return. This is much faster
+        // than calling setData for each bin. Values are unweighted.
+        void adoptData(std::vector<int> &indices, std::vector<double> &values);
+        // Replaces our covariance matrix, if any, with a new matrix whose (inverse) covariance
+        // elements are adopted from the packed vector provided, or throws a RuntimeError. See
+        // CovarianceMatrix::adoptCovariance for details. The packed matrix elements refer to our
+        // bins in the order of our index iterator. Think about whether you want to call
+        // unweightData() first.
+        void adoptCovariance(std::vector<double> &packed, bool inverse = false);
         // Returns a const shared pointer to our covariance matrix, if any.
         CovarianceMatrixCPtr getCovarianceMatrix() const;
         // Replaces our covariance matrix, if any, with the specified matrix or throws a
@@ -183,6 +201,13 @@ namespace likely {
         // congruent binned data. After this operation, isCovarianceModifiable will be false
         // for both binned data objects. Think about whether you want to call unweightData() first.
         void shareCovarianceMatrix(BinnedData const &other);
+        // Replaces our covariance matrix, if any, with the separable KroneckerCovarianceMatrix
+        // built from one covariance per axis of our grid, or throws a RuntimeError. Every bin of
+        // our grid must have data, added in order of increasing global index, and each axis
+        // covariance must have the size of the corresponding axis binning. Memory usage then
+        // scales with the sum of the squared axis sizes, instead of the squared number of bins.
+        // Think about whether you want to call unweightData() first.
+        void setSeparableCovariance(std::vector<CovarianceMatrixCPtr> const &axisCovariances);
         // Transforms our covariance matrix C by replacing it with C.Dinv.C. On return, D
         // contains our original covariance matrix. Calls unweightData().
         void transformCovariance(CovarianceMatrixPtr D);
@@ -196,6 +221,17 @@ namespace likely {
         // used here is an optimization, not a mistake.) If no covariance is available,
         // then Cinv=identity is assumed.
         double chiSquare(std::vector<double> pred) const;
+        // Calculates the chi-square for the specified predicted data vector, as above, and fills
+        // the gradient vector provided with its derivatives with respect to npar parameters,
+        // given the Jacobian of the prediction with respect to these parameters, stored so that
+        // d(pred[k])/d(param[p]) = jacobian[p*n+k] with n = getNBinsWithData(). Throws a
+        // RuntimeError unless jacobian has a positive multiple of n elements. If a hessian vector
+        // is also provided, it is filled with the Gauss-Newton approximation 2 Jt.Cinv.J to the
+        // second derivatives, in the BLAS packed format implied by packedMatrixIndex(row,col).
+        // Cinv is applied to the residuals and all of the Jacobian columns at once, which is
+        // much faster than 2*npar chi-square evaluations for numerical derivatives.
+        double chiSquare(std::vector<double> const &pred, std::vector<double> const &jacobian,
+            std::vector<double> &gradient, std::vector<double> *hessian = 0) const;
         // Returns this dataset's scalar weight. If we have a covariance matrix, this is defined
         // as det(C)^(-1/n) where n = getNBinsWithData(). Otherwise, it will be a scalar value
         // playing the role of Cinv that is maintained internally and which defaults to one.
@@ -264,6 +300,11 @@ namespace likely {
         // The returned object shares a copy of our covariance matrix (but see cloneCovariance).
         // Uses the random generator provided or else the default Random::instance().
         BinnedDataPtr sample(RandomPtr random = RandomPtr()) const;
+        // Returns nsample new BinnedData objects generated as above, which all share our
+        // covariance matrix, or throws a RuntimeError. All of the noise vectors are generated
+        // with a single call to CovarianceMatrix::sample(nsample,random), which is much faster
+        // than repeated calls to the method above when many mock datasets are needed.
+        std::vector<BinnedDataPtr> sample(int nsample, RandomPtr random = RandomPtr()) const;
         
         // Prints the (unweighted) data associated with this object to the specified output stream.
         // To print an associated covariance matrix, use getCovarianceMatrix()->printToStream(out,...).
@@ -279,6 +320,17 @@ namespace likely {
         // or index2 < index1 are not written to the file. Throws a RuntimeError if the
         // covariance is not positive-definite.
         void saveInverseCovariance(std::ostream &os, double scale = 1) const;
+        // Saves our index map, (unweighted) data vector and any covariance matrix to the
+        // specified file using the binary format described in MappedFile.h, or throws a
+        // RuntimeError. Loading a binary file is much faster than parsing the text formats
+        // written by saveData and saveInverseCovariance.
+        void saveBinary(std::string const &filename) const;
+        // Loads data and any covariance matrix from the specified binary file written by
+        // saveBinary, or throws a RuntimeError. This object must not have any data yet and
+        // its grid must have the same total number of bins as the saved object. The loaded
+        // covariance is a MappedCovarianceMatrix that reads its elements directly from the
+        // file, so that many processes loading the same file share a single copy in memory.
+        void loadBinary(std::string const &filename);
 
         // Returns a string that displays the memory state of this object.
         std::string getMemoryState() const;
@@ -286,13 +338,25 @@ namespace likely {
 	private:
         // The grid that our data represents.
         BinnedGrid _grid;
-        enum { EMPTY_BIN = -1 };
-        std::vector<int> _offset, _index;
+        // The offset into _data of each global index with data, and vice versa.
+        struct Bins {
+            explicit Bins(int nbins) : offset(nbins) { }
+            BinnedOffsetMap offset;
+            std::vector<int> index;
+        };
+        // Our bins and data vectors are shared by copies (e.g., from clone or sample) and
+        // only copied by the first object that changes them, using the methods below, so
+        // the bins of a finalized object are never copied. All other access is read only.
+        boost::shared_ptr<Bins> _bins;
         // Our data vector which might be weighted.
-        mutable std::vector<double> _data;
-        // A data vector cache which is either empty or else contains the weighted/unweighted
+        mutable boost::shared_ptr<std::vector<double> > _data;
+        // A data vector cache which is either null or else contains the weighted/unweighted
         // complement corresponding to _data.
-        mutable std::vector<double> _dataCache;
+        mutable boost::shared_ptr<std::vector<double> > _dataCache;
+        // Returns our data vector or bins for modification, after making a private copy if
+        // they are shared with any other object.
+        std::vector<double> &_changesData() const;
+        Bins &_changesBins();
         // A shared pointer to our covariance matrix, if any.
         CovarianceMatrixPtr _covariance;
         // In case we have no covariance, we need a scalar that plays the role of Cinv, to
@@ -311,15 +375,15 @@ namespace likely {
 	}; // BinnedData
 	
     inline BinnedGrid BinnedData::getGrid() const { return _grid; }
-    inline int BinnedData::getNBinsWithData() const { return _index.size(); }
+    inline int BinnedData::getNBinsWithData() const { return _bins->index.size(); }
     inline bool BinnedData::hasCovariance() const { return _covariance.get() != 0; }
     inline bool BinnedData::isDataWeighted() const { return _weighted; }
     inline CovarianceMatrixCPtr BinnedData::getCovarianceMatrix() const { return _covariance; }
     inline bool BinnedData::isCovarianceModifiable() const {
         return 0 == _covariance.get() || _covariance.unique();
     }
-    inline BinnedData::IndexIterator BinnedData::begin() const { return _index.begin(); }
-    inline BinnedData::IndexIterator BinnedData::end() const { return _index.end(); }
+    inline BinnedData::IndexIterator BinnedData::begin() const { return _bins->index.begin(); }
+    inline BinnedData::IndexIterator BinnedData::end() const { return _bins->index.end(); }
     inline bool BinnedData::isFinalized() const { return _finalized; }
     inline BinnedData& BinnedData::operator+=(BinnedData const& other) { return add(other); }
 
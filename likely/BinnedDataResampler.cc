@@ -8,11 +8,35 @@
 #include "likely/CovarianceAccumulator.h"
 
 #include "boost/math/special_functions/binomial.hpp"
+#include "boost/cstdint.hpp"
 
 #include <algorithm>
+#include <string>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 namespace local = likely;
 
+namespace likely {
+namespace resampler {
+    // Number of samples generated by each thread before they are accumulated.
+    unsigned long const samplesPerThread = 16;
+    // Returns the generator seed for bootstrap sample k of a run with the specified seed,
+    // by mixing (seed,k) with the SplitMix64 finalizer, so that runs with different seeds
+    // use unrelated random streams.
+    int sampleSeed(int seed, unsigned long k) {
+        boost::uint64_t z = ((boost::uint64_t)(boost::uint32_t)seed << 32) ^ (boost::uint64_t)k;
+        z += 0x9e3779b97f4a7c15ULL;
+        z = (z ^ (z >> 30))*0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27))*0x94d049bb133111ebULL;
+        z ^= z >> 31;
+        return (int)(boost::uint32_t)(z >> 32);
+    }
+} // resampler
+} // likely
+
 local::BinnedDataResampler::BinnedDataResampler(bool useScalarWeights, RandomPtr random)
 : _useScalarWeights(useScalarWeights), _random(random), _combinedScalarWeight(0)
 {
@@ -144,19 +168,52 @@ local::BinnedDataPtr local::BinnedDataResampler::getObservationCopy(int index, b
 
 local::BinnedDataPtr local::BinnedDataResampler::jackknife(int ndrop, unsigned long seqno,
 bool addCovariance) const {
+    return _jackknife(ndrop,seqno,addCovariance,_subset);
+}
+
+local::BinnedDataPtr local::BinnedDataResampler::_jackknife(int ndrop, unsigned long seqno,
+bool addCovariance, std::vector<int> &subset) const {
     int nobs(_observations.size());
     if(ndrop < 0 || ndrop >= nobs) {
         throw RuntimeError("BinnedDataResampler::jackknife: invalid ndrop.");
     }
-    // Fill our _subset vector with the subset indices corresponding to seqno.
+    // Fill the subset vector with the subset indices corresponding to seqno.
     int nkeep = nobs - ndrop;
-    _subset.resize(nkeep);
-    if(!getSubset(nobs,seqno,_subset)) return BinnedDataPtr();
-    // Create an empty dataset with the right axis binning.
-    BinnedDataPtr resample(_observations[0]->clone(true));
-    // Add each observation from the generated sample.
-    for(int obsIndex = 0; obsIndex < nkeep; ++obsIndex) {
-        *resample += *_observations[_subset[obsIndex]];
+    subset.resize(nkeep);
+    if(!getSubset(nobs,seqno,subset)) return BinnedDataPtr();
+    BinnedDataPtr resample;
+    if(ndrop < nkeep && !_useScalarWeights) {
+        // It is faster to start from our combined dataset and subtract the dropped observations,
+        // which are the gaps in the (increasing) subset. This does not work with scalar weights
+        // since our combined dataset uses the full covariance of each observation.
+        resample.reset(_combined->clone());
+        resample->cloneCovariance();
+        int next(0);
+        for(int obsIndex = 0; obsIndex < nobs; ++obsIndex) {
+            if(next < nkeep && subset[next] == obsIndex) {
+                next++;
+            }
+            else {
+                resample->add(*_observations[obsIndex],-1);
+            }
+        }
+        // Check the result once, by unweighting its data. This decomposes and inverts the
+        // subtracted inverse covariance, which is needed anyway to read the data, and keeps
+        // both representations.
+        try {
+            resample->unweightData();
+        }
+        catch(RuntimeError const &e) {
+            throw RuntimeError("BinnedDataResampler::jackknife: subtraction spoiled by round-off.");
+        }
+    }
+    else {
+        // Create an empty dataset with the right axis binning.
+        resample.reset(_observations[0]->clone(true));
+        // Add each observation from the generated sample.
+        for(int obsIndex = 0; obsIndex < nkeep; ++obsIndex) {
+            *resample += *_observations[subset[obsIndex]];
+        }
     }
     if(addCovariance) _addCovariance(resample);
     return resample;
@@ -164,17 +221,22 @@ bool addCovariance) const {
 
 local::BinnedDataPtr local::BinnedDataResampler::bootstrap(int size, bool fixCovariance,
 bool addCovariance) const {
+    return _bootstrap(size,fixCovariance,addCovariance,*_random,_counts);
+}
+
+local::BinnedDataPtr local::BinnedDataResampler::_bootstrap(int size, bool fixCovariance,
+bool addCovariance, Random &random, std::vector<int> &counts) const {
     if(size < 0) {
         throw RuntimeError("BinnedDataResampler::bootstrap: invalid size.");
     }
     if(0 == size) size = getNObservations();
     if(0 == getNObservations()) return BinnedDataPtr();
-    // Do we need to (re)initialize our counts vector?
-    if(_counts.size() != _observations.size()) {
-        _counts.resize(_observations.size(),0);
+    // Do we need to (re)initialize the counts vector?
+    if(counts.size() != _observations.size()) {
+        counts.resize(_observations.size(),0);
     }
     // Generate a random sample with replacement.
-    _random->sampleWithReplacement(_counts,size);
+    random.sampleWithReplacement(counts,size);
     // Create an empty dataset with the right axis binning.
     BinnedDataPtr resample(_observations[0]->clone(true));
     // We cannot fix a non-existent covariance.
@@ -186,7 +248,7 @@ bool addCovariance) const {
     // Loop over observations, adding each one the appropriate number of times.
     bool duplicatesFound(false);
     for(int obsIndex = 0; obsIndex < _observations.size(); ++obsIndex) {
-        int count(_counts[obsIndex]);
+        int count(counts[obsIndex]);
         if(0 == count) continue;
         if(count > 1) duplicatesFound = true;
         BinnedDataCPtr observation = _observations[obsIndex];
@@ -217,3 +279,87 @@ AccumulationCallback callback, int interval) const {
     }
     return accumulator;
 }
+
+local::CovarianceAccumulatorPtr
+local::BinnedDataResampler::accumulateBootstrap(int nSamples, int seed, int nthreads) const {
+    if(nSamples <= 0) {
+        throw RuntimeError("BinnedDataResampler::accumulateBootstrap: expected nSamples > 0.");
+    }
+    return _accumulateParallel(nSamples,-1,seed,nthreads);
+}
+
+local::CovarianceAccumulatorPtr
+local::BinnedDataResampler::accumulateJackknife(int ndrop, unsigned long nSamples, int nthreads) const {
+    int nobs(_observations.size());
+    if(ndrop < 0 || ndrop >= nobs) {
+        throw RuntimeError("BinnedDataResampler::accumulateJackknife: invalid ndrop.");
+    }
+    // Limit the number of samples to the number of distinct subsets.
+    double nsubsets = boost::math::binomial_coefficient<double>(nobs,ndrop);
+    if(0 == nSamples || nSamples > nsubsets) nSamples = (unsigned long)nsubsets;
+    return _accumulateParallel(nSamples,ndrop,0,nthreads);
+}
+
+local::CovarianceAccumulatorPtr
+local::BinnedDataResampler::_accumulateParallel(unsigned long nSamples, int ndrop, int seed,
+int nthreads) const {
+    if(nthreads < 0) {
+        throw RuntimeError("BinnedDataResampler: expected nthreads >= 0.");
+    }
+    if(0 == getNObservations()) return CovarianceAccumulatorPtr();
+    int nbins(_observations[0]->getNBinsWithData());
+    CovarianceAccumulatorPtr accumulator(new CovarianceAccumulator(nbins));
+    // Put each observation into weighted form now, so that adding it to a sample in the
+    // worker threads below does not modify it. This is normally a no-op since observations
+    // are compressed when they are added, but a caller might have unweighted one since then,
+    // e.g., by calling getData() via getObservation().
+    for(int obsIndex = 0; obsIndex < _observations.size(); ++obsIndex) {
+        _observations[obsIndex]->compress();
+    }
+#ifdef _OPENMP
+    if(0 == nthreads) nthreads = omp_get_max_threads();
+#else
+    nthreads = 1;
+#endif
+    // Generate samples in chunks, saving their unweighted data vectors so they can be
+    // accumulated in order. Unweighting each sample (which usually requires a Cholesky
+    // decomposition of its covariance) is the most expensive step, so this is done by
+    // the worker threads.
+    unsigned long chunkSize(resampler::samplesPerThread*nthreads);
+    std::vector<double> vectors(std::min(chunkSize,nSamples)*nbins);
+    std::string error;
+    for(unsigned long first = 0; first < nSamples; first += chunkSize) {
+        long nchunk = std::min(chunkSize,nSamples-first);
+#pragma omp parallel num_threads(nthreads)
+        {
+            // Each thread has its own random generator and scratch vector.
+            Random random;
+            std::vector<int> scratch;
+#pragma omp for schedule(dynamic)
+            for(long k = 0; k < nchunk; ++k) {
+                try {
+                    BinnedDataPtr sample;
+                    if(ndrop < 0) {
+                        random.setGeneratorSeed(resampler::sampleSeed(seed,first + k));
+                        sample = _bootstrap(0,false,false,random,scratch);
+                    }
+                    else {
+                        sample = _jackknife(ndrop,first + k,false,scratch);
+                        if(!sample) throw RuntimeError("BinnedDataResampler: invalid jackknife seqno.");
+                    }
+                    double *vector(&vectors[k*nbins]);
+                    for(BinnedData::IndexIterator iter = sample->begin(); iter != sample->end(); ++iter) {
+                        *vector++ = sample->getData(*iter);
+                    }
+                }
+                catch(std::exception const &e) {
+#pragma omp critical
+                    error = e.what();
+                }
+            }
+        }
+        if(!error.empty()) throw RuntimeError(error);
+        for(long k = 0; k < nchunk; ++k) accumulator->accumulate(&vectors[k*nbins]);
+    }
+    return accumulator;
+}
@@ -68,6 +68,10 @@ namespace likely {
         //  while(sample = resampler.jackknife(ndrop,seqno++)) {
         //    ...
         //  }
+        // When fewer observations are dropped than kept, and scalar weights are not being used,
+        // each sample is formed by subtracting the dropped observations from our combined dataset,
+        // so that its cost grows with ndrop instead of the number of observations kept. Throws a
+        // RuntimeError if round-off spoils the positive definiteness of a subtracted covariance.
         // Note that the number of jackknife samples generated this way gets large quickly
         // as ndrop increases. There is no requirement that seqno increase by one for successive
         // calls, so jackknifing can easily be parallelized in various ways.
@@ -88,7 +92,33 @@ namespace likely {
         typedef boost::function<bool (CovarianceAccumulatorCPtr)> AccumulationCallback;
         CovarianceAccumulatorPtr estimateCombinedCovariance(int nSamples,
             AccumulationCallback callback = AccumulationCallback(), int interval = 0) const;
+        // Returns a CovarianceAccumulator of the data vectors of nSamples bootstrap samples of
+        // our observations, generated in parallel using nthreads OpenMP threads, or the OpenMP
+        // default number of threads if nthreads is zero. Samples are generated as for
+        // estimateCombinedCovariance, except that sample k uses its own random stream with a
+        // seed derived by hashing (seed,k), and samples are accumulated in order, so the result
+        // only depends on the seed and not on the number of threads. Different seeds give
+        // independent streams. Samples are generated serially if the library was
+        // built without OpenMP.
+        CovarianceAccumulatorPtr accumulateBootstrap(int nSamples, int seed, int nthreads = 0) const;
+        // Returns a CovarianceAccumulator of the data vectors of the jackknife samples with the
+        // specified number of observations dropped and seqno = 0,1,...,nSamples-1, or all of
+        // them if nSamples is zero, generated in parallel as for accumulateBootstrap. Note that
+        // jackknife samples are much less spread out than the combined observations, so the
+        // accumulated covariance must be scaled up, e.g., by about (n-ndrop)/ndrop for the
+        // complete set of samples, to estimate the covariance of the combined observations.
+        CovarianceAccumulatorPtr accumulateJackknife(int ndrop, unsigned long nSamples = 0,
+            int nthreads = 0) const;
 	private:
+	    // Implement bootstrap and jackknife using the random generator and scratch vector
+	    // provided, so that they can be called concurrently with different arguments.
+	    BinnedDataPtr _bootstrap(int size, bool fixCovariance, bool addCovariance,
+	        Random &random, std::vector<int> &counts) const;
+	    BinnedDataPtr _jackknife(int ndrop, unsigned long seqno, bool addCovariance,
+	        std::vector<int> &subset) const;
+	    // Implements accumulateBootstrap (ndrop < 0) and accumulateJackknife (ndrop >= 0).
+	    CovarianceAccumulatorPtr _accumulateParallel(unsigned long nSamples, int ndrop, int seed,
+	        int nthreads) const;
 	    // Adds a covariance matrix to a resampling built with scalar weights. The matrix will be
 	    // a copy of our combined covariance scaled by the ratio of our _combinedScalarWeight to
 	    // the sample's scalar weight.
@@ -0,0 +1,147 @@
+#include "likely/BinnedDataView.h"
+#include "likely/RuntimeError.h"
+#include "likely/BinnedData.h"
+#include "likely/BinnedGrid.h"
+#include "likely/CovarianceMatrix.h"
+
+#include "boost/thread/locks.hpp"
+
+#include <cmath>
+
+namespace local = likely;
+
+local::BinnedDataView::BinnedDataView(BinnedDataCPtr parent, std::set<int> const &keep)
+: _parent(parent), _covarianceReady(false)
+{
+    if(!parent) {
+        throw RuntimeError("BinnedDataView: invalid parent.");
+    }
+    for(std::set<int>::const_iterator iter = keep.begin(); iter != keep.end(); ++iter) {
+        if(!parent->hasData(*iter)) {
+            throw RuntimeError("BinnedDataView: cannot keep bin with no data.");
+        }
+    }
+    // Use the parent's index order, which is not necessarily increasing.
+    _index.reserve(keep.size());
+    for(BinnedData::IndexIterator iter = parent->begin(); iter != parent->end(); ++iter) {
+        if(keep.count(*iter)) _index.push_back(*iter);
+    }
+    _initialize();
+}
+
+local::BinnedDataView::BinnedDataView(BinnedDataCPtr parent, int axis, int firstBin, int lastBin)
+: _parent(parent), _covarianceReady(false)
+{
+    if(!parent) {
+        throw RuntimeError("BinnedDataView: invalid parent.");
+    }
+    BinnedGrid grid(parent->getGrid());
+    if(axis < 0 || axis >= grid.getNAxes()) {
+        throw RuntimeError("BinnedDataView: invalid axis.");
+    }
+    std::vector<int> binIndices;
+    for(BinnedData::IndexIterator iter = parent->begin(); iter != parent->end(); ++iter) {
+        grid.getBinIndices(*iter,binIndices);
+        if(binIndices[axis] >= firstBin && binIndices[axis] <= lastBin) _index.push_back(*iter);
+    }
+    _initialize();
+}
+
+local::BinnedDataView::~BinnedDataView() { }
+
+void local::BinnedDataView::_initialize() {
+    if(0 == _index.size()) {
+        throw RuntimeError("BinnedDataView: no bins selected.");
+    }
+    _parentOffset.reserve(_index.size());
+    _data.reserve(_index.size());
+    for(int k = 0; k < _index.size(); ++k) {
+        _parentOffset.push_back(_parent->getOffsetForIndex(_index[k]));
+        _data.push_back(_parent->getData(_index[k]));
+    }
+    // Remember these now so that later calls never read the parent's data.
+    _parentNBins = _parent->getNBinsWithData();
+    _scalarWeight = _parent->hasCovariance() ? 0 : _parent->getScalarWeight();
+}
+
+double local::BinnedDataView::getData(int offset) const {
+    if(offset < 0 || offset >= _index.size()) {
+        throw RuntimeError("BinnedDataView::getData: invalid offset.");
+    }
+    return _data[offset];
+}
+
+void local::BinnedDataView::_readsCovariance() const {
+    if(_covarianceReady.load(boost::memory_order_acquire)) return;
+    boost::lock_guard<boost::mutex> lock(_mutex);
+    // Another thread might have done the work while we were waiting for the lock.
+    if(_covarianceReady.load(boost::memory_order_relaxed)) return;
+    CovarianceMatrixCPtr parentCov(_parent->getCovarianceMatrix());
+    if(parentCov) {
+        // Extract the packed covariance of our bins. The parent does any inversion or
+        // decompression that this requires, and caches the result for other views. A
+        // structured parent is read one column at a time, by multiplying unit vectors, so
+        // that it keeps its compact representation.
+        int size(_index.size());
+        std::vector<double> packed((size*(size+1))/2);
+        if(parentCov->isStructured()) {
+            std::vector<double> column;
+            for(int col = 0; col < size; ++col) {
+                column.assign(_parentNBins,0);
+                column[_parentOffset[col]] = 1;
+                parentCov->multiplyByCovariance(column);
+                for(int row = 0; row <= col; ++row) {
+                    packed[row + (col*(col+1))/2] = column[_parentOffset[row]];
+                }
+            }
+        }
+        else {
+            for(int col = 0; col < size; ++col) {
+                for(int row = 0; row <= col; ++row) {
+                    packed[row + (col*(col+1))/2] = parentCov->getCovariance(_parentOffset[row],_parentOffset[col]);
+                }
+            }
+        }
+        CovarianceMatrixPtr covariance(new CovarianceMatrix(size));
+        covariance->adoptCovariance(packed);
+        _covariance = covariance;
+    }
+    _covarianceReady.store(true,boost::memory_order_release);
+}
+
+local::CovarianceMatrixCPtr local::BinnedDataView::getCovarianceMatrix() const {
+    _readsCovariance();
+    return _covariance;
+}
+
+double local::BinnedDataView::chiSquare(std::vector<double> const &pred, bool parentOrder) const {
+    int size(_index.size());
+    if(pred.size() != (parentOrder ? _parentNBins : size)) {
+        throw RuntimeError("BinnedDataView::chiSquare: prediction vector has wrong size.");
+    }
+    std::vector<double> delta(size);
+    double unweighted(0);
+    for(int k = 0; k < size; ++k) {
+        double residual = (parentOrder ? pred[_parentOffset[k]] : pred[k]) - _data[k];
+        delta[k] = residual;
+        unweighted += residual*residual;
+    }
+    _readsCovariance();
+    // Our sub-covariance caches its own Cholesky decomposition for subsequent calls.
+    return _covariance ? _covariance->chiSquare(delta) : unweighted*_scalarWeight;
+}
+
+double local::BinnedDataView::getLogDeterminant() const {
+    _readsCovariance();
+    if(_covariance) return _covariance->getLogDeterminant();
+    return -std::log(_scalarWeight)*_index.size();
+}
+
+std::size_t local::BinnedDataView::getMemoryUsage() const {
+    std::size_t usage = sizeof(*this) + sizeof(int)*(_index.capacity() + _parentOffset.capacity()) +
+        sizeof(double)*_data.capacity();
+    if(_covarianceReady.load(boost::memory_order_acquire) && _covariance) {
+        usage += _covariance->getMemoryUsage();
+    }
+    return usage;
+}
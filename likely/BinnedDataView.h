@@ -0,0 +1,82 @@
+#ifndef LIKELY_BINNED_DATA_VIEW
+#define LIKELY_BINNED_DATA_VIEW
+
+#include "likely/types.h"
+
+#include "boost/atomic.hpp"
+#include "boost/thread/mutex.hpp"
+
+#include <vector>
+#include <set>
+#include <cstddef>
+
+namespace likely {
+    // Provides a read-only view of a subset of the bins of a BinnedData object, e.g., for a
+    // scale cut or a slice along one axis, without copying the parent's covariance. The view
+    // copies the parent's unweighted data for its bins when it is created, and refers to the
+    // parent's covariance through a list of bins, so any number of views of the same parent
+    // can be used side by side. The covariance of the selected bins is only extracted (and then
+    // factorized) the first time it is needed, and is cached by the view. The parent's covariance
+    // should not be modified while any views of it are in use. Since a view only reads its
+    // parent's covariance, which is itself safe for concurrent reads, const methods of views
+    // can be called concurrently, including views that share the same parent.
+	class BinnedDataView {
+	public:
+	    // Creates a view of the bins of parent listed by global index in keep, or throws a
+	    // RuntimeError if any of these bins has no data or if keep is empty. Bins are ordered
+	    // as in the parent's index iterator.
+		BinnedDataView(BinnedDataCPtr parent, std::set<int> const &keep);
+		// Creates a view of the bins of parent whose bin index along the specified axis is in
+		// the range [firstBin,lastBin], or throws a RuntimeError if no bins are selected.
+		BinnedDataView(BinnedDataCPtr parent, int axis, int firstBin, int lastBin);
+		virtual ~BinnedDataView();
+		// Returns the parent dataset that we are viewing.
+        BinnedDataCPtr getParent() const;
+        // Returns the number of bins in this view.
+        int getNBinsWithData() const;
+        // Iterates over the global indices of the bins in this view.
+        typedef std::vector<int>::const_iterator IndexIterator;
+        IndexIterator begin() const;
+        IndexIterator end() const;
+        // Returns the unweighted data for the specified offset into this view, or throws a
+        // RuntimeError.
+        double getData(int offset) const;
+        // Returns the covariance of the bins in this view, which is extracted from the parent
+        // the first time it is requested, or a null pointer if the parent has no covariance.
+        CovarianceMatrixCPtr getCovarianceMatrix() const;
+        // Calculates the chi-square = (data-pred).Cinv.(data-pred) for the bins in this view,
+        // or throws a RuntimeError, as for BinnedData::chiSquare. The predicted data vector must
+        // use the same index sequence as our index iterator, unless parentOrder is true, in which
+        // case it must use the parent's index sequence and bins outside this view are ignored.
+        double chiSquare(std::vector<double> const &pred, bool parentOrder = false) const;
+        // Returns the log(determinant) of our covariance, or of our parent's scalar weight
+        // repeated for each bin if the parent has no covariance.
+        double getLogDeterminant() const;
+        // Returns the memory usage of this object, including any cached covariance but not
+        // including our parent.
+        std::size_t getMemoryUsage() const;
+	private:
+	    // Initializes our offsets into the parent and our copy of its data from _index.
+	    void _initialize();
+	    // Extracts our covariance from the parent, if necessary.
+	    void _readsCovariance() const;
+	    BinnedDataCPtr _parent;
+	    // The global index and parent offset of each bin in this view.
+	    std::vector<int> _index, _parentOffset;
+	    // Our copy of the parent's unweighted data for each bin in this view.
+	    std::vector<double> _data;
+	    // The parent's number of bins and scalar weight, when it has no covariance.
+	    int _parentNBins;
+	    double _scalarWeight;
+	    mutable CovarianceMatrixPtr _covariance;
+	    mutable boost::atomic<bool> _covarianceReady;
+	    mutable boost::mutex _mutex;
+	}; // BinnedDataView
+
+    inline BinnedDataCPtr BinnedDataView::getParent() const { return _parent; }
+    inline int BinnedDataView::getNBinsWithData() const { return _index.size(); }
+    inline BinnedDataView::IndexIterator BinnedDataView::begin() const { return _index.begin(); }
+    inline BinnedDataView::IndexIterator BinnedDataView::end() const { return _index.end(); }
+} // likely
+
+#endif // LIKELY_BINNED_DATA_VIEW
@@ -0,0 +1,102 @@
+#include "likely/BinnedOffsetMap.h"
+#include "likely/RuntimeError.h"
+
+namespace local = likely;
+
+namespace likely {
+namespace offsetmap {
+    // Number of slots in a newly created hash table, which must be a power of two.
+    int const initialSlots = 16;
+} // offsetmap
+} // likely
+
+local::BinnedOffsetMap::BinnedOffsetMap(int nbins)
+: _nbins(nbins)
+{
+    if(nbins <= 0) {
+        throw RuntimeError("BinnedOffsetMap: expected nbins > 0.");
+    }
+    clear();
+}
+
+local::BinnedOffsetMap::~BinnedOffsetMap() { }
+
+void local::BinnedOffsetMap::clear() {
+    _noffsets = 0;
+    _nslots = 0;
+    _dense = false;
+    _table.clear();
+    if(!_useDense(offsetmap::initialSlots)) {
+        _nslots = offsetmap::initialSlots;
+        _table.assign(2*_nslots,EMPTY_BIN);
+    }
+}
+
+bool local::BinnedOffsetMap::_useDense(int nslots) {
+    // Each hash table slot uses two ints and each dense element uses one.
+    if(2*(std::size_t)nslots < (std::size_t)_nbins) return false;
+    std::vector<int> dense(_nbins,EMPTY_BIN);
+    for(int slot = 0; slot < _nslots; ++slot) {
+        int index(_table[2*slot]);
+        if(index != EMPTY_BIN) dense[index] = _table[2*slot+1];
+    }
+    _table.swap(dense);
+    _nslots = 0;
+    _dense = true;
+    return true;
+}
+
+int local::BinnedOffsetMap::_findSlot(int index) const {
+    // Use a multiplicative hash, folding its high bits into the low bits so that strided
+    // indices are spread out, and linear probing. Our table is never more than half full
+    // so this always terminates.
+    unsigned hash(2654435761u*(unsigned)index);
+    unsigned mask(_nslots-1), slot((hash ^ (hash >> 16)) & mask);
+    while(_table[2*slot] != EMPTY_BIN && _table[2*slot] != index) slot = (slot+1) & mask;
+    return slot;
+}
+
+void local::BinnedOffsetMap::_grow() {
+    int nslots(2*_nslots);
+    if(_useDense(nslots)) return;
+    // Swap in an empty table and reinsert our old contents.
+    std::vector<int> previous(2*nslots,EMPTY_BIN);
+    _table.swap(previous);
+    _nslots = nslots;
+    for(int slot = 0; slot < nslots/2; ++slot) {
+        int index(previous[2*slot]);
+        if(index == EMPTY_BIN) continue;
+        int newSlot(_findSlot(index));
+        _table[2*newSlot] = index;
+        _table[2*newSlot+1] = previous[2*slot+1];
+    }
+}
+
+void local::BinnedOffsetMap::setOffset(int index, int offset) {
+    if(index < 0 || index >= _nbins) {
+        throw RuntimeError("BinnedOffsetMap::setOffset: invalid index.");
+    }
+    if(offset < 0) {
+        throw RuntimeError("BinnedOffsetMap::setOffset: invalid offset.");
+    }
+    if(_dense) {
+        if(_table[index] == EMPTY_BIN) _noffsets++;
+        _table[index] = offset;
+        return;
+    }
+    int slot(_findSlot(index));
+    if(_table[2*slot] == EMPTY_BIN) {
+        // Keep the table at most half full.
+        if(2*(_noffsets+1) > _nslots) {
+            _grow();
+            return setOffset(index,offset);
+        }
+        _table[2*slot] = index;
+        _noffsets++;
+    }
+    _table[2*slot+1] = offset;
+}
+
+std::size_t local::BinnedOffsetMap::getMemoryUsage() const {
+    return sizeof(*this) + sizeof(int)*_table.capacity();
+}
@@ -0,0 +1,62 @@
+#ifndef LIKELY_BINNED_OFFSET_MAP
+#define LIKELY_BINNED_OFFSET_MAP
+
+#include <vector>
+#include <cstddef>
+
+namespace likely {
+    // Maps the global indices of a BinnedGrid to the offsets of the bins that have data in a
+    // BinnedData object. A new map uses an open-addressing hash table whose memory usage scales
+    // with the number of offsets, and switches automatically to a dense vector with one element
+    // per grid bin once enough bins are filled that the dense vector is smaller. Lookups take
+    // constant (expected) time with either representation, so huge and mostly empty grids do
+    // not need any memory for their empty bins.
+	class BinnedOffsetMap {
+	public:
+	    // Creates a new empty map for global indices 0 to nbins-1, or throws a RuntimeError.
+		explicit BinnedOffsetMap(int nbins);
+		virtual ~BinnedOffsetMap();
+		// The offset returned for an index that has not been assigned an offset.
+		enum { EMPTY_BIN = -1 };
+		// Returns the offset assigned to the specified global index, or EMPTY_BIN. The caller
+		// is responsible for checking that index is valid.
+        int getOffset(int index) const;
+        // Assigns an offset >= 0 to the specified global index, replacing any previous
+        // assignment, or throws a RuntimeError.
+        void setOffset(int index, int offset);
+        // Removes all assigned offsets and returns to the hash table representation.
+        void clear();
+        // Returns the number of global indices that this map was created for.
+        int getNBins() const;
+        // Returns the number of global indices with an assigned offset.
+        int getNOffsets() const;
+        // Returns true if we have switched to a dense vector with one element per grid bin.
+        bool isDense() const;
+        // Returns the memory usage of this object.
+        std::size_t getMemoryUsage() const;
+	private:
+	    // Doubles the size of our hash table, or switches to a dense vector if it would be
+	    // smaller than the new table.
+	    void _grow();
+	    // Returns the hash table slot that contains index, or else the empty slot where it
+	    // should be inserted.
+	    int _findSlot(int index) const;
+	    // Switches to a dense vector if it would be no larger than a hash table with the
+	    // specified number of slots, and returns true if we are dense.
+	    bool _useDense(int nslots);
+	    int _nbins, _noffsets, _nslots;
+	    bool _dense;
+	    // Either the offset of each grid bin (dense) or else (index,offset) pairs for each
+	    // slot of our hash table, with index = EMPTY_BIN for unused slots.
+	    std::vector<int> _table;
+	}; // BinnedOffsetMap
+
+    inline int BinnedOffsetMap::getNBins() const { return _nbins; }
+    inline int BinnedOffsetMap::getNOffsets() const { return _noffsets; }
+    inline bool BinnedOffsetMap::isDense() const { return _dense; }
+    inline int BinnedOffsetMap::getOffset(int index) const {
+        return _dense ? _table[index] : _table[2*_findSlot(index)+1];
+    }
+} // likely
+
+#endif // LIKELY_BINNED_OFFSET_MAP
@@ -0,0 +1,287 @@
+#include "likely/BlockDiagonalCovarianceMatrix.h"
+#include "likely/RuntimeError.h"
+#include "likely/Random.h"
+
+#include <algorithm>
+#include <utility>
+#include <exception>
+
+namespace local = likely;
+
+// Blocks are independent, so loops over blocks are parallelized when OpenMP is enabled. Since
+// exceptions cannot propagate out of a parallel region, each loop body records the message of
+// any exception it catches and the loop rethrows it afterwards as a RuntimeError.
+
+local::BlockDiagonalCovarianceMatrix::BlockDiagonalCovarianceMatrix(
+std::vector<CovarianceMatrixCPtr> const &blocks)
+: CovarianceMatrix(_getTotalSize(blocks))
+{
+    _blocks.reserve(blocks.size());
+    for(int b = 0; b < blocks.size(); ++b) {
+        _blocks.push_back(CovarianceMatrixPtr(blocks[b]->clone()));
+    }
+    _initialize();
+}
+
+local::BlockDiagonalCovarianceMatrix::BlockDiagonalCovarianceMatrix(CovarianceMatrix const &other)
+: CovarianceMatrix(other.getSize())
+{
+    std::vector<int> sizes;
+    other.getBlockSizes(sizes);
+    _blocks.reserve(sizes.size());
+    int start(0);
+    for(int b = 0; b < sizes.size(); ++b) {
+        _blocks.push_back(other.getDiagonalBlock(start,sizes[b]));
+        start += sizes[b];
+    }
+    _initialize();
+}
+
+local::BlockDiagonalCovarianceMatrix::~BlockDiagonalCovarianceMatrix() { }
+
+int local::BlockDiagonalCovarianceMatrix::_getTotalSize(std::vector<CovarianceMatrixCPtr> const &blocks) {
+    if(0 == blocks.size()) {
+        throw RuntimeError("BlockDiagonalCovarianceMatrix: no blocks provided.");
+    }
+    int size(0);
+    for(int b = 0; b < blocks.size(); ++b) {
+        if(!blocks[b]) throw RuntimeError("BlockDiagonalCovarianceMatrix: invalid block.");
+        size += blocks[b]->getSize();
+    }
+    return size;
+}
+
+void local::BlockDiagonalCovarianceMatrix::_initialize() {
+    _offsets.reserve(_blocks.size()+1);
+    _offsets.push_back(0);
+    for(int b = 0; b < _blocks.size(); ++b) {
+        _offsets.push_back(_offsets.back() + _blocks[b]->getSize());
+    }
+    _structured = true;
+}
+
+local::CovarianceMatrixCPtr local::BlockDiagonalCovarianceMatrix::getBlock(int index) const {
+    if(index < 0 || index >= _blocks.size()) {
+        throw RuntimeError("BlockDiagonalCovarianceMatrix::getBlock: invalid index.");
+    }
+    return _blocks[index];
+}
+
+local::CovarianceMatrix *local::BlockDiagonalCovarianceMatrix::clone() const {
+    if(!_structured) return CovarianceMatrix::clone();
+    std::vector<CovarianceMatrixCPtr> blocks(_blocks.begin(),_blocks.end());
+    return new BlockDiagonalCovarianceMatrix(blocks);
+}
+
+double local::BlockDiagonalCovarianceMatrix::getLogDeterminant() const {
+    if(!_structured) return CovarianceMatrix::getLogDeterminant();
+    int nblocks(_blocks.size());
+    std::vector<double> logdet(nblocks);
+    std::string error;
+#pragma omp parallel for schedule(dynamic)
+    for(int b = 0; b < nblocks; ++b) {
+        try {
+            logdet[b] = _blocks[b]->getLogDeterminant();
+        }
+        catch(std::exception const &e) {
+#pragma omp critical
+            error = e.what();
+        }
+    }
+    if(!error.empty()) throw RuntimeError(error);
+    double sum(0);
+    for(int b = 0; b < nblocks; ++b) sum += logdet[b];
+    return sum;
+}
+
+void local::BlockDiagonalCovarianceMatrix::getEigenModes(
+std::vector<double> &eigenvalues, std::vector<double> &eigenvectors) const {
+    if(!_structured) return CovarianceMatrix::getEigenModes(eigenvalues,eigenvectors);
+    int nblocks(_blocks.size()), size(getSize());
+    std::vector<std::vector<double> > values(nblocks), vectors(nblocks);
+    std::string error;
+#pragma omp parallel for schedule(dynamic)
+    for(int b = 0; b < nblocks; ++b) {
+        try {
+            _blocks[b]->getEigenModes(values[b],vectors[b]);
+        }
+        catch(std::exception const &e) {
+#pragma omp critical
+            error = e.what();
+        }
+    }
+    if(!error.empty()) throw RuntimeError(error);
+    // Merge the block eigenmodes in order of increasing eigenvalue, and embed each
+    // block eigenvector in the full space.
+    std::vector<std::pair<double,int> > order;
+    order.reserve(size);
+    for(int b = 0; b < nblocks; ++b) {
+        for(int k = 0; k < values[b].size(); ++k) {
+            order.push_back(std::make_pair(values[b][k],_offsets[b]+k));
+        }
+    }
+    std::sort(order.begin(),order.end());
+    eigenvalues.resize(size);
+    eigenvectors.assign(size*size,0);
+    for(int i = 0; i < size; ++i) {
+        int index(order[i].second);
+        int b = std::upper_bound(_offsets.begin(),_offsets.end(),index) - _offsets.begin() - 1;
+        int k(index - _offsets[b]), blockSize(_blocks[b]->getSize());
+        eigenvalues[i] = order[i].first;
+        for(int j = 0; j < blockSize; ++j) {
+            eigenvectors[i*size + _offsets[b] + j] = vectors[b][k*blockSize + j];
+        }
+    }
+}
+
+void local::BlockDiagonalCovarianceMatrix::getBlockSizes(std::vector<int> &sizes) const {
+    if(!_structured) return CovarianceMatrix::getBlockSizes(sizes);
+    sizes.resize(0);
+    for(int b = 0; b < _blocks.size(); ++b) sizes.push_back(_blocks[b]->getSize());
+}
+
+void local::BlockDiagonalCovarianceMatrix::_multiply(std::vector<double> &vector, bool inverse) const {
+    int nblocks(_blocks.size());
+    std::string error;
+#pragma omp parallel for schedule(dynamic)
+    for(int b = 0; b < nblocks; ++b) {
+        try {
+            std::vector<double> block(vector.begin()+_offsets[b],vector.begin()+_offsets[b+1]);
+            if(inverse) {
+                _blocks[b]->multiplyByInverseCovariance(block);
+            }
+            else {
+                _blocks[b]->multiplyByCovariance(block);
+            }
+            std::copy(block.begin(),block.end(),vector.begin()+_offsets[b]);
+        }
+        catch(std::exception const &e) {
+#pragma omp critical
+            error = e.what();
+        }
+    }
+    if(!error.empty()) throw RuntimeError(error);
+}
+
+void local::BlockDiagonalCovarianceMatrix::multiplyByCovariance(std::vector<double> &vector) const {
+    if(!_structured) return CovarianceMatrix::multiplyByCovariance(vector);
+    if(vector.size() != getSize()) {
+        throw RuntimeError("BlockDiagonalCovarianceMatrix::multiplyByCovariance: vector has wrong size.");
+    }
+    _multiply(vector,false);
+}
+
+void local::BlockDiagonalCovarianceMatrix::multiplyByInverseCovariance(std::vector<double> &vector) const {
+    if(!_structured) return CovarianceMatrix::multiplyByInverseCovariance(vector);
+    if(vector.size() != getSize()) {
+        throw RuntimeError("BlockDiagonalCovarianceMatrix::multiplyByInverseCovariance: vector has wrong size.");
+    }
+    _multiply(vector,true);
+}
+
+double local::BlockDiagonalCovarianceMatrix::chiSquare(std::vector<double> const &delta) const {
+    if(!_structured) return CovarianceMatrix::chiSquare(delta);
+    if(delta.size() != getSize()) {
+        throw RuntimeError("BlockDiagonalCovarianceMatrix::chiSquare: delta has wrong size.");
+    }
+    double chi2;
+    chiSquare(&delta[0],1,&chi2);
+    return chi2;
+}
+
+void local::BlockDiagonalCovarianceMatrix::chiSquare(double const *deltas, int nvec, double *chi2) const {
+    if(!_structured) return CovarianceMatrix::chiSquare(deltas,nvec,chi2);
+    if(nvec <= 0) {
+        throw RuntimeError("BlockDiagonalCovarianceMatrix::chiSquare: expected nvec > 0.");
+    }
+    int nblocks(_blocks.size()), size(getSize());
+    std::vector<double> partial(nblocks*nvec);
+    std::string error;
+#pragma omp parallel for schedule(dynamic)
+    for(int b = 0; b < nblocks; ++b) {
+        try {
+            // Gather the residuals for this block into consecutive vectors.
+            int blockSize(_blocks[b]->getSize());
+            std::vector<double> block(blockSize*nvec);
+            for(int n = 0; n < nvec; ++n) {
+                double const *delta(deltas + n*size + _offsets[b]);
+                std::copy(delta,delta+blockSize,block.begin()+n*blockSize);
+            }
+            _blocks[b]->chiSquare(&block[0],nvec,&partial[b*nvec]);
+        }
+        catch(std::exception const &e) {
+#pragma omp critical
+            error = e.what();
+        }
+    }
+    if(!error.empty()) throw RuntimeError(error);
+    for(int n = 0; n < nvec; ++n) {
+        double sum(0);
+        for(int b = 0; b < nblocks; ++b) sum += partial[b*nvec+n];
+        chi2[n] = sum;
+    }
+}
+
+double local::BlockDiagonalCovarianceMatrix::sample(std::vector<double> &delta, RandomPtr random) const {
+    if(!_structured) return CovarianceMatrix::sample(delta,random);
+    // Random generators are not thread safe, so we sample each block in turn.
+    delta.resize(0);
+    delta.reserve(getSize());
+    double nll(0);
+    std::vector<double> block;
+    for(int b = 0; b < _blocks.size(); ++b) {
+        nll += _blocks[b]->sample(block,random);
+        delta.insert(delta.end(),block.begin(),block.end());
+    }
+    return nll;
+}
+
+boost::shared_array<double> local::BlockDiagonalCovarianceMatrix::sample(int nsample, RandomPtr random) const {
+    if(!_structured) return CovarianceMatrix::sample(nsample,random);
+    if(nsample <= 0) {
+        throw RuntimeError("BlockDiagonalCovarianceMatrix: expected nsample > 0.");
+    }
+    int size(getSize());
+    boost::shared_array<double> array(new double[nsample*size]);
+    for(int b = 0; b < _blocks.size(); ++b) {
+        int blockSize(_blocks[b]->getSize());
+        boost::shared_array<double> block = _blocks[b]->sample(nsample,random);
+        for(int n = 0; n < nsample; ++n) {
+            std::copy(block.get() + n*blockSize,block.get() + (n+1)*blockSize,
+                array.get() + n*size + _offsets[b]);
+        }
+    }
+    return array;
+}
+
+bool local::BlockDiagonalCovarianceMatrix::compress() const {
+    if(!_structured) return CovarianceMatrix::compress();
+    bool compressed(false);
+    for(int b = 0; b < _blocks.size(); ++b) {
+        if(_blocks[b]->compress()) compressed = true;
+    }
+    return compressed;
+}
+
+std::size_t local::BlockDiagonalCovarianceMatrix::getMemoryUsage() const {
+    std::size_t usage = CovarianceMatrix::getMemoryUsage() + sizeof(*this) - sizeof(CovarianceMatrix) +
+        sizeof(CovarianceMatrixPtr)*_blocks.capacity() + sizeof(int)*_offsets.capacity();
+    for(int b = 0; b < _blocks.size(); ++b) usage += _blocks[b]->getMemoryUsage();
+    return usage;
+}
+
+void local::BlockDiagonalCovarianceMatrix::_getDense(std::vector<double> &packed, bool &inverse) const {
+    // Build the packed covariance with zeros outside of our blocks.
+    int size(getSize());
+    packed.assign((size*(size+1))/2,0);
+    for(int b = 0; b < _blocks.size(); ++b) {
+        int offset(_offsets[b]), blockSize(_blocks[b]->getSize());
+        for(int col = 0; col < blockSize; ++col) {
+            int index(offset + ((offset+col)*(offset+col+1))/2);
+            for(int row = 0; row <= col; ++row) {
+                packed[index+row] = _blocks[b]->getCovariance(row,col);
+            }
+        }
+    }
+    inverse = false;
+}
@@ -0,0 +1,67 @@
+#ifndef LIKELY_BLOCK_DIAGONAL_COVARIANCE_MATRIX
+#define LIKELY_BLOCK_DIAGONAL_COVARIANCE_MATRIX
+
+#include "likely/CovarianceMatrix.h"
+
+namespace likely {
+    // Represents a covariance matrix whose non-zero elements are all contained in consecutive
+    // diagonal blocks. Each block is stored as an independent CovarianceMatrix, so memory
+    // scales with the sum of the squared block sizes and decompositions, inverses, eigenmodes
+    // and chi-squares are calculated one block at a time. Blocks are processed in parallel
+    // when the library is built with OpenMP enabled. Any operation that is not specialized
+    // below (e.g., setting an individual element) converts this object into an equivalent
+    // dense CovarianceMatrix.
+	class BlockDiagonalCovarianceMatrix : public CovarianceMatrix {
+	public:
+	    // Creates a new block-diagonal covariance matrix using copies of the blocks provided,
+	    // in order. Throws a RuntimeError if no blocks are provided.
+		explicit BlockDiagonalCovarianceMatrix(std::vector<CovarianceMatrixCPtr> const &blocks);
+		// Creates a new block-diagonal covariance matrix using the blocks detected in the
+		// specified covariance matrix by getBlockSizes.
+		explicit BlockDiagonalCovarianceMatrix(CovarianceMatrix const &other);
+		virtual ~BlockDiagonalCovarianceMatrix();
+		// Returns the number of diagonal blocks.
+        int getNBlocks() const;
+        // Returns a pointer to the specified block, or throws a RuntimeError.
+        CovarianceMatrixCPtr getBlock(int index) const;
+        // Returns true if we are still using our block-diagonal representation.
+        bool isBlockDiagonal() const;
+        // Returns a copy that preserves our block-diagonal representation, if we still have one.
+        virtual CovarianceMatrix *clone() const;
+        // The following methods use our block-diagonal representation, when available, and are
+        // otherwise equivalent to the corresponding CovarianceMatrix methods.
+        virtual double getLogDeterminant() const;
+        using CovarianceMatrix::getEigenModes;
+        virtual void getEigenModes(std::vector<double> &eigenvalues, std::vector<double> &eigenvectors) const;
+        virtual void getBlockSizes(std::vector<int> &sizes) const;
+        virtual void multiplyByCovariance(std::vector<double> &vector) const;
+        using CovarianceMatrix::multiplyByInverseCovariance;
+        virtual void multiplyByInverseCovariance(std::vector<double> &vector) const;
+        using CovarianceMatrix::chiSquare;
+        virtual double chiSquare(std::vector<double> const &delta) const;
+        virtual void chiSquare(double const *deltas, int nvec, double *chi2) const;
+        using CovarianceMatrix::sample;
+        virtual double sample(std::vector<double> &delta, RandomPtr random = RandomPtr()) const;
+        virtual boost::shared_array<double> sample(int nsample, RandomPtr random = RandomPtr()) const;
+        virtual bool compress() const;
+        virtual std::size_t getMemoryUsage() const;
+    protected:
+        virtual void _getDense(std::vector<double> &packed, bool &inverse) const;
+	private:
+	    // Copies are created with clone() or the CovarianceMatrix copy constructor.
+        BlockDiagonalCovarianceMatrix(BlockDiagonalCovarianceMatrix const &other);
+        // Returns the total size of the specified blocks, or throws a RuntimeError.
+        static int _getTotalSize(std::vector<CovarianceMatrixCPtr> const &blocks);
+        // Initializes our block offsets and switches to our block-diagonal representation.
+        void _initialize();
+        // Multiplies each block of vector by its (inverse) covariance.
+        void _multiply(std::vector<double> &vector, bool inverse) const;
+        std::vector<CovarianceMatrixPtr> _blocks;
+        std::vector<int> _offsets;
+	}; // BlockDiagonalCovarianceMatrix
+
+    inline int BlockDiagonalCovarianceMatrix::getNBlocks() const { return _blocks.size(); }
+    inline bool BlockDiagonalCovarianceMatrix::isBlockDiagonal() const { return _structured; }
+} // likely
+
+#endif // LIKELY_BLOCK_DIAGONAL_COVARIANCE_MATRIX
@@ -75,15 +75,13 @@ int local::CovarianceAccumulator::count() const {
 }
 
 local::CovarianceMatrixPtr local::CovarianceAccumulator::getCovariance() const {
-    CovarianceMatrixPtr cov(new CovarianceMatrix(_size));
-    int index(0);
-    for(int col = 0; col < _size; ++col) {
-        for(int row = 0; row <= col; ++row) {
-            double value(weighted_covariance(_pimpl->accumulators[index++]));
-            cov->setCovariance(row,col,value);
-        }
+    // Our accumulators are already in packed order.
+    std::vector<double> packed;
+    packed.reserve((_size*(_size+1))/2);
+    for(int index = 0; index < (_size*(_size+1))/2; ++index) {
+        packed.push_back(weighted_covariance(_pimpl->accumulators[index]));
     }
-    return cov;
+    return CovarianceMatrixPtr(new CovarianceMatrix(packed));
 }
 
 void local::CovarianceAccumulator::dump(std::ostream &out) const {
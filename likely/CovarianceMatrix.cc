@@ -3,21 +3,37 @@
 #include "likely/CovarianceMatrix.h"
 #include "likely/RuntimeError.h"
 #include "likely/Random.h"
+#include "likely/MappedFile.h"
+#include "likely/PackedKernels.h"
 
 #include "boost/format.hpp"
 #include "boost/lexical_cast.hpp"
 #include "boost/smart_ptr.hpp"
+#include "boost/thread/locks.hpp"
 
+#include <algorithm>
 #include <cassert>
 #include <cmath>
 #include <iostream>
 
+#include "config.h" // defines HAVE_LIBBLAS when configure finds a BLAS library
+
 // Declare bindings to BLAS,LAPACK routines we need
 extern "C" {
     // http://www.netlib.org/lapack/double/dpptrf.f
     void dpptrf_(char const *uplo, int const *n, double *ap, int *info);
     // http://www.netlib.org/lapack/double/dpptri.f
     void dpptri_(char const *uplo, int const *n, double *ap, int *info);
+    // http://www.netlib.org/lapack/double/dpftrf.f
+    void dpftrf_(char const *transr, char const *uplo, int const *n, double *a, int *info);
+    // http://www.netlib.org/lapack/double/dpftri.f
+    void dpftri_(char const *transr, char const *uplo, int const *n, double *a, int *info);
+    // http://www.netlib.org/lapack/double/dtpttf.f
+    void dtpttf_(char const *transr, char const *uplo, int const *n, double const *ap,
+        double *arf, int *info);
+    // http://www.netlib.org/lapack/double/dtfttp.f
+    void dtfttp_(char const *transr, char const *uplo, int const *n, double const *arf,
+        double *ap, int *info);
     // http://netlib.org/blas/dspmv.f
     void dspmv_(char const *uplo, int const *n, double const *alpha, double const *ap,
         double const *x, int const *incx, double const *beta, double *y, int const *incy);
@@ -25,6 +41,14 @@ extern "C" {
     void dtrmm_(char const *side, char const *uplo, char const *transa, const char *diag,
         int const *m, int const *n, double const *alpha, double const *a, int const *lda,
         double *b, int const *ldb);
+    // http://www.netlib.org/blas/dtrsm.f
+    void dtrsm_(char const *side, char const *uplo, char const *transa, const char *diag,
+        int const *m, int const *n, double const *alpha, double const *a, int const *lda,
+        double *b, int const *ldb);
+    // http://www.netlib.org/blas/dgemm.f
+    void dgemm_(char const *transa, char const *transb, int const *m, int const *n, int const *k,
+        double const *alpha, double const *a, int const *lda, double const *b, int const *ldb,
+        double const *beta, double *c, int const *ldc);
     // http://www.netlib.org/blas/dsyrk.f
     void dsyrk_(char const *uplo, char const *trans, int const *n, int const *k,
         double const *alpha, double const *a, int const *lda, double const *beta,
@@ -33,12 +57,58 @@ extern "C" {
     void dspevd_(char const *jobz, char const *uplo, int const *n, double *ap, double *w,
         double *z, int const *ldz, double *work, int const *lwork, int *iwork,
         int const *liwork, int *info);
+    // http://www.netlib.org/lapack/double/dsyevr.f
+    void dsyevr_(char const *jobz, char const *range, char const *uplo, int const *n, double *a,
+        int const *lda, double const *vl, double const *vu, int const *il, int const *iu,
+        double const *abstol, int *m, double *w, double *z, int const *ldz, int *isuppz,
+        double *work, int const *lwork, int *iwork, int const *liwork, int *info);
 }
 
+#if defined(__GNUC__) && defined(__ELF__)
+// Runtime thread control is not part of the BLAS standard, so we declare the library-specific
+// entry points as weak symbols that resolve to null when the BLAS in use does not provide them.
+extern "C" {
+    void openblas_set_num_threads(int nthreads) __attribute__((weak));
+    void MKL_Set_Num_Threads(int nthreads) __attribute__((weak));
+}
+#define LIKELY_WEAK_BLAS_THREADS
+#endif
+
 namespace local = likely;
 
+namespace likely {
+namespace covariance {
+    // Matrices with at least this many rows are decomposed and inverted using the blocked
+    // rectangular full packed (RFP) LAPACK routines. See setBlockedDecompositionThreshold().
+    int blockedDecompositionThreshold(256);
+    // Returns true if a matrix of the specified size should use the blocked RFP routines.
+    bool useBlockedDecomposition(int size) {
+        return blockedDecompositionThreshold > 0 && size >= blockedDecompositionThreshold;
+    }
+    // Fills sizes with the diagonal block sizes implied by the smallest row index firstRow[col]
+    // of any non-zero element in each column. A new block starts at col when no column >= col
+    // has a non-zero element above row col.
+    void blocksFromFirstRows(std::vector<int> const &firstRow, std::vector<int> &sizes) {
+        int size = firstRow.size();
+        sizes.resize(0);
+        int lastStart(size), minRow(size);
+        for(int col = size-1; col >= 0; --col) {
+            if(firstRow[col] < minRow) minRow = firstRow[col];
+            if(minRow == col) {
+                sizes.push_back(lastStart - col);
+                lastStart = col;
+            }
+        }
+        std::reverse(sizes.begin(),sizes.end());
+    }
+    // Accumulates the telemetry of all CovarianceMatrix objects.
+    boost::mutex globalTelemetryMutex;
+    CovarianceTelemetry globalTelemetry;
+} // covariance
+} // likely
+
 local::CovarianceMatrix::CovarianceMatrix(int size)
-: _size(size), _compressed(false), _logDeterminant(0)
+: _structured(false), _size(size), _logDeterminant(0), _compressed(false), _firstMode(0), _ready(0)
 {
     if(size <= 0) {
         throw RuntimeError("CovarianceMatrix: expected size > 0.");
@@ -49,24 +119,56 @@ local::CovarianceMatrix::CovarianceMatrix(int size)
 }
 
 local::CovarianceMatrix::CovarianceMatrix(std::vector<double> packed)
-: _ncov(packed.size()), _compressed(false), _logDeterminant(0)
+: _structured(false), _ncov(packed.size()), _logDeterminant(0), _compressed(false), _firstMode(0),
+_ready(0)
 {
     if(_ncov == 0) {
         throw RuntimeError("CovarianceMatrix: expected packed size > 0.");
     }
     _size = symmetricMatrixSize(_ncov);
-    // Copy elements from the input array to our internal storage now. The first
-    // call to setCovariance triggers the allocation of our internal storage.
-    int index(0);
-    for(int col = 0; col < _size; ++col) {
-        for(int row = 0; row <= col; ++row) {
-            setCovariance(row,col,packed[index++]);
+    for(int k = 0; k < _size; ++k) {
+        if(packed[(k*(k+3))/2] <= 0) {
+            throw RuntimeError("CovarianceMatrix: diagonal elements must be > 0.");
         }
     }
+    // Adopt the input array (which is already a copy) as our covariance matrix.
+    _cov.swap(packed);
+}
+
+local::CovarianceMatrix::CovarianceMatrix(CovarianceMatrix const &other)
+: _structured(false), _size(other._size), _ncov(other._ncov), _ready(0)
+{
+    // Another thread might be reading (and so materializing) the original.
+    boost::lock_guard<boost::recursive_mutex> lock(other._mutex);
+    _logDeterminant = other._logDeterminant;
+    _compressed = other._compressed;
+    _cov = other._cov;
+    _icov = other._icov;
+    _cholesky = other._cholesky;
+    _diag = other._diag;
+    _offdiagIndex = other._offdiagIndex;
+    _offdiagValue = other._offdiagValue;
+    _compressedBlocks = other._compressedBlocks;
+    _firstMode = other._firstMode;
+    _modeValues = other._modeValues;
+    _modeVectors = other._modeVectors;
+    if(other._structured) {
+        // Copying a subclass with a structured representation into a plain CovarianceMatrix
+        // creates an equivalent dense matrix, and leaves the original unchanged.
+        bool inverse;
+        std::vector<double> packed;
+        other._getDense(packed,inverse);
+        (inverse ? _icov : _cov).swap(packed);
+        _logDeterminant = other.getLogDeterminant();
+    }
 }
 
 local::CovarianceMatrix::~CovarianceMatrix() { }
 
+local::CovarianceMatrix *local::CovarianceMatrix::clone() const {
+    return new CovarianceMatrix(*this);
+}
+
 local::CovarianceMatrix& local::CovarianceMatrix::operator=(CovarianceMatrix other) {
     swap(*this,other);
     return *this;
@@ -85,18 +187,100 @@ void local::swap(CovarianceMatrix& a, CovarianceMatrix& b) {
     swap(a._diag,b._diag);
     swap(a._offdiagIndex,b._offdiagIndex);
     swap(a._offdiagValue,b._offdiagValue);
+    swap(a._compressedBlocks,b._compressedBlocks);
+    swap(a._firstMode,b._firstMode);
+    swap(a._modeValues,b._modeValues);
+    swap(a._modeVectors,b._modeVectors);
+    bool structured(a._structured);
+    a._structured = b._structured.load();
+    b._structured = structured;
+    // Our mutexes stay with their objects, and all cached state must be checked again.
+    a._resetReady();
+    b._resetReady();
 }
 
 size_t local::CovarianceMatrix::getMemoryUsage() const {
+    boost::lock_guard<boost::recursive_mutex> lock(_mutex);
     return sizeof(*this) + sizeof(double)*(
         _cov.capacity() + _icov.capacity() + _cholesky.capacity() +
-        _diag.capacity() + _offdiagIndex.capacity() + _offdiagValue.capacity());
+        _diag.capacity() + _offdiagIndex.capacity() + _offdiagValue.capacity() +
+        _modeValues.capacity() + _modeVectors.capacity()) +
+        sizeof(int)*_compressedBlocks.capacity();
 }
 
 std::string local::CovarianceMatrix::getMemoryState() const {
-    return boost::str(boost::format("[%c%c%c%c%c%c%c] %d") %
+    boost::lock_guard<boost::recursive_mutex> lock(_mutex);
+    return boost::str(boost::format("[%c%c%c%c%c%c%c%c] %d") %
         _tag('M',_cov) % _tag('I',_icov) % _tag('C',_cholesky) % (_logDeterminant == 0 ? '-':'L') %
-        _tag('D',_diag) % _tag('Z',_offdiagIndex) % _tag('V',_offdiagValue) % getMemoryUsage());
+        _tag('D',_diag) % _tag('Z',_offdiagIndex) % _tag('V',_offdiagValue) %
+        _tag('E',_modeVectors) % getMemoryUsage());
+}
+
+local::CovarianceTelemetry local::CovarianceMatrix::getTelemetry() const {
+    boost::lock_guard<boost::mutex> lock(_telemetryMutex);
+    return _telemetry;
+}
+
+void local::CovarianceMatrix::resetTelemetry() {
+    boost::lock_guard<boost::mutex> lock(_telemetryMutex);
+    _telemetry.reset();
+}
+
+void local::CovarianceMatrix::_recordTransition(CovarianceTelemetry::Transition transition,
+WallClockTimer const &timer, std::size_t bytes) const {
+    double seconds(timer.getElapsedSeconds());
+    {
+        boost::lock_guard<boost::mutex> lock(_telemetryMutex);
+        _telemetry.record(transition,seconds,bytes);
+    }
+    boost::lock_guard<boost::mutex> lock(covariance::globalTelemetryMutex);
+    covariance::globalTelemetry.record(transition,seconds,bytes);
+}
+
+local::CovarianceTelemetry local::getGlobalCovarianceTelemetry() {
+    boost::lock_guard<boost::mutex> lock(covariance::globalTelemetryMutex);
+    return covariance::globalTelemetry;
+}
+
+void local::resetGlobalCovarianceTelemetry() {
+    boost::lock_guard<boost::mutex> lock(covariance::globalTelemetryMutex);
+    covariance::globalTelemetry.reset();
+}
+
+void local::CovarianceMatrix::saveBinary(std::string const &filename) const {
+    saveBinary(filename,MappedFileContents());
+}
+
+void local::CovarianceMatrix::saveBinary(std::string const &filename,
+MappedFileContents const &contents) const {
+    boost::lock_guard<boost::recursive_mutex> lock(_mutex);
+    if(_structured) {
+        // Save the dense equivalent of a structured representation via a temporary, so that
+        // saving does not permanently replace our compact representation. A zero determinant
+        // tells the loader that it should calculate the determinant when it is needed.
+        bool inverse;
+        std::vector<double> packed;
+        _getDense(packed,inverse);
+        MappedFileContents saved(contents);
+        saved.size = _size;
+        saved.logDeterminant = 0;
+        saved.covariance = inverse ? 0 : &packed[0];
+        saved.inverseCovariance = inverse ? &packed[0] : 0;
+        saved.cholesky = 0;
+        MappedFile::write(filename,saved);
+        return;
+    }
+    _uncompress();
+    if(_cov.empty() && _icov.empty()) {
+        throw RuntimeError("CovarianceMatrix::saveBinary: no elements have been set.");
+    }
+    MappedFileContents saved(contents);
+    saved.size = _size;
+    saved.logDeterminant = _logDeterminant;
+    saved.covariance = _cov.empty() ? 0 : &_cov[0];
+    saved.inverseCovariance = _icov.empty() ? 0 : &_icov[0];
+    saved.cholesky = _cholesky.empty() ? 0 : &_cholesky[0];
+    MappedFile::write(filename,saved);
 }
 
 char local::CovarianceMatrix::_tag(char symbol, std::vector<double> const &vector) const {
@@ -106,54 +290,218 @@ char local::CovarianceMatrix::_tag(char symbol, std::vector<double> const &vecto
 }
 
 bool local::CovarianceMatrix::compress() const {
-    // Are we already compressed?
-    if(_compressed) return false;
+    // Are we already compressed? A structured representation is already compact.
+    if(_compressed || _structured) return false;
+    boost::lock_guard<boost::recursive_mutex> lock(_mutex);
+    WallClockTimer timer;
+    std::size_t bytes(0);
     // Do we still have valid compressed data?
     if(_diag.empty()) {
         // Reserve space for the diagonal elements, which cannot be compressed.
         _diag.reserve(_size);
         // Prepare to read the inverse covariance and check if anything been allocated yet.
         if(!_readsICov()) return false;
-        // Loop over the upper-diagonal (row <= col) inverse matrix elements.
-        int index(0);
-        double value;
+        // Count the off-diagonal elements within diagonal blocks and the number that are non-zero.
+        _compressedBlocks.resize(0);
+        std::vector<int> sizes;
+        symmetricMatrixBlocks(_icov,sizes,_size);
+        std::size_t nblocked(0), nonzero(0);
+        for(int k = 0; k < sizes.size(); ++k) nblocked += (sizes[k]*(sizes[k]-1))/2;
         for(int col = 0; col < _size; ++col) {
-            for(int row = 0; row < col; ++row) {
-                // double parentheses here to tell clang that the '=' below isn't a typo.
-                if((value = _icov[index])) {
-                    _offdiagIndex.push_back(index);
-                    _offdiagValue.push_back(value);
+            for(int index = (col*(col+1))/2; index < (col*(col+3))/2; ++index) {
+                if(_icov[index]) nonzero++;
+            }
+        }
+        if(sizes.size() > 1 && nblocked < 2*nonzero) {
+            // Save the upper-diagonal (row < col) inverse matrix elements within each block.
+            _offdiagValue.reserve(nblocked);
+            int start(0);
+            for(int k = 0; k < sizes.size(); ++k) {
+                for(int col = start; col < start + sizes[k]; ++col) {
+                    int index((col*(col+1))/2);
+                    for(int row = start; row < col; ++row) {
+                        _offdiagValue.push_back(_icov[index+row]);
+                    }
                 }
-                index++;
+                start += sizes[k];
             }
-            _diag.push_back(_icov[index++]);
+            for(int col = 0; col < _size; ++col) _diag.push_back(_icov[(col*(col+3))/2]);
+            _compressedBlocks.swap(sizes);
         }
+        else {
+            // Loop over the upper-diagonal (row <= col) inverse matrix elements.
+            int index(0);
+            double value;
+            for(int col = 0; col < _size; ++col) {
+                for(int row = 0; row < col; ++row) {
+                    // double parentheses here to tell clang that the '=' below isn't a typo.
+                    if((value = _icov[index])) {
+                        _offdiagIndex.push_back(index);
+                        _offdiagValue.push_back(value);
+                    }
+                    index++;
+                }
+                _diag.push_back(_icov[index++]);
+            }
+        }
+        bytes = sizeof(double)*(_diag.capacity() + _offdiagIndex.capacity() +
+            _offdiagValue.capacity()) + sizeof(int)*_compressedBlocks.capacity();
     }
     // Delete anything we don't need now.
     if(!_cov.empty()) std::vector<double>().swap(_cov);
     if(!_icov.empty()) std::vector<double>().swap(_icov);
     if(!_cholesky.empty()) std::vector<double>().swap(_cholesky);
+    _deleteEigenModes();
     _compressed = true;
+    _resetReady();
+    _recordTransition(CovarianceTelemetry::Compression,timer,bytes);
     return true;
 }
 
+void local::CovarianceMatrix::_getDense(std::vector<double> &packed, bool &inverse) const {
+    throw RuntimeError("CovarianceMatrix: no structured representation available.");
+}
+
+bool local::CovarianceMatrix::_isReady(int flags) const {
+    return flags == (_ready.load(boost::memory_order_acquire) & flags);
+}
+
+void local::CovarianceMatrix::_setReady(int flags) const {
+    _ready.fetch_or(flags,boost::memory_order_release);
+}
+
+void local::CovarianceMatrix::_resetReady() const {
+    _ready.store(0,boost::memory_order_release);
+}
+
+void local::CovarianceMatrix::_cacheLogDeterminant(double value) const {
+    // Readers can access _logDeterminant without locking once it is flagged as ready.
+    if(!_isReady(LOGDET_READY)) _logDeterminant = value;
+}
+
 void local::CovarianceMatrix::_uncompress() const {
-    // Are we already decompressed?
-    if(!_compressed) return;
-    assert(0 == _cov.capacity());
-    assert(0 == _icov.capacity());
-    assert(0 == _cholesky.capacity());
-    // Decompress the inverse covariance matrix.
-    std::vector<double>(_ncov,0).swap(_icov);
-    for(int k = 0; k < _offdiagIndex.size(); ++k) {
-        _icov[_offdiagIndex[k]] = _offdiagValue[k];
+    // Is our dense representation already available?
+    if(_isReady(DENSE_READY)) return;
+    boost::lock_guard<boost::recursive_mutex> lock(_mutex);
+    // Do we need to switch from a subclass' structured representation to a dense one? This
+    // is a one-way transition, after which we behave exactly like a plain CovarianceMatrix.
+    if(_structured) {
+        WallClockTimer timer;
+        bool inverse;
+        std::vector<double> packed;
+        _getDense(packed,inverse);
+        (inverse ? _icov : _cov).swap(packed);
+        // Our determinant is usually cheap to calculate from our structured representation.
+        _logDeterminant = getLogDeterminant();
+        _structured = false;
+        _recordTransition(CovarianceTelemetry::Decompression,timer,sizeof(double)*_ncov);
     }
-    for(int k = 0; k < _size; ++k) {
-        _icov[(k*(k+3))/2] = _diag[k];
+    // Are we still compressed?
+    if(_compressed) {
+        assert(0 == _cov.capacity());
+        assert(0 == _icov.capacity());
+        assert(0 == _cholesky.capacity());
+        // Decompress the inverse covariance matrix.
+        WallClockTimer timer;
+        std::vector<double>(_ncov,0).swap(_icov);
+        _addCompressedOffDiagonal(_icov,1);
+        for(int k = 0; k < _size; ++k) {
+            _icov[(k*(k+3))/2] = _diag[k];
+        }
+        // Don't delete the compressed matrix data in case we can re-use it
+        // because no changes are made before the next call to compress().
+        _compressed = false;
+        _recordTransition(CovarianceTelemetry::Decompression,timer,sizeof(double)*_ncov);
+    }
+    _setReady(DENSE_READY);
+}
+
+void local::CovarianceMatrix::_addCompressedOffDiagonal(std::vector<double> &packed,
+double weight) const {
+    if(_compressedBlocks.empty()) {
+        for(int k = 0; k < _offdiagIndex.size(); ++k) {
+            packed[_offdiagIndex[k]] += weight*_offdiagValue[k];
+        }
+    }
+    else {
+        if(_offdiagValue.empty()) return;
+        // The off-diagonal elements of each block column are contiguous in both arrays.
+        double const *value(&_offdiagValue[0]);
+        int start(0);
+        for(int k = 0; k < _compressedBlocks.size(); ++k) {
+            for(int col = start; col < start + _compressedBlocks[k]; ++col) {
+                addScaled(value,weight,&packed[(col*(col+1))/2 + start],col-start);
+                value += col-start;
+            }
+            start += _compressedBlocks[k];
+        }
+    }
+}
+
+void local::CovarianceMatrix::getBlockSizes(std::vector<int> &sizes) const {
+    if(_structured) _uncompress();
+    boost::lock_guard<boost::recursive_mutex> lock(_mutex);
+    if(_compressed) {
+        if(!_compressedBlocks.empty()) {
+            sizes = _compressedBlocks;
+            return;
+        }
+        // Find the first non-zero row of each column using our (increasing) compressed indices.
+        std::vector<int> firstRow(_size);
+        for(int col = 0; col < _size; ++col) firstRow[col] = col;
+        int col(0);
+        for(int k = 0; k < _offdiagIndex.size(); ++k) {
+            int index = (int)_offdiagIndex[k];
+            while(index >= ((col+1)*(col+2))/2) ++col;
+            int row = index - (col*(col+1))/2;
+            if(row < firstRow[col]) firstRow[col] = row;
+        }
+        covariance::blocksFromFirstRows(firstRow,sizes);
+    }
+    else if(!_cov.empty()) {
+        symmetricMatrixBlocks(_cov,sizes,_size);
+    }
+    else if(!_icov.empty()) {
+        symmetricMatrixBlocks(_icov,sizes,_size);
+    }
+    else {
+        throw RuntimeError("CovarianceMatrix::getBlockSizes: no elements have been set.");
     }
-    // Don't delete the compressed matrix data in case we can re-use it
-    // because no changes are made before the next call to compress().
-    _compressed = false;
+}
+
+local::CovarianceMatrixPtr local::CovarianceMatrix::getDiagonalBlock(int start, int size) const {
+    if(start < 0 || size <= 0 || start + size > _size) {
+        throw RuntimeError("CovarianceMatrix::getDiagonalBlock: invalid block.");
+    }
+    boost::lock_guard<boost::recursive_mutex> lock(_mutex);
+    _uncompress();
+    int end(start + size);
+    // A block of the inverse covariance is only the inverse of the corresponding covariance
+    // block when it is not correlated with any other index.
+    bool inverse(_cov.empty());
+    if(inverse) {
+        if(_icov.empty()) {
+            throw RuntimeError("CovarianceMatrix::getDiagonalBlock: no elements have been set.");
+        }
+        for(int col = start; col < _size; ++col) {
+            int first(col < end ? 0 : start), last(col < end ? start : end);
+            for(int row = first; row < last; ++row) {
+                if(_icov[row + (col*(col+1))/2]) {
+                    throw RuntimeError("CovarianceMatrix::getDiagonalBlock: block is correlated.");
+                }
+            }
+        }
+    }
+    std::vector<double> const &matrix(inverse ? _icov : _cov);
+    std::vector<double> packed;
+    packed.reserve((size*(size+1))/2);
+    for(int col = start; col < end; ++col) {
+        int index((col*(col+1))/2);
+        for(int row = start; row <= col; ++row) packed.push_back(matrix[index+row]);
+    }
+    CovarianceMatrixPtr block(new CovarianceMatrix(size));
+    (inverse ? block->_icov : block->_cov).swap(packed);
+    return block;
 }
 
 int local::symmetricMatrixIndex(int row, int col, int size) {
@@ -173,11 +521,108 @@ int local::symmetricMatrixSize(int nelem) {
     return size;
 }
 
+void local::CovarianceMatrix::getInverseElements(std::vector<int> &rows, std::vector<int> &cols,
+std::vector<double> &values) const {
+    boost::lock_guard<boost::recursive_mutex> lock(_mutex);
+    rows.resize(0);
+    cols.resize(0);
+    values.resize(0);
+    if(_compressed) {
+        // Read our compressed inverse covariance directly.
+        for(int k = 0; k < _size; ++k) {
+            rows.push_back(k);
+            cols.push_back(k);
+            values.push_back(_diag[k]);
+        }
+        if(_compressedBlocks.empty()) {
+            // Indices are in increasing order, so we only need to advance col.
+            int col(0);
+            for(int k = 0; k < _offdiagIndex.size(); ++k) {
+                int index(_offdiagIndex[k]);
+                while(index >= ((col+1)*(col+2))/2) col++;
+                rows.push_back(index - (col*(col+1))/2);
+                cols.push_back(col);
+                values.push_back(_offdiagValue[k]);
+            }
+        }
+        else {
+            std::vector<double>::const_iterator value(_offdiagValue.begin());
+            int start(0);
+            for(int k = 0; k < _compressedBlocks.size(); ++k) {
+                for(int col = start; col < start + _compressedBlocks[k]; ++col) {
+                    for(int row = start; row < col; ++row) {
+                        double next(*value++);
+                        if(0 == next) continue;
+                        rows.push_back(row);
+                        cols.push_back(col);
+                        values.push_back(next);
+                    }
+                }
+                start += _compressedBlocks[k];
+            }
+        }
+        return;
+    }
+    if(!_readsICov()) {
+        throw RuntimeError("CovarianceMatrix::getInverseElements: no elements have been set.");
+    }
+    int index(0);
+    for(int col = 0; col < _size; ++col) {
+        for(int row = 0; row <= col; ++row) {
+            double value(_icov[index++]);
+            if(0 == value) continue;
+            rows.push_back(row);
+            cols.push_back(col);
+            values.push_back(value);
+        }
+    }
+}
+
+void local::setBlockedDecompositionThreshold(int size) {
+    if(size < 0) {
+        throw RuntimeError("setBlockedDecompositionThreshold: expected size >= 0.");
+    }
+    covariance::blockedDecompositionThreshold = size;
+}
+
+int local::getBlockedDecompositionThreshold() {
+    return covariance::blockedDecompositionThreshold;
+}
+
+bool local::setLinearAlgebraThreads(int nthreads) {
+    if(nthreads <= 0) {
+        throw RuntimeError("setLinearAlgebraThreads: expected nthreads > 0.");
+    }
+    bool supported(false);
+#ifdef LIKELY_WEAK_BLAS_THREADS
+    if(openblas_set_num_threads) {
+        openblas_set_num_threads(nthreads);
+        supported = true;
+    }
+    if(MKL_Set_Num_Threads) {
+        MKL_Set_Num_Threads(nthreads);
+        supported = true;
+    }
+#endif
+    return supported;
+}
+
 double local::choleskyDecompose(std::vector<double> &matrix, int size) {
-    static char uplo('U');
-    static int info(0);
+    static char uplo('U'), transr('N');
+    int info(0);
     if(0 == size) size = symmetricMatrixSize(matrix.size());
-    dpptrf_(&uplo,&size,&matrix[0],&info);
+    if(covariance::useBlockedDecomposition(size)) {
+        // The packed routine dpptrf only uses level-2 BLAS, so we temporarily convert
+        // to the RFP format, which uses the same amount of memory as packed storage but
+        // is compatible with the level-3 (blocked and possibly multithreaded) BLAS.
+        std::vector<double> rfp(matrix.size());
+        dtpttf_(&transr,&uplo,&size,&matrix[0],&rfp[0],&info);
+        dpftrf_(&transr,&uplo,&size,&rfp[0],&info);
+        if(0 == info) dtfttp_(&transr,&uplo,&size,&rfp[0],&matrix[0],&info);
+    }
+    else {
+        dpptrf_(&uplo,&size,&matrix[0],&info);
+    }
     if(0 != info) {
         info = 0;
         throw RuntimeError("choleskyDecomposition: matrix is not positive definite.");
@@ -191,10 +636,19 @@ double local::choleskyDecompose(std::vector<double> &matrix, int size) {
 }
 
 void local::invertCholesky(std::vector<double> &matrix, int size) {
-    static char uplo('U');
-    static int info(0);
+    static char uplo('U'), transr('N');
+    int info(0);
     if(0 == size) size = symmetricMatrixSize(matrix.size());
-    dpptri_(&uplo,&size,&matrix[0],&info);
+    if(covariance::useBlockedDecomposition(size)) {
+        // Use the RFP format for the same reasons as in choleskyDecompose.
+        std::vector<double> rfp(matrix.size());
+        dtpttf_(&transr,&uplo,&size,&matrix[0],&rfp[0],&info);
+        dpftri_(&transr,&uplo,&size,&rfp[0],&info);
+        if(0 == info) dtfttp_(&transr,&uplo,&size,&rfp[0],&matrix[0],&info);
+    }
+    else {
+        dpptri_(&uplo,&size,&matrix[0],&info);
+    }
     if(0 != info) {
         info = 0;
         throw RuntimeError("invertCholesky: symmetric matrix inversion failed.");
@@ -204,7 +658,7 @@ void local::invertCholesky(std::vector<double> &matrix, int size) {
 void local::matrixSquare(std::vector<double> const &matrix, std::vector<double> &result,
 bool transposeLeft, int size) {
     static char uplo('U');
-    static int info(0);
+    int info(0);
     static double alpha(1),beta(0);
     // Calculate the matrix size, if necessary.
     if(0 == size) size = symmetricMatrixSize(matrix.size());
@@ -213,35 +667,194 @@ bool transposeLeft, int size) {
     boost::shared_array<double> unpackedResult(new double [size*size]);
     dsyrk_(&uplo,&trans,&size,&size,&alpha,&matrix[0],&size,&beta,unpackedResult.get(),&size);
     // Pack the result back into 'U' format.
-    result.resize(0);
-    result.reserve((size*(size+1))/2);
+    result.resize((size*(size+1))/2);
+    packSymmetricMatrix(unpackedResult.get(),&result[0],size);
+}
+
+void local::symmetricMatrixBlocks(std::vector<double> const &matrix, std::vector<int> &sizes,
+int size) {
+    if(0 == size) size = symmetricMatrixSize(matrix.size());
+    std::vector<int> firstRow(size);
     for(int col = 0; col < size; ++col) {
-        int base(col*size);
-        for(int row = 0; row <= col; ++row) {
-            result.push_back(unpackedResult[base++]);
+        int index((col*(col+1))/2);
+        firstRow[col] = col;
+        for(int row = 0; row < col; ++row) {
+            if(matrix[index+row]) {
+                firstRow[col] = row;
+                break;
+            }
         }
-    }    
+    }
+    covariance::blocksFromFirstRows(firstRow,sizes);
 }
 
 void local::symmetricMatrixMultiply(std::vector<double> const &matrix,
 std::vector<double> const &vector, std::vector<double> &result) {
-    static char uplo('U');
-    static int incr(1);
-    static double alpha(1),beta(0);
     int size(vector.size());
     if(matrix.size() != (size*(size+1))/2) {
         throw RuntimeError("symmetricMatrixMultiply: incompatible matrix and vector sizes.");
     }
     // size result correctly (but do not need to zero elements since beta=0)
     std::vector<double>(size).swap(result);
+    symmetricMatrixMultiply(&matrix[0],&vector[0],&result[0],size);
+}
+
+void local::symmetricMatrixMultiply(double const *matrix, double const *vector, double *result,
+int size) {
+#ifdef HAVE_LIBBLAS
+    static char uplo('U');
+    static int incr(1);
+    static double alpha(1),beta(0);
     // See http://netlib.org/blas/dspmv.f
-    dspmv_(&uplo,&size,&alpha,&matrix[0],&vector[0],&incr,&beta,&result[0],&incr);
+    dspmv_(&uplo,&size,&alpha,matrix,vector,&incr,&beta,result,&incr);
+#else
+    packedSymmetricMultiply(matrix,vector,result,size);
+#endif
+}
+
+void local::triangularSolve(std::vector<double> const &matrix, double *vectors, int nvec,
+bool transpose, int size) {
+    if(0 == size) size = symmetricMatrixSize(matrix.size());
+    triangularSolve(&matrix[0],vectors,nvec,transpose,size);
+}
+
+void local::triangularSolve(double const *matrix, double *vectors, int nvec,
+bool transpose, int size) {
+    if(size <= 0) {
+        throw RuntimeError("triangularSolve: expected size > 0.");
+    }
+    if(nvec <= 0) {
+        throw RuntimeError("triangularSolve: expected nvec > 0.");
+    }
+#ifndef HAVE_LIBBLAS
+    // Substitute directly in the packed matrix, one vector at a time.
+    packedTriangularSolve(matrix,vectors,nvec,transpose,size);
+#else
+    static char side('L'), uplo('U'), diag('N'), noTrans('N'), trans('T');
+    static double one(1), minusOne(-1);
+    int const blockSize(64);
+    // Work through the matrix in blocks of rows. Each block needs the triangular diagonal
+    // block of U plus the rectangular panel of U that couples it to the rows already solved.
+    // We unpack only these pieces, so that level-3 BLAS can be used with temporary storage
+    // that scales with size*blockSize instead of size*size.
+    std::vector<double> panel(size*std::min(size,blockSize)), block(blockSize*blockSize);
+    int nblocks = (size + blockSize - 1)/blockSize;
+    for(int iblock = 0; iblock < nblocks; ++iblock) {
+        // Solve Ut.X = B by forward substitution, or U.X = B by backward substitution.
+        int first = transpose ? iblock*blockSize : (nblocks-1-iblock)*blockSize;
+        int nrows = std::min(blockSize,size-first), last = first + nrows;
+        double *rows = vectors + first;
+        if(transpose && first > 0) {
+            // Unpack the panel U[0:first,first:last] column by column.
+            for(int col = 0; col < nrows; ++col) {
+                double const *src = &matrix[((first+col)*(first+col+1))/2];
+                std::copy(src,src+first,&panel[col*first]);
+            }
+            // B[first:last] -= Pt.X[0:first]
+            dgemm_(&trans,&noTrans,&nrows,&nvec,&first,&minusOne,&panel[0],&first,
+                vectors,&size,&one,rows,&size);
+        }
+        else if(!transpose && last < size) {
+            // Unpack the panel U[first:last,last:size] column by column.
+            int ncols = size - last;
+            for(int col = 0; col < ncols; ++col) {
+                double const *src = &matrix[((last+col)*(last+col+1))/2 + first];
+                std::copy(src,src+nrows,&panel[col*nrows]);
+            }
+            // B[first:last] -= P.X[last:size]
+            dgemm_(&noTrans,&noTrans,&nrows,&nvec,&ncols,&minusOne,&panel[0],&nrows,
+                vectors+last,&size,&one,rows,&size);
+        }
+        // Unpack the upper-triangular diagonal block U[first:last,first:last]. The lower
+        // triangle is never referenced so does not need to be initialized.
+        for(int col = 0; col < nrows; ++col) {
+            double const *src = &matrix[((first+col)*(first+col+1))/2 + first];
+            std::copy(src,src+col+1,&block[col*nrows]);
+        }
+        dtrsm_(&side,&uplo,transpose ? &trans : &noTrans,&diag,&nrows,&nvec,&one,
+            &block[0],&nrows,rows,&size);
+    }
+#endif
+}
+
+void local::choleskyUpdate(std::vector<double> &matrix, double const *vectors, int nvec,
+bool downdate, int size) {
+    if(0 == size) size = symmetricMatrixSize(matrix.size());
+    if(nvec <= 0) {
+        throw RuntimeError("choleskyUpdate: expected nvec > 0.");
+    }
+    double sign = downdate ? -1 : +1;
+    // Copy the input vectors since the algorithm overwrites them, and allocate space
+    // for the rotation coefficients (c,s) associated with each vector and diagonal element.
+    std::vector<double> x(vectors,vectors+nvec*size), c(nvec*size), s(nvec*size);
+    // The usual formulation of this algorithm (e.g., LINPACK dchud/dchdd) updates U one row
+    // at a time, but rows are not contiguous in packed 'U' format, so we instead sweep through
+    // the columns of U and apply all of the rotations that affect each column in turn.
+    for(int col = 0; col < size; ++col) {
+        double *ucol = &matrix[(col*(col+1))/2];
+        for(int v = 0; v < nvec; ++v) {
+            double xj = x[v*size+col];
+            double const *cv = &c[v*size], *sv = &s[v*size];
+            for(int row = 0; row < col; ++row) {
+                ucol[row] = (ucol[row] + sign*sv[row]*xj)/cv[row];
+                xj = cv[row]*xj - sv[row]*ucol[row];
+            }
+            double diag = ucol[col], r2 = diag*diag + sign*xj*xj;
+            if(r2 <= 0) {
+                throw RuntimeError("choleskyUpdate: downdated matrix is not positive definite.");
+            }
+            double r = std::sqrt(r2);
+            c[v*size+col] = r/diag;
+            s[v*size+col] = xj/diag;
+            ucol[col] = r;
+        }
+    }
+}
+
+int local::conjugateGradientSolve(LinearOperator const &multiply, LinearOperator const &precondition,
+double const *b, double *x, int size, double tolerance, int maxIterations) {
+    if(size <= 0 || tolerance <= 0 || maxIterations <= 0) {
+        throw RuntimeError("conjugateGradientSolve: invalid parameters.");
+    }
+    std::vector<double> r(b,b+size), z(size), p(size), q(size);
+    std::fill(x,x+size,0);
+    double bnorm2(0);
+    for(int k = 0; k < size; ++k) bnorm2 += b[k]*b[k];
+    if(0 == bnorm2) return 0;
+    double limit2(tolerance*tolerance*bnorm2);
+    precondition(&r[0],&z[0]);
+    p = z;
+    double rz(0);
+    for(int k = 0; k < size; ++k) rz += r[k]*z[k];
+    for(int iteration = 1; iteration <= maxIterations; ++iteration) {
+        multiply(&p[0],&q[0]);
+        double pq(0);
+        for(int k = 0; k < size; ++k) pq += p[k]*q[k];
+        if(pq <= 0) {
+            throw RuntimeError("conjugateGradientSolve: matrix is not positive definite.");
+        }
+        double alpha(rz/pq), rnorm2(0);
+        for(int k = 0; k < size; ++k) {
+            x[k] += alpha*p[k];
+            r[k] -= alpha*q[k];
+            rnorm2 += r[k]*r[k];
+        }
+        if(rnorm2 <= limit2) return iteration;
+        precondition(&r[0],&z[0]);
+        double rzNext(0);
+        for(int k = 0; k < size; ++k) rzNext += r[k]*z[k];
+        double beta(rzNext/rz);
+        rz = rzNext;
+        for(int k = 0; k < size; ++k) p[k] = z[k] + beta*p[k];
+    }
+    throw RuntimeError("conjugateGradientSolve: no convergence after " +
+        boost::lexical_cast<std::string>(maxIterations) + " iterations.");
 }
 
 void local::symmetricMatrixEigenSolve(std::vector<double> const &matrix,
 std::vector<double> &eigenvalues, std::vector<double> &eigenvectors, int size) {
     static char jobz('V'), uplo('U');
-    static int info(0);
+    int info(0);
     // Calculate the matrix size if it was not provided.
     if(0 == size) size = symmetricMatrixSize(matrix.size());
     // Allocate space for the eigenvalues and vectors.
@@ -264,46 +877,161 @@ std::vector<double> &eigenvalues, std::vector<double> &eigenvectors, int size) {
     }   
 }
 
+void local::symmetricMatrixEigenSolve(std::vector<double> const &matrix,
+std::vector<double> &eigenvalues, std::vector<double> &eigenvectors,
+int first, int last, int size) {
+    static char jobz('V'), range('I'), uplo('U');
+    // Calculate the matrix size if it was not provided.
+    if(0 == size) size = symmetricMatrixSize(matrix.size());
+    if(first < 0 || last < first || last >= size) {
+        throw RuntimeError("symmetricMatrixEigenSolve: invalid range of eigenvalues.");
+    }
+    // dsyevr needs the full matrix, although it only reads the upper triangle.
+    std::vector<double> unpacked(size*size);
+    unpackSymmetricMatrix(&matrix[0],&unpacked[0],size);
+    // Allocate space for the eigenvalues and vectors. LAPACK uses 1-based indices.
+    int nmodes(last-first+1), il(first+1), iu(last+1), found(0), info(0);
+    double unused(0), abstol(0);
+    eigenvalues.resize(size), eigenvectors.resize(size*nmodes);
+    std::vector<int> isuppz(2*nmodes);
+    // Query the optimal workspace sizes.
+    int workSize(-1), iworkSize(-1), iworkQuery(0);
+    double workQuery(0);
+    dsyevr_(&jobz,&range,&uplo,&size,&unpacked[0],&size,&unused,&unused,&il,&iu,&abstol,
+        &found,&eigenvalues[0],&eigenvectors[0],&size,&isuppz[0],&workQuery,&workSize,
+        &iworkQuery,&iworkSize,&info);
+    if(0 == info) {
+        workSize = (int)workQuery, iworkSize = iworkQuery;
+        std::vector<double> work(workSize);
+        std::vector<int> iwork(iworkSize);
+        dsyevr_(&jobz,&range,&uplo,&size,&unpacked[0],&size,&unused,&unused,&il,&iu,&abstol,
+            &found,&eigenvalues[0],&eigenvectors[0],&size,&isuppz[0],&work[0],&workSize,
+            &iwork[0],&iworkSize,&info);
+    }
+    if(0 != info || found != nmodes) {
+        throw RuntimeError("symmetricMatrixEigenSolve: failed with info = " +
+            boost::lexical_cast<std::string>(info));
+    }
+    // dsyevr uses all of eigenvalues as workspace, but only the first nmodes are valid.
+    eigenvalues.resize(nmodes);
+}
+
+namespace likely {
+namespace covariance {
+    // Prunes a packed symmetric matrix in place so that it only contains the rows and columns
+    // listed in keep, which must be in increasing order.
+    void prunePacked(std::vector<double> &matrix, std::vector<int> const &keep, int oldSize) {
+        int newSize(keep.size()), newIndex(0);
+        for(int newCol = 0; newCol < newSize; ++newCol) {
+            int oldBase = (keep[newCol]*(keep[newCol]+1))/2;
+            for(int newRow = 0; newRow <= newCol; ++newRow) {
+                int oldIndex = oldBase + keep[newRow];
+                // Since keep is increasing, we never clobber an element that we still need.
+                assert(oldIndex >= newIndex);
+                matrix[newIndex++] = matrix[oldIndex];
+            }
+        }
+        matrix.resize((newSize*(newSize+1))/2);
+    }
+} // covariance
+} // likely
+
 void local::CovarianceMatrix::prune(std::set<int> const &keep) {
     int newSize(keep.size());
     if(newSize == getSize()) return;
-    
-    if(!_readsCov()) {
+    if(0 == newSize) {
+        throw RuntimeError("CovarianceMatrix::prune: cannot prune all elements.");
+    }
+    // Build sorted lists of the indices to keep and drop, checking that all indices are valid.
+    std::vector<int> keepList(keep.begin(),keep.end()), dropList;
+    if(keepList.front() < 0 || keepList.back() >= _size) {
+        throw RuntimeError("CovarianceMatrix::prune: index out of range.");
+    }
+    dropList.reserve(_size - newSize);
+    for(int index = 0, next = 0; index < _size; ++index) {
+        if(next < newSize && keepList[next] == index) next++;
+        else dropList.push_back(index);
+    }
+    int ndrop(dropList.size());
+    _uncompress();
+    _resetReady();
+    _deleteEigenModes();
+    if(_cov.empty() && _icov.empty()) {
         throw RuntimeError("CovarianceMatrix::prune: no elements have been set.");
     }
-    _changesCov();
-    
-    std::set<int>::const_iterator nextOldCol(keep.begin());
-    for(int newCol = 0; newCol < newSize; ++newCol) {
-        int oldCol = *nextOldCol++;        
-        std::set<int>::const_iterator nextOldRow(keep.begin());
-        for(int newRow = 0; newRow <= newCol; ++newRow) {
-            int oldRow = *nextOldRow++;
-            int newIndex = symmetricMatrixIndex(newRow, newCol, newSize);            
-            int oldIndex = symmetricMatrixIndex(oldRow, oldCol, getSize());
-
-            //std::cout << "prune: " << newCol << ',' << newRow << ' ' << oldCol << ',' << oldRow
-            //    << ' ' << newIndex << ',' << oldIndex << std::endl;
-            assert(oldIndex >= newIndex);
-
-            _cov[newIndex] = _cov[oldIndex];
+    // Any cached compressed matrix data is now invalid so delete it.
+    if(!_diag.empty()) {
+        std::vector<double>().swap(_diag);
+        std::vector<double>().swap(_offdiagIndex);
+        std::vector<double>().swap(_offdiagValue);
+    }
+    // The pruned covariance is simply the submatrix C[K,K] of the kept rows and columns.
+    if(!_cov.empty()) covariance::prunePacked(_cov,keepList,_size);
+    // With C = Ut.U and D the dropped indices, C[K,K] = U[K,K]t.U[K,K] + U[D,K]t.U[D,K] where
+    // U[K,K] is still upper triangular. The pruned decomposition is therefore a rank-ndrop
+    // update of U[K,K] using the rows of U[D,K], which is always numerically stable.
+    if(!_cholesky.empty()) {
+        std::vector<double> rows(ndrop*newSize,0);
+        for(int v = 0; v < ndrop; ++v) {
+            int oldRow = dropList[v];
+            for(int newCol = 0; newCol < newSize; ++newCol) {
+                int oldCol = keepList[newCol];
+                if(oldRow < oldCol) rows[v*newSize+newCol] = _cholesky[(oldCol*(oldCol+1))/2 + oldRow];
+            }
         }
+        covariance::prunePacked(_cholesky,keepList,_size);
+        choleskyUpdate(_cholesky,&rows[0],ndrop,false,newSize);
+    }
+    // The inverse of C[K,K] is the Schur complement P[K,K] - P[K,D].P[D,D]inv.P[D,K] of P = Cinv.
+    // We calculate it using P[D,D] = Vt.V and Z = Vtinv.P[D,K] so that P[K,D].P[D,D]inv.P[D,K] = Zt.Z.
+    double logdetDD(0);
+    if(!_icov.empty()) {
+        std::vector<double> PDD, Z(ndrop*newSize);
+        PDD.reserve((ndrop*(ndrop+1))/2);
+        for(int col = 0; col < ndrop; ++col) {
+            for(int row = 0; row <= col; ++row) {
+                PDD.push_back(_icov[symmetricMatrixIndex(dropList[row],dropList[col],_size)]);
+            }
+        }
+        for(int k = 0; k < newSize; ++k) {
+            for(int d = 0; d < ndrop; ++d) {
+                Z[k*ndrop+d] = _icov[symmetricMatrixIndex(dropList[d],keepList[k],_size)];
+            }
+        }
+        logdetDD = choleskyDecompose(PDD,ndrop);
+        triangularSolve(PDD,&Z[0],newSize,true,ndrop);
+        covariance::prunePacked(_icov,keepList,_size);
+        int index(0);
+        for(int col = 0; col < newSize; ++col) {
+            for(int row = 0; row <= col; ++row) {
+                double dotprod(0);
+                for(int d = 0; d < ndrop; ++d) dotprod += Z[row*ndrop+d]*Z[col*ndrop+d];
+                _icov[index++] -= dotprod;
+            }
+        }
+    }
+    // Update our cached log(determinant) using |C[K,K]| = |C|.|P[D,D]| or else, if we have
+    // one, from our updated Cholesky decomposition.
+    if(!_cholesky.empty()) {
+        _logDeterminant = 0;
+        for(int k = 0; k < newSize; ++k) _logDeterminant += 2*std::log(_cholesky[(k*(k+3))/2]);
+    }
+    else if(!_icov.empty() && 0 != _logDeterminant) {
+        _logDeterminant += logdetDD;
+    }
+    else {
+        _logDeterminant = 0;
     }
     _size = newSize;
     _ncov = (newSize*(newSize+1))/2;
-    _cov.resize(_ncov);
-
-    assert(0 == _icov.capacity());
-    assert(0 == _cholesky.capacity());
-    assert(0 == _diag.capacity());
-    assert(0 == _offdiagIndex.capacity());
-    assert(0 == _offdiagValue.capacity());
 }
 
 void local::CovarianceMatrix::_changesCov() {
     _uncompress();
-    // Any cached determinant is now invalid.
+    _resetReady();
+    // Any cached determinant and eigenmodes are now invalid.
     _logDeterminant = 0;
+    _deleteEigenModes();
     // Any cached compressed matrix data is now invalid so delete it.
     if(!_diag.empty()) {
         // TODO: use resize(0) instead?
@@ -321,8 +1049,10 @@ void local::CovarianceMatrix::_changesCov() {
         else {
             // Try to invert the existing inverse covariance in place. This will throw a
             // RuntimeError in case the existing inverse covariance is only partially filled in.
+            WallClockTimer timer;
             _logDeterminant = -choleskyDecompose(_icov,_size);
             invertCholesky(_icov,_size);
+            _recordTransition(CovarianceTelemetry::Inversion,timer);
             // Remove the existing inverse covariance (by swapping with _cov), since it will
             // become invalid after we update the the covariance.
             _cov.swap(_icov);
@@ -343,8 +1073,10 @@ void local::CovarianceMatrix::_changesCov() {
 
 void local::CovarianceMatrix::_changesICov() {
     _uncompress();
-    // Any cached determinant is now invalid.
+    _resetReady();
+    // Any cached determinant and eigenmodes are now invalid.
     _logDeterminant = 0;
+    _deleteEigenModes();
     // Any cached compressed matrix data is now invalid so delete it.
     if(!_diag.empty()) {
         // TODO: use resize(0) instead?
@@ -362,6 +1094,7 @@ void local::CovarianceMatrix::_changesICov() {
         else {
             // Try to invert the existing covariance in place. This will throw a
             // RuntimeError in case the existing covariance is only partially filled in.
+            WallClockTimer timer;
             if(_cholesky.empty()) {
                 _logDeterminant = +choleskyDecompose(_cov,_size);
                 // No need to save this Cholesky decomposition since it will be invalid soon.
@@ -379,6 +1112,7 @@ void local::CovarianceMatrix::_changesICov() {
                 // Remove the existing _cov.
                 std::vector<double>().swap(_cov);
             }
+            _recordTransition(CovarianceTelemetry::Inversion,timer);
         }
     }
     else {
@@ -392,6 +1126,8 @@ void local::CovarianceMatrix::_changesICov() {
 }
 
 bool local::CovarianceMatrix::_readsCov() const {
+    if(_isReady(COV_READY)) return true;
+    boost::lock_guard<boost::recursive_mutex> lock(_mutex);
     _uncompress();
     // Do we have a covariance matrix allocated yet?
     if(_cov.empty()) {
@@ -402,16 +1138,23 @@ bool local::CovarianceMatrix::_readsCov() const {
         else {
             // Try to invert the existing inverse covariance into _cov. This will throw a
             // RuntimeError in case the existing inverse covariance is only partially filled in.
-            _cov = _icov;
-            _logDeterminant = -choleskyDecompose(_cov,_size);
+            // Decompose a copy so that _cov stays empty if this fails, e.g., after subtractInverse.
+            WallClockTimer timer;
+            std::vector<double> cov(_icov);
+            _cacheLogDeterminant(-choleskyDecompose(cov,_size));
             // (we don't bother keeping the Cholesky decomposition of the inverse covariance)
-            invertCholesky(_cov,_size);
+            invertCholesky(cov,_size);
+            _cov.swap(cov);
+            _recordTransition(CovarianceTelemetry::Inversion,timer,sizeof(double)*_cov.capacity());
         }
     }
+    _setReady(COV_READY);
     return true;
 }
 
 bool local::CovarianceMatrix::_readsICov() const {
+    if(_isReady(ICOV_READY)) return true;
+    boost::lock_guard<boost::recursive_mutex> lock(_mutex);
     _uncompress();
     // Do we have an inverse covariance matrix allocated yet?
     if(_icov.empty()) {
@@ -422,32 +1165,44 @@ bool local::CovarianceMatrix::_readsICov() const {
         else {
             // Try to invert the existing covariance into _icov. This will throw a
             // RuntimeError in case the existing inverse covariance is only partially filled in.
+            WallClockTimer timer;
+            std::size_t bytes(0);
             if(_cholesky.empty()) {
                 // Calculate and save the covariance Cholesky decomposition.
                 _icov = _cov;
-                _logDeterminant = +choleskyDecompose(_icov,_size);
+                _cacheLogDeterminant(+choleskyDecompose(_icov,_size));
                 _cholesky = _icov;
+                bytes += sizeof(double)*_cholesky.capacity();
             }
             else {
                 // Use the cached Cholesky decomposition.
                 _icov = _cholesky;
             }
             invertCholesky(_icov,_size);
+            bytes += sizeof(double)*_icov.capacity();
+            _recordTransition(CovarianceTelemetry::Inversion,timer,bytes);
         }
     }
+    _setReady(ICOV_READY);
     return true;
 }
 
 void local::CovarianceMatrix::_readsCholesky() const {
+    if(_isReady(CHOLESKY_READY)) return;
+    boost::lock_guard<boost::recursive_mutex> lock(_mutex);
     // Make sure we have a packed Cholesky decomposition available.
     if(_cholesky.empty()) {
         if(!_readsCov()) {
             throw RuntimeError(
                 "CovarianceMatrix: invalid Cholesky decomposition (no elements set yet).");
         }
+        WallClockTimer timer;
         _cholesky = _cov;
-        _logDeterminant = +choleskyDecompose(_cholesky,_size);
-    }    
+        _cacheLogDeterminant(+choleskyDecompose(_cholesky,_size));
+        _recordTransition(CovarianceTelemetry::Decomposition,timer,
+            sizeof(double)*_cholesky.capacity());
+    }
+    _setReady(CHOLESKY_READY);
 }
 
 double local::CovarianceMatrix::getCovariance(int row, int col) const {
@@ -502,6 +1257,42 @@ local::CovarianceMatrix &local::CovarianceMatrix::setInverseCovariance(int row,
     return *this;
 }
 
+local::CovarianceMatrix &local::CovarianceMatrix::adoptCovariance(std::vector<double> &packed) {
+    _adopt(packed,false);
+    return *this;
+}
+
+local::CovarianceMatrix &local::CovarianceMatrix::adoptInverseCovariance(std::vector<double> &packed) {
+    _adopt(packed,true);
+    return *this;
+}
+
+void local::CovarianceMatrix::_adopt(std::vector<double> &packed, bool inverse) {
+    if(packed.size() != _ncov) {
+        throw RuntimeError("CovarianceMatrix::adopt: packed matrix has the wrong size.");
+    }
+    for(int k = 0; k < _size; ++k) {
+        if(packed[(k*(k+3))/2] <= 0) {
+            throw RuntimeError("CovarianceMatrix::adopt: diagonal elements must be > 0.");
+        }
+    }
+    // Every element is being replaced, so discard all of our other representations without
+    // converting them.
+    _structured = false;
+    _compressed = false;
+    _resetReady();
+    _logDeterminant = 0;
+    _deleteEigenModes();
+    std::vector<double>().swap(_diag);
+    std::vector<double>().swap(_offdiagIndex);
+    std::vector<double>().swap(_offdiagValue);
+    std::vector<int>().swap(_compressedBlocks);
+    std::vector<double>().swap(_cholesky);
+    std::vector<double>().swap(inverse ? _cov : _icov);
+    (inverse ? _icov : _cov).swap(packed);
+    std::vector<double>().swap(packed);
+}
+
 void local::CovarianceMatrix::multiplyByCovariance(std::vector<double> &vector) const {
     _readsCov();
     std::vector<double> result;
@@ -516,23 +1307,156 @@ void local::CovarianceMatrix::multiplyByInverseCovariance(std::vector<double> &v
     vector.swap(result);
 }
 
+void local::CovarianceMatrix::addInverseColumns(std::vector<int> const &offsets,
+std::vector<double> const &weights, std::vector<double> &vector) const {
+    if(offsets.size() != weights.size()) {
+        throw RuntimeError("CovarianceMatrix::addInverseColumns: offsets and weights have different sizes.");
+    }
+    if(vector.size() != _size) {
+        throw RuntimeError("CovarianceMatrix::addInverseColumns: vector has wrong size.");
+    }
+    for(int a = 0; a < offsets.size(); ++a) {
+        if(offsets[a] < 0 || offsets[a] >= _size) {
+            throw RuntimeError("CovarianceMatrix::addInverseColumns: invalid offset.");
+        }
+    }
+    if(!_readsICov()) {
+        throw RuntimeError("CovarianceMatrix::addInverseColumns: no elements have been set.");
+    }
+    for(int a = 0; a < offsets.size(); ++a) {
+        int col(offsets[a]);
+        double weight(weights[a]);
+        // Elements (row,col) with row <= col are stored consecutively, and the remaining
+        // elements (col,row) are in the packed columns row > col.
+        addScaled(&_icov[(col*(col+1))/2],weight,&vector[0],col+1);
+        for(int row = col+1; row < _size; ++row) {
+            vector[row] += weight*_icov[col + (row*(row+1))/2];
+        }
+    }
+}
+
+void local::CovarianceMatrix::multiplyByInverseCovariance(double *vectors, int nvec) const {
+    if(nvec <= 0) {
+        throw RuntimeError("CovarianceMatrix::multiplyByInverseCovariance: expected nvec > 0.");
+    }
+    if(_structured) {
+        std::vector<double> vector(_size);
+        for(int n = 0; n < nvec; ++n) {
+            std::copy(vectors + n*_size,vectors + (n+1)*_size,vector.begin());
+            multiplyByInverseCovariance(vector);
+            std::copy(vector.begin(),vector.end(),vectors + n*_size);
+        }
+        return;
+    }
+    // Cinv = Uinv.Utinv so we solve Ut.Y = X then U.Z = Y for all vectors at once.
+    _readsCholesky();
+    triangularSolve(_cholesky,vectors,nvec,true,_size);
+    triangularSolve(_cholesky,vectors,nvec,false,_size);
+}
+
 double local::CovarianceMatrix::chiSquare(std::vector<double> const &delta) const {
     std::vector<double> icovDelta = delta;
     multiplyByInverseCovariance(icovDelta);
-    double result(0);
-    for(int k = 0; k < delta.size(); ++k) {
-        result += delta[k]*icovDelta[k];
+    return dotProduct(&delta[0],&icovDelta[0],delta.size());
+}
+
+void local::CovarianceMatrix::chiSquare(double const *deltas, int nvec, double *chi2) const {
+    if(nvec <= 0) {
+        throw RuntimeError("CovarianceMatrix::chiSquare: expected nvec > 0.");
+    }
+    // Use chi2 = delta.Cinv.delta = |Utinv.delta|^2 where C = Ut.U and U is the upper-diagonal
+    // Cholesky decomposition of C that we store in _cholesky. Solving Ut.X = D for all of the
+    // residual vectors D at once uses level-3 BLAS instead of nvec separate level-2 passes.
+    _readsCholesky();
+    std::vector<double> solved(deltas,deltas+nvec*_size);
+    triangularSolve(_cholesky,&solved[0],nvec,true,_size);
+    double const *next(&solved[0]);
+    for(int n = 0; n < nvec; ++n) {
+        double result(0);
+        for(int k = 0; k < _size; ++k) {
+            double value(*next++);
+            result += value*value;
+        }
+        chi2[n] = result;
+    }
+}
+
+void local::CovarianceMatrix::chiSquare(std::vector<double> const &deltas,
+std::vector<double> &chi2) const {
+    if(0 == deltas.size() || 0 != deltas.size() % _size) {
+        throw RuntimeError("CovarianceMatrix::chiSquare: invalid residuals vector size.");
     }
-    return result;
+    int nvec = deltas.size()/_size;
+    chi2.resize(nvec);
+    chiSquare(&deltas[0],nvec,&chi2[0]);
 }
 
 void local::CovarianceMatrix::getEigenModes(
 std::vector<double> &eigenvalues, std::vector<double> &eigenvectors) const {
-    // Solve our eigensystem for Cinv
+    // Solve our eigensystem for Cinv, unless we already have it cached.
     // TODO: if only C is available, solve its eigensystem instead, remembering to transform
     // lambda -> 1/lambda and to reverse eigenvalues vector.
-    _readsICov();
-    symmetricMatrixEigenSolve(_icov,eigenvalues,eigenvectors,_size);    
+    boost::lock_guard<boost::recursive_mutex> lock(_mutex);
+    _readsEigenModes(0,_size-1);
+    eigenvalues = _modeValues;
+    eigenvectors = _modeVectors;
+}
+
+void local::CovarianceMatrix::getEigenModes(int nmodes,
+std::vector<double> &eigenvalues, std::vector<double> &eigenvectors) const {
+    if(0 == nmodes || nmodes > _size || nmodes < -_size) {
+        throw RuntimeError("CovarianceMatrix::getEigenModes: invalid nmodes.");
+    }
+    // Large variance modes have the smallest inverse covariance eigenvalues.
+    int first(nmodes > 0 ? 0 : _size + nmodes), last(nmodes > 0 ? nmodes - 1 : _size - 1);
+    if(_structured) {
+        // Use the (virtual) full solution, which might exploit our structured representation.
+        getEigenModes(eigenvalues,eigenvectors);
+        eigenvalues.erase(eigenvalues.begin()+last+1,eigenvalues.end());
+        eigenvalues.erase(eigenvalues.begin(),eigenvalues.begin()+first);
+        eigenvectors.erase(eigenvectors.begin()+(last+1)*_size,eigenvectors.end());
+        eigenvectors.erase(eigenvectors.begin(),eigenvectors.begin()+first*_size);
+        return;
+    }
+    boost::lock_guard<boost::recursive_mutex> lock(_mutex);
+    _readsEigenModes(first,last);
+    int offset(first - _firstMode);
+    eigenvalues.assign(_modeValues.begin()+offset,_modeValues.begin()+offset+last-first+1);
+    eigenvectors.assign(_modeVectors.begin()+offset*_size,
+        _modeVectors.begin()+(offset+last-first+1)*_size);
+}
+
+void local::CovarianceMatrix::_readsEigenModes(int first, int last) const {
+    // Are the requested modes already cached?
+    int ncached(_modeValues.size());
+    if(ncached > 0 && first >= _firstMode && last < _firstMode + ncached) return;
+    if(!_readsICov()) {
+        throw RuntimeError("CovarianceMatrix: no eigenmodes (no elements set yet).");
+    }
+    // Solve for the smallest range that includes both the new and any cached modes, so
+    // that interleaved requests for different modes do not repeat the same work.
+    if(ncached > 0) {
+        first = std::min(first,_firstMode);
+        last = std::max(last,_firstMode + ncached - 1);
+    }
+    WallClockTimer timer;
+    if(0 == first && _size-1 == last) {
+        symmetricMatrixEigenSolve(_icov,_modeValues,_modeVectors,_size);
+    }
+    else {
+        symmetricMatrixEigenSolve(_icov,_modeValues,_modeVectors,first,last,_size);
+    }
+    _firstMode = first;
+    _recordTransition(CovarianceTelemetry::EigenSolve,timer,
+        sizeof(double)*(_modeValues.capacity() + _modeVectors.capacity()));
+}
+
+void local::CovarianceMatrix::_deleteEigenModes() const {
+    if(!_modeVectors.empty()) {
+        std::vector<double>().swap(_modeValues);
+        std::vector<double>().swap(_modeVectors);
+    }
+    _firstMode = 0;
 }
 
 double local::CovarianceMatrix::chiSquareModes(std::vector<double> const &delta,
@@ -545,10 +1469,7 @@ std::vector<double> &chi2modes) const {
     chi2modes.reserve(_size);
     for(int i = 0; i < _size; ++i) {
         // Calculate the dot product of eigenvector i with delta
-        double dotprod(0);
-        for(int j = 0; j < _size; ++j) {
-            dotprod += eigenvectors[i*_size + j]*delta[j];
-        }
+        double dotprod = dotProduct(&eigenvectors[i*_size],&delta[0],_size);
         // Calculate and save the contribution to chi2 due to this eigenmode.
         double chi2i = dotprod*dotprod*eigenvalues[i];
         // Replace lambda with 1/lambda so that we return decreasing eigenvalues of cov
@@ -564,31 +1485,60 @@ void local::CovarianceMatrix::rescaleEigenvalues(std::vector<double> const &scal
     if(scales.size() != _size) {
         throw RuntimeError("CovarianceMatrix::rescaleEigenvalues: bad size for scales.");
     }
-    // Solve our eigensystem for Cinv
-    _changesICov();
-    std::vector<double> eigenvalues,eigenvectors;
-    symmetricMatrixEigenSolve(_icov,eigenvalues,eigenvectors,_size);
-    // Rescale each eigenvalue.
-    std::vector<double> scaleFactors(eigenvalues);
     for(int j = 0; j < _size; ++j) {
         if(scales[j] <= 0) throw RuntimeError("CovarianceMatrix::rescaleEigenvalues: got scale <= 0.");
-        // The sqrt is because we will be use matrixSquare below.
-        scaleFactors[j] = std::sqrt(eigenvalues[j]/scales[j]);
     }
-    // Next we replace X with S.X where S is a diagonal matrix of scaleFactors and X[j*size+i] is
-    // the i-th element of the j-th eigenvector.
+    // Solve our eigensystem for Cinv, unless we already have it cached, and take ownership
+    // of it before _changesICov deletes the cache.
+    std::vector<double> eigenvalues,eigenvectors;
+    {
+        boost::lock_guard<boost::recursive_mutex> lock(_mutex);
+        _readsEigenModes(0,_size-1);
+        eigenvalues.swap(_modeValues);
+        eigenvectors.swap(_modeVectors);
+    }
+    _changesICov();
+    // Next we replace X with S.X where S is a diagonal matrix of scale factors and X[j*size+i] is
+    // the i-th element of the j-th eigenvector. The sqrt is because we use matrixSquare below.
     int index(0);
     // Loop over eigenvectors
     for(int j = 0; j < _size; ++j) {
         double scale = std::sqrt(eigenvalues[j]/scales[j]);
         // Loop over components of this eigenvector
         for(int i = 0; i < _size; ++i) {
-            //eigenvectors[index++] *= scaleFactors[i];
             eigenvectors[index++] *= scale;
         }
     }
-    // Finally, fill _icov with X.Xt
+    // Fill _icov with X.Xt
     matrixSquare(eigenvectors,_icov,false,_size);
+    // Our new eigenmodes are the original eigenvectors with eigenvalues lambda/scale, which
+    // we cache after undoing the scaling above and restoring the order of increasing eigenvalue.
+    std::vector<std::pair<double,int> > order;
+    order.reserve(_size);
+    index = 0;
+    for(int j = 0; j < _size; ++j) {
+        double scale = std::sqrt(eigenvalues[j]/scales[j]);
+        for(int i = 0; i < _size; ++i) {
+            eigenvectors[index++] /= scale;
+        }
+        order.push_back(std::make_pair(eigenvalues[j]/scales[j],j));
+    }
+    std::sort(order.begin(),order.end());
+    _modeValues.resize(_size);
+    for(int k = 0; k < _size; ++k) _modeValues[k] = order[k].first;
+    bool reordered(false);
+    for(int k = 0; k < _size; ++k) if(order[k].second != k) reordered = true;
+    if(reordered) {
+        _modeVectors.resize(_size*_size);
+        for(int k = 0; k < _size; ++k) {
+            std::copy(eigenvectors.begin()+order[k].second*_size,
+                eigenvectors.begin()+(order[k].second+1)*_size,_modeVectors.begin()+k*_size);
+        }
+    }
+    else {
+        _modeVectors.swap(eigenvectors);
+    }
+    _firstMode = 0;
 }
 
 double local::CovarianceMatrix::sample(std::vector<double> &delta, RandomPtr random) const {
@@ -610,14 +1560,9 @@ double local::CovarianceMatrix::sample(std::vector<double> &delta, RandomPtr ran
         nll += r*r;
     }
     _readsCholesky();
-    // Add correlations via L.delta
-    int index(0);
+    // Add correlations via L.delta, where row i of L = Ut is the i-th packed column of U.
     for(int i = 0; i < _size; ++i) {
-        double result(0);
-        for(int j = 0; j <= i; ++j) {
-            result += _cholesky[index++]*deltap[j];
-        }
-        delta.push_back(result);
+        delta.push_back(dotProduct(&_cholesky[(i*(i+1))/2],&deltap[0],i+1));
     }
     return nll/2;
 }
@@ -626,13 +1571,14 @@ void local::CovarianceMatrix::replaceWithTripleProduct(CovarianceMatrix const &o
     if(other.getSize() != _size) {
         throw RuntimeError("CovarianceMatrix::addInverse: incompatible sizes.");
     }
-    // Any cached compressed matrix data is now invalid so delete it.
+    // Any cached compressed matrix data and eigenmodes are now invalid so delete them.
     if(!_diag.empty()) {
         // TODO: use resize(0) instead?
         std::vector<double>().swap(_diag);
         std::vector<double>().swap(_offdiagIndex);
         std::vector<double>().swap(_offdiagValue);
     }
+    _deleteEigenModes();
     // Instead of calculating C -> A.Cinv.A we calculate Cinv -> Ainv.C.Ainv using:
     //
     //   Ainv.C.Ainv = Ainv.U*.U.Ainv = (U.Ainv)*.(U.Ainv)
@@ -649,21 +1595,16 @@ void local::CovarianceMatrix::replaceWithTripleProduct(CovarianceMatrix const &o
     // upper triangular form of U, but not optimized for the symmetry of Ainv.
     // DTRMM needs both matrices to be unpacked first. Do this in two separate loops
     // so we can free the _cholesky memory before allocating the second temporary array.
+    // (DTRMM never references the lower triangle, so unpacking U as a symmetric matrix is harmless.)
     boost::shared_array<double> unpackedCholesky(new double [_size*_size]);
-    double *choleskyPtr(&_cholesky[0]);
-    for(int col = 0; col < _size; ++col) {
-        for(int row = 0; row <= col; ++row) {
-            unpackedCholesky[col*_size + row] = *choleskyPtr++;
-        }
-    }
+    unpackSymmetricMatrix(&_cholesky[0],unpackedCholesky.get(),_size);
     std::vector<double>().swap(_cholesky);
     boost::shared_array<double> unpackedOther(new double [_size*_size]);
-    for(int col = 0; col < _size; ++col) {
-        for(int row = 0; row < col; ++row) {
-            unpackedOther[row*_size + col] = unpackedOther[col*_size + row] =
-                other.getInverseCovariance(row,col);
-        }
-        unpackedOther[col*_size + col] = other.getInverseCovariance(col,col);
+    if(other._readsICov()) {
+        unpackSymmetricMatrix(&other._icov[0],unpackedOther.get(),_size);
+    }
+    else {
+        std::fill(unpackedOther.get(),unpackedOther.get()+_size*_size,0.);
     }
 
     double alpha(1);
@@ -681,13 +1622,11 @@ void local::CovarianceMatrix::replaceWithTripleProduct(CovarianceMatrix const &o
         &beta,unpackedResult,&_size);
     
     // Finally, pack the result back into our inverse covariance.
-    _icov.resize(0);
-    _icov.reserve(_ncov);
-    for(int col = 0; col < _size; ++col) {
-        for(int row = 0; row <= col; ++row) {
-            _icov.push_back(unpackedResult[col*_size + row]);
-        }
-    }
+    _icov.resize(_ncov);
+    packSymmetricMatrix(unpackedResult,&_icov[0],_size);
+    // Our cached determinant and any ready flags set by _readsCholesky above are now invalid.
+    _logDeterminant = 0;
+    _resetReady();
 }
 
 local::CovarianceMatrixPtr local::generateRandomCovariance(int size, double scale, RandomPtr random) {
@@ -756,6 +1695,19 @@ boost::shared_array<double> local::CovarianceMatrix::sample(int nsample, RandomP
     if(nsample <= 0) {
         throw RuntimeError("CovarianceMatrix: expected nsample > 0.");
     }
+    // Use the default generator if none was specified.
+    if(!random) random = Random::instance();
+    // Generate double-precision normally distributed (but uncorrelated) random numbers.
+    std::size_t nrandom(nsample*_size), ngen(nrandom);
+    boost::shared_array<double> array = random->fillDoubleArrayNormal(ngen);
+    correlate(array.get(),nsample);
+    return array;
+}
+
+void local::CovarianceMatrix::correlate(double *vectors, int nvec) const {
+    if(nvec <= 0) {
+        throw RuntimeError("CovarianceMatrix::correlate: expected nvec > 0.");
+    }
     _readsCholesky();
     // Temporarily transpose and expand the packed Cholesky matrix.
     boost::shared_array<double> expanded(new double[_size*_size]);
@@ -768,21 +1720,15 @@ boost::shared_array<double> local::CovarianceMatrix::sample(int nsample, RandomP
             expanded[row*_size + col] = *ptr++;
         }
     }
-    // Use the default generator if none was specified.
-    if(!random) random = Random::instance();
-    // Generate double-precision normally distributed (but uncorrelated) random numbers.
-    std::size_t nrandom(nsample*_size), ngen(nrandom);
-    boost::shared_array<double> array = random->fillDoubleArrayNormal(ngen);
-    // Consider this array to be a rectangular matrix M of dimensions _size x nsample and
-    // calculate (expanded).(M) to obtain a new matrix of dimensions _size x nsample
-    // containing correlated residual vectors of length _size in each of its nsample columns.
+    // Consider the vectors to be a rectangular matrix M of dimensions _size x nvec and
+    // calculate (expanded).(M) to obtain a new matrix of dimensions _size x nvec
+    // containing correlated residual vectors of length _size in each of its nvec columns.
     // The column-major ordering of BLAS means that the transformed residuals vectors
     // will be consecutive in memory.
     double alpha(1);
     char side = 'L', uplo = 'L', transa = 'N', diag = 'N';
-    dtrmm_(&side,&uplo,&transa,&diag,&_size,&nsample,&alpha,
-        expanded.get(),&_size,array.get(),&_size);
-    return array;
+    dtrmm_(&side,&uplo,&transa,&diag,&_size,&nvec,&alpha,
+        expanded.get(),&_size,vectors,&_size);
 }
 
 void local::CovarianceMatrix::printToStream(std::ostream &os, bool normalized, std::string format,
@@ -829,9 +1775,12 @@ void local::CovarianceMatrix::addInverse(CovarianceMatrix const &other, double w
         for(int k = 0; k < _size; ++k) {
             _icov[(k*(k+3))/2] += weight*other._diag[k];
         }
-        for(int k = 0; k < other._offdiagIndex.size(); ++k) {
-            _icov[other._offdiagIndex[k]] += weight*other._offdiagValue[k];
-        }
+        other._addCompressedOffDiagonal(_icov,weight);
+    }
+    else if(other._readsICov()) {
+        // Both inverses use the same packed layout, so add them in a single vectorized pass.
+        _changesICov();
+        addScaled(&other._icov[0],weight,&_icov[0],_ncov);
     }
     else {
         for(int col = 0; col < _size; ++col) {
@@ -844,6 +1793,148 @@ void local::CovarianceMatrix::addInverse(CovarianceMatrix const &other, double w
     }
 }
 
+void local::CovarianceMatrix::subtractInverse(CovarianceMatrix const &other, double weight) {
+    if(weight <= 0) {
+        throw RuntimeError("CovarianceMatrix::subtractInverse: expected weight > 0.");
+    }
+    if(other.getSize() != _size) {
+        throw RuntimeError("CovarianceMatrix::subtractInverse: incompatible sizes.");
+    }
+    if(!_compressed && !_structured && _icov.empty() && _cov.empty()) {
+        throw RuntimeError("CovarianceMatrix::subtractInverse: no elements have been set.");
+    }
+    if(other.isCompressed()) {
+        _changesICov();
+        for(int k = 0; k < _size; ++k) {
+            _icov[(k*(k+3))/2] -= weight*other._diag[k];
+        }
+        other._addCompressedOffDiagonal(_icov,-weight);
+    }
+    else if(other._readsICov()) {
+        _changesICov();
+        addScaled(&other._icov[0],-weight,&_icov[0],_ncov);
+    }
+    else {
+        throw RuntimeError("CovarianceMatrix::subtractInverse: other matrix has no elements set.");
+    }
+}
+
+void local::CovarianceMatrix::addInverseLowRank(std::vector<double> const &vectors,
+bool subtract) {
+    if(0 == vectors.size() || 0 != vectors.size() % _size) {
+        throw RuntimeError("CovarianceMatrix::addInverseLowRank: invalid vectors size.");
+    }
+    int rank = vectors.size()/_size;
+    double sign = subtract ? -1 : +1;
+    _uncompress();
+    if(_cov.empty()) {
+        if(_icov.empty()) {
+            throw RuntimeError("CovarianceMatrix::addInverseLowRank: no elements have been set.");
+        }
+        // We only have an inverse covariance, so there is no decomposition to preserve and
+        // we just need to add sign*W.Wt to each element of a copy.
+        std::vector<double> updated(_icov);
+        int index(0);
+        for(int col = 0; col < _size; ++col) {
+            for(int row = 0; row <= col; ++row) {
+                double sum(0);
+                for(int k = 0; k < rank; ++k) sum += vectors[k*_size+row]*vectors[k*_size+col];
+                updated[index++] += sign*sum;
+            }
+        }
+        // Adding to a positive definite matrix cannot spoil it, but subtracting can, so check
+        // that the updated matrix can still be decomposed before we change anything.
+        if(subtract) {
+            std::vector<double> decomposed(updated);
+            try {
+                choleskyDecompose(decomposed,_size);
+            }
+            catch(RuntimeError const &e) {
+                throw RuntimeError("CovarianceMatrix::addInverseLowRank: result is not positive definite.");
+            }
+        }
+        _changesICov();
+        _icov.swap(updated);
+        return;
+    }
+    // Use the Woodbury identity to express the change to Cinv as a change to C:
+    //
+    //   (Cinv + sign*W.Wt)^(-1) = C - sign*Y.Sinv.Yt = C - sign*V.Vt
+    //
+    // with Y = C.W, S = 1 + sign*Wt.Y, S = Ust.Us and V = Y.Usinv.
+    std::vector<double> Y(vectors), column;
+    for(int k = 0; k < rank; ++k) {
+        column.assign(vectors.begin()+k*_size,vectors.begin()+(k+1)*_size);
+        multiplyByCovariance(column);
+        std::copy(column.begin(),column.end(),Y.begin()+k*_size);
+    }
+    std::vector<double> S;
+    S.reserve((rank*(rank+1))/2);
+    for(int col = 0; col < rank; ++col) {
+        for(int row = 0; row <= col; ++row) {
+            double dotprod(0);
+            for(int j = 0; j < _size; ++j) dotprod += vectors[row*_size+j]*Y[col*_size+j];
+            S.push_back((row == col ? 1 : 0) + sign*dotprod);
+        }
+    }
+    // This will throw a RuntimeError before we have changed anything if the result would
+    // not be positive definite.
+    double logdetS;
+    try {
+        logdetS = choleskyDecompose(S,rank);
+    }
+    catch(RuntimeError const &e) {
+        throw RuntimeError("CovarianceMatrix::addInverseLowRank: result is not positive definite.");
+    }
+    // We are now committed to changing this matrix.
+    _resetReady();
+    _deleteEigenModes();
+    // Calculate Vt = Ustinv.Yt by solving Ust.Vt = Yt, one row of Y (of length rank) at a time.
+    std::vector<double> Vt(rank*_size);
+    for(int j = 0; j < _size; ++j) {
+        for(int k = 0; k < rank; ++k) Vt[j*rank+k] = Y[k*_size+j];
+    }
+    triangularSolve(S,&Vt[0],_size,true,rank);
+    std::vector<double> V(rank*_size);
+    for(int j = 0; j < _size; ++j) {
+        for(int k = 0; k < rank; ++k) V[k*_size+j] = Vt[j*rank+k];
+    }
+    // Any cached compressed matrix data is now invalid so delete it.
+    if(!_diag.empty()) {
+        std::vector<double>().swap(_diag);
+        std::vector<double>().swap(_offdiagIndex);
+        std::vector<double>().swap(_offdiagValue);
+    }
+    // Update the Cholesky decomposition of C = Ut.U in O(rank*size^2) operations. Adding to
+    // Cinv means subtracting from C, so this is a downdate when subtract is false.
+    if(!_cholesky.empty()) {
+        try {
+            choleskyUpdate(_cholesky,&V[0],rank,!subtract,_size);
+        }
+        catch(RuntimeError const &e) {
+            // Round-off can spoil a downdate of a nearly singular matrix, so just drop the
+            // decomposition and let it be recalculated the next time it is needed.
+            std::vector<double>().swap(_cholesky);
+        }
+    }
+    // Update any matrices we have in memory.
+    int index(0);
+    for(int col = 0; col < _size; ++col) {
+        for(int row = 0; row <= col; ++row) {
+            double vsum(0), wsum(0);
+            for(int k = 0; k < rank; ++k) {
+                vsum += V[k*_size+row]*V[k*_size+col];
+                wsum += vectors[k*_size+row]*vectors[k*_size+col];
+            }
+            _cov[index] -= sign*vsum;
+            if(!_icov.empty()) _icov[index] += sign*wsum;
+            index++;
+        }
+    }
+    // Update any cached determinant using |C'| = |C|/|S|.
+    if(0 != _logDeterminant) _logDeterminant -= logdetS;
+}
+
 int local::CovarianceMatrix::getNElements() const {
     // Prepare to read from the covariance matrix, and return zero if nothing has
     // been allocated yet.
@@ -866,36 +1957,48 @@ bool local::CovarianceMatrix::isPositiveDefinite() const {
         return true;
     }
     catch(RuntimeError const &e) {
+        boost::lock_guard<boost::recursive_mutex> lock(_mutex);
         std::vector<double>().swap(_cholesky);
         return false;
     }
 }
 
 double local::CovarianceMatrix::getLogDeterminant() const {
+    if(_isReady(LOGDET_READY)) return _logDeterminant;
+    boost::lock_guard<boost::recursive_mutex> lock(_mutex);
     // Only do the minimum work necessary...
     if(0 == _logDeterminant) {
         _uncompress();
-        // If we don't have a cached value then we have at most one of _icov or _cov,
-        // but not both. Do a Cholesky decomposition of whatever we have.
-        assert(_cholesky.empty());
-        assert(_cov.empty() || _icov.empty());
-        if(!_cov.empty()) {
+        // If we don't have a cached value then we normally have at most one of _icov or _cov,
+        // but not both. The exception is a matrix whose log(determinant) happens to be exactly
+        // zero, in which case any Cholesky decomposition we already have gives the answer.
+        if(!_cholesky.empty()) {
+            double logdet(0);
+            for(int k = 0; k < _size; ++k) logdet += 2*std::log(_cholesky[(k*(k+3))/2]);
+            _logDeterminant = logdet;
+        }
+        else if(!_cov.empty()) {
             // Calculate and save the covariance Cholesky decomposition now.
+            WallClockTimer timer;
             _cholesky = _cov;
             _logDeterminant = +choleskyDecompose(_cholesky,_size);
+            _recordTransition(CovarianceTelemetry::Decomposition,timer,
+                sizeof(double)*_cholesky.capacity());
         }
         else if(!_icov.empty()) {
             // Calculate the inverse covariance Cholesky decomposition now.
+            WallClockTimer timer;
             _cholesky = _icov;
             _logDeterminant = -choleskyDecompose(_cholesky,_size);
             // Don't keep this decomposition, since this was the inverse.
             std::vector<double>().swap(_cholesky);
+            _recordTransition(CovarianceTelemetry::Decomposition,timer);
         }
         else {
             throw RuntimeError("CovarianceMatrix::getLogDeterminant: no elements have been set.");
         }
     }
-    assert(_logDeterminant != 0);
+    _setReady(LOGDET_READY);
     return _logDeterminant;
 }
 
@@ -905,6 +2008,7 @@ void local::CovarianceMatrix::applyScaleFactor(double scaleFactor) {
     }
     // We could actually do this on a compressed object - maybe later...
     _uncompress();
+    _resetReady();
     // Transform whatever vectors we have using the appropriate scale.
     if(!_cov.empty()) {
         double scale(scaleFactor);
@@ -919,6 +2023,9 @@ void local::CovarianceMatrix::applyScaleFactor(double scaleFactor) {
         for(int index = 0; index < _ncov; ++index) _cholesky[index] *= scale;
     }
     if(_logDeterminant != 0) _logDeterminant += _size*std::log(scaleFactor);
+    // Our inverse covariance eigenvectors are unchanged, but their eigenvalues are all
+    // divided by scaleFactor.
+    for(int k = 0; k < _modeValues.size(); ++k) _modeValues[k] /= scaleFactor;
 }
 
 local::CovarianceMatrixPtr local::createDiagonalCovariance(int size, double diagonalValue) {
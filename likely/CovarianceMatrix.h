@@ -4,8 +4,13 @@
 #define LIKELY_COVARIANCE_MATRIX
 
 #include "likely/types.h"
+#include "likely/CovarianceTelemetry.h"
 
 #include "boost/smart_ptr.hpp"
+#include "boost/function.hpp"
+#include "boost/atomic.hpp"
+#include "boost/thread/recursive_mutex.hpp"
+#include "boost/thread/mutex.hpp"
 
 #include <vector>
 #include <set>
@@ -14,7 +19,13 @@
 #include <iosfwd>
 
 namespace likely {
+    struct MappedFileContents;
     // Represents a covariance matrix.
+    //
+    // Const methods can be called concurrently from different threads. Each cached representation
+    // (covariance, inverse, Cholesky decomposition, log(determinant)) is calculated at most once,
+    // while holding a lock, and is then read without any locking. Non-const methods and compress()
+    // must not be called while any other thread is using the same object.
 	class CovarianceMatrix {
 	public:
 	    // Creates a new size-by-size covariance matrix with all elements initialized to zero.
@@ -32,7 +43,13 @@ namespace likely {
 		// The corresponding index calculation is m(i,j) = array[i+j*(j+1)/2] for i<=j. The
 		// matrix size will be inferred from the input vector size using symmetricMatrixSize.
         explicit CovarianceMatrix(std::vector<double> packed);
+        // Creates a copy of another covariance matrix. Copying a subclass that uses a structured
+        // representation creates an equivalent dense matrix, without changing the original.
+        CovarianceMatrix(CovarianceMatrix const &other);
 		virtual ~CovarianceMatrix();
+		// Returns a newly allocated copy of this object that preserves any structured
+		// representation used by a subclass. The caller is responsible for deleting it.
+        virtual CovarianceMatrix *clone() const;
 
 		// Assignment operator.
         CovarianceMatrix& operator=(CovarianceMatrix other);
@@ -46,7 +63,7 @@ namespace likely {
         // cached so repeated calls to this method are inexpensive. A cached value is available
         // after compression, so call this method before compress() if you will need it. Otherwise,
         // this method will trigger a decompression in order to calculate its result.
-        double getLogDeterminant() const;
+        virtual double getLogDeterminant() const;
         // Returns true if we are positive definite, which is not automatically true while a
         // matrix is being built or modified element by element. This test is relatively expensive
         // but its result is cached.
@@ -71,19 +88,70 @@ namespace likely {
         // return value if you are not using this functionality.
         CovarianceMatrix &setCovariance(int row, int col, double value);
         CovarianceMatrix &setInverseCovariance(int row, int col, double value);
+        // Replaces all of our (inverse) covariance matrix elements with the packed matrix
+        // provided, in the format described for our packed constructor, or throws a RuntimeError
+        // without changing anything if it has the wrong size or any diagonal element <= 0. The
+        // elements are adopted without being copied, so packed is empty on return. All elements
+        // are validated at once, and any other representation (including a subclass' structured
+        // representation) is discarded without being converted, so this is much faster than
+        // setting each element individually.
+        CovarianceMatrix &adoptCovariance(std::vector<double> &packed);
+        CovarianceMatrix &adoptInverseCovariance(std::vector<double> &packed);
         
         // Fills the vectors provided with the eigenvectors and eigenmodes of our inverse covariance.
         // Vectors are ordered by increasing inverse covariance eigenvalue, i.e., from large to small
-        // variance. See symmetricMatrixEigenSolve for details.
-        void getEigenModes(std::vector<double> &eigenvalues, std::vector<double> &eigenvectors) const;
+        // variance. See symmetricMatrixEigenSolve for details. The eigensystem is cached until
+        // our elements change, so repeated calls only copy the cached modes.
+        virtual void getEigenModes(std::vector<double> &eigenvalues, std::vector<double> &eigenvectors) const;
+        // Fills the vectors provided with a subset of the eigenmodes returned by the method above:
+        // the nmodes modes with the largest variances if nmodes > 0, or the -nmodes modes with the
+        // smallest variances if nmodes < 0, in the same order. Only the requested modes are
+        // calculated, if necessary, which is much faster than a full solution when |nmodes| is
+        // small. Throws a RuntimeError unless 0 < |nmodes| <= getSize().
+        void getEigenModes(int nmodes, std::vector<double> &eigenvalues, std::vector<double> &eigenvectors) const;
+        // Fills the vector provided with the sizes of the smallest consecutive diagonal blocks
+        // that contain all non-zero elements, so a matrix without any block structure has a
+        // single block of size getSize(). Uses whichever representation is already in memory,
+        // without any inversion, or throws a RuntimeError if no elements have been set.
+        virtual void getBlockSizes(std::vector<int> &sizes) const;
+        // Returns a new covariance matrix for the consecutive diagonal block of the specified
+        // size that starts at index start, or throws a RuntimeError. If only our inverse
+        // covariance is available, the block must not be correlated with any other index.
+        CovarianceMatrixPtr getDiagonalBlock(int start, int size) const;
+        // Fills the vectors provided with the row, column and value of each non-zero inverse
+        // covariance element with row <= col, in no particular order, or throws a RuntimeError
+        // if no elements have been set. A compressed matrix is read without being uncompressed.
+        void getInverseElements(std::vector<int> &rows, std::vector<int> &cols,
+            std::vector<double> &values) const;
 
         // Multiplies the specified vector by the (inverse) covariance or throws a RuntimeError.
         // The result is stored in the input vector, overwriting its original contents.
-        void multiplyByCovariance(std::vector<double> &vector) const;
-        void multiplyByInverseCovariance(std::vector<double> &vector) const;
+        virtual void multiplyByCovariance(std::vector<double> &vector) const;
+        virtual void multiplyByInverseCovariance(std::vector<double> &vector) const;
+        // Multiplies nvec vectors, stored consecutively so that element k of the n-th vector is
+        // vectors[n*getSize()+k], by the inverse covariance in place, or throws a RuntimeError.
+        // This uses our Cholesky decomposition and two level-3 triangular solves for all of the
+        // vectors at once. A subclass that uses a structured representation multiplies each
+        // vector separately with the method above, unless it overrides this method.
+        virtual void multiplyByInverseCovariance(double *vectors, int nvec) const;
+        // Adds weights[a] times column offsets[a] of our inverse covariance to the specified
+        // vector, for each a, or throws a RuntimeError. This reads the packed inverse directly
+        // using O(getSize()*m) operations for m columns, so it is much faster than a full
+        // multiplication when m is small. Use multiplyByInverseCovariance instead for a
+        // structured matrix, which this method would convert to a dense inverse.
+        void addInverseColumns(std::vector<int> const &offsets, std::vector<double> const &weights,
+            std::vector<double> &vector) const;
         // Calculates the chi-square = delta.Cinv.delta for the specified residuals vector delta
         // or throws a RuntimeError.
-        double chiSquare(std::vector<double> const &delta) const;
+        virtual double chiSquare(std::vector<double> const &delta) const;
+        // Calculates the chi-square values for nvec residual vectors, stored consecutively
+        // so that element k of the n-th vector is deltas[n*getSize()+k], and saves the results
+        // in chi2[n], or throws a RuntimeError. This uses our Cholesky decomposition and a single
+        // level-3 triangular solve, so is faster than repeated calls to chiSquare(delta) when
+        // several residual vectors are available at once (e.g., for numerical gradients). The
+        // vector version infers nvec from the size of deltas and resizes chi2 as necessary.
+        virtual void chiSquare(double const *deltas, int nvec, double *chi2) const;
+        void chiSquare(std::vector<double> const &deltas, std::vector<double> &chi2) const;
         // Calculates the contributions to the chi-square for delta associated with each of
         // our eigenmodes, or throws a RuntimeError. Returns the chi-square value and fills the
         // vectors provided with the eigenvalues (in decreasing order), corresponding orthonormal
@@ -106,14 +174,32 @@ namespace likely {
         // Adds each element of the inverse of the specified CovarianceMatrix to our inverse
         // elements, using the specified weight (which must be positive in order to preserve
         // our positive-definiteness). If the other matrix is compressed, this method will
-        // not uncompress it.
+        // not uncompress it. Once our inverse covariance has been allocated, this method does
+        // not allocate any memory unless the other matrix needs to be inverted or uncompressed.
         void addInverse(CovarianceMatrix const &other, double weight = 1);
+        // Subtracts the inverse of the specified CovarianceMatrix, times the specified positive
+        // weight, from our inverse elements, e.g., to remove a matrix that was previously added
+        // with addInverse, with the same cost as addInverse. The result is not validated here,
+        // since it is usually followed by other subtractions, but it might not be positive
+        // definite, which can happen due to round-off even when removing a matrix that was
+        // previously added. In that case, the next decomposition (triggered, for example, by
+        // isPositiveDefinite or by accessing our covariance) throws a RuntimeError.
+        void subtractInverse(CovarianceMatrix const &other, double weight = 1);
+        // Adds (or subtracts, if subtract is true) the low-rank matrix W.Wt to our inverse
+        // covariance, where the columns of the size x rank matrix W are stored consecutively
+        // in vectors, i.e., W[j,k] = vectors[k*getSize()+j], or throws a RuntimeError. For example,
+        // changing the weight of bin j by dw > 0 corresponds to a single vector with element j
+        // equal to sqrt(dw). Any cached covariance matrix, Cholesky decomposition and determinant
+        // are updated using O(rank*size^2) operations, so they do not need to be recalculated
+        // from scratch. Throws a RuntimeError, without changing anything, if the result would not
+        // be positive definite.
+        void addInverseLowRank(std::vector<double> const &vectors, bool subtract = false);
 
         // Fills the vector provided with a single random sampling of the Gausian probability
         // density implied by this object, or throws a RuntimeError. Returns the value of
         // delta.Cinv.delta/2 which is the negative log-likelihood of the generated sample.
         // Uses the random generator provided or else the default Random::instance().
-        double sample(std::vector<double> &delta, RandomPtr random = RandomPtr()) const;
+        virtual double sample(std::vector<double> &delta, RandomPtr random = RandomPtr()) const;
         // Generates the specified number of random residuals vectors by sampling the Gaussian
         // probability density implied by this object, or throws a RuntimeError. The generated
         // vectors are stored consecutively in the returned shared_array object, which will
@@ -125,11 +211,21 @@ namespace likely {
         // generating large numbers of residual vectors, and is slower than repeated use of
         // the single-sample method above for small values of nsample (on a macbookpro, the
         // crossover is around nsample = 32 and this method is ~4x faster for large nsample).
-        boost::shared_array<double> sample(int nsample, RandomPtr random = RandomPtr()) const;
+        virtual boost::shared_array<double> sample(int nsample, RandomPtr random = RandomPtr()) const;
+        // Transforms nvec vectors of uncorrelated normal values with mean 0 and RMS 1, stored
+        // consecutively as for the method above, into samples of the Gaussian probability density
+        // implied by this object, in place, or throws a RuntimeError. This multiplies all of the
+        // vectors by our Cholesky decomposition with a single level-3 BLAS call, and gives the
+        // same results (up to round-off) as single-sample calls that used the same values.
+        void correlate(double *vectors, int nvec) const;
         
         // Prunes this covariance matrix by eliminating any rows and columns corresponding to
         // indices not specified in the keep set. Throws a RuntimeError if any indices are
-        // out of range. Pruning is done in place and does not require any new memory allocation.
+        // out of range. Pruning is done in place. Any covariance, inverse covariance and Cholesky
+        // decomposition already in memory are pruned directly, without being recalculated,
+        // using a rank-m Cholesky update and a Schur complement, where m is the number of pruned
+        // indices. This requires O(m*size^2) operations and O(m*size) temporary memory, so a
+        // sequence of nested prunes is much cheaper than starting from scratch each time.
         void prune(std::set<int> const &keep);
 
         // Prints our covariance matrix elements to the specified output stream, using the
@@ -140,6 +236,15 @@ namespace likely {
         void printToStream(std::ostream &os, bool normalized = false,
             std::string format = std::string("%+10.3lg"),
             std::vector<std::string> const &labels = std::vector<std::string>()) const;
+        // Saves this covariance matrix to the specified file using the binary format described in
+        // MappedFile.h, or throws a RuntimeError. Any inverse covariance, Cholesky decomposition
+        // and log(determinant) already in memory are also saved, so they do not need to be
+        // recalculated after loading. The second form also saves any index map and data vector
+        // specified in contents. Use MappedCovarianceMatrix to load the saved file. A subclass
+        // with a structured representation saves its dense equivalent via a temporary copy,
+        // and keeps its structured representation.
+        void saveBinary(std::string const &filename) const;
+        void saveBinary(std::string const &filename, MappedFileContents const &contents) const;
         // Requests that this covariance matrix be compressed to reduce its memory usage,
         // if possible. Returns immediately if we are already compressed. Any compression
         // is lossless. The next call to any method except getSize(), compress(), or isCompressed().
@@ -149,22 +254,27 @@ namespace likely {
         // which can be retrieved by getLogDeterminant() without uncompression. If determinant
         // caching is an important optimization for your application, be sure to call
         // getLogDeterminant() before calling compress(). Return value indicates if any
-        // compression was actually performed.
-        bool compress() const;
+        // compression was actually performed. A block-diagonal matrix (see getBlockSizes) is
+        // compressed by storing the off-diagonal elements within each block, without indices,
+        // when this is smaller than storing the index of each non-zero element.
+        virtual bool compress() const;
         // Returns true if this covariance matrix is currently compressed.
         bool isCompressed() const;
+        // Returns true if this object currently uses a subclass' structured representation,
+        // which any element access would permanently replace with a dense matrix.
+        bool isStructured() const;
         // Returns the memory usage of this object.
-        std::size_t getMemoryUsage() const;
+        virtual std::size_t getMemoryUsage() const;
         // Returns a string describing this object's internal state in the form
         // 
-        // [MICDZV] nnnnnnn
+        // [MICLDZVE] nnnnnnn
         //
         // where each letter indicates the memory allocation state of an internal
         // vector and nnnnnn is the total number of bytes used by this object, as reported
         // by getMemoryUsage(). The letter codes are: M = _cov, I = _icov, C = _cholesky,
-        // L = log(det), D = _diag, Z = _offdiagIndex, V = _offdiagValue. A "-" indidcates
-        // that the vector is not allocated. A "." below is a wildcard. Lower case indicates
-        // that the vector has spaced reserved but is empty.
+        // L = log(det), D = _diag, Z = _offdiagIndex, V = _offdiagValue, E = _modeVectors.
+        // A "-" indidcates that the vector is not allocated. A "." below is a wildcard. Lower
+        // case indicates that the vector has spaced reserved but is empty.
         //
         // [----...] : newly created object with no elements set
         // [M---...] : most recent change was to covariance matrix
@@ -177,7 +287,30 @@ namespace likely {
         // [....D--] : Matrix is diagonal and compressed
         // [...-DZV] : Matrix is non-diagonal and compressed without cached log(det)
         // [...LDZV] : Matrix is non-diagonal and compressed with cached log(det)
+        // [....D-V] : Matrix is block diagonal and compressed
         std::string getMemoryState() const;
+        // Returns the counts, wall-clock times and allocations of the expensive transitions
+        // between our cached representations since this object was created or resetTelemetry()
+        // was last called. Use this to find code that repeatedly switches between covariance
+        // and inverse covariance access, or between compressed and uncompressed use.
+        CovarianceTelemetry getTelemetry() const;
+        void resetTelemetry();
+
+    protected:
+        // Subclasses that use a more compact structured representation of the covariance set
+        // this flag in their constructors and override the virtual methods above to use it.
+        // Any other method will first call _getDense via _uncompress, after which this object
+        // permanently behaves like a dense CovarianceMatrix and the flag is cleared.
+        mutable boost::atomic<bool> _structured;
+        // Fills the vector provided with the packed covariance matrix (inverse = false) or
+        // inverse covariance matrix (inverse = true) equivalent to a subclass' structured
+        // representation. The default implementation throws a RuntimeError.
+        virtual void _getDense(std::vector<double> &packed, bool &inverse) const;
+        // Records a completed transition that was timed with the timer provided and allocated
+        // the specified number of bytes, in our telemetry and the global telemetry. Subclasses
+        // should call this for the expensive operations of their structured representations.
+        void _recordTransition(CovarianceTelemetry::Transition transition,
+            WallClockTimer const &timer, std::size_t bytes = 0) const;
         
     private:
         // Undoes any compression. Returns immediately if we are already uncompressed.
@@ -193,6 +326,28 @@ namespace likely {
         // Prepares to change at least one element of _cov or _icov.
         void _changesCov();
         void _changesICov();
+        // Implements adoptCovariance and adoptInverseCovariance.
+        void _adopt(std::vector<double> &packed, bool inverse);
+        // Flags for cached representations that are complete and can be read without locking.
+        enum { DENSE_READY = 1, COV_READY = 2, ICOV_READY = 4, CHOLESKY_READY = 8, LOGDET_READY = 16 };
+        // Returns true if all of the specified flags are set. Flags are set (with release
+        // semantics) only after the corresponding representation has been calculated while
+        // holding _mutex, and are all reset by any change.
+        bool _isReady(int flags) const;
+        void _setReady(int flags) const;
+        void _resetReady() const;
+        // Saves a value of _logDeterminant calculated while holding _mutex, unless lock-free
+        // readers might already be reading it.
+        void _cacheLogDeterminant(double value) const;
+        // Adds weight times our compressed off-diagonal inverse covariance elements to the
+        // packed matrix provided.
+        void _addCompressedOffDiagonal(std::vector<double> &packed, double weight) const;
+        // Prepares to read the consecutive inverse covariance eigenmodes first,...,last (in order
+        // of increasing eigenvalue) from _modeValues and _modeVectors. Must be called while holding
+        // _mutex, and for as long as the cached modes are being read.
+        void _readsEigenModes(int first, int last) const;
+        // Deletes any cached eigenmodes.
+        void _deleteEigenModes() const;
         // Helper function used by getMemoryState()
         char _tag(char symbol, std::vector<double> const &vector) const;
 
@@ -210,6 +365,22 @@ namespace likely {
         // compression replaces _cov, _icov, _cholesky with the following
         // smaller vectors, that encode the inverse covariance matrix (_icov not _cov).
         mutable std::vector<double> _diag, _offdiagIndex, _offdiagValue;
+        // Lists the block sizes when _offdiagValue stores the packed off-diagonal elements
+        // of each diagonal block instead of elements listed in _offdiagIndex.
+        mutable std::vector<int> _compressedBlocks;
+        // Caches the inverse covariance eigenmodes _firstMode,...,_firstMode+_modeValues.size()-1
+        // (in order of increasing eigenvalue) until any change to _cov or _icov. Eigenvectors
+        // are stored consecutively, as for getEigenModes().
+        mutable int _firstMode;
+        mutable std::vector<double> _modeValues, _modeVectors;
+        // Tracks which cached representations are ready (see _isReady) and serializes their
+        // calculation. The mutex is recursive since materializations are nested.
+        mutable boost::atomic<int> _ready;
+        mutable boost::recursive_mutex _mutex;
+        // Our telemetry has its own lock since subclasses record transitions while holding
+        // their own locks.
+        mutable CovarianceTelemetry _telemetry;
+        mutable boost::mutex _telemetryMutex;
 	}; // CovarianceMatrix
 	
     void swap(CovarianceMatrix& a, CovarianceMatrix& b);
@@ -218,6 +389,8 @@ namespace likely {
     
     inline bool CovarianceMatrix::isCompressed() const { return _compressed; }
 
+    inline bool CovarianceMatrix::isStructured() const { return _structured; }
+
     // Returns the array offset index for the BLAS packed 'U' symmetric matrix format
     // described at http://www.netlib.org/lapack/lug/node123.html or throws a
     // RuntimeError for invalid row or col inputs. The corresponding iterator sequence is:
@@ -245,16 +418,76 @@ namespace likely {
     // implied by packedMatrixIndex(row,col), e.g. by first calling _choleskyDecompose(matrix).
     // The matrix size will be calculated unless a positive value is provided.
     void invertCholesky(std::vector<double> &matrix, int size = 0);
+    // Sets the minimum matrix size for which choleskyDecompose and invertCholesky switch from the
+    // packed LAPACK routines (which only use level-2 BLAS) to the equivalent blocked routines for
+    // the rectangular full packed (RFP) format, which use level-3 BLAS and benefit from a
+    // multithreaded BLAS library. Matrices are converted back to packed format afterwards, so
+    // the only cost is a temporary copy of the packed matrix. Use size = 0 to always use the
+    // packed routines. Throws a RuntimeError for size < 0. The default threshold is 256.
+    void setBlockedDecompositionThreshold(int size);
+    int getBlockedDecompositionThreshold();
+    // Requests that the underlying BLAS/LAPACK library use the specified number of threads.
+    // Returns true if the library supports this request (currently OpenBLAS and MKL) or else
+    // false, in which case the library's own defaults (e.g., environment variables) apply.
+    bool setLinearAlgebraThreads(int nthreads);
+    // Returns the telemetry summed over all CovarianceMatrix objects (including objects that
+    // no longer exist) since the program started or resetGlobalCovarianceTelemetry() was last
+    // called. These are safe to call from any thread.
+    CovarianceTelemetry getGlobalCovarianceTelemetry();
+    void resetGlobalCovarianceTelemetry();
+    // Fills the vector provided with the sizes of the smallest consecutive diagonal blocks of a
+    // symmetric matrix that contain all of its non-zero elements. The input matrix is assumed to
+    // be in the BLAS packed 'U' format implied by packedMatrixIndex(row,col). The matrix size
+    // will be calculated unless a positive value is provided.
+    void symmetricMatrixBlocks(std::vector<double> const &matrix, std::vector<int> &sizes,
+        int size = 0);
     // Multiplies a symmetric matrix by a vector, or throws a RuntimeError. The input matrix
     // is assumed to be in the BLAS packed 'U' format implied by packedMatrixIndex(row,col).
     void symmetricMatrixMultiply(std::vector<double> const &matrix,
         std::vector<double> const &vector, std::vector<double> &result);
+    // Calculates the same product using packed matrix elements that are not stored in a vector,
+    // e.g., in a memory-mapped file, and stores the result in an array of length size. Uses
+    // level-2 BLAS when available, or else the built-in kernels of PackedKernels.h.
+    void symmetricMatrixMultiply(double const *matrix, double const *vector, double *result,
+        int size);
+    // Solves Ut.X = B (transpose = true) or U.X = B (transpose = false) in place for nvec
+    // column vectors of length size stored consecutively in vectors, where U is an upper-diagonal
+    // matrix in the BLAS packed 'U' format implied by packedMatrixIndex(row,col), e.g., the output
+    // of choleskyDecompose. Uses blocked level-3 BLAS with temporary storage proportional to size,
+    // rather than size*size, or else the built-in kernels of PackedKernels.h when configure did
+    // not find a BLAS library. The matrix size will be calculated unless a positive value is provided.
+    void triangularSolve(std::vector<double> const &matrix, double *vectors, int nvec,
+        bool transpose, int size = 0);
+    // Solves the same equations using packed matrix elements that are not stored in a vector,
+    // e.g., in a memory-mapped file. The matrix size must be provided.
+    void triangularSolve(double const *matrix, double *vectors, int nvec,
+        bool transpose, int size);
     // Fills the result vector with Mt.M (transposeLeft = true) or M.Mt (transposeLeft = false)
     // where M is the input (unpacked) matrix, and result is in the BLAS packed 'U' format
     // implied by packedMatrixIndex(row,col). The matrix size will be calculated unless a
     // positive value is provided. 
     void matrixSquare(std::vector<double> const &matrix, std::vector<double> &result,
         bool transposeLeft, int size = 0);
+    // Updates the Cholesky decomposition U of a symmetric positive definite matrix A = Ut.U,
+    // stored in the BLAS packed 'U' format, so that it becomes the decomposition of A + X.Xt
+    // (downdate = false) or A - X.Xt (downdate = true), where the columns of the size x nvec
+    // matrix X are stored consecutively in vectors. Uses O(nvec*size^2) operations instead of
+    // the O(size^3) needed for a new decomposition. Throws a RuntimeError if a downdated matrix
+    // would not be positive definite, in which case the input matrix is left in an invalid
+    // state. The matrix size will be calculated unless a positive value is provided.
+    void choleskyUpdate(std::vector<double> &matrix, double const *vectors, int nvec,
+        bool downdate, int size = 0);
+    // Represents a linear operator that fills result with M.x for some fixed matrix M, where
+    // x and result are arrays of the same size and do not overlap.
+    typedef boost::function<void (double const *x, double *result)> LinearOperator;
+    // Solves M.x = b for a symmetric positive definite matrix M of the specified size using
+    // preconditioned conjugate gradients, where multiply calculates M.x and precondition
+    // applies an approximate inverse of M. Starts from x = 0 and stops when the norm of
+    // b - M.x is at most tolerance times the norm of b. Returns the number of iterations used,
+    // or throws a RuntimeError if M is not positive definite or this does not converge within
+    // maxIterations.
+    int conjugateGradientSolve(LinearOperator const &multiply, LinearOperator const &precondition,
+        double const *b, double *x, int size, double tolerance, int maxIterations);
     // Solves the eigensystem for a symmetric matrix, or throws a RuntimeError. The input matrix
     // is assumed to be in the BLAS packed 'U' format implied by packedMatrixIndex(row,col).
     // The matrix size will be calculated unless a positive value is provided. Fills eigenvalues
@@ -262,6 +495,12 @@ namespace likely {
     // eigenvectors are orthonormal.
     void symmetricMatrixEigenSolve(std::vector<double> const &matrix,
         std::vector<double> &eigenvalues, std::vector<double> &eigenvectors, int size = 0);
+    // Solves for the subset of eigenvalues with indices first,...,last (counting from zero in
+    // order of increasing eigenvalue) and their eigenvectors, using the LAPACK dsyevr routine.
+    // Otherwise identical to the function above.
+    void symmetricMatrixEigenSolve(std::vector<double> const &matrix,
+        std::vector<double> &eigenvalues, std::vector<double> &eigenvectors,
+        int first, int last, int size = 0);
         
     // Creates a diagonal covariance matrix with constant elements (first form) or specified
     // positive elements (second form).
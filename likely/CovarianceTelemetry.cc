@@ -0,0 +1,108 @@
+#include "likely/CovarianceTelemetry.h"
+#include "likely/RuntimeError.h"
+
+#include "boost/format.hpp"
+
+#include <iostream>
+#include <sys/time.h>
+
+namespace local = likely;
+
+local::CovarianceTelemetry::CovarianceTelemetry() {
+    reset();
+}
+
+local::CovarianceTelemetry::~CovarianceTelemetry() { }
+
+void local::CovarianceTelemetry::reset() {
+    for(int t = 0; t < NTransitions; ++t) {
+        _count[t] = 0;
+        _seconds[t] = 0;
+        _bytes[t] = 0;
+    }
+}
+
+void local::CovarianceTelemetry::_checkTransition(Transition transition) {
+    if(transition < 0 || transition >= NTransitions) {
+        throw RuntimeError("CovarianceTelemetry: invalid transition.");
+    }
+}
+
+void local::CovarianceTelemetry::record(Transition transition, double seconds, std::size_t bytes) {
+    _checkTransition(transition);
+    _count[transition]++;
+    _seconds[transition] += seconds;
+    _bytes[transition] += bytes;
+}
+
+local::CovarianceTelemetry &local::CovarianceTelemetry::operator+=(CovarianceTelemetry const &other) {
+    for(int t = 0; t < NTransitions; ++t) {
+        _count[t] += other._count[t];
+        _seconds[t] += other._seconds[t];
+        _bytes[t] += other._bytes[t];
+    }
+    return *this;
+}
+
+long local::CovarianceTelemetry::getCount(Transition transition) const {
+    _checkTransition(transition);
+    return _count[transition];
+}
+
+double local::CovarianceTelemetry::getSeconds(Transition transition) const {
+    _checkTransition(transition);
+    return _seconds[transition];
+}
+
+std::size_t local::CovarianceTelemetry::getBytesAllocated(Transition transition) const {
+    _checkTransition(transition);
+    return _bytes[transition];
+}
+
+long local::CovarianceTelemetry::getTotalCount() const {
+    long total(0);
+    for(int t = 0; t < NTransitions; ++t) total += _count[t];
+    return total;
+}
+
+double local::CovarianceTelemetry::getTotalSeconds() const {
+    double total(0);
+    for(int t = 0; t < NTransitions; ++t) total += _seconds[t];
+    return total;
+}
+
+std::size_t local::CovarianceTelemetry::getTotalBytesAllocated() const {
+    std::size_t total(0);
+    for(int t = 0; t < NTransitions; ++t) total += _bytes[t];
+    return total;
+}
+
+std::string local::CovarianceTelemetry::getName(Transition transition) {
+    _checkTransition(transition);
+    static char const *names[NTransitions] = {
+        "decomposition", "inversion", "eigensolve", "compression", "decompression" };
+    return names[transition];
+}
+
+void local::CovarianceTelemetry::printToStream(std::ostream &os) const {
+    boost::format formatter("%13s %8d %12.6f s %14d bytes");
+    for(int t = 0; t < NTransitions; ++t) {
+        os << formatter % getName((Transition)t) % _count[t] % _seconds[t] % _bytes[t] << std::endl;
+    }
+    os << formatter % "total" % getTotalCount() % getTotalSeconds() % getTotalBytesAllocated()
+        << std::endl;
+}
+
+local::WallClockTimer::WallClockTimer()
+: _start(_now())
+{ }
+
+double local::WallClockTimer::getElapsedSeconds() const {
+    return _now() - _start;
+}
+
+double local::WallClockTimer::_now() {
+    struct timeval now;
+    gettimeofday(&now,0);
+    return now.tv_sec + 1e-6*now.tv_usec;
+}
@@ -0,0 +1,67 @@
+#ifndef LIKELY_COVARIANCE_TELEMETRY
+#define LIKELY_COVARIANCE_TELEMETRY
+
+#include <string>
+#include <cstddef>
+#include <iosfwd>
+
+namespace likely {
+    // Summarizes the expensive transitions between the cached representations of one or more
+    // covariance matrices, with the number of times each transition occurred, the total
+    // wall-clock time spent in it, and the total number of bytes it allocated for the new
+    // representation. Use CovarianceMatrix::getTelemetry() for a single matrix or
+    // getGlobalCovarianceTelemetry() for all matrices.
+	class CovarianceTelemetry {
+	public:
+	    // The transitions that are tracked:
+	    //  - Decomposition: Cholesky decomposition of the covariance or its inverse.
+	    //  - Inversion: calculating the covariance from its inverse, or vice versa.
+	    //  - EigenSolve: solving for some or all eigenmodes.
+	    //  - Compression: building a compressed representation in compress().
+	    //  - Decompression: rebuilding a dense matrix from a compressed representation, or
+	    //    from the structured representation of a subclass.
+	    enum Transition { Decomposition, Inversion, EigenSolve, Compression, Decompression, NTransitions };
+	    // Creates a new object with all counters set to zero.
+		CovarianceTelemetry();
+		virtual ~CovarianceTelemetry();
+		// Records one transition that took the specified wall-clock time and allocated the
+		// specified number of bytes.
+        void record(Transition transition, double seconds, std::size_t bytes);
+        // Adds the counters of another object to our counters.
+        CovarianceTelemetry &operator+=(CovarianceTelemetry const &other);
+        // Resets all counters to zero.
+        void reset();
+        // Returns the counters for a single transition, or throws a RuntimeError.
+        long getCount(Transition transition) const;
+        double getSeconds(Transition transition) const;
+        std::size_t getBytesAllocated(Transition transition) const;
+        // Returns the counters summed over all transitions.
+        long getTotalCount() const;
+        double getTotalSeconds() const;
+        std::size_t getTotalBytesAllocated() const;
+        // Returns a printable name for a transition, or throws a RuntimeError.
+        static std::string getName(Transition transition);
+        // Dumps our counters to the specified output stream, with one line per transition.
+        void printToStream(std::ostream &os) const;
+	private:
+	    // Throws a RuntimeError unless transition is valid.
+        static void _checkTransition(Transition transition);
+        long _count[NTransitions];
+        double _seconds[NTransitions];
+        std::size_t _bytes[NTransitions];
+	}; // CovarianceTelemetry
+
+	// Measures elapsed wall-clock time for CovarianceTelemetry.
+	class WallClockTimer {
+	public:
+	    // Starts the timer.
+	    WallClockTimer();
+	    // Returns the number of seconds since this timer was started.
+	    double getElapsedSeconds() const;
+	private:
+	    static double _now();
+	    double _start;
+	}; // WallClockTimer
+} // likely
+
+#endif // LIKELY_COVARIANCE_TELEMETRY
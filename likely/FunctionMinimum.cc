@@ -3,6 +3,7 @@
 #include "likely/FunctionMinimum.h"
 #include "likely/RuntimeError.h"
 #include "likely/CovarianceMatrix.h"
+#include "likely/Random.h"
 
 #include "boost/format.hpp"
 #include "boost/lexical_cast.hpp"
@@ -136,6 +137,44 @@ Parameters &toParams) const {
     return nlWeight;
 }
 
+void local::FunctionMinimum::setRandomParameters(Parameters const &fromParams, int nsample,
+std::vector<Parameters> &toParams, std::vector<double> &nlWeights, RandomPtr random) const {
+    if(!hasCovariance()) {
+        throw RuntimeError(
+            "FunctionMinimum::getRandomParameters: no covariance matrix available.");
+    }
+    if(nsample <= 0) {
+        throw RuntimeError("FunctionMinimum::getRandomParameters: expected nsample > 0.");
+    }
+    // Use the default generator if none was specified.
+    if(!random) random = Random::instance();
+    // Generate uncorrelated offsets for our floating parameters, stored consecutively, in the
+    // same order as repeated calls to the method above. The -log(likelihood) of each offset
+    // vector is half the sum of its squared uncorrelated values.
+    int nfloating(_covar->getSize());
+    std::vector<double> offsets(nsample*nfloating);
+    nlWeights.assign(nsample,0);
+    for(int n = 0; n < nsample; ++n) {
+        for(int k = 0; k < nfloating; ++k) {
+            double r(random->getNormal());
+            offsets[n*nfloating+k] = r;
+            nlWeights[n] += r*r;
+        }
+        nlWeights[n] /= 2;
+    }
+    // Correlate all of the offsets at once.
+    _covar->correlate(&offsets[0],nsample);
+    toParams.assign(nsample,fromParams);
+    for(int n = 0; n < nsample; ++n) {
+        double const *nextOffset(&offsets[n*nfloating]);
+        int index(0);
+        for(FitParameters::const_iterator iter = _parameters.begin(); iter != _parameters.end(); ++iter) {
+            if(iter->isFloating()) toParams[n][index] += *nextOffset++;
+            index++;
+        }
+    }
+}
+
 void local::FunctionMinimum::printToStream(std::ostream &os, std::string const &formatSpec) const {
     boost::format formatter(formatSpec.c_str());
     std::vector<std::string> labels;
@@ -62,6 +62,15 @@ namespace likely {
         // input fromParams vector. Returns the -log(liklihood) associated with the random
         // offset vector (see CovarianceMatrix::sample for details)
         double setRandomParameters(const Parameters &fromParams, Parameters &toParams) const;
+        // Fills toParams with nsample parameter vectors generated as above, and nlWeights with
+        // the corresponding -log(likelihood) values, or throws a RuntimeError. Uses the random
+        // generator provided or else the default Random::instance(), and gives the same results
+        // (up to round-off) as nsample calls to the method above with the same generator state.
+        // All offsets are correlated with a single call to CovarianceMatrix::correlate, which is
+        // much faster than repeated calls to the method above.
+        void setRandomParameters(const Parameters &fromParams, int nsample,
+            std::vector<Parameters> &toParams, std::vector<double> &nlWeights,
+            RandomPtr random = RandomPtr()) const;
         // Sets the number of times the function and its gradient have been evaluated to
         // obtain this estimate of the minimum.
         void setCounts(long nEvalCount, long nGradCount);
@@ -0,0 +1,147 @@
+#include "likely/IncrementalChiSquare.h"
+#include "likely/RuntimeError.h"
+#include "likely/BinnedData.h"
+#include "likely/CovarianceMatrix.h"
+#include "likely/PackedKernels.h"
+
+namespace local = likely;
+
+namespace likely {
+namespace incremental {
+    // An incremental update of m out of n bins reads m columns of the packed inverse
+    // covariance, with O(n*m) operations, so a single O(n^2) level-2 BLAS recalculation is
+    // faster once m exceeds this fraction of n.
+    int const maxChangedFraction = 8;
+} // incremental
+} // likely
+
+local::IncrementalChiSquare::IncrementalChiSquare(BinnedDataCPtr data, int recalculateInterval)
+: _binnedData(data), _recalculateInterval(recalculateInterval), _nfull(0), _nincremental(0)
+{
+    if(!data || 0 == data->getNBinsWithData()) {
+        throw RuntimeError("IncrementalChiSquare: expected data with at least one bin.");
+    }
+    if(recalculateInterval < 0) {
+        throw RuntimeError("IncrementalChiSquare: expected recalculateInterval >= 0.");
+    }
+    reset();
+}
+
+local::IncrementalChiSquare::~IncrementalChiSquare() { }
+
+void local::IncrementalChiSquare::reset() {
+    _covariance = _binnedData->getCovarianceMatrix();
+    _scalarWeight = _covariance ? 0 : _binnedData->getScalarWeight();
+    _data.resize(0);
+    _data.reserve(_binnedData->getNBinsWithData());
+    for(BinnedData::IndexIterator iter = _binnedData->begin(); iter != _binnedData->end(); ++iter) {
+        _data.push_back(_binnedData->getData(*iter));
+    }
+    _pred.resize(0);
+}
+
+void local::IncrementalChiSquare::_recalculate() {
+    int n(_data.size());
+    _residual.resize(n);
+    for(int k = 0; k < n; ++k) _residual[k] = _pred[k] - _data[k];
+    _weighted = _residual;
+    if(_covariance) {
+        _covariance->multiplyByInverseCovariance(_weighted);
+    }
+    else {
+        for(int k = 0; k < n; ++k) _weighted[k] *= _scalarWeight;
+    }
+    _chiSquare = dotProduct(&_residual[0],&_weighted[0],n);
+    _nsinceRecalculate = 0;
+    _nfull++;
+}
+
+double local::IncrementalChiSquare::chiSquare(std::vector<double> const &pred) {
+    int n(_data.size());
+    if(pred.size() != n) {
+        throw RuntimeError("IncrementalChiSquare::chiSquare: prediction vector has wrong size.");
+    }
+    if(_pred.empty()) {
+        _pred = pred;
+        _recalculate();
+        return _chiSquare;
+    }
+    // Find the bins whose predictions have changed.
+    _changed.resize(0);
+    _changedValues.resize(0);
+    for(int k = 0; k < n; ++k) {
+        if(pred[k] != _pred[k]) {
+            _changed.push_back(k);
+            _changedValues.push_back(pred[k]);
+        }
+    }
+    _applyChanges();
+    return _chiSquare;
+}
+
+double local::IncrementalChiSquare::update(std::vector<int> const &offsets,
+std::vector<double> const &values) {
+    if(_pred.empty()) {
+        throw RuntimeError("IncrementalChiSquare::update: no previous prediction to update.");
+    }
+    if(offsets.size() != values.size()) {
+        throw RuntimeError("IncrementalChiSquare::update: offsets and values have different sizes.");
+    }
+    int n(_data.size());
+    for(int a = 0; a < offsets.size(); ++a) {
+        if(offsets[a] < 0 || offsets[a] >= n) {
+            throw RuntimeError("IncrementalChiSquare::update: invalid offset.");
+        }
+    }
+    _changed = offsets;
+    _changedValues = values;
+    _applyChanges();
+    return _chiSquare;
+}
+
+void local::IncrementalChiSquare::_applyChanges() {
+    int n(_data.size()), m(_changed.size());
+    if(0 == m) return;
+    // Do we need a full recalculation?
+    if(incremental::maxChangedFraction*m > n ||
+    (_recalculateInterval > 0 && _nsinceRecalculate >= _recalculateInterval)) {
+        for(int a = 0; a < m; ++a) _pred[_changed[a]] = _changedValues[a];
+        _recalculate();
+        return;
+    }
+    // Update the prediction and residual, and add 2 delta.w to the chi-square using the
+    // previous w. Offsets that appear more than once accumulate their deltas correctly,
+    // since each delta is calculated relative to the previous value.
+    _delta.resize(m);
+    _previous.resize(m);
+    double change(0);
+    for(int a = 0; a < m; ++a) {
+        int offset(_changed[a]);
+        _delta[a] = _changedValues[a] - _pred[offset];
+        _pred[offset] = _changedValues[a];
+        _residual[offset] += _delta[a];
+        _previous[a] = _weighted[offset];
+        change += 2*_delta[a]*_weighted[offset];
+    }
+    // Update w += Cinv.delta using the changed columns of Cinv, or else with a single
+    // multiplication of the sparse vector of deltas, so that a structured covariance is
+    // never unpacked.
+    if(!_covariance) {
+        for(int a = 0; a < m; ++a) _weighted[_changed[a]] += _scalarWeight*_delta[a];
+    }
+    else if(_covariance->isStructured()) {
+        _sparse.assign(n,0);
+        for(int a = 0; a < m; ++a) _sparse[_changed[a]] += _delta[a];
+        _covariance->multiplyByInverseCovariance(_sparse);
+        for(int j = 0; j < n; ++j) _weighted[j] += _sparse[j];
+    }
+    else {
+        _covariance->addInverseColumns(_changed,_delta,_weighted);
+    }
+    // The change in w at the changed bins is Cinv.delta restricted to those bins, so this
+    // adds delta.Cinv.delta without any more inverse covariance accesses.
+    for(int a = 0; a < m; ++a) change += _delta[a]*(_weighted[_changed[a]] - _previous[a]);
+    _chiSquare += change;
+    _nsinceRecalculate++;
+    _nincremental++;
+}
@@ -0,0 +1,69 @@
+#ifndef LIKELY_INCREMENTAL_CHI_SQUARE
+#define LIKELY_INCREMENTAL_CHI_SQUARE
+
+#include "likely/types.h"
+
+#include <vector>
+
+namespace likely {
+    // Evaluates BinnedData::chiSquare(pred) for a sequence of predictions that usually differ
+    // in only a few bins, e.g., when a nuisance parameter only affects one redshift slice.
+    // We remember the last residual r = pred - data and w = Cinv.r, so that changing m bins by
+    // delta updates the chi-square r.w in O(n*m) operations, instead of O(n^2), using
+    //
+    //   chi2' = chi2 + 2 delta.w + delta.Cinv.delta,   w' = w + Cinv.delta
+    //
+    // A structured covariance (see CovarianceMatrix::isStructured) is never unpacked, since
+    // Cinv.delta is then calculated with a single multiplication.
+    //
+    // Rounding errors accumulate with each update, so the chi-square and w are recalculated
+    // from scratch after a configurable number of updates. The data vector is copied, and a
+    // shared pointer to the covariance is saved, when this object is created or reset() is
+    // called, so later changes to the BinnedData object's data (or a new covariance) are not seen
+    // until reset() is called. The covariance itself is shared, not copied, so it should not be
+    // modified while this object is in use. Objects are not thread safe, so create one per thread.
+	class IncrementalChiSquare {
+	public:
+	    // Creates a new evaluator for the specified data, which must have at least one bin, or
+	    // throws a RuntimeError. A full recalculation is done after every recalculateInterval
+	    // incremental updates, or never if recalculateInterval is zero.
+		explicit IncrementalChiSquare(BinnedDataCPtr data, int recalculateInterval = 100);
+		virtual ~IncrementalChiSquare();
+		// Returns the chi-square of the specified predicted data vector, which uses the same
+		// index sequence as our data's index iterator, or throws a RuntimeError. Bins whose
+		// predictions have changed since the last call are updated incrementally when there
+		// are few enough of them, and otherwise the chi-square is recalculated.
+        double chiSquare(std::vector<double> const &pred);
+        // Changes the predictions at the specified offsets (see BinnedData::getOffsetForIndex)
+        // to the values provided and returns the new chi-square, or throws a RuntimeError. This
+        // avoids scanning the whole prediction vector when the changed bins are already known.
+        // Throws a RuntimeError if no prediction has been provided yet via chiSquare(pred).
+        double update(std::vector<int> const &offsets, std::vector<double> const &values);
+        // Copies the current data vector and covariance of our BinnedData object, and forgets
+        // any previous prediction.
+        void reset();
+        // Returns the number of full and incremental evaluations since we were created.
+        long getNFullEvaluations() const;
+        long getNIncrementalUpdates() const;
+	private:
+	    // Recalculates _residual, _weighted and _chiSquare from _pred.
+	    void _recalculate();
+	    // Changes the prediction at each offset in _changed to the corresponding value in
+	    // _changedValues, either incrementally or with a full recalculation.
+	    void _applyChanges();
+	    BinnedDataCPtr _binnedData;
+	    CovarianceMatrixCPtr _covariance;
+	    int _recalculateInterval, _nsinceRecalculate;
+	    long _nfull, _nincremental;
+	    double _scalarWeight, _chiSquare;
+	    std::vector<int> _changed;
+	    std::vector<double> _changedValues, _delta, _previous, _sparse;
+	    // Our copy of the unweighted data, the last prediction, their difference r and Cinv.r
+	    std::vector<double> _data, _pred, _residual, _weighted;
+	}; // IncrementalChiSquare
+
+    inline long IncrementalChiSquare::getNFullEvaluations() const { return _nfull; }
+    inline long IncrementalChiSquare::getNIncrementalUpdates() const { return _nincremental; }
+} // likely
+
+#endif // LIKELY_INCREMENTAL_CHI_SQUARE
@@ -0,0 +1,255 @@
+#include "likely/KroneckerCovarianceMatrix.h"
+#include "likely/RuntimeError.h"
+#include "likely/Random.h"
+#include "likely/PackedKernels.h"
+
+#include <algorithm>
+
+namespace local = likely;
+
+local::KroneckerCovarianceMatrix::KroneckerCovarianceMatrix(
+std::vector<CovarianceMatrixCPtr> const &factors)
+: CovarianceMatrix(_getTotalSize(factors)), _logDet(0)
+{
+    WallClockTimer timer;
+    int size(getSize());
+    std::size_t bytes(0);
+    _factorSize.reserve(factors.size());
+    _factorCov.reserve(factors.size());
+    _factorCholesky.reserve(factors.size());
+    for(int k = 0; k < factors.size(); ++k) {
+        // Read a structured factor through a dense copy, so that it keeps its representation.
+        CovarianceMatrixCPtr factor(factors[k]);
+        if(factor->isStructured()) factor.reset(new CovarianceMatrix(*factor));
+        int n(factor->getSize());
+        std::vector<double> packed((n*(n+1))/2);
+        for(int col = 0; col < n; ++col) {
+            for(int row = 0; row <= col; ++row) {
+                packed[row + (col*(col+1))/2] = factor->getCovariance(row,col);
+            }
+        }
+        // Each factor's determinant appears once for every combination of the other indices.
+        std::vector<double> cholesky(packed);
+        _logDet += (size/n)*choleskyDecompose(cholesky,n);
+        bytes += sizeof(double)*(packed.size() + cholesky.size());
+        _factorSize.push_back(n);
+        _factorCov.push_back(packed);
+        _factorCholesky.push_back(cholesky);
+    }
+    _recordTransition(CovarianceTelemetry::Decomposition,timer,bytes);
+    _structured = true;
+}
+
+local::KroneckerCovarianceMatrix::KroneckerCovarianceMatrix(KroneckerCovarianceMatrix const &other)
+: CovarianceMatrix(other.getSize()), _factorSize(other._factorSize), _factorCov(other._factorCov),
+_factorCholesky(other._factorCholesky), _logDet(other._logDet)
+{
+    _structured = true;
+}
+
+local::KroneckerCovarianceMatrix::~KroneckerCovarianceMatrix() { }
+
+int local::KroneckerCovarianceMatrix::_getTotalSize(std::vector<CovarianceMatrixCPtr> const &factors) {
+    if(0 == factors.size()) {
+        throw RuntimeError("KroneckerCovarianceMatrix: no factors provided.");
+    }
+    int size(1);
+    for(int k = 0; k < factors.size(); ++k) {
+        if(!factors[k]) throw RuntimeError("KroneckerCovarianceMatrix: invalid factor.");
+        size *= factors[k]->getSize();
+    }
+    return size;
+}
+
+local::CovarianceMatrixPtr local::KroneckerCovarianceMatrix::getFactor(int index) const {
+    if(index < 0 || index >= _factorSize.size()) {
+        throw RuntimeError("KroneckerCovarianceMatrix::getFactor: invalid index.");
+    }
+    return CovarianceMatrixPtr(new CovarianceMatrix(_factorCov[index]));
+}
+
+local::CovarianceMatrix *local::KroneckerCovarianceMatrix::clone() const {
+    if(!_structured) return CovarianceMatrix::clone();
+    return new KroneckerCovarianceMatrix(*this);
+}
+
+double local::KroneckerCovarianceMatrix::getLogDeterminant() const {
+    if(!_structured) return CovarianceMatrix::getLogDeterminant();
+    return _logDet;
+}
+
+void local::KroneckerCovarianceMatrix::_apply(double *vectors, int nvec, AxisOperation operation) const {
+    int size(getSize()), left(1);
+    std::vector<double> buffer, result;
+    for(int k = 0; k < _factorSize.size(); ++k) {
+        // Element i along this axis of vector v is at v*size + (l*n + i)*right + r, where
+        // l and r enumerate the combinations of indices before and after this axis.
+        int n(_factorSize[k]), right(size/(left*n)), nfibers(nvec*left*right);
+        double const *cov(&_factorCov[k][0]), *cholesky(&_factorCholesky[k][0]);
+        // Gather the fibers along this axis into consecutive vectors of length n, unless
+        // they already are.
+        double *fibers(vectors);
+        if(right > 1) {
+            buffer.resize(nfibers*n);
+            for(int vl = 0; vl < nvec*left; ++vl) {
+                for(int i = 0; i < n; ++i) {
+                    double const *src(vectors + (vl*n + i)*right);
+                    for(int r = 0; r < right; ++r) buffer[(vl*right + r)*n + i] = src[r];
+                }
+            }
+            fibers = &buffer[0];
+        }
+        switch(operation) {
+        case MultiplyByCovariance:
+            result.resize(n);
+            for(int f = 0; f < nfibers; ++f) {
+                symmetricMatrixMultiply(cov,fibers + f*n,&result[0],n);
+                std::copy(result.begin(),result.end(),fibers + f*n);
+            }
+            break;
+        case MultiplyByInverse:
+            triangularSolve(cholesky,fibers,nfibers,true,n);
+            triangularSolve(cholesky,fibers,nfibers,false,n);
+            break;
+        case SolveTranspose:
+            triangularSolve(cholesky,fibers,nfibers,true,n);
+            break;
+        case MultiplyByTranspose:
+            // Row i of Ut is the i-th packed column of U, and only uses elements <= i, so
+            // we can update each fiber in place starting from its last element.
+            for(int f = 0; f < nfibers; ++f) {
+                double *x(fibers + f*n);
+                for(int i = n-1; i >= 0; --i) x[i] = dotProduct(cholesky + (i*(i+1))/2,x,i+1);
+            }
+            break;
+        }
+        if(right > 1) {
+            for(int vl = 0; vl < nvec*left; ++vl) {
+                for(int i = 0; i < n; ++i) {
+                    double *dst(vectors + (vl*n + i)*right);
+                    for(int r = 0; r < right; ++r) dst[r] = buffer[(vl*right + r)*n + i];
+                }
+            }
+        }
+        left *= n;
+    }
+}
+
+void local::KroneckerCovarianceMatrix::multiplyByCovariance(std::vector<double> &vector) const {
+    if(!_structured) return CovarianceMatrix::multiplyByCovariance(vector);
+    if(vector.size() != getSize()) {
+        throw RuntimeError("KroneckerCovarianceMatrix::multiplyByCovariance: vector has wrong size.");
+    }
+    _apply(&vector[0],1,MultiplyByCovariance);
+}
+
+void local::KroneckerCovarianceMatrix::multiplyByInverseCovariance(std::vector<double> &vector) const {
+    if(!_structured) return CovarianceMatrix::multiplyByInverseCovariance(vector);
+    if(vector.size() != getSize()) {
+        throw RuntimeError("KroneckerCovarianceMatrix::multiplyByInverseCovariance: vector has wrong size.");
+    }
+    _apply(&vector[0],1,MultiplyByInverse);
+}
+
+void local::KroneckerCovarianceMatrix::multiplyByInverseCovariance(double *vectors, int nvec) const {
+    if(!_structured) return CovarianceMatrix::multiplyByInverseCovariance(vectors,nvec);
+    if(nvec <= 0) {
+        throw RuntimeError("KroneckerCovarianceMatrix::multiplyByInverseCovariance: expected nvec > 0.");
+    }
+    _apply(vectors,nvec,MultiplyByInverse);
+}
+
+double local::KroneckerCovarianceMatrix::chiSquare(std::vector<double> const &delta) const {
+    if(!_structured) return CovarianceMatrix::chiSquare(delta);
+    if(delta.size() != getSize()) {
+        throw RuntimeError("KroneckerCovarianceMatrix::chiSquare: delta has wrong size.");
+    }
+    double chi2;
+    chiSquare(&delta[0],1,&chi2);
+    return chi2;
+}
+
+void local::KroneckerCovarianceMatrix::chiSquare(double const *deltas, int nvec, double *chi2) const {
+    if(!_structured) return CovarianceMatrix::chiSquare(deltas,nvec,chi2);
+    if(nvec <= 0) {
+        throw RuntimeError("KroneckerCovarianceMatrix::chiSquare: expected nvec > 0.");
+    }
+    // Cinv = (U1inv x U2inv x ...).(U1inv x U2inv x ...)t so each chi-square is the squared
+    // length of delta after solving Ut.x = delta along every axis.
+    int size(getSize());
+    std::vector<double> solved(deltas,deltas + nvec*size);
+    _apply(&solved[0],nvec,SolveTranspose);
+    for(int n = 0; n < nvec; ++n) {
+        double const *x(&solved[n*size]);
+        chi2[n] = dotProduct(x,x,size);
+    }
+}
+
+double local::KroneckerCovarianceMatrix::sample(std::vector<double> &delta, RandomPtr random) const {
+    if(!_structured) return CovarianceMatrix::sample(delta,random);
+    // Use the default generator if none was specified.
+    if(!random) random = Random::instance();
+    int size(getSize());
+    delta.resize(size);
+    for(int k = 0; k < size; ++k) delta[k] = random->getNormal();
+    double nll(dotProduct(&delta[0],&delta[0],size)/2);
+    // Add correlations via (U1t x U2t x ...).delta, whose covariance is C1 x C2 x ...
+    _apply(&delta[0],1,MultiplyByTranspose);
+    return nll;
+}
+
+boost::shared_array<double> local::KroneckerCovarianceMatrix::sample(int nsample, RandomPtr random) const {
+    if(!_structured) return CovarianceMatrix::sample(nsample,random);
+    if(nsample <= 0) {
+        throw RuntimeError("KroneckerCovarianceMatrix: expected nsample > 0.");
+    }
+    // Use the default generator if none was specified.
+    if(!random) random = Random::instance();
+    std::size_t nrandom(nsample*getSize()), ngen(nrandom);
+    boost::shared_array<double> array = random->fillDoubleArrayNormal(ngen);
+    _apply(array.get(),nsample,MultiplyByTranspose);
+    return array;
+}
+
+bool local::KroneckerCovarianceMatrix::compress() const {
+    if(!_structured) return CovarianceMatrix::compress();
+    return false;
+}
+
+std::size_t local::KroneckerCovarianceMatrix::getMemoryUsage() const {
+    std::size_t usage = CovarianceMatrix::getMemoryUsage() + sizeof(*this) - sizeof(CovarianceMatrix) +
+        sizeof(int)*_factorSize.capacity() +
+        sizeof(std::vector<double>)*(_factorCov.capacity() + _factorCholesky.capacity());
+    for(int k = 0; k < _factorSize.size(); ++k) {
+        usage += sizeof(double)*(_factorCov[k].capacity() + _factorCholesky[k].capacity());
+    }
+    return usage;
+}
+
+void local::KroneckerCovarianceMatrix::_getDense(std::vector<double> &packed, bool &inverse) const {
+    // Decompose each index into its factor indices, then build each packed element as the
+    // product of the corresponding factor elements.
+    int size(getSize()), nfactors(_factorSize.size());
+    std::vector<int> indices(size*nfactors);
+    for(int index = 0; index < size; ++index) {
+        int partial(index);
+        for(int k = nfactors-1; k >= 0; --k) {
+            int n(_factorSize[k]);
+            indices[index*nfactors + k] = partial % n;
+            partial /= n;
+        }
+    }
+    packed.resize((size*(size+1))/2);
+    for(int col = 0; col < size; ++col) {
+        for(int row = 0; row <= col; ++row) {
+            double product(1);
+            for(int k = 0; k < nfactors; ++k) {
+                int i(indices[row*nfactors + k]), j(indices[col*nfactors + k]);
+                if(i > j) std::swap(i,j);
+                product *= _factorCov[k][i + (j*(j+1))/2];
+            }
+            packed[row + (col*(col+1))/2] = product;
+        }
+    }
+    inverse = false;
+}
@@ -0,0 +1,76 @@
+#ifndef LIKELY_KRONECKER_COVARIANCE_MATRIX
+#define LIKELY_KRONECKER_COVARIANCE_MATRIX
+
+#include "likely/CovarianceMatrix.h"
+
+namespace likely {
+    // Represents a separable covariance matrix C = C1 x C2 x ... that is the Kronecker product
+    // of smaller factor covariances, e.g., one per axis of a BinnedGrid. Indices are ordered with
+    // the last factor's index increasing fastest, consistent with BinnedGrid::getIndex, so the
+    // element (i,j) is the product of the factor elements (i_k,j_k). Only the factors and their
+    // Cholesky decompositions are stored, so memory scales with the sum of the squared factor
+    // sizes instead of the squared product, and inverse products, chi-squares, log(determinant)
+    // and sampling are calculated by applying each factor (or its Cholesky decomposition) along
+    // the corresponding axis of a residual vector. Any operation that is not specialized below
+    // (e.g., setting an individual element) converts this object into an equivalent dense
+    // CovarianceMatrix.
+	class KroneckerCovarianceMatrix : public CovarianceMatrix {
+	public:
+	    // Creates a new Kronecker product covariance matrix using copies of the factors provided,
+	    // in order. Throws a RuntimeError if no factors are provided or any factor is not
+	    // positive definite.
+		explicit KroneckerCovarianceMatrix(std::vector<CovarianceMatrixCPtr> const &factors);
+		virtual ~KroneckerCovarianceMatrix();
+		// Returns the number of factors.
+        int getNFactors() const;
+        // Returns a new dense covariance matrix equal to the specified factor, or throws a
+        // RuntimeError.
+        CovarianceMatrixPtr getFactor(int index) const;
+        // Returns true if we are still using our Kronecker product representation.
+        bool isKronecker() const;
+        // Returns a copy that preserves our Kronecker product representation, if we still have one,
+        // by copying our factors and their Cholesky decompositions.
+        virtual CovarianceMatrix *clone() const;
+        // The following methods use our Kronecker product representation, when available, and are
+        // otherwise equivalent to the corresponding CovarianceMatrix methods.
+        virtual double getLogDeterminant() const;
+        virtual void multiplyByCovariance(std::vector<double> &vector) const;
+        using CovarianceMatrix::multiplyByInverseCovariance;
+        virtual void multiplyByInverseCovariance(std::vector<double> &vector) const;
+        virtual void multiplyByInverseCovariance(double *vectors, int nvec) const;
+        using CovarianceMatrix::chiSquare;
+        virtual double chiSquare(std::vector<double> const &delta) const;
+        virtual void chiSquare(double const *deltas, int nvec, double *chi2) const;
+        using CovarianceMatrix::sample;
+        virtual double sample(std::vector<double> &delta, RandomPtr random = RandomPtr()) const;
+        virtual boost::shared_array<double> sample(int nsample, RandomPtr random = RandomPtr()) const;
+        // Our representation is already compact, so this does nothing and returns false unless
+        // we have been converted to a dense matrix.
+        virtual bool compress() const;
+        virtual std::size_t getMemoryUsage() const;
+    protected:
+        virtual void _getDense(std::vector<double> &packed, bool &inverse) const;
+	private:
+	    // Copies are created with clone() or the CovarianceMatrix copy constructor. This
+	    // copies our Kronecker product representation, which other must still have.
+        KroneckerCovarianceMatrix(KroneckerCovarianceMatrix const &other);
+        // Returns the product of the specified factor sizes, or throws a RuntimeError.
+        static int _getTotalSize(std::vector<CovarianceMatrixCPtr> const &factors);
+        // The operations that can be applied along one axis of a residual vector using the
+        // factor covariance C = Ut.U for that axis.
+        enum AxisOperation { MultiplyByCovariance, MultiplyByInverse, SolveTranspose, MultiplyByTranspose };
+        // Applies the specified operation along every axis of nvec residual vectors stored
+        // consecutively, in place.
+        void _apply(double *vectors, int nvec, AxisOperation operation) const;
+        // Size, packed covariance and Cholesky decomposition U of each factor.
+        std::vector<int> _factorSize;
+        std::vector<std::vector<double> > _factorCov, _factorCholesky;
+        // Sum of the factor log(determinant)s, each weighted by the product of the other sizes.
+        double _logDet;
+	}; // KroneckerCovarianceMatrix
+
+    inline int KroneckerCovarianceMatrix::getNFactors() const { return _factorSize.size(); }
+    inline bool KroneckerCovarianceMatrix::isKronecker() const { return _structured; }
+} // likely
+
+#endif // LIKELY_KRONECKER_COVARIANCE_MATRIX
@@ -0,0 +1,204 @@
+#include "likely/LowRankCovarianceMatrix.h"
+#include "likely/RuntimeError.h"
+#include "likely/Random.h"
+
+#include <cmath>
+
+namespace local = likely;
+
+local::LowRankCovarianceMatrix::LowRankCovarianceMatrix(
+std::vector<double> const &diagonal, std::vector<double> const &modes)
+: CovarianceMatrix(diagonal.size() > 0 ? (int)diagonal.size() : 0),
+_diagonal(diagonal), _modes(modes)
+{
+    int size(getSize());
+    if(modes.size() % size != 0) {
+        throw RuntimeError("LowRankCovarianceMatrix: modes size is not a multiple of diagonal size.");
+    }
+    _rank = modes.size()/size;
+    // Calculate log(det(D)) and the weighted modes W = Dinv.U
+    _logDet = 0;
+    for(int j = 0; j < size; ++j) {
+        if(_diagonal[j] <= 0) {
+            throw RuntimeError("LowRankCovarianceMatrix: diagonal elements must be > 0.");
+        }
+        _logDet += std::log(_diagonal[j]);
+    }
+    _weighted.reserve(_modes.size());
+    for(int k = 0; k < _rank; ++k) {
+        for(int j = 0; j < size; ++j) _weighted.push_back(_modes[k*size+j]/_diagonal[j]);
+    }
+    if(_rank > 0) {
+        // Build the packed rank x rank matrix K = I + Ut.Dinv.U = I + Ut.W
+        _kcholesky.reserve((_rank*(_rank+1))/2);
+        for(int col = 0; col < _rank; ++col) {
+            for(int row = 0; row <= col; ++row) {
+                double sum(row == col ? 1 : 0);
+                double const *u(&_modes[row*size]), *w(&_weighted[col*size]);
+                for(int j = 0; j < size; ++j) sum += u[j]*w[j];
+                _kcholesky.push_back(sum);
+            }
+        }
+        // det(C) = det(D).det(K) by the matrix determinant lemma.
+        _logDet += choleskyDecompose(_kcholesky,_rank);
+    }
+    _structured = true;
+}
+
+local::LowRankCovarianceMatrix::~LowRankCovarianceMatrix() { }
+
+local::CovarianceMatrix *local::LowRankCovarianceMatrix::clone() const {
+    if(!_structured) return CovarianceMatrix::clone();
+    return new LowRankCovarianceMatrix(_diagonal,_modes);
+}
+
+double local::LowRankCovarianceMatrix::getLogDeterminant() const {
+    if(!_structured) return CovarianceMatrix::getLogDeterminant();
+    return _logDet;
+}
+
+void local::LowRankCovarianceMatrix::_projectWeighted(double const *x, int nvec, double *y) const {
+    int size(getSize());
+    for(int n = 0; n < nvec; ++n) {
+        double const *xn(x + n*size);
+        for(int k = 0; k < _rank; ++k) {
+            double const *w(&_weighted[k*size]);
+            double sum(0);
+            for(int j = 0; j < size; ++j) sum += w[j]*xn[j];
+            y[n*_rank+k] = sum;
+        }
+    }
+}
+
+void local::LowRankCovarianceMatrix::multiplyByCovariance(std::vector<double> &vector) const {
+    if(!_structured) return CovarianceMatrix::multiplyByCovariance(vector);
+    int size(getSize());
+    if(vector.size() != size) {
+        throw RuntimeError("LowRankCovarianceMatrix::multiplyByCovariance: vector has wrong size.");
+    }
+    // Calculate C.x = D.x + U.(Ut.x)
+    std::vector<double> result(size);
+    for(int j = 0; j < size; ++j) result[j] = _diagonal[j]*vector[j];
+    for(int k = 0; k < _rank; ++k) {
+        double const *u(&_modes[k*size]);
+        double dot(0);
+        for(int j = 0; j < size; ++j) dot += u[j]*vector[j];
+        for(int j = 0; j < size; ++j) result[j] += dot*u[j];
+    }
+    vector.swap(result);
+}
+
+void local::LowRankCovarianceMatrix::multiplyByInverseCovariance(std::vector<double> &vector) const {
+    if(!_structured) return CovarianceMatrix::multiplyByInverseCovariance(vector);
+    int size(getSize());
+    if(vector.size() != size) {
+        throw RuntimeError("LowRankCovarianceMatrix::multiplyByInverseCovariance: vector has wrong size.");
+    }
+    // Use the Woodbury identity Cinv = Dinv - W.Kinv.Wt with K = I + Ut.W = Rt.R
+    if(_rank > 0) {
+        std::vector<double> y(_rank);
+        _projectWeighted(&vector[0],1,&y[0]);
+        triangularSolve(_kcholesky,&y[0],1,true,_rank);
+        triangularSolve(_kcholesky,&y[0],1,false,_rank);
+        for(int j = 0; j < size; ++j) vector[j] /= _diagonal[j];
+        for(int k = 0; k < _rank; ++k) {
+            double const *w(&_weighted[k*size]);
+            for(int j = 0; j < size; ++j) vector[j] -= y[k]*w[j];
+        }
+    }
+    else {
+        for(int j = 0; j < size; ++j) vector[j] /= _diagonal[j];
+    }
+}
+
+double local::LowRankCovarianceMatrix::chiSquare(std::vector<double> const &delta) const {
+    if(!_structured) return CovarianceMatrix::chiSquare(delta);
+    if(delta.size() != getSize()) {
+        throw RuntimeError("LowRankCovarianceMatrix::chiSquare: delta has wrong size.");
+    }
+    double chi2;
+    chiSquare(&delta[0],1,&chi2);
+    return chi2;
+}
+
+void local::LowRankCovarianceMatrix::chiSquare(double const *deltas, int nvec, double *chi2) const {
+    if(!_structured) return CovarianceMatrix::chiSquare(deltas,nvec,chi2);
+    if(nvec <= 0) {
+        throw RuntimeError("LowRankCovarianceMatrix::chiSquare: expected nvec > 0.");
+    }
+    int size(getSize());
+    // Calculate delta.Dinv.delta - |Rinv^t.Wt.delta|^2 for each vector.
+    std::vector<double> y(nvec*_rank);
+    if(_rank > 0) {
+        _projectWeighted(deltas,nvec,&y[0]);
+        triangularSolve(_kcholesky,&y[0],nvec,true,_rank);
+    }
+    for(int n = 0; n < nvec; ++n) {
+        double const *delta(deltas + n*size);
+        double sum(0);
+        for(int j = 0; j < size; ++j) sum += delta[j]*delta[j]/_diagonal[j];
+        for(int k = 0; k < _rank; ++k) sum -= y[n*_rank+k]*y[n*_rank+k];
+        chi2[n] = sum;
+    }
+}
+
+double local::LowRankCovarianceMatrix::sample(std::vector<double> &delta, RandomPtr random) const {
+    if(!_structured) return CovarianceMatrix::sample(delta,random);
+    // Use the default generator if none was specified.
+    if(!random) random = Random::instance();
+    // Generate delta = sqrt(D).z1 + U.z2 where z1,z2 are uncorrelated unit normal vectors.
+    int size(getSize());
+    delta.resize(size);
+    for(int j = 0; j < size; ++j) delta[j] = std::sqrt(_diagonal[j])*random->getNormal();
+    for(int k = 0; k < _rank; ++k) {
+        double z(random->getNormal());
+        double const *u(&_modes[k*size]);
+        for(int j = 0; j < size; ++j) delta[j] += z*u[j];
+    }
+    return chiSquare(delta)/2;
+}
+
+boost::shared_array<double> local::LowRankCovarianceMatrix::sample(int nsample, RandomPtr random) const {
+    if(!_structured) return CovarianceMatrix::sample(nsample,random);
+    if(nsample <= 0) {
+        throw RuntimeError("LowRankCovarianceMatrix: expected nsample > 0.");
+    }
+    // Use the default generator if none was specified.
+    if(!random) random = Random::instance();
+    int size(getSize());
+    std::size_t nrandom(nsample*size), ngen(nrandom);
+    boost::shared_array<double> array = random->fillDoubleArrayNormal(ngen);
+    std::vector<double> scale(size);
+    for(int j = 0; j < size; ++j) scale[j] = std::sqrt(_diagonal[j]);
+    for(int n = 0; n < nsample; ++n) {
+        double *delta(array.get() + n*size);
+        for(int j = 0; j < size; ++j) delta[j] *= scale[j];
+        for(int k = 0; k < _rank; ++k) {
+            double z(random->getNormal());
+            double const *u(&_modes[k*size]);
+            for(int j = 0; j < size; ++j) delta[j] += z*u[j];
+        }
+    }
+    return array;
+}
+
+std::size_t local::LowRankCovarianceMatrix::getMemoryUsage() const {
+    return CovarianceMatrix::getMemoryUsage() + sizeof(*this) - sizeof(CovarianceMatrix) +
+        sizeof(double)*(_diagonal.capacity() + _modes.capacity() + _weighted.capacity() +
+        _kcholesky.capacity());
+}
+
+void local::LowRankCovarianceMatrix::_getDense(std::vector<double> &packed, bool &inverse) const {
+    // Build the packed covariance D + U.Ut
+    int size(getSize());
+    packed.resize(0);
+    packed.reserve((size*(size+1))/2);
+    for(int col = 0; col < size; ++col) {
+        for(int row = 0; row <= col; ++row) {
+            double sum(row == col ? _diagonal[col] : 0);
+            for(int k = 0; k < _rank; ++k) sum += _modes[k*size+row]*_modes[k*size+col];
+            packed.push_back(sum);
+        }
+    }
+    inverse = false;
+}
@@ -0,0 +1,57 @@
+#ifndef LIKELY_LOW_RANK_COVARIANCE_MATRIX
+#define LIKELY_LOW_RANK_COVARIANCE_MATRIX
+
+#include "likely/CovarianceMatrix.h"
+
+namespace likely {
+    // Represents a covariance matrix of the form C = D + U.Ut where D is diagonal and U is a
+    // size x rank matrix of modes with rank << size. Only D, U and a rank x rank decomposition
+    // are stored, and the Woodbury identity is used to calculate chi-squares, inverse
+    // covariance products, log(determinant) and samples with O(size*rank^2) operations and
+    // O(size*rank) memory. Any operation that is not specialized below (e.g., setting an
+    // individual element) converts this object into an equivalent dense CovarianceMatrix.
+	class LowRankCovarianceMatrix : public CovarianceMatrix {
+	public:
+	    // Creates a new covariance matrix using the specified positive diagonal elements and
+	    // low-rank modes, where the columns of U are stored consecutively in modes, i.e.,
+	    // U[j,k] = modes[k*size+j] with size = diagonal.size(). Throws a RuntimeError if any
+	    // diagonal element is not positive or modes.size() is not a multiple of size.
+		LowRankCovarianceMatrix(std::vector<double> const &diagonal, std::vector<double> const &modes);
+		virtual ~LowRankCovarianceMatrix();
+		// Returns the number of low-rank modes.
+        int getRank() const;
+        // Returns true if we are still using our low-rank representation.
+        bool isLowRank() const;
+        // Returns a copy that preserves our low-rank representation, if we still have one.
+        virtual CovarianceMatrix *clone() const;
+        // The following methods use our low-rank representation, when available, and are
+        // otherwise equivalent to the corresponding CovarianceMatrix methods.
+        virtual double getLogDeterminant() const;
+        virtual void multiplyByCovariance(std::vector<double> &vector) const;
+        using CovarianceMatrix::multiplyByInverseCovariance;
+        virtual void multiplyByInverseCovariance(std::vector<double> &vector) const;
+        using CovarianceMatrix::chiSquare;
+        virtual double chiSquare(std::vector<double> const &delta) const;
+        virtual void chiSquare(double const *deltas, int nvec, double *chi2) const;
+        using CovarianceMatrix::sample;
+        virtual double sample(std::vector<double> &delta, RandomPtr random = RandomPtr()) const;
+        virtual boost::shared_array<double> sample(int nsample, RandomPtr random = RandomPtr()) const;
+        virtual std::size_t getMemoryUsage() const;
+    protected:
+        virtual void _getDense(std::vector<double> &packed, bool &inverse) const;
+	private:
+	    // Copies are created with clone() or the CovarianceMatrix copy constructor.
+        LowRankCovarianceMatrix(LowRankCovarianceMatrix const &other);
+        // Overwrites y with Wt.x for nvec vectors stored consecutively in x and y.
+        void _projectWeighted(double const *x, int nvec, double *y) const;
+        int _rank;
+        double _logDet;
+        // _weighted = Dinv.U and _kcholesky is the Cholesky decomposition of I + Ut.Dinv.U
+        std::vector<double> _diagonal, _modes, _weighted, _kcholesky;
+	}; // LowRankCovarianceMatrix
+
+    inline int LowRankCovarianceMatrix::getRank() const { return _rank; }
+    inline bool LowRankCovarianceMatrix::isLowRank() const { return _structured; }
+} // likely
+
+#endif // LIKELY_LOW_RANK_COVARIANCE_MATRIX
@@ -0,0 +1,258 @@
+#include "likely/MappedCovarianceMatrix.h"
+#include "likely/MappedFile.h"
+#include "likely/RuntimeError.h"
+#include "likely/Random.h"
+#include "likely/PackedKernels.h"
+
+#include "boost/thread/locks.hpp"
+
+#include <cmath>
+
+namespace local = likely;
+
+local::MappedCovarianceMatrix::MappedCovarianceMatrix(MappedFileCPtr file)
+: CovarianceMatrix(_getMatrixSize(file)), _file(file), _choleskyReady(false), _logDetReady(false)
+{
+    _logDet = _file->getContents().logDeterminant;
+    if(0 != _logDet) _logDetReady = true;
+    _structured = true;
+}
+
+local::MappedCovarianceMatrix::~MappedCovarianceMatrix() { }
+
+int local::MappedCovarianceMatrix::_getMatrixSize(MappedFileCPtr file) {
+    if(!file) {
+        throw RuntimeError("MappedCovarianceMatrix: invalid file.");
+    }
+    MappedFileContents const &contents(file->getContents());
+    if(0 == contents.size ||
+    (0 == contents.covariance && 0 == contents.inverseCovariance && 0 == contents.cholesky)) {
+        throw RuntimeError("MappedCovarianceMatrix: file does not contain a covariance matrix.");
+    }
+    return contents.size;
+}
+
+local::CovarianceMatrix *local::MappedCovarianceMatrix::clone() const {
+    if(!_structured) return CovarianceMatrix::clone();
+    return new MappedCovarianceMatrix(_file);
+}
+
+double const *local::MappedCovarianceMatrix::_getCholesky() const {
+    MappedFileContents const &contents(_file->getContents());
+    if(contents.cholesky) return contents.cholesky;
+    if(!_choleskyReady.load(boost::memory_order_acquire)) {
+        if(0 == contents.covariance) return 0;
+        // Decompose a private copy of the covariance, unless another thread beat us to it.
+        boost::lock_guard<boost::recursive_mutex> lock(_mappedMutex);
+        if(!_choleskyReady) {
+            WallClockTimer timer;
+            int size(getSize());
+            _ownCholesky.assign(contents.covariance,contents.covariance + ((std::size_t)size*(size+1))/2);
+            choleskyDecompose(_ownCholesky,size);
+            _recordTransition(CovarianceTelemetry::Decomposition,timer,
+                sizeof(double)*_ownCholesky.capacity());
+            _choleskyReady.store(true,boost::memory_order_release);
+        }
+    }
+    return &_ownCholesky[0];
+}
+
+void local::MappedCovarianceMatrix::_multiplyCholesky(double const *vector, double *result,
+bool transpose) const {
+    double const *cholesky(_getCholesky());
+    int size(getSize());
+    for(int j = 0; j < size; ++j) result[j] = 0;
+    // Loop over the packed columns of U.
+    for(int col = 0; col < size; ++col) {
+        double const *column(cholesky + (col*(col+1))/2);
+        if(transpose) {
+            double sum(0);
+            for(int row = 0; row <= col; ++row) sum += column[row]*vector[row];
+            result[col] = sum;
+        }
+        else {
+            for(int row = 0; row <= col; ++row) result[row] += column[row]*vector[col];
+        }
+    }
+}
+
+double local::MappedCovarianceMatrix::getLogDeterminant() const {
+    if(!_structured) return CovarianceMatrix::getLogDeterminant();
+    if(_logDetReady.load(boost::memory_order_acquire)) return _logDet;
+    boost::lock_guard<boost::recursive_mutex> lock(_mappedMutex);
+    if(!_logDetReady) {
+        MappedFileContents const &contents(_file->getContents());
+        int size(getSize());
+        if(contents.cholesky || contents.covariance) {
+            double const *cholesky(_getCholesky());
+            double logdet(0);
+            for(int k = 0; k < size; ++k) logdet += 2*std::log(cholesky[(k*(k+3))/2]);
+            _logDet = logdet;
+        }
+        else {
+            // Decompose a temporary copy of the inverse covariance.
+            WallClockTimer timer;
+            std::vector<double> work(contents.inverseCovariance,
+                contents.inverseCovariance + ((std::size_t)size*(size+1))/2);
+            _logDet = -choleskyDecompose(work,size);
+            _recordTransition(CovarianceTelemetry::Decomposition,timer);
+        }
+        _logDetReady.store(true,boost::memory_order_release);
+    }
+    return _logDet;
+}
+
+void local::MappedCovarianceMatrix::multiplyByCovariance(std::vector<double> &vector) const {
+    MappedFileContents const &contents(_file->getContents());
+    if(!_structured || !(contents.covariance || contents.cholesky)) {
+        return CovarianceMatrix::multiplyByCovariance(vector);
+    }
+    int size(getSize());
+    if(vector.size() != size) {
+        throw RuntimeError("MappedCovarianceMatrix::multiplyByCovariance: vector has wrong size.");
+    }
+    std::vector<double> result(size);
+    if(contents.covariance) {
+        symmetricMatrixMultiply(contents.covariance,&vector[0],&result[0],size);
+    }
+    else {
+        // C.x = Ut.(U.x)
+        std::vector<double> work(size);
+        _multiplyCholesky(&vector[0],&work[0],false);
+        _multiplyCholesky(&work[0],&result[0],true);
+    }
+    vector.swap(result);
+}
+
+void local::MappedCovarianceMatrix::multiplyByInverseCovariance(std::vector<double> &vector) const {
+    if(!_structured) return CovarianceMatrix::multiplyByInverseCovariance(vector);
+    int size(getSize());
+    if(vector.size() != size) {
+        throw RuntimeError("MappedCovarianceMatrix::multiplyByInverseCovariance: vector has wrong size.");
+    }
+    MappedFileContents const &contents(_file->getContents());
+    if(contents.inverseCovariance) {
+        std::vector<double> result(size);
+        symmetricMatrixMultiply(contents.inverseCovariance,&vector[0],&result[0],size);
+        vector.swap(result);
+    }
+    else {
+        // Cinv.x = Uinv.(Uinv^t.x)
+        double const *cholesky(_getCholesky());
+        triangularSolve(cholesky,&vector[0],1,true,size);
+        triangularSolve(cholesky,&vector[0],1,false,size);
+    }
+}
+
+double local::MappedCovarianceMatrix::chiSquare(std::vector<double> const &delta) const {
+    if(!_structured) return CovarianceMatrix::chiSquare(delta);
+    if(delta.size() != getSize()) {
+        throw RuntimeError("MappedCovarianceMatrix::chiSquare: delta has wrong size.");
+    }
+    double chi2;
+    chiSquare(&delta[0],1,&chi2);
+    return chi2;
+}
+
+void local::MappedCovarianceMatrix::chiSquare(double const *deltas, int nvec, double *chi2) const {
+    if(!_structured) return CovarianceMatrix::chiSquare(deltas,nvec,chi2);
+    if(nvec <= 0) {
+        throw RuntimeError("MappedCovarianceMatrix::chiSquare: expected nvec > 0.");
+    }
+    int size(getSize());
+    double const *cholesky(_getCholesky());
+    if(cholesky) {
+        // chi2 = |Uinv^t.delta|^2
+        std::vector<double> work(deltas,deltas + nvec*size);
+        triangularSolve(cholesky,&work[0],nvec,true,size);
+        for(int n = 0; n < nvec; ++n) {
+            chi2[n] = dotProduct(&work[n*size],&work[n*size],size);
+        }
+    }
+    else {
+        // chi2 = delta.Cinv.delta using the mapped inverse covariance.
+        double const *icov(_file->getContents().inverseCovariance);
+        std::vector<double> work(size);
+        for(int n = 0; n < nvec; ++n) {
+            double const *delta(deltas + n*size);
+            symmetricMatrixMultiply(icov,delta,&work[0],size);
+            chi2[n] = dotProduct(delta,&work[0],size);
+        }
+    }
+}
+
+double local::MappedCovarianceMatrix::sample(std::vector<double> &delta, RandomPtr random) const {
+    if(!_structured || !_getCholesky()) return CovarianceMatrix::sample(delta,random);
+    // Use the default generator if none was specified.
+    if(!random) random = Random::instance();
+    // Generate delta = Ut.z where z is a vector of uncorrelated unit normal values.
+    int size(getSize());
+    std::vector<double> z(size);
+    double nll(0);
+    for(int k = 0; k < size; ++k) {
+        z[k] = random->getNormal();
+        nll += z[k]*z[k];
+    }
+    delta.resize(size);
+    _multiplyCholesky(&z[0],&delta[0],true);
+    return nll/2;
+}
+
+boost::shared_array<double> local::MappedCovarianceMatrix::sample(int nsample, RandomPtr random) const {
+    if(!_structured || !_getCholesky()) return CovarianceMatrix::sample(nsample,random);
+    if(nsample <= 0) {
+        throw RuntimeError("MappedCovarianceMatrix: expected nsample > 0.");
+    }
+    // Use the default generator if none was specified.
+    if(!random) random = Random::instance();
+    int size(getSize());
+    std::size_t nrandom(nsample*size), ngen(nrandom);
+    boost::shared_array<double> array = random->fillDoubleArrayNormal(ngen);
+    std::vector<double> z(size);
+    for(int n = 0; n < nsample; ++n) {
+        double *delta(array.get() + n*size);
+        std::copy(delta,delta+size,z.begin());
+        _multiplyCholesky(&z[0],delta,true);
+    }
+    return array;
+}
+
+std::size_t local::MappedCovarianceMatrix::getMemoryUsage() const {
+    // The mapped file is shared via the system page cache, so is not included here.
+    boost::lock_guard<boost::recursive_mutex> lock(_mappedMutex);
+    return CovarianceMatrix::getMemoryUsage() + sizeof(*this) - sizeof(CovarianceMatrix) +
+        sizeof(double)*_ownCholesky.capacity();
+}
+
+void local::MappedCovarianceMatrix::_getDense(std::vector<double> &packed, bool &inverse) const {
+    MappedFileContents const &contents(_file->getContents());
+    int size(getSize());
+    std::size_t ncov(((std::size_t)size*(size+1))/2);
+    if(contents.covariance) {
+        packed.assign(contents.covariance,contents.covariance + ncov);
+        inverse = false;
+    }
+    else if(contents.inverseCovariance) {
+        packed.assign(contents.inverseCovariance,contents.inverseCovariance + ncov);
+        inverse = true;
+    }
+    else {
+        // Calculate C = Ut.U one column at a time.
+        std::vector<double> column(size,0), result(size);
+        packed.resize(0);
+        packed.reserve(ncov);
+        for(int col = 0; col < size; ++col) {
+            std::copy(contents.cholesky + (col*(col+1))/2,contents.cholesky + (col*(col+3))/2 + 1,
+                column.begin());
+            _multiplyCholesky(&column[0],&result[0],true);
+            packed.insert(packed.end(),result.begin(),result.begin()+col+1);
+            std::fill(column.begin(),column.end(),0);
+        }
+        inverse = false;
+    }
+}
+
+local::CovarianceMatrixPtr local::createMappedCovariance(std::string const &filename) {
+    MappedFileCPtr file(new MappedFile(filename));
+    return CovarianceMatrixPtr(new MappedCovarianceMatrix(file));
+}
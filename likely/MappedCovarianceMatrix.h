@@ -0,0 +1,67 @@
+#ifndef LIKELY_MAPPED_COVARIANCE_MATRIX
+#define LIKELY_MAPPED_COVARIANCE_MATRIX
+
+#include "likely/CovarianceMatrix.h"
+
+namespace likely {
+    // Represents a covariance matrix that is read directly from a memory-mapped binary file
+    // written by CovarianceMatrix::saveBinary, without copying its packed arrays into memory.
+    // Chi-squares, samples and products use whichever of the saved covariance, inverse
+    // covariance and Cholesky decomposition are needed. If no Cholesky decomposition was saved
+    // but a covariance was, a private decomposition is calculated when first needed. Any
+    // operation that is not specialized below (e.g., setting an individual element) copies
+    // the mapped arrays into an equivalent dense CovarianceMatrix.
+	class MappedCovarianceMatrix : public CovarianceMatrix {
+	public:
+	    // Uses the specified mapped file, or throws a RuntimeError if it does not contain a
+	    // covariance matrix. The file can be shared with other objects, e.g., a BinnedData
+	    // object loaded from the same file.
+		explicit MappedCovarianceMatrix(MappedFileCPtr file);
+		virtual ~MappedCovarianceMatrix();
+		// Returns true if we are still reading our elements from the mapped file.
+        bool isMapped() const;
+        // Returns a copy that shares our mapped file, if we are still using it.
+        virtual CovarianceMatrix *clone() const;
+        // The following methods use our mapped arrays, when available, and are otherwise
+        // equivalent to the corresponding CovarianceMatrix methods.
+        virtual double getLogDeterminant() const;
+        virtual void multiplyByCovariance(std::vector<double> &vector) const;
+        using CovarianceMatrix::multiplyByInverseCovariance;
+        virtual void multiplyByInverseCovariance(std::vector<double> &vector) const;
+        using CovarianceMatrix::chiSquare;
+        virtual double chiSquare(std::vector<double> const &delta) const;
+        virtual void chiSquare(double const *deltas, int nvec, double *chi2) const;
+        using CovarianceMatrix::sample;
+        virtual double sample(std::vector<double> &delta, RandomPtr random = RandomPtr()) const;
+        virtual boost::shared_array<double> sample(int nsample, RandomPtr random = RandomPtr()) const;
+        virtual std::size_t getMemoryUsage() const;
+    protected:
+        virtual void _getDense(std::vector<double> &packed, bool &inverse) const;
+	private:
+	    // Copies are created with clone() or the CovarianceMatrix copy constructor.
+        MappedCovarianceMatrix(MappedCovarianceMatrix const &other);
+        // Returns the size of the covariance matrix in the specified file, or throws a RuntimeError.
+        static int _getMatrixSize(MappedFileCPtr file);
+        // Returns a pointer to the mapped Cholesky decomposition, or else our private
+        // decomposition of the mapped covariance, or else zero.
+        double const *_getCholesky() const;
+        // Fills result with U.vector (transpose = false) or Ut.vector (transpose = true)
+        // using our Cholesky decomposition U.
+        void _multiplyCholesky(double const *vector, double *result, bool transpose) const;
+        MappedFileCPtr _file;
+        // Our private Cholesky decomposition and log(determinant) are calculated at most once,
+        // while holding _mappedMutex, and then read without locking, as in CovarianceMatrix.
+        mutable double _logDet;
+        mutable std::vector<double> _ownCholesky;
+        mutable boost::atomic<bool> _choleskyReady, _logDetReady;
+        mutable boost::recursive_mutex _mappedMutex;
+	}; // MappedCovarianceMatrix
+
+    inline bool MappedCovarianceMatrix::isMapped() const { return _structured; }
+
+    // Creates a new covariance matrix that reads its elements from the specified binary file,
+    // written by CovarianceMatrix::saveBinary, or throws a RuntimeError.
+    CovarianceMatrixPtr createMappedCovariance(std::string const &filename);
+} // likely
+
+#endif // LIKELY_MAPPED_COVARIANCE_MATRIX
@@ -0,0 +1,189 @@
+#include "likely/MappedFile.h"
+#include "likely/RuntimeError.h"
+
+#include "boost/cstdint.hpp"
+#include "boost/lexical_cast.hpp"
+
+#include <fstream>
+#include <cstring>
+#include <cstdio>
+#include <limits>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace local = likely;
+
+namespace likely {
+namespace mapped {
+    char const magic[8] = { 'L','I','K','E','L','Y','B','F' };
+    boost::uint32_t const version(1), byteOrder(0x01020304);
+    // All arrays start at a multiple of this many bytes from the start of the file.
+    std::size_t const alignment(64);
+    // Array offsets are listed in the header in the order they appear in the file, and
+    // are zero for arrays that are not present.
+    enum { INDEX, DATA, COVARIANCE, INVERSE_COVARIANCE, CHOLESKY, NARRAYS };
+    struct Header {
+        char magic[8];
+        boost::uint32_t version, byteOrder;
+        boost::int64_t size, ndata, nbins;
+        double logDeterminant;
+        boost::uint64_t offset[NARRAYS];
+    };
+    std::size_t align(std::size_t offset) {
+        return ((offset + alignment - 1)/alignment)*alignment;
+    }
+} // mapped
+} // likely
+
+local::MappedFileContents::MappedFileContents()
+: size(0), logDeterminant(0), covariance(0), inverseCovariance(0), cholesky(0),
+ndata(0), nbins(0), index(0), data(0)
+{ }
+
+local::MappedFile::MappedFile(std::string const &filename)
+: _filename(filename), _address(0), _length(0)
+{
+    int fd = ::open(filename.c_str(),O_RDONLY);
+    if(fd < 0) {
+        throw RuntimeError("MappedFile: unable to open " + filename);
+    }
+    struct stat info;
+    if(0 != ::fstat(fd,&info) || info.st_size < (off_t)sizeof(mapped::Header)) {
+        ::close(fd);
+        throw RuntimeError("MappedFile: file is too small: " + filename);
+    }
+    _length = info.st_size;
+    // The mapping remains valid after the file descriptor is closed.
+    _address = ::mmap(0,_length,PROT_READ,MAP_SHARED,fd,0);
+    ::close(fd);
+    if(MAP_FAILED == _address) {
+        _address = 0;
+        throw RuntimeError("MappedFile: unable to map " + filename);
+    }
+    // Validate the header and array offsets.
+    char const *base = static_cast<char const*>(_address);
+    mapped::Header const &header = *reinterpret_cast<mapped::Header const*>(base);
+    std::string error;
+    if(0 != std::memcmp(header.magic,mapped::magic,sizeof(mapped::magic))) {
+        error = "MappedFile: not a likely binary file: ";
+    }
+    else if(header.byteOrder != mapped::byteOrder) {
+        error = "MappedFile: file has incompatible byte order: ";
+    }
+    else if(header.version != mapped::version) {
+        error = "MappedFile: unsupported file version: ";
+    }
+    else if(header.size < 0 || header.ndata < 0 || header.nbins < header.ndata ||
+    header.size > std::numeric_limits<int>::max() || header.nbins > std::numeric_limits<int>::max()) {
+        error = "MappedFile: invalid header: ";
+    }
+    else {
+        std::size_t ncov = ((std::size_t)header.size*(header.size+1))/2;
+        std::size_t bytes[mapped::NARRAYS] = {
+            header.ndata*sizeof(int), header.ndata*sizeof(double),
+            ncov*sizeof(double), ncov*sizeof(double), ncov*sizeof(double) };
+        for(int k = 0; k < mapped::NARRAYS; ++k) {
+            boost::uint64_t offset(header.offset[k]);
+            if(0 == offset) continue;
+            if(offset % mapped::alignment != 0 || offset + bytes[k] > _length) {
+                error = "MappedFile: file is truncated or corrupted: ";
+            }
+        }
+    }
+    if(!error.empty()) {
+        ::munmap(_address,_length);
+        _address = 0;
+        throw RuntimeError(error + filename);
+    }
+    _contents.size = header.size;
+    _contents.logDeterminant = header.logDeterminant;
+    _contents.ndata = header.ndata;
+    _contents.nbins = header.nbins;
+    boost::uint64_t const *offset(header.offset);
+    if(offset[mapped::INDEX]) {
+        _contents.index = reinterpret_cast<int const*>(base + offset[mapped::INDEX]);
+    }
+    if(offset[mapped::DATA]) {
+        _contents.data = reinterpret_cast<double const*>(base + offset[mapped::DATA]);
+    }
+    if(offset[mapped::COVARIANCE]) {
+        _contents.covariance = reinterpret_cast<double const*>(base + offset[mapped::COVARIANCE]);
+    }
+    if(offset[mapped::INVERSE_COVARIANCE]) {
+        _contents.inverseCovariance =
+            reinterpret_cast<double const*>(base + offset[mapped::INVERSE_COVARIANCE]);
+    }
+    if(offset[mapped::CHOLESKY]) {
+        _contents.cholesky = reinterpret_cast<double const*>(base + offset[mapped::CHOLESKY]);
+    }
+}
+
+local::MappedFile::~MappedFile() {
+    if(_address) ::munmap(_address,_length);
+}
+
+void local::MappedFile::write(std::string const &filename, MappedFileContents const &contents) {
+    if(contents.size < 0 || contents.ndata < 0 || contents.nbins < contents.ndata) {
+        throw RuntimeError("MappedFile::write: invalid contents.");
+    }
+    if(contents.ndata > 0 && (0 == contents.index || 0 == contents.data)) {
+        throw RuntimeError("MappedFile::write: missing index or data.");
+    }
+    std::size_t ncov = ((std::size_t)contents.size*(contents.size+1))/2;
+    char const *arrays[mapped::NARRAYS] = {
+        reinterpret_cast<char const*>(contents.index),
+        reinterpret_cast<char const*>(contents.data),
+        reinterpret_cast<char const*>(contents.covariance),
+        reinterpret_cast<char const*>(contents.inverseCovariance),
+        reinterpret_cast<char const*>(contents.cholesky) };
+    std::size_t bytes[mapped::NARRAYS] = {
+        contents.ndata*sizeof(int), contents.ndata*sizeof(double),
+        ncov*sizeof(double), ncov*sizeof(double), ncov*sizeof(double) };
+    // Fill the header and calculate the offset of each array.
+    mapped::Header header;
+    std::memset(&header,0,sizeof(header));
+    std::memcpy(header.magic,mapped::magic,sizeof(mapped::magic));
+    header.version = mapped::version;
+    header.byteOrder = mapped::byteOrder;
+    header.size = contents.size;
+    header.ndata = contents.ndata;
+    header.nbins = contents.nbins;
+    header.logDeterminant = contents.logDeterminant;
+    std::size_t offset = mapped::align(sizeof(header));
+    for(int k = 0; k < mapped::NARRAYS; ++k) {
+        if(0 == arrays[k] || 0 == bytes[k]) continue;
+        header.offset[k] = offset;
+        offset = mapped::align(offset + bytes[k]);
+    }
+    // Write the header and each array, with zero padding, to a temporary file in the same
+    // directory. We never modify an existing file in place, since it might still be mapped by
+    // this or another process (possibly as the source of the contents we are writing).
+    std::string tmpname(filename + ".tmp." + boost::lexical_cast<std::string>(::getpid()));
+    std::ofstream out(tmpname.c_str(),std::ios::out | std::ios::binary | std::ios::trunc);
+    if(!out.good()) {
+        throw RuntimeError("MappedFile::write: unable to open " + tmpname);
+    }
+    char const padding[mapped::alignment] = { 0 };
+    out.write(reinterpret_cast<char const*>(&header),sizeof(header));
+    std::size_t position(sizeof(header));
+    for(int k = 0; k < mapped::NARRAYS; ++k) {
+        if(0 == header.offset[k]) continue;
+        out.write(padding,header.offset[k] - position);
+        out.write(arrays[k],bytes[k]);
+        position = header.offset[k] + bytes[k];
+    }
+    out.close();
+    if(out.fail()) {
+        std::remove(tmpname.c_str());
+        throw RuntimeError("MappedFile::write: error writing " + tmpname);
+    }
+    // Atomically replace any existing file. Existing mappings keep the old file's contents.
+    if(0 != std::rename(tmpname.c_str(),filename.c_str())) {
+        std::remove(tmpname.c_str());
+        throw RuntimeError("MappedFile::write: unable to rename " + tmpname + " to " + filename);
+    }
+}
@@ -0,0 +1,59 @@
+#ifndef LIKELY_MAPPED_FILE
+#define LIKELY_MAPPED_FILE
+
+#include <string>
+#include <cstddef>
+
+namespace likely {
+    // Describes the arrays stored in a binary file. Any pointer can be null to indicate that
+    // the corresponding array is not present. Matrices use the BLAS packed 'U' format implied
+    // by symmetricMatrixIndex and have size*(size+1)/2 elements. The index map and data vector
+    // have ndata elements, and nbins is the total number of bins in the corresponding grid.
+    struct MappedFileContents {
+        MappedFileContents();
+        int size;
+        double logDeterminant;
+        double const *covariance, *inverseCovariance, *cholesky;
+        int ndata, nbins;
+        int const *index;
+        double const *data;
+    };
+
+    // Provides read-only access to a binary file written by MappedFile::write(...). The file is
+    // memory mapped, so its arrays are read directly from the system page cache without being
+    // copied, and the same physical memory is shared by all processes that map the same file.
+    // The format (version 1) is a fixed-size header followed by the index map, data vector,
+    // covariance, inverse covariance and Cholesky decomposition, in that order, each starting
+    // at an offset that is a multiple of 64 bytes. Values use the native byte order, which
+    // is checked when the file is opened.
+	class MappedFile {
+	public:
+	    // Maps the specified file into memory, or throws a RuntimeError if it cannot be opened
+	    // or does not have the expected format.
+		explicit MappedFile(std::string const &filename);
+		virtual ~MappedFile();
+		// Returns pointers to the arrays stored in this file, which remain valid for the
+		// lifetime of this object.
+        MappedFileContents const &getContents() const;
+        // Returns the name of the mapped file.
+        std::string const &getFilename() const;
+        // Writes the specified contents to a new binary file, replacing any existing file,
+        // or throws a RuntimeError. The contents are written to a temporary file that is then
+        // renamed, so an existing file is never partially overwritten and any existing
+        // mappings of it remain valid and unchanged.
+        static void write(std::string const &filename, MappedFileContents const &contents);
+	private:
+	    // Objects of this class own a memory mapping so cannot be copied.
+        MappedFile(MappedFile const &other);
+        MappedFile &operator=(MappedFile const &other);
+        std::string _filename;
+        void *_address;
+        std::size_t _length;
+        MappedFileContents _contents;
+	}; // MappedFile
+
+    inline MappedFileContents const &MappedFile::getContents() const { return _contents; }
+    inline std::string const &MappedFile::getFilename() const { return _filename; }
+} // likely
+
+#endif // LIKELY_MAPPED_FILE
@@ -0,0 +1,221 @@
+#include "likely/PackedKernels.h"
+#include "likely/RuntimeError.h"
+
+#include <algorithm>
+
+// Vectorized kernels are compiled for specific instruction sets using function attributes,
+// so they do not need any special compiler flags and are only called after checking at
+// runtime that the processor supports them.
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define LIKELY_X86_KERNELS
+#endif
+
+namespace local = likely;
+
+namespace likely {
+namespace kernels {
+    typedef double (*DotKernel)(double const *x, double const *y, int size);
+    typedef void (*AddScaledKernel)(double const *x, double scale, double *y, int size);
+    struct Kernels {
+        SimdLevel level;
+        DotKernel dot;
+        AddScaledKernel addScaled;
+    };
+    double dotScalar(double const *x, double const *y, int size) {
+        double sum(0);
+        for(int k = 0; k < size; ++k) sum += x[k]*y[k];
+        return sum;
+    }
+    void addScaledScalar(double const *x, double scale, double *y, int size) {
+        for(int k = 0; k < size; ++k) y[k] += scale*x[k];
+    }
+#ifdef LIKELY_X86_KERNELS
+    // Each kernel uses two independent accumulators to hide the latency of its adds.
+    __attribute__((target("sse2")))
+    double dotSSE2(double const *x, double const *y, int size) {
+        __m128d sum0 = _mm_setzero_pd(), sum1 = _mm_setzero_pd();
+        int k(0);
+        for(; k + 4 <= size; k += 4) {
+            sum0 = _mm_add_pd(sum0,_mm_mul_pd(_mm_loadu_pd(x+k),_mm_loadu_pd(y+k)));
+            sum1 = _mm_add_pd(sum1,_mm_mul_pd(_mm_loadu_pd(x+k+2),_mm_loadu_pd(y+k+2)));
+        }
+        double partial[2];
+        _mm_storeu_pd(partial,_mm_add_pd(sum0,sum1));
+        double sum(partial[0] + partial[1]);
+        for(; k < size; ++k) sum += x[k]*y[k];
+        return sum;
+    }
+    __attribute__((target("sse2")))
+    void addScaledSSE2(double const *x, double scale, double *y, int size) {
+        __m128d a = _mm_set1_pd(scale);
+        int k(0);
+        for(; k + 2 <= size; k += 2) {
+            _mm_storeu_pd(y+k,_mm_add_pd(_mm_loadu_pd(y+k),_mm_mul_pd(a,_mm_loadu_pd(x+k))));
+        }
+        for(; k < size; ++k) y[k] += scale*x[k];
+    }
+    __attribute__((target("avx2,fma")))
+    double dotAVX2(double const *x, double const *y, int size) {
+        __m256d sum0 = _mm256_setzero_pd(), sum1 = _mm256_setzero_pd();
+        int k(0);
+        for(; k + 8 <= size; k += 8) {
+            sum0 = _mm256_fmadd_pd(_mm256_loadu_pd(x+k),_mm256_loadu_pd(y+k),sum0);
+            sum1 = _mm256_fmadd_pd(_mm256_loadu_pd(x+k+4),_mm256_loadu_pd(y+k+4),sum1);
+        }
+        __m256d sum4 = _mm256_add_pd(sum0,sum1);
+        __m128d sum2 = _mm_add_pd(_mm256_castpd256_pd128(sum4),_mm256_extractf128_pd(sum4,1));
+        double partial[2];
+        _mm_storeu_pd(partial,sum2);
+        double sum(partial[0] + partial[1]);
+        for(; k < size; ++k) sum += x[k]*y[k];
+        return sum;
+    }
+    __attribute__((target("avx2,fma")))
+    void addScaledAVX2(double const *x, double scale, double *y, int size) {
+        __m256d a = _mm256_set1_pd(scale);
+        int k(0);
+        for(; k + 4 <= size; k += 4) {
+            _mm256_storeu_pd(y+k,_mm256_fmadd_pd(a,_mm256_loadu_pd(x+k),_mm256_loadu_pd(y+k)));
+        }
+        for(; k < size; ++k) y[k] += scale*x[k];
+    }
+    __attribute__((target("avx512f")))
+    double dotAVX512(double const *x, double const *y, int size) {
+        __m512d sum0 = _mm512_setzero_pd(), sum1 = _mm512_setzero_pd();
+        int k(0);
+        for(; k + 16 <= size; k += 16) {
+            sum0 = _mm512_fmadd_pd(_mm512_loadu_pd(x+k),_mm512_loadu_pd(y+k),sum0);
+            sum1 = _mm512_fmadd_pd(_mm512_loadu_pd(x+k+8),_mm512_loadu_pd(y+k+8),sum1);
+        }
+        double sum(_mm512_reduce_add_pd(_mm512_add_pd(sum0,sum1)));
+        for(; k < size; ++k) sum += x[k]*y[k];
+        return sum;
+    }
+    __attribute__((target("avx512f")))
+    void addScaledAVX512(double const *x, double scale, double *y, int size) {
+        __m512d a = _mm512_set1_pd(scale);
+        int k(0);
+        for(; k + 8 <= size; k += 8) {
+            _mm512_storeu_pd(y+k,_mm512_fmadd_pd(a,_mm512_loadu_pd(x+k),_mm512_loadu_pd(y+k)));
+        }
+        for(; k < size; ++k) y[k] += scale*x[k];
+    }
+#endif
+    // Returns the most capable level supported by this processor.
+    SimdLevel supportedLevel() {
+#ifdef LIKELY_X86_KERNELS
+        __builtin_cpu_init();
+        if(__builtin_cpu_supports("avx512f")) return SimdAVX512;
+        if(__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) return SimdAVX2;
+        if(__builtin_cpu_supports("sse2")) return SimdSSE2;
+#endif
+        return NoSimd;
+    }
+    // Returns the kernels for the most capable supported level up to the level specified.
+    Kernels select(SimdLevel level) {
+        Kernels selected = { NoSimd, &dotScalar, &addScaledScalar };
+#ifdef LIKELY_X86_KERNELS
+        level = std::min(level,supportedLevel());
+        if(level == SimdAVX512) {
+            selected.level = SimdAVX512;
+            selected.dot = &dotAVX512;
+            selected.addScaled = &addScaledAVX512;
+        }
+        else if(level == SimdAVX2) {
+            selected.level = SimdAVX2;
+            selected.dot = &dotAVX2;
+            selected.addScaled = &addScaledAVX2;
+        }
+        else if(level == SimdSSE2) {
+            selected.level = SimdSSE2;
+            selected.dot = &dotSSE2;
+            selected.addScaled = &addScaledSSE2;
+        }
+#endif
+        return selected;
+    }
+    // Returns the kernels in use, which are selected the first time this is called.
+    Kernels &active() {
+        static Kernels kernels(select(SimdAVX512));
+        return kernels;
+    }
+} // kernels
+} // likely
+
+local::SimdLevel local::getSimdLevel() {
+    return kernels::active().level;
+}
+
+local::SimdLevel local::setSimdLevel(SimdLevel level) {
+    kernels::active() = kernels::select(level);
+    return kernels::active().level;
+}
+
+double local::dotProduct(double const *x, double const *y, int size) {
+    return kernels::active().dot(x,y,size);
+}
+
+void local::addScaled(double const *x, double scale, double *y, int size) {
+    kernels::active().addScaled(x,scale,y,size);
+}
+
+void local::packedSymmetricMultiply(double const *matrix, double const *vector, double *result,
+int size) {
+    if(size <= 0) {
+        throw RuntimeError("packedSymmetricMultiply: expected size > 0.");
+    }
+    kernels::Kernels const &kernel(kernels::active());
+    // Column col holds M[0:col+1,col], which contributes to result[col] through its dot product
+    // with vector[0:col+1] and to result[0:col] through its off-diagonal elements.
+    std::fill(result,result+size,0.);
+    for(int col = 0; col < size; ++col) {
+        double const *column = matrix + (col*(col+1))/2;
+        result[col] += kernel.dot(column,vector,col+1);
+        if(col > 0) kernel.addScaled(column,vector[col],result,col);
+    }
+}
+
+void local::packedTriangularSolve(double const *matrix, double *vectors, int nvec, bool transpose,
+int size) {
+    if(size <= 0) {
+        throw RuntimeError("packedTriangularSolve: expected size > 0.");
+    }
+    if(nvec <= 0) {
+        throw RuntimeError("packedTriangularSolve: expected nvec > 0.");
+    }
+    kernels::Kernels const &kernel(kernels::active());
+    for(int v = 0; v < nvec; ++v) {
+        double *x = vectors + v*size;
+        if(transpose) {
+            // Forward substitution using the dot product of each column with the solved rows.
+            for(int col = 0; col < size; ++col) {
+                double const *column = matrix + (col*(col+1))/2;
+                x[col] = (x[col] - kernel.dot(column,x,col))/column[col];
+            }
+        }
+        else {
+            // Backward substitution, eliminating each solved row from the rows above it.
+            for(int col = size-1; col >= 0; --col) {
+                double const *column = matrix + (col*(col+1))/2;
+                x[col] /= column[col];
+                if(col > 0) kernel.addScaled(column,-x[col],x,col);
+            }
+        }
+    }
+}
+
+void local::unpackSymmetricMatrix(double const *packed, double *full, int size) {
+    for(int col = 0; col < size; ++col) {
+        double const *column = packed + (col*(col+1))/2;
+        std::copy(column,column+col+1,full+col*size);
+        // The lower triangle of this column is the upper triangle of the corresponding row.
+        for(int row = col+1; row < size; ++row) full[col*size+row] = packed[(row*(row+1))/2+col];
+    }
+}
+
+void local::packSymmetricMatrix(double const *full, double *packed, int size) {
+    for(int col = 0; col < size; ++col) {
+        std::copy(full+col*size,full+col*size+col+1,packed + (col*(col+1))/2);
+    }
+}
@@ -0,0 +1,41 @@
+#ifndef LIKELY_PACKED_KERNELS
+#define LIKELY_PACKED_KERNELS
+
+namespace likely {
+    // Built-in vectorized kernels for symmetric and triangular matrices in the BLAS packed 'U'
+    // format implied by packedMatrixIndex(row,col). Each column of a packed matrix is contiguous
+    // in memory, so every operation below reduces to dot products and scaled additions of
+    // contiguous column segments, which are vectorized using the widest instruction set
+    // extensions that the processor supports at runtime. These are used by CovarianceMatrix
+    // for its own loops, and in place of level-2 BLAS when configure did not find a BLAS library.
+    // Unpacked matrices are stored in column-major order with leading dimension size.
+
+    // Instruction set extensions that can be used by the kernels, in increasing order.
+    enum SimdLevel { NoSimd, SimdSSE2, SimdAVX2, SimdAVX512 };
+    // Returns the instruction set extensions that are currently being used.
+    SimdLevel getSimdLevel();
+    // Selects the most capable instruction set extensions up to the specified level that
+    // the processor supports, and returns the level actually selected. The default is the
+    // most capable level supported. This is intended for testing and benchmarking and should
+    // not be called while other threads are using the kernels.
+    SimdLevel setSimdLevel(SimdLevel level);
+
+    // Returns the dot product of the vectors x and y of length size.
+    double dotProduct(double const *x, double const *y, int size);
+    // Adds scale*x to the vector y of length size.
+    void addScaled(double const *x, double scale, double *y, int size);
+    // Fills result with M.vector where M is a symmetric size x size packed matrix.
+    void packedSymmetricMultiply(double const *matrix, double const *vector, double *result,
+        int size);
+    // Solves Ut.X = B (transpose = true) or U.X = B (transpose = false) in place for nvec
+    // column vectors of length size stored consecutively in vectors, where U is an upper-diagonal
+    // packed matrix, e.g., the output of choleskyDecompose.
+    void packedTriangularSolve(double const *matrix, double *vectors, int nvec, bool transpose,
+        int size);
+    // Unpacks a symmetric packed matrix into both triangles of a full size x size matrix.
+    void unpackSymmetricMatrix(double const *packed, double *full, int size);
+    // Packs the upper triangle of a full size x size matrix. The lower triangle is not used.
+    void packSymmetricMatrix(double const *full, double *packed, int size);
+} // likely
+
+#endif // LIKELY_PACKED_KERNELS
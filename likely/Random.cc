@@ -41,6 +41,10 @@ void local::Random::setSeed(int seedValue) {
     init_gen_rand(seedValue);
 }
 
+void local::Random::setGeneratorSeed(int seedValue) {
+    _generator.seed(seedValue);
+}
+
 int local::Random::getInteger(int min, int max) {
     boost::random::uniform_int_distribution<> dist(min,max);
     return dist(_generator);
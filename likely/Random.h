@@ -18,6 +18,11 @@ namespace likely {
 	public:
 		Random();
         void setSeed(int seedValue);
+        // Sets the seed used by getUniform, getNormal, getInteger, partialShuffle and
+        // sampleWithReplacement only. Unlike setSeed, this does not reseed the SFMT generator
+        // (which is shared by all instances) so it can be called concurrently on different
+        // instances, e.g., to give each thread its own reproducible random stream.
+        void setGeneratorSeed(int seedValue);
 
         // Returns a double-precision value uniformly sampled from [0,1).
         double getUniform();
@@ -0,0 +1,352 @@
+#include "likely/SinglePrecisionCovarianceMatrix.h"
+#include "likely/RuntimeError.h"
+#include "likely/Random.h"
+
+#include "boost/thread/locks.hpp"
+
+#include <cmath>
+#include <cfloat>
+#include <algorithm>
+
+namespace local = likely;
+
+namespace likely {
+namespace single {
+    // Refinement normally converges in a few iterations, so this is only a safeguard.
+    int const maxIterations(30);
+} // single
+} // likely
+
+local::SinglePrecisionCovarianceMatrix::SinglePrecisionCovarianceMatrix(
+CovarianceMatrix const &other, double tolerance)
+: CovarianceMatrix(other.getSize()), _tolerance(tolerance), _roundingError(0), _logDet(0),
+_covReady(true), _choleskyReady(true)
+{
+    int size(getSize());
+    _floatCov.reserve((size*(size+1))/2);
+    for(int col = 0; col < size; ++col) {
+        for(int row = 0; row <= col; ++row) {
+            _floatCov.push_back(_round(other.getCovariance(row,col)));
+        }
+    }
+    _initialize();
+}
+
+local::SinglePrecisionCovarianceMatrix::SinglePrecisionCovarianceMatrix(
+std::vector<double> const &packed, double tolerance)
+: CovarianceMatrix(packed.size() > 0 ? symmetricMatrixSize(packed.size()) : 0),
+_tolerance(tolerance), _roundingError(0), _logDet(0), _covReady(true), _choleskyReady(true)
+{
+    _floatCov.reserve(packed.size());
+    for(int index = 0; index < packed.size(); ++index) {
+        _floatCov.push_back(_round(packed[index]));
+    }
+    _initialize();
+}
+
+local::SinglePrecisionCovarianceMatrix::SinglePrecisionCovarianceMatrix(
+SinglePrecisionCovarianceMatrix const &other)
+: CovarianceMatrix(other.getSize()), _tolerance(other._tolerance),
+_roundingError(other._roundingError), _logDet(other._logDet), _covReady(false), _choleskyReady(false)
+{
+    boost::lock_guard<boost::recursive_mutex> lock(other._floatMutex);
+    _floatCov = other._floatCov;
+    _floatCholesky = other._floatCholesky;
+    _floatDiag = other._floatDiag;
+    _floatOffdiagValue = other._floatOffdiagValue;
+    _floatOffdiagIndex = other._floatOffdiagIndex;
+    _covReady = !_floatCov.empty();
+    _choleskyReady = !_floatCholesky.empty();
+    _structured = true;
+}
+
+local::SinglePrecisionCovarianceMatrix::~SinglePrecisionCovarianceMatrix() { }
+
+float local::SinglePrecisionCovarianceMatrix::_round(double value) {
+    if(!(std::fabs(value) <= FLT_MAX)) {
+        throw RuntimeError("SinglePrecisionCovarianceMatrix: element cannot be represented in single precision.");
+    }
+    float rounded(value);
+    if(0 != value) {
+        _roundingError = std::max(_roundingError,std::fabs(rounded - value)/std::fabs(value));
+    }
+    return rounded;
+}
+
+void local::SinglePrecisionCovarianceMatrix::_initialize() {
+    if(_tolerance <= 0) {
+        throw RuntimeError("SinglePrecisionCovarianceMatrix: expected tolerance > 0.");
+    }
+    int size(getSize());
+    for(int k = 0; k < size; ++k) {
+        if(_floatCov[(k*(k+3))/2] <= 0) {
+            throw RuntimeError("SinglePrecisionCovarianceMatrix: diagonal elements must be > 0.");
+        }
+    }
+    // Calculate our Cholesky decomposition now to check that we are positive definite.
+    _logDet = _decompose();
+    _structured = true;
+}
+
+double local::SinglePrecisionCovarianceMatrix::_decompose() const {
+    // Decompose a temporary double-precision copy of our rounded elements, so that our
+    // log(determinant) is exact and our rounded decomposition is as accurate as possible.
+    WallClockTimer timer;
+    int size(getSize()), ncov((size*(size+1))/2);
+    float const *cov(_getCovariance());
+    std::vector<double> work(cov,cov+ncov);
+    double logDet;
+    try {
+        logDet = choleskyDecompose(work,size);
+    }
+    catch(RuntimeError const &e) {
+        throw RuntimeError("SinglePrecisionCovarianceMatrix: matrix is not positive definite.");
+    }
+    _floatCholesky.assign(work.begin(),work.end());
+    _recordTransition(CovarianceTelemetry::Decomposition,timer,sizeof(float)*_floatCholesky.capacity());
+    return logDet;
+}
+
+local::CovarianceMatrix *local::SinglePrecisionCovarianceMatrix::clone() const {
+    if(!_structured) return CovarianceMatrix::clone();
+    return new SinglePrecisionCovarianceMatrix(*this);
+}
+
+float const *local::SinglePrecisionCovarianceMatrix::_getCovariance() const {
+    if(!_covReady.load(boost::memory_order_acquire)) {
+        // Restore our packed elements, unless another thread beat us to it.
+        boost::lock_guard<boost::recursive_mutex> lock(_floatMutex);
+        if(!_covReady) {
+            int size(getSize());
+            _floatCov.assign((size*(size+1))/2,0);
+            for(int k = 0; k < size; ++k) _floatCov[(k*(k+3))/2] = _floatDiag[k];
+            for(int k = 0; k < _floatOffdiagIndex.size(); ++k) {
+                _floatCov[_floatOffdiagIndex[k]] = _floatOffdiagValue[k];
+            }
+            _covReady.store(true,boost::memory_order_release);
+        }
+    }
+    return &_floatCov[0];
+}
+
+float const *local::SinglePrecisionCovarianceMatrix::_getCholesky() const {
+    if(!_choleskyReady.load(boost::memory_order_acquire)) {
+        boost::lock_guard<boost::recursive_mutex> lock(_floatMutex);
+        if(!_choleskyReady) {
+            _decompose();
+            _choleskyReady.store(true,boost::memory_order_release);
+        }
+    }
+    return &_floatCholesky[0];
+}
+
+void local::SinglePrecisionCovarianceMatrix::_multiplyCovariance(double const *vector, double *result) const {
+    float const *cov(_getCovariance());
+    int size(getSize());
+    for(int j = 0; j < size; ++j) result[j] = 0;
+    // Loop over the packed columns, using each element above the diagonal twice.
+    for(int col = 0; col < size; ++col) {
+        float const *column(cov + (col*(col+1))/2);
+        double sum(column[col]*vector[col]), x(vector[col]);
+        for(int row = 0; row < col; ++row) {
+            sum += column[row]*vector[row];
+            result[row] += column[row]*x;
+        }
+        result[col] += sum;
+    }
+}
+
+void local::SinglePrecisionCovarianceMatrix::_solveCholesky(double *vector) const {
+    float const *cholesky(_getCholesky());
+    int size(getSize());
+    // Solve Ut.y = b by forward substitution, reading each packed column of U once.
+    for(int col = 0; col < size; ++col) {
+        float const *column(cholesky + (col*(col+1))/2);
+        double sum(vector[col]);
+        for(int row = 0; row < col; ++row) sum -= column[row]*vector[row];
+        vector[col] = sum/column[col];
+    }
+    // Solve U.x = y by back substitution.
+    for(int col = size-1; col >= 0; --col) {
+        float const *column(cholesky + (col*(col+1))/2);
+        double x(vector[col] /= column[col]);
+        for(int row = 0; row < col; ++row) vector[row] -= column[row]*x;
+    }
+}
+
+void local::SinglePrecisionCovarianceMatrix::_solve(double const *b, double *x) const {
+    int size(getSize());
+    std::copy(b,b+size,x);
+    _solveCholesky(x);
+    // Refine x using double-precision residuals r = b - C.x until the corrections are negligible.
+    std::vector<double> r(size);
+    double previous(0);
+    for(int iteration = 0; iteration < single::maxIterations; ++iteration) {
+        _multiplyCovariance(x,&r[0]);
+        for(int j = 0; j < size; ++j) r[j] = b[j] - r[j];
+        _solveCholesky(&r[0]);
+        double xmax(0), dxmax(0);
+        for(int j = 0; j < size; ++j) {
+            x[j] += r[j];
+            xmax = std::max(xmax,std::fabs(x[j]));
+            dxmax = std::max(dxmax,std::fabs(r[j]));
+        }
+        if(dxmax <= _tolerance*xmax) return;
+        // Stop if the corrections are no longer shrinking quickly.
+        if(iteration > 0 && dxmax > previous/2) break;
+        previous = dxmax;
+    }
+    throw RuntimeError("SinglePrecisionCovarianceMatrix: iterative refinement did not converge.");
+}
+
+void local::SinglePrecisionCovarianceMatrix::_multiplyCholesky(double *vector) const {
+    float const *cholesky(_getCholesky());
+    int size(getSize());
+    // Element col of Ut.x only depends on x[0..col], so we can work in place from the end.
+    for(int col = size-1; col >= 0; --col) {
+        float const *column(cholesky + (col*(col+1))/2);
+        double sum(0);
+        for(int row = 0; row <= col; ++row) sum += column[row]*vector[row];
+        vector[col] = sum;
+    }
+}
+
+double local::SinglePrecisionCovarianceMatrix::getLogDeterminant() const {
+    if(!_structured) return CovarianceMatrix::getLogDeterminant();
+    return _logDet;
+}
+
+void local::SinglePrecisionCovarianceMatrix::multiplyByCovariance(std::vector<double> &vector) const {
+    if(!_structured) return CovarianceMatrix::multiplyByCovariance(vector);
+    if(vector.size() != getSize()) {
+        throw RuntimeError("SinglePrecisionCovarianceMatrix::multiplyByCovariance: vector has wrong size.");
+    }
+    std::vector<double> result(getSize());
+    _multiplyCovariance(&vector[0],&result[0]);
+    vector.swap(result);
+}
+
+void local::SinglePrecisionCovarianceMatrix::multiplyByInverseCovariance(std::vector<double> &vector) const {
+    if(!_structured) return CovarianceMatrix::multiplyByInverseCovariance(vector);
+    if(vector.size() != getSize()) {
+        throw RuntimeError("SinglePrecisionCovarianceMatrix::multiplyByInverseCovariance: vector has wrong size.");
+    }
+    std::vector<double> result(getSize());
+    _solve(&vector[0],&result[0]);
+    vector.swap(result);
+}
+
+double local::SinglePrecisionCovarianceMatrix::chiSquare(std::vector<double> const &delta) const {
+    if(!_structured) return CovarianceMatrix::chiSquare(delta);
+    if(delta.size() != getSize()) {
+        throw RuntimeError("SinglePrecisionCovarianceMatrix::chiSquare: delta has wrong size.");
+    }
+    double chi2;
+    chiSquare(&delta[0],1,&chi2);
+    return chi2;
+}
+
+void local::SinglePrecisionCovarianceMatrix::chiSquare(double const *deltas, int nvec, double *chi2) const {
+    if(!_structured) return CovarianceMatrix::chiSquare(deltas,nvec,chi2);
+    if(nvec <= 0) {
+        throw RuntimeError("SinglePrecisionCovarianceMatrix::chiSquare: expected nvec > 0.");
+    }
+    // Calculate delta.x with C.x = delta for each vector.
+    int size(getSize());
+    std::vector<double> x(size);
+    for(int n = 0; n < nvec; ++n) {
+        double const *delta(deltas + n*size);
+        _solve(delta,&x[0]);
+        double sum(0);
+        for(int j = 0; j < size; ++j) sum += delta[j]*x[j];
+        chi2[n] = sum;
+    }
+}
+
+double local::SinglePrecisionCovarianceMatrix::sample(std::vector<double> &delta, RandomPtr random) const {
+    if(!_structured) return CovarianceMatrix::sample(delta,random);
+    // Use the default generator if none was specified.
+    if(!random) random = Random::instance();
+    // Generate delta = Ut.z where z is a vector of uncorrelated unit normal values.
+    int size(getSize());
+    delta.resize(size);
+    double nll(0);
+    for(int k = 0; k < size; ++k) {
+        delta[k] = random->getNormal();
+        nll += delta[k]*delta[k];
+    }
+    _multiplyCholesky(&delta[0]);
+    return nll/2;
+}
+
+boost::shared_array<double> local::SinglePrecisionCovarianceMatrix::sample(int nsample, RandomPtr random) const {
+    if(!_structured) return CovarianceMatrix::sample(nsample,random);
+    if(nsample <= 0) {
+        throw RuntimeError("SinglePrecisionCovarianceMatrix: expected nsample > 0.");
+    }
+    // Use the default generator if none was specified.
+    if(!random) random = Random::instance();
+    int size(getSize());
+    std::size_t nrandom(nsample*size), ngen(nrandom);
+    boost::shared_array<double> array = random->fillDoubleArrayNormal(ngen);
+    for(int n = 0; n < nsample; ++n) _multiplyCholesky(array.get() + n*size);
+    return array;
+}
+
+bool local::SinglePrecisionCovarianceMatrix::compress() const {
+    if(!_structured) return CovarianceMatrix::compress();
+    boost::lock_guard<boost::recursive_mutex> lock(_floatMutex);
+    bool compressed(false);
+    // Our Cholesky decomposition can always be recalculated.
+    if(!_floatCholesky.empty()) {
+        std::vector<float>().swap(_floatCholesky);
+        _choleskyReady = false;
+        compressed = true;
+    }
+    if(_floatCov.empty()) return compressed;
+    int size(getSize());
+    // Do we still have valid compressed data?
+    if(_floatDiag.empty()) {
+        // Is a list of non-zero off-diagonal elements smaller than our packed elements?
+        std::size_t nonzero(0);
+        for(int col = 0; col < size; ++col) {
+            for(int index = (col*(col+1))/2; index < (col*(col+3))/2; ++index) {
+                if(_floatCov[index]) nonzero++;
+            }
+        }
+        if(sizeof(float)*(size + nonzero) + sizeof(int)*nonzero < sizeof(float)*_floatCov.size()) {
+            _floatDiag.reserve(size);
+            _floatOffdiagValue.reserve(nonzero);
+            _floatOffdiagIndex.reserve(nonzero);
+            for(int col = 0; col < size; ++col) {
+                for(int index = (col*(col+1))/2; index < (col*(col+3))/2; ++index) {
+                    if(_floatCov[index]) {
+                        _floatOffdiagIndex.push_back(index);
+                        _floatOffdiagValue.push_back(_floatCov[index]);
+                    }
+                }
+                _floatDiag.push_back(_floatCov[(col*(col+3))/2]);
+            }
+        }
+    }
+    if(!_floatDiag.empty()) {
+        std::vector<float>().swap(_floatCov);
+        _covReady = false;
+        compressed = true;
+    }
+    return compressed;
+}
+
+std::size_t local::SinglePrecisionCovarianceMatrix::getMemoryUsage() const {
+    boost::lock_guard<boost::recursive_mutex> lock(_floatMutex);
+    return CovarianceMatrix::getMemoryUsage() + sizeof(*this) - sizeof(CovarianceMatrix) +
+        sizeof(float)*(_floatCov.capacity() + _floatCholesky.capacity() + _floatDiag.capacity() +
+        _floatOffdiagValue.capacity()) + sizeof(int)*_floatOffdiagIndex.capacity();
+}
+
+void local::SinglePrecisionCovarianceMatrix::_getDense(std::vector<double> &packed, bool &inverse) const {
+    int size(getSize());
+    float const *cov(_getCovariance());
+    packed.assign(cov,cov + (size*(size+1))/2);
+    inverse = false;
+}
@@ -0,0 +1,94 @@
+#ifndef LIKELY_SINGLE_PRECISION_COVARIANCE_MATRIX
+#define LIKELY_SINGLE_PRECISION_COVARIANCE_MATRIX
+
+#include "likely/CovarianceMatrix.h"
+
+namespace likely {
+    // Represents a covariance matrix whose packed elements and Cholesky decomposition are stored
+    // in single precision, which halves the memory and bandwidth needed compared with a dense
+    // CovarianceMatrix. All sums are accumulated in double precision, and each solution of
+    // C.x = b obtained with the single-precision decomposition is iteratively refined using
+    // double-precision residuals, so chi-squares and inverse covariance products agree with
+    // a double-precision calculation using the same (rounded) elements. The decomposition is
+    // calculated using temporary double-precision storage, so the log(determinant) is also
+    // exact, and samples use the rounded decomposition directly. Any operation that is not
+    // specialized below (e.g., setting an individual element) converts this object into an
+    // equivalent dense CovarianceMatrix.
+	class SinglePrecisionCovarianceMatrix : public CovarianceMatrix {
+	public:
+	    // Creates a single-precision copy of the specified covariance matrix, or of the specified
+	    // packed covariance elements (see the CovarianceMatrix constructor). Iterative refinement
+	    // stops when the largest correction is below tolerance times the largest solution element.
+	    // Throws a RuntimeError if any element cannot be represented in single precision, if the
+	    // rounded matrix is not positive definite, or if tolerance <= 0.
+		explicit SinglePrecisionCovarianceMatrix(CovarianceMatrix const &other, double tolerance = 1e-10);
+		explicit SinglePrecisionCovarianceMatrix(std::vector<double> const &packed, double tolerance = 1e-10);
+		virtual ~SinglePrecisionCovarianceMatrix();
+		// Returns true if we are still using our single-precision representation.
+        bool isSinglePrecision() const;
+        // Returns the largest relative change of any element due to rounding to single precision.
+        double getRoundingError() const;
+        // Returns a copy that preserves our single-precision representation, if we still have one.
+        virtual CovarianceMatrix *clone() const;
+        // The following methods use our single-precision representation, when available, and are
+        // otherwise equivalent to the corresponding CovarianceMatrix methods. A RuntimeError is
+        // thrown if iterative refinement does not converge, which indicates that this matrix is
+        // too poorly conditioned to be stored in single precision.
+        virtual double getLogDeterminant() const;
+        virtual void multiplyByCovariance(std::vector<double> &vector) const;
+        using CovarianceMatrix::multiplyByInverseCovariance;
+        virtual void multiplyByInverseCovariance(std::vector<double> &vector) const;
+        using CovarianceMatrix::chiSquare;
+        virtual double chiSquare(std::vector<double> const &delta) const;
+        virtual void chiSquare(double const *deltas, int nvec, double *chi2) const;
+        using CovarianceMatrix::sample;
+        virtual double sample(std::vector<double> &delta, RandomPtr random = RandomPtr()) const;
+        virtual boost::shared_array<double> sample(int nsample, RandomPtr random = RandomPtr()) const;
+        // Releases our Cholesky decomposition and, when this is smaller, replaces our packed
+        // elements with their diagonal elements and the values and indices of non-zero
+        // off-diagonal elements. Both are restored when next needed.
+        virtual bool compress() const;
+        virtual std::size_t getMemoryUsage() const;
+    protected:
+        virtual void _getDense(std::vector<double> &packed, bool &inverse) const;
+	private:
+	    // Copies are created with clone() or the CovarianceMatrix copy constructor.
+        SinglePrecisionCovarianceMatrix(SinglePrecisionCovarianceMatrix const &other);
+        // Returns the specified element rounded to single precision and updates _roundingError,
+        // or throws a RuntimeError if it cannot be represented.
+        float _round(double value);
+        // Initializes our Cholesky decomposition and log(determinant) from _floatCov.
+        void _initialize();
+        // Fills _floatCholesky with the rounded Cholesky decomposition of our packed elements
+        // and returns their log(determinant), or throws a RuntimeError.
+        double _decompose() const;
+        // Returns pointers to our packed elements and Cholesky decomposition, restoring
+        // them first if they have been compressed.
+        float const *_getCovariance() const;
+        float const *_getCholesky() const;
+        // Solves C.x = b in place for a single vector using our Cholesky decomposition.
+        void _solveCholesky(double *vector) const;
+        // Solves C.x = b with iterative refinement, or throws a RuntimeError.
+        void _solve(double const *b, double *x) const;
+        // Fills result with C.vector using our single-precision elements.
+        void _multiplyCovariance(double const *vector, double *result) const;
+        // Overwrites vector with Ut.vector using our Cholesky decomposition U.
+        void _multiplyCholesky(double *vector) const;
+        double _tolerance, _roundingError, _logDet;
+        // Our single-precision packed elements and Cholesky decomposition, which are distinct
+        // from the double-precision arrays of our base class.
+        mutable std::vector<float> _floatCov, _floatCholesky;
+        // Compressed representation of _floatCov.
+        mutable std::vector<float> _floatDiag, _floatOffdiagValue;
+        mutable std::vector<int> _floatOffdiagIndex;
+        // Our packed elements and Cholesky decomposition are restored at most once after
+        // compression, while holding _floatMutex, and then read without locking.
+        mutable boost::atomic<bool> _covReady, _choleskyReady;
+        mutable boost::recursive_mutex _floatMutex;
+	}; // SinglePrecisionCovarianceMatrix
+
+    inline bool SinglePrecisionCovarianceMatrix::isSinglePrecision() const { return _structured; }
+    inline double SinglePrecisionCovarianceMatrix::getRoundingError() const { return _roundingError; }
+} // likely
+
+#endif // LIKELY_SINGLE_PRECISION_COVARIANCE_MATRIX
@@ -0,0 +1,210 @@
+#include "likely/SparseCovarianceMatrix.h"
+#include "likely/RuntimeError.h"
+
+#include "boost/thread/locks.hpp"
+#include "boost/bind.hpp"
+
+namespace local = likely;
+
+namespace likely {
+namespace sparse {
+    // Matrix-vector products with fewer non-zero elements than this are not worth the
+    // overhead of starting threads.
+    int const minParallelElements = 16384;
+} // sparse
+} // likely
+
+local::SparseCovarianceMatrix::SparseCovarianceMatrix(int size, std::vector<int> const &rows,
+std::vector<int> const &cols, std::vector<double> const &values, bool inverse, double tolerance,
+int maxIterations)
+: CovarianceMatrix(size), _inverse(inverse), _tolerance(tolerance), _maxIterations(maxIterations),
+_logDet(0), _logDetReady(false)
+{
+    _initialize(rows,cols,values);
+}
+
+local::SparseCovarianceMatrix::SparseCovarianceMatrix(CovarianceMatrix const &other, double tolerance,
+int maxIterations)
+: CovarianceMatrix(other.getSize()), _inverse(true), _tolerance(tolerance),
+_maxIterations(maxIterations), _logDet(0), _logDetReady(false)
+{
+    std::vector<int> rows,cols;
+    std::vector<double> values;
+    other.getInverseElements(rows,cols,values);
+    _initialize(rows,cols,values);
+}
+
+local::SparseCovarianceMatrix::SparseCovarianceMatrix(SparseCovarianceMatrix const &other)
+: CovarianceMatrix(other.getSize()), _inverse(other._inverse), _tolerance(other._tolerance),
+_maxIterations(other._maxIterations), _rowStart(other._rowStart), _column(other._column),
+_value(other._value), _diagonal(other._diagonal), _logDet(0), _logDetReady(false)
+{
+    if(other._logDetReady.load(boost::memory_order_acquire)) {
+        _logDet = other._logDet;
+        _logDetReady = true;
+    }
+    _structured = true;
+}
+
+local::SparseCovarianceMatrix::~SparseCovarianceMatrix() { }
+
+void local::SparseCovarianceMatrix::_initialize(std::vector<int> const &rows,
+std::vector<int> const &cols, std::vector<double> const &values) {
+    if(_tolerance <= 0 || _maxIterations <= 0) {
+        throw RuntimeError("SparseCovarianceMatrix: expected tolerance > 0 and maxIterations > 0.");
+    }
+    int size(getSize()), nelem(values.size());
+    if(rows.size() != nelem || cols.size() != nelem) {
+        throw RuntimeError("SparseCovarianceMatrix: rows, cols and values have different sizes.");
+    }
+    // Count the elements in each row, including both elements of each symmetric pair.
+    std::vector<int> count(size,0);
+    for(int k = 0; k < nelem; ++k) {
+        if(rows[k] < 0 || rows[k] >= size || cols[k] < 0 || cols[k] >= size) {
+            throw RuntimeError("SparseCovarianceMatrix: element index out of range.");
+        }
+        count[rows[k]]++;
+        if(rows[k] != cols[k]) count[cols[k]]++;
+    }
+    _rowStart.reserve(size+1);
+    _rowStart.push_back(0);
+    for(int row = 0; row < size; ++row) _rowStart.push_back(_rowStart.back() + count[row]);
+    // Fill each row.
+    std::vector<int> next(_rowStart.begin(),_rowStart.end()-1);
+    _column.resize(_rowStart.back());
+    _value.resize(_rowStart.back());
+    _diagonal.assign(size,0);
+    for(int k = 0; k < nelem; ++k) {
+        int row(rows[k]), col(cols[k]);
+        _column[next[row]] = col;
+        _value[next[row]++] = values[k];
+        if(row != col) {
+            _column[next[col]] = row;
+            _value[next[col]++] = values[k];
+        }
+        else {
+            _diagonal[row] += values[k];
+        }
+    }
+    for(int row = 0; row < size; ++row) {
+        if(_diagonal[row] <= 0) {
+            throw RuntimeError("SparseCovarianceMatrix: diagonal elements must be > 0.");
+        }
+    }
+    _structured = true;
+}
+
+local::CovarianceMatrix *local::SparseCovarianceMatrix::clone() const {
+    if(!_structured) return CovarianceMatrix::clone();
+    return new SparseCovarianceMatrix(*this);
+}
+
+void local::SparseCovarianceMatrix::_multiply(double const *x, double *result) const {
+    int size(getSize());
+    // Rows are independent, so can be calculated in parallel.
+#pragma omp parallel for schedule(static) if(_value.size() >= sparse::minParallelElements)
+    for(int row = 0; row < size; ++row) {
+        double sum(0);
+        for(int j = _rowStart[row]; j < _rowStart[row+1]; ++j) sum += _value[j]*x[_column[j]];
+        result[row] = sum;
+    }
+}
+
+void local::SparseCovarianceMatrix::_precondition(double const *x, double *result) const {
+    for(int row = 0; row < getSize(); ++row) result[row] = x[row]/_diagonal[row];
+}
+
+void local::SparseCovarianceMatrix::_apply(double const *x, double *result, bool solve) const {
+    if(solve) {
+        conjugateGradientSolve(boost::bind(&SparseCovarianceMatrix::_multiply,this,_1,_2),
+            boost::bind(&SparseCovarianceMatrix::_precondition,this,_1,_2),
+            x,result,getSize(),_tolerance,_maxIterations);
+    }
+    else {
+        _multiply(x,result);
+    }
+}
+
+double local::SparseCovarianceMatrix::getLogDeterminant() const {
+    if(!_structured) return CovarianceMatrix::getLogDeterminant();
+    if(_logDetReady.load(boost::memory_order_acquire)) return _logDet;
+    boost::lock_guard<boost::recursive_mutex> lock(_sparseMutex);
+    if(!_logDetReady) {
+        // Decompose a temporary dense copy of our stored matrix.
+        WallClockTimer timer;
+        bool inverse;
+        std::vector<double> packed;
+        _getDense(packed,inverse);
+        double logdet = choleskyDecompose(packed,getSize());
+        _logDet = inverse ? -logdet : logdet;
+        _recordTransition(CovarianceTelemetry::Decomposition,timer);
+        _logDetReady.store(true,boost::memory_order_release);
+    }
+    return _logDet;
+}
+
+void local::SparseCovarianceMatrix::multiplyByCovariance(std::vector<double> &vector) const {
+    if(!_structured) return CovarianceMatrix::multiplyByCovariance(vector);
+    if(vector.size() != getSize()) {
+        throw RuntimeError("SparseCovarianceMatrix::multiplyByCovariance: vector has wrong size.");
+    }
+    std::vector<double> result(getSize());
+    _apply(&vector[0],&result[0],_inverse);
+    vector.swap(result);
+}
+
+void local::SparseCovarianceMatrix::multiplyByInverseCovariance(std::vector<double> &vector) const {
+    if(!_structured) return CovarianceMatrix::multiplyByInverseCovariance(vector);
+    if(vector.size() != getSize()) {
+        throw RuntimeError("SparseCovarianceMatrix::multiplyByInverseCovariance: vector has wrong size.");
+    }
+    std::vector<double> result(getSize());
+    _apply(&vector[0],&result[0],!_inverse);
+    vector.swap(result);
+}
+
+double local::SparseCovarianceMatrix::chiSquare(std::vector<double> const &delta) const {
+    if(!_structured) return CovarianceMatrix::chiSquare(delta);
+    if(delta.size() != getSize()) {
+        throw RuntimeError("SparseCovarianceMatrix::chiSquare: delta has wrong size.");
+    }
+    double chi2;
+    chiSquare(&delta[0],1,&chi2);
+    return chi2;
+}
+
+void local::SparseCovarianceMatrix::chiSquare(double const *deltas, int nvec, double *chi2) const {
+    if(!_structured) return CovarianceMatrix::chiSquare(deltas,nvec,chi2);
+    if(nvec <= 0) {
+        throw RuntimeError("SparseCovarianceMatrix::chiSquare: expected nvec > 0.");
+    }
+    // Calculate delta.Cinv.delta for each vector.
+    int size(getSize());
+    std::vector<double> y(size);
+    for(int n = 0; n < nvec; ++n) {
+        double const *delta(deltas + n*size);
+        _apply(delta,&y[0],!_inverse);
+        double sum(0);
+        for(int j = 0; j < size; ++j) sum += delta[j]*y[j];
+        chi2[n] = sum;
+    }
+}
+
+std::size_t local::SparseCovarianceMatrix::getMemoryUsage() const {
+    return CovarianceMatrix::getMemoryUsage() + sizeof(*this) - sizeof(CovarianceMatrix) +
+        sizeof(int)*(_rowStart.capacity() + _column.capacity()) +
+        sizeof(double)*(_value.capacity() + _diagonal.capacity());
+}
+
+void local::SparseCovarianceMatrix::_getDense(std::vector<double> &packed, bool &inverse) const {
+    // Each element with row <= col is stored once in the row'th row.
+    int size(getSize());
+    packed.assign((size*(size+1))/2,0);
+    for(int row = 0; row < size; ++row) {
+        for(int j = _rowStart[row]; j < _rowStart[row+1]; ++j) {
+            int col(_column[j]);
+            if(row <= col) packed[row + (col*(col+1))/2] += _value[j];
+        }
+    }
+    inverse = _inverse;
+}
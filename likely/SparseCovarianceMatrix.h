@@ -0,0 +1,82 @@
+#ifndef LIKELY_SPARSE_COVARIANCE_MATRIX
+#define LIKELY_SPARSE_COVARIANCE_MATRIX
+
+#include "likely/CovarianceMatrix.h"
+
+namespace likely {
+    // Represents a covariance matrix whose covariance or inverse covariance is sparse, using
+    // compressed sparse row (CSR) storage of its non-zero elements so that memory and time
+    // scale with the number of non-zero elements rather than size^2. Products with the
+    // stored matrix are calculated directly, with rows divided between threads when OpenMP is
+    // enabled. Products with its inverse are calculated with Jacobi-preconditioned conjugate
+    // gradients. The log(determinant) uses a temporary dense copy, so is expensive but only
+    // calculated once. Any operation that is not specialized below (e.g., sampling or setting
+    // an individual element) converts this object into an equivalent dense CovarianceMatrix.
+	class SparseCovarianceMatrix : public CovarianceMatrix {
+	public:
+	    // Creates a new size x size matrix from the specified non-zero elements of the inverse
+	    // covariance (inverse = true) or covariance (inverse = false), where element k has
+	    // indices rows[k] and cols[k] and each symmetric pair of off-diagonal elements should
+	    // only be listed once. Conjugate-gradient iterations stop when the norm of the residual
+	    // is below tolerance times the norm of the input vector, or else throw a RuntimeError
+	    // after maxIterations. Throws a RuntimeError for inconsistent inputs or any diagonal
+	    // element that is not positive.
+		SparseCovarianceMatrix(int size, std::vector<int> const &rows, std::vector<int> const &cols,
+		    std::vector<double> const &values, bool inverse, double tolerance = 1e-10,
+		    int maxIterations = 1000);
+		// Creates a new matrix using the non-zero inverse covariance elements of another matrix,
+		// which is not uncompressed if it is already compressed.
+		explicit SparseCovarianceMatrix(CovarianceMatrix const &other, double tolerance = 1e-10,
+		    int maxIterations = 1000);
+		virtual ~SparseCovarianceMatrix();
+		// Returns true if we are still using our sparse representation.
+        bool isSparse() const;
+        // Returns true if we store the inverse covariance, or false for the covariance.
+        bool isInverse() const;
+        // Returns the number of non-zero elements we store, counting symmetric pairs twice.
+        int getNNonZero() const;
+        // Returns a copy that preserves our sparse representation, if we still have one.
+        virtual CovarianceMatrix *clone() const;
+        // The following methods use our sparse representation, when available, and are
+        // otherwise equivalent to the corresponding CovarianceMatrix methods.
+        virtual double getLogDeterminant() const;
+        virtual void multiplyByCovariance(std::vector<double> &vector) const;
+        using CovarianceMatrix::multiplyByInverseCovariance;
+        virtual void multiplyByInverseCovariance(std::vector<double> &vector) const;
+        using CovarianceMatrix::chiSquare;
+        virtual double chiSquare(std::vector<double> const &delta) const;
+        virtual void chiSquare(double const *deltas, int nvec, double *chi2) const;
+        virtual std::size_t getMemoryUsage() const;
+    protected:
+        virtual void _getDense(std::vector<double> &packed, bool &inverse) const;
+	private:
+	    // Copies are created with clone() or the CovarianceMatrix copy constructor.
+        SparseCovarianceMatrix(SparseCovarianceMatrix const &other);
+        // Builds our CSR representation from a list of elements, or throws a RuntimeError.
+        void _initialize(std::vector<int> const &rows, std::vector<int> const &cols,
+            std::vector<double> const &values);
+        // Fills result with A.x where A is our stored matrix, or with an approximation to
+        // Ainv.x using the inverse of our diagonal.
+        void _multiply(double const *x, double *result) const;
+        void _precondition(double const *x, double *result) const;
+        // Fills result with A.x (solve = false) or Ainv.x (solve = true).
+        void _apply(double const *x, double *result, bool solve) const;
+        bool _inverse;
+        double _tolerance;
+        int _maxIterations;
+        // Row k has elements _value[j] in columns _column[j] for j = _rowStart[k],...,_rowStart[k+1]-1
+        std::vector<int> _rowStart, _column;
+        std::vector<double> _value, _diagonal;
+        // Our log(determinant) is calculated at most once, while holding _sparseMutex (which is
+        // separate from the lock of our base class), and then read without locking.
+        mutable double _logDet;
+        mutable boost::atomic<bool> _logDetReady;
+        mutable boost::recursive_mutex _sparseMutex;
+	}; // SparseCovarianceMatrix
+
+    inline bool SparseCovarianceMatrix::isSparse() const { return _structured; }
+    inline bool SparseCovarianceMatrix::isInverse() const { return _inverse; }
+    inline int SparseCovarianceMatrix::getNNonZero() const { return _value.size(); }
+} // likely
+
+#endif // LIKELY_SPARSE_COVARIANCE_MATRIX
@@ -0,0 +1,314 @@
+#include "likely/ToeplitzCovarianceMatrix.h"
+#include "likely/RuntimeError.h"
+#include "likely/Random.h"
+
+#include "boost/thread/locks.hpp"
+#include "boost/bind.hpp"
+
+#include <cmath>
+#include <algorithm>
+
+namespace local = likely;
+
+namespace likely {
+namespace toeplitz {
+    // Conjugate gradients normally converge in a few tens of iterations with our
+    // preconditioner, so this is only a safeguard.
+    int const maxIterations(1000);
+    // The circulant embedding size is doubled at most this many times while searching
+    // for a non-negative definite embedding.
+    int const maxDoublings(3);
+} // toeplitz
+} // likely
+
+local::ToeplitzCovarianceMatrix::ToeplitzCovarianceMatrix(std::vector<double> const &row, double tolerance)
+: CovarianceMatrix(_getRowSize(row)), _tolerance(tolerance), _row(row), _logDet(0), _logDetReady(false)
+{
+    if(_row[0] <= 0) {
+        throw RuntimeError("ToeplitzCovarianceMatrix: diagonal elements must be > 0.");
+    }
+    if(_tolerance <= 0) {
+        throw RuntimeError("ToeplitzCovarianceMatrix: expected tolerance > 0.");
+    }
+    // Find the smallest power of two that can embed our matrix, then try larger embeddings
+    // (padded with zeros) if necessary to find one that is non-negative definite.
+    int size(getSize()), minSize(1);
+    while(minSize < 2*size-2) minSize *= 2;
+    int m(minSize);
+    for(int doubling = 0; doubling <= toeplitz::maxDoublings; ++doubling) {
+        _embed(m);
+        if(_canSample) break;
+        m *= 2;
+    }
+    // Use the smallest embedding if none of them are suitable for sampling.
+    if(!_canSample) _embed(minSize);
+    _structured = true;
+}
+
+local::ToeplitzCovarianceMatrix::ToeplitzCovarianceMatrix(ToeplitzCovarianceMatrix const &other)
+: CovarianceMatrix(other.getSize()), _tolerance(other._tolerance), _row(other._row),
+_eigenvalues(other._eigenvalues), _twiddle(other._twiddle), _canSample(other._canSample),
+_usePreconditioner(other._usePreconditioner), _logDet(0), _logDetReady(false)
+{
+    if(other._logDetReady.load(boost::memory_order_acquire)) {
+        _logDet = other._logDet;
+        _logDetReady = true;
+    }
+    _structured = true;
+}
+
+local::ToeplitzCovarianceMatrix::~ToeplitzCovarianceMatrix() { }
+
+int local::ToeplitzCovarianceMatrix::_getRowSize(std::vector<double> const &row) {
+    if(0 == row.size()) {
+        throw RuntimeError("ToeplitzCovarianceMatrix: row is empty.");
+    }
+    return row.size();
+}
+
+void local::ToeplitzCovarianceMatrix::_embed(int m) {
+    // Tabulate the FFT twiddle factors exp(-2 pi i k/m) for k < m/2.
+    _twiddle.resize(0);
+    _twiddle.reserve(m/2);
+    for(int k = 0; k < m/2; ++k) _twiddle.push_back(std::polar(1.,-2*M_PI*k/m));
+    // Build the first column of the circulant matrix that embeds our matrix in its upper-left
+    // corner and calculate its eigenvalues, which are real since the column is symmetric.
+    int size(getSize());
+    std::vector<std::complex<double> > column(m,0.);
+    for(int k = 0; k < size; ++k) {
+        column[k] = _row[k];
+        if(k > 0) column[m-k] = _row[k];
+    }
+    _eigenvalues.resize(m);
+    _transform(column,false);
+    double minValue(column[0].real()), maxValue(minValue);
+    for(int k = 0; k < m; ++k) {
+        _eigenvalues[k] = column[k].real();
+        minValue = std::min(minValue,_eigenvalues[k]);
+        maxValue = std::max(maxValue,_eigenvalues[k]);
+    }
+    // Allow for round-off errors in zero eigenvalues.
+    _canSample = (minValue >= -1e-10*maxValue);
+    _usePreconditioner = (minValue > 1e-10*maxValue);
+}
+
+void local::ToeplitzCovarianceMatrix::_transform(std::vector<std::complex<double> > &data,
+bool inverse) const {
+    int n(data.size());
+    // Reorder the input in bit-reversed order.
+    for(int i = 1, j = 0; i < n; ++i) {
+        int bit(n >> 1);
+        for(; j & bit; bit >>= 1) j ^= bit;
+        j ^= bit;
+        if(i < j) std::swap(data[i],data[j]);
+    }
+    // Perform the radix-2 butterflies.
+    for(int len = 2; len <= n; len <<= 1) {
+        int half(len/2), step(n/len);
+        for(int i = 0; i < n; i += len) {
+            for(int k = 0; k < half; ++k) {
+                std::complex<double> w(_twiddle[k*step]);
+                if(inverse) w = std::conj(w);
+                std::complex<double> u(data[i+k]), v(data[i+k+half]*w);
+                data[i+k] = u + v;
+                data[i+k+half] = u - v;
+            }
+        }
+    }
+}
+
+void local::ToeplitzCovarianceMatrix::_multiplyEmbedded(double const *x, double *result,
+bool inverse, std::vector<std::complex<double> > &work) const {
+    int size(getSize()), m(_eigenvalues.size());
+    // Zero pad x to the embedding size, then multiply by the circulant matrix or its inverse
+    // in Fourier space.
+    work.assign(m,0.);
+    for(int k = 0; k < size; ++k) work[k] = x[k];
+    _transform(work,false);
+    for(int k = 0; k < m; ++k) {
+        if(inverse) {
+            work[k] /= _eigenvalues[k];
+        }
+        else {
+            work[k] *= _eigenvalues[k];
+        }
+    }
+    _transform(work,true);
+    for(int k = 0; k < size; ++k) result[k] = work[k].real()/m;
+}
+
+void local::ToeplitzCovarianceMatrix::_multiply(double const *x, double *result) const {
+    std::vector<std::complex<double> > work;
+    _multiplyEmbedded(x,result,false,work);
+}
+
+void local::ToeplitzCovarianceMatrix::_precondition(double const *x, double *result) const {
+    // Use the upper-left block of the inverse embedding matrix, or else the inverse
+    // of our diagonal.
+    if(_usePreconditioner) {
+        std::vector<std::complex<double> > work;
+        _multiplyEmbedded(x,result,true,work);
+    }
+    else {
+        for(int k = 0; k < getSize(); ++k) result[k] = x[k]/_row[0];
+    }
+}
+
+void local::ToeplitzCovarianceMatrix::_solve(double const *b, double *x) const {
+    conjugateGradientSolve(boost::bind(&ToeplitzCovarianceMatrix::_multiply,this,_1,_2),
+        boost::bind(&ToeplitzCovarianceMatrix::_precondition,this,_1,_2),
+        b,x,getSize(),_tolerance,toeplitz::maxIterations);
+}
+
+local::CovarianceMatrix *local::ToeplitzCovarianceMatrix::clone() const {
+    if(!_structured) return CovarianceMatrix::clone();
+    return new ToeplitzCovarianceMatrix(*this);
+}
+
+double local::ToeplitzCovarianceMatrix::getLogDeterminant() const {
+    if(!_structured) return CovarianceMatrix::getLogDeterminant();
+    if(_logDetReady.load(boost::memory_order_acquire)) return _logDet;
+    boost::lock_guard<boost::recursive_mutex> lock(_toeplitzMutex);
+    if(!_logDetReady) {
+        // Use the Durbin recursion (Golub & Van Loan, Algorithm 4.7.1) for the matrix
+        // normalized to unit diagonal, whose k-th leading principal minor is the product
+        // of the first k prediction error variances beta.
+        WallClockTimer timer;
+        int size(getSize());
+        double scale(_row[0]), logdet(size*std::log(scale));
+        if(size > 1) {
+            std::vector<double> y(size-1), z(size-1);
+            double alpha(-_row[1]/scale), beta(1);
+            y[0] = alpha;
+            for(int k = 1; k < size; ++k) {
+                beta *= (1 - alpha*alpha);
+                if(beta <= 0) {
+                    throw RuntimeError("ToeplitzCovarianceMatrix: matrix is not positive definite.");
+                }
+                logdet += std::log(beta);
+                if(k == size-1) break;
+                double sum(_row[k+1]);
+                for(int j = 0; j < k; ++j) sum += _row[k-j]*y[j];
+                alpha = -sum/scale/beta;
+                for(int j = 0; j < k; ++j) z[j] = y[j] + alpha*y[k-1-j];
+                y.swap(z);
+                y[k] = alpha;
+            }
+        }
+        _logDet = logdet;
+        _recordTransition(CovarianceTelemetry::Decomposition,timer);
+        _logDetReady.store(true,boost::memory_order_release);
+    }
+    return _logDet;
+}
+
+void local::ToeplitzCovarianceMatrix::multiplyByCovariance(std::vector<double> &vector) const {
+    if(!_structured) return CovarianceMatrix::multiplyByCovariance(vector);
+    if(vector.size() != getSize()) {
+        throw RuntimeError("ToeplitzCovarianceMatrix::multiplyByCovariance: vector has wrong size.");
+    }
+    std::vector<std::complex<double> > work;
+    _multiplyEmbedded(&vector[0],&vector[0],false,work);
+}
+
+void local::ToeplitzCovarianceMatrix::multiplyByInverseCovariance(std::vector<double> &vector) const {
+    if(!_structured) return CovarianceMatrix::multiplyByInverseCovariance(vector);
+    if(vector.size() != getSize()) {
+        throw RuntimeError("ToeplitzCovarianceMatrix::multiplyByInverseCovariance: vector has wrong size.");
+    }
+    std::vector<double> result(getSize());
+    _solve(&vector[0],&result[0]);
+    vector.swap(result);
+}
+
+double local::ToeplitzCovarianceMatrix::chiSquare(std::vector<double> const &delta) const {
+    if(!_structured) return CovarianceMatrix::chiSquare(delta);
+    if(delta.size() != getSize()) {
+        throw RuntimeError("ToeplitzCovarianceMatrix::chiSquare: delta has wrong size.");
+    }
+    double chi2;
+    chiSquare(&delta[0],1,&chi2);
+    return chi2;
+}
+
+void local::ToeplitzCovarianceMatrix::chiSquare(double const *deltas, int nvec, double *chi2) const {
+    if(!_structured) return CovarianceMatrix::chiSquare(deltas,nvec,chi2);
+    if(nvec <= 0) {
+        throw RuntimeError("ToeplitzCovarianceMatrix::chiSquare: expected nvec > 0.");
+    }
+    // Calculate delta.x with C.x = delta for each vector.
+    int size(getSize());
+    std::vector<double> x(size);
+    for(int n = 0; n < nvec; ++n) {
+        double const *delta(deltas + n*size);
+        _solve(delta,&x[0]);
+        double sum(0);
+        for(int j = 0; j < size; ++j) sum += delta[j]*x[j];
+        chi2[n] = sum;
+    }
+}
+
+double local::ToeplitzCovarianceMatrix::sample(std::vector<double> &delta, RandomPtr random) const {
+    if(!_structured || !_canSample) return CovarianceMatrix::sample(delta,random);
+    // Use the default generator if none was specified.
+    if(!random) random = Random::instance();
+    // The real part of the FFT of sqrt(lambda/m).(z1 + i z2), where z1,z2 are vectors of
+    // uncorrelated unit normal values, is a sample of our embedding matrix whose first size
+    // elements are a sample of our matrix.
+    int size(getSize()), m(_eigenvalues.size());
+    std::vector<std::complex<double> > work(m);
+    for(int k = 0; k < m; ++k) {
+        double scale(std::sqrt(std::max(0.,_eigenvalues[k])/m));
+        double re(random->getNormal()), im(random->getNormal());
+        work[k] = std::complex<double>(scale*re,scale*im);
+    }
+    _transform(work,false);
+    delta.resize(size);
+    for(int j = 0; j < size; ++j) delta[j] = work[j].real();
+    return chiSquare(delta)/2;
+}
+
+boost::shared_array<double> local::ToeplitzCovarianceMatrix::sample(int nsample, RandomPtr random) const {
+    if(!_structured || !_canSample) return CovarianceMatrix::sample(nsample,random);
+    if(nsample <= 0) {
+        throw RuntimeError("ToeplitzCovarianceMatrix: expected nsample > 0.");
+    }
+    // Use the default generator if none was specified.
+    if(!random) random = Random::instance();
+    // The real and imaginary parts of each transform (see above) are independent samples.
+    int size(getSize()), m(_eigenvalues.size()), npair((nsample+1)/2);
+    std::size_t nrandom(2*npair*(std::size_t)m), ngen(nrandom);
+    boost::shared_array<double> normal = random->fillDoubleArrayNormal(ngen);
+    boost::shared_array<double> array(new double[nsample*size]);
+    std::vector<double> scale(m);
+    for(int k = 0; k < m; ++k) scale[k] = std::sqrt(std::max(0.,_eigenvalues[k])/m);
+    std::vector<std::complex<double> > work(m);
+    for(int pair = 0; pair < npair; ++pair) {
+        double const *z(normal.get() + 2*pair*(std::size_t)m);
+        for(int k = 0; k < m; ++k) work[k] = std::complex<double>(scale[k]*z[2*k],scale[k]*z[2*k+1]);
+        _transform(work,false);
+        double *delta(array.get() + 2*pair*size);
+        for(int j = 0; j < size; ++j) delta[j] = work[j].real();
+        if(2*pair+1 < nsample) {
+            delta += size;
+            for(int j = 0; j < size; ++j) delta[j] = work[j].imag();
+        }
+    }
+    return array;
+}
+
+std::size_t local::ToeplitzCovarianceMatrix::getMemoryUsage() const {
+    return CovarianceMatrix::getMemoryUsage() + sizeof(*this) - sizeof(CovarianceMatrix) +
+        sizeof(double)*(_row.capacity() + _eigenvalues.capacity()) +
+        sizeof(std::complex<double>)*_twiddle.capacity();
+}
+
+void local::ToeplitzCovarianceMatrix::_getDense(std::vector<double> &packed, bool &inverse) const {
+    int size(getSize());
+    packed.resize(0);
+    packed.reserve((size*(size+1))/2);
+    for(int col = 0; col < size; ++col) {
+        for(int row = 0; row <= col; ++row) packed.push_back(_row[col-row]);
+    }
+    inverse = false;
+}
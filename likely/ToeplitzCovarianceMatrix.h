@@ -0,0 +1,94 @@
+#ifndef LIKELY_TOEPLITZ_COVARIANCE_MATRIX
+#define LIKELY_TOEPLITZ_COVARIANCE_MATRIX
+
+#include "likely/CovarianceMatrix.h"
+
+#include <complex>
+
+namespace likely {
+    // Represents a stationary covariance matrix whose elements only depend on the separation
+    // of their indices, C(i,j) = row[|i-j|], as for stationary noise on a uniform binning or
+    // sampling. Only the first row is stored, together with the eigenvalues of a circulant
+    // matrix of size m >= 2*size-2 (a power of two) that embeds C, so that products with C use
+    // FFTs of length m and O(size*log(size)) operations. Inverse covariance products and
+    // chi-squares are calculated with preconditioned conjugate gradients, using the inverse
+    // of the embedding circulant matrix as a preconditioner, so each iteration is also
+    // O(size*log(size)). Samples are generated exactly with the circulant embedding method
+    // when the embedding matrix is non-negative definite (see canSample). Any operation that
+    // is not specialized below (e.g., setting an individual element) converts this object
+    // into an equivalent dense CovarianceMatrix.
+	class ToeplitzCovarianceMatrix : public CovarianceMatrix {
+	public:
+	    // Creates a new covariance matrix with the specified first row. Conjugate-gradient
+	    // iterations stop when the norm of the residual is below tolerance times the norm of the
+	    // input vector. Throws a RuntimeError if row is empty, row[0] <= 0 or tolerance <= 0.
+	    // Positive definiteness is only checked when getLogDeterminant() is first called.
+		explicit ToeplitzCovarianceMatrix(std::vector<double> const &row, double tolerance = 1e-10);
+		virtual ~ToeplitzCovarianceMatrix();
+		// Returns true if we are still using our Toeplitz representation.
+        bool isToeplitz() const;
+        // Returns the first row of this matrix.
+        std::vector<double> const &getRow() const;
+        // Returns the size of our circulant embedding, which is used for FFTs.
+        int getEmbeddingSize() const;
+        // Returns true if our circulant embedding is non-negative definite, so that we can
+        // generate samples without converting to a dense representation. Sampling a matrix
+        // without a suitable embedding uses an equivalent dense CovarianceMatrix.
+        bool canSample() const;
+        // Returns a copy that preserves our Toeplitz representation, if we still have one.
+        virtual CovarianceMatrix *clone() const;
+        // The following methods use our Toeplitz representation, when available, and are
+        // otherwise equivalent to the corresponding CovarianceMatrix methods. The
+        // log(determinant) is calculated with the Durbin recursion, which uses O(size^2)
+        // operations but only O(size) memory, and is cached. A RuntimeError is thrown if
+        // conjugate gradients do not converge or if this matrix is not positive definite.
+        virtual double getLogDeterminant() const;
+        virtual void multiplyByCovariance(std::vector<double> &vector) const;
+        using CovarianceMatrix::multiplyByInverseCovariance;
+        virtual void multiplyByInverseCovariance(std::vector<double> &vector) const;
+        using CovarianceMatrix::chiSquare;
+        virtual double chiSquare(std::vector<double> const &delta) const;
+        virtual void chiSquare(double const *deltas, int nvec, double *chi2) const;
+        using CovarianceMatrix::sample;
+        virtual double sample(std::vector<double> &delta, RandomPtr random = RandomPtr()) const;
+        virtual boost::shared_array<double> sample(int nsample, RandomPtr random = RandomPtr()) const;
+        virtual std::size_t getMemoryUsage() const;
+    protected:
+        virtual void _getDense(std::vector<double> &packed, bool &inverse) const;
+	private:
+	    // Copies are created with clone() or the CovarianceMatrix copy constructor.
+        ToeplitzCovarianceMatrix(ToeplitzCovarianceMatrix const &other);
+        // Returns the size of the specified row, or throws a RuntimeError.
+        static int _getRowSize(std::vector<double> const &row);
+        // Calculates the eigenvalues of the circulant embedding of size m.
+        void _embed(int m);
+        // Performs an in-place FFT of length getEmbeddingSize(), without any normalization.
+        void _transform(std::vector<std::complex<double> > &data, bool inverse) const;
+        // Fills result with C.x (inverse = false) or the first getSize() elements of Cemb^-1.x
+        // (inverse = true), where Cemb is our embedding matrix and x is zero padded. Uses the
+        // work vector provided for temporary storage.
+        void _multiplyEmbedded(double const *x, double *result, bool inverse,
+            std::vector<std::complex<double> > &work) const;
+        // Fills result with C.x or an approximation to Cinv.x, for use with conjugateGradientSolve.
+        void _multiply(double const *x, double *result) const;
+        void _precondition(double const *x, double *result) const;
+        // Solves C.x = b using preconditioned conjugate gradients, or throws a RuntimeError.
+        void _solve(double const *b, double *x) const;
+        double _tolerance;
+        std::vector<double> _row, _eigenvalues;
+        std::vector<std::complex<double> > _twiddle;
+        bool _canSample, _usePreconditioner;
+        // Our log(determinant) is calculated at most once, while holding _toeplitzMutex (which is
+        // separate from the lock of our base class), and then read without locking.
+        mutable double _logDet;
+        mutable boost::atomic<bool> _logDetReady;
+        mutable boost::recursive_mutex _toeplitzMutex;
+	}; // ToeplitzCovarianceMatrix
+
+    inline bool ToeplitzCovarianceMatrix::isToeplitz() const { return _structured; }
+    inline std::vector<double> const &ToeplitzCovarianceMatrix::getRow() const { return _row; }
+    inline int ToeplitzCovarianceMatrix::getEmbeddingSize() const { return _eigenvalues.size(); }
+    inline bool ToeplitzCovarianceMatrix::canSample() const { return _canSample; }
+} // likely
+
+#endif // LIKELY_TOEPLITZ_COVARIANCE_MATRIX
@@ -26,8 +26,21 @@
 #include "likely/NonUniformSampling.h"
 
 #include "likely/CovarianceMatrix.h"
+#include "likely/LowRankCovarianceMatrix.h"
+#include "likely/BlockDiagonalCovarianceMatrix.h"
+#include "likely/MappedCovarianceMatrix.h"
+#include "likely/SinglePrecisionCovarianceMatrix.h"
+#include "likely/ToeplitzCovarianceMatrix.h"
+#include "likely/SparseCovarianceMatrix.h"
+#include "likely/PackedKernels.h"
+#include "likely/CovarianceTelemetry.h"
+#include "likely/KroneckerCovarianceMatrix.h"
+#include "likely/MappedFile.h"
 #include "likely/BinnedGrid.h"
 #include "likely/BinnedData.h"
+#include "likely/BinnedOffsetMap.h"
+#include "likely/IncrementalChiSquare.h"
+#include "likely/BinnedDataView.h"
 #include "likely/BinnedDataResampler.h"
 
 #include "likely/FitParameter.h"
@@ -39,6 +39,10 @@ namespace likely {
     typedef boost::shared_ptr<BinnedData> BinnedDataPtr;
     typedef boost::shared_ptr<const BinnedData> BinnedDataCPtr;
 
+    // Declares a smart pointer to a const memory-mapped binary file.
+    class MappedFile;
+    typedef boost::shared_ptr<const MappedFile> MappedFileCPtr;
+
     // Represents a smart pointer to a minimization engine.
     class AbsEngine;
     typedef boost::shared_ptr<AbsEngine> AbsEnginePtr;
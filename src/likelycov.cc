@@ -251,5 +251,8 @@ int main(int argc, char **argv) {
                 << 1e3*elapsed(t2,t3)/ntot << std::endl;
         }
     }
-    
+
+    // Summarize the expensive transitions triggered by everything above.
+    std::cout << "Covariance transitions:" << std::endl;
+    lk::getGlobalCovarianceTelemetry().printToStream(std::cout);
 }
@@ -7,6 +7,11 @@
 #include "likely/likely.h"
 namespace lk = likely;
 
+#include <cstdio>
+#include <cmath>
+#include <set>
+#include <algorithm>
+
 struct BinnedDataFixture
 {
     BinnedDataFixture() {
@@ -17,10 +22,11 @@ struct BinnedDataFixture
         	axis2(new lk::UniformSampling(0.,1.,3)),
         	axis3(new lk::NonUniformBinning(bins));
 
-        lk::BinnedGrid grid(axis1,axis2,axis3);
-        binnedData.reset(new lk::BinnedData(grid));
+        grid.reset(new lk::BinnedGrid(axis1,axis2,axis3));
+        binnedData.reset(new lk::BinnedData(*grid));
     }
     ~BinnedDataFixture() { }   
+    boost::shared_ptr<const lk::BinnedGrid> grid;
     boost::shared_ptr<const lk::BinnedData> binnedData;
 };
 
@@ -30,6 +36,469 @@ BOOST_AUTO_TEST_CASE( shouldThrowBinningErrorInConstructorWithInvalidParameters
 	BOOST_CHECK_EQUAL(1, 1);
 }
 
+BOOST_AUTO_TEST_CASE( shouldSaveAndLoadBinaryFile ) {
+	lk::BinnedData data(*grid);
+	int indices[4] = { 3, 0, 11, 26 };
+	for(int k = 0; k < 4; ++k) data.setData(indices[k],0.5*k-1);
+	lk::CovarianceMatrixPtr cov(new lk::CovarianceMatrix(4));
+	for(int k = 0; k < 4; ++k) cov->setCovariance(k,k,1+k);
+	cov->setCovariance(0,2,0.3);
+	data.setCovarianceMatrix(cov);
+	std::string filename("likelycheck-data.bin");
+	data.saveBinary(filename);
+	lk::BinnedData loaded(*grid);
+	loaded.loadBinary(filename);
+	std::remove(filename.c_str());
+	BOOST_REQUIRE_EQUAL(loaded.getNBinsWithData(), 4);
+	for(int k = 0; k < 4; ++k) {
+		BOOST_CHECK_EQUAL(loaded.getIndexAtOffset(k), indices[k]);
+		BOOST_CHECK_EQUAL(loaded.getData(indices[k]), data.getData(indices[k]));
+	}
+	std::vector<double> pred(4,1);
+	BOOST_CHECK_CLOSE(loaded.chiSquare(pred), data.chiSquare(pred), 1e-8);
+}
+
+BOOST_AUTO_TEST_CASE( shouldGenerateBatchedSamples ) {
+	lk::BinnedData data(*grid);
+	for(int k = 0; k < 4; ++k) data.setData(k,k);
+	lk::CovarianceMatrixPtr cov(new lk::CovarianceMatrix(4));
+	for(int k = 0; k < 4; ++k) cov->setCovariance(k,k,1+k);
+	cov->setCovariance(0,1,0.5);
+	data.setCovarianceMatrix(cov);
+	lk::RandomPtr random(new lk::Random());
+	random->setSeed(10);
+	int nsample(2000);
+	std::vector<lk::BinnedDataPtr> samples = data.sample(nsample,random);
+	BOOST_REQUIRE_EQUAL(samples.size(), nsample);
+	std::vector<double> mean(4,0);
+	double sum01(0);
+	for(int n = 0; n < nsample; ++n) {
+		BOOST_REQUIRE_EQUAL(samples[n]->getNBinsWithData(), 4);
+		BOOST_CHECK(samples[n]->getCovarianceMatrix() == data.getCovarianceMatrix());
+		for(int k = 0; k < 4; ++k) mean[k] += samples[n]->getData(k)/nsample;
+		sum01 += (samples[n]->getData(0) - 0)*(samples[n]->getData(1) - 1)/nsample;
+	}
+	// Check the sample mean and covariance with generous (~5 sigma) tolerances.
+	for(int k = 0; k < 4; ++k) BOOST_CHECK_SMALL(mean[k] - k, 5*std::sqrt((1.+k)/nsample));
+	BOOST_CHECK_SMALL(sum01 - 0.5, 0.2);
+	BOOST_CHECK_THROW(data.sample(0,random), lk::RuntimeError);
+}
+
+BOOST_AUTO_TEST_CASE( shouldUseSparseOffsetMap ) {
+	// A 4-million bin grid with only a few thousand bins filled, in a strided order.
+	lk::AbsBinningCPtr
+		rpar(new lk::UniformBinning(0.,1.,200)),
+		rperp(new lk::UniformBinning(0.,1.,200)),
+		z(new lk::UniformBinning(0.,1.,100));
+	lk::BinnedGrid huge(rpar,rperp,z);
+	lk::BinnedData data(huge);
+	int nfill(3000), stride(1024);
+	for(int k = 0; k < nfill; ++k) data.setData((k*stride) % huge.getNBinsTotal(),k);
+	BOOST_REQUIRE_EQUAL(data.getNBinsWithData(), nfill);
+	BOOST_CHECK(data.getMemoryUsage() < sizeof(int)*huge.getNBinsTotal()/10);
+	for(int k = 0; k < nfill; ++k) {
+		int index((k*stride) % huge.getNBinsTotal());
+		BOOST_CHECK_EQUAL(data.getOffsetForIndex(index), k);
+		BOOST_CHECK(!data.hasData(index+1));
+	}
+	std::set<int> keep;
+	keep.insert(stride);
+	keep.insert(7*stride);
+	data.prune(keep);
+	BOOST_CHECK_EQUAL(data.getOffsetForIndex(7*stride), 1);
+	BOOST_CHECK(!data.hasData(2*stride));
+	// The map switches to a dense vector as the grid fills up.
+	lk::BinnedOffsetMap map(1000);
+	BOOST_CHECK(!map.isDense());
+	for(int index = 999; index >= 0; index -= 3) map.setOffset(index,index/3);
+	BOOST_CHECK(map.isDense());
+	BOOST_CHECK_EQUAL(map.getNOffsets(), 334);
+	BOOST_CHECK_EQUAL(map.getOffset(501), 167);
+	BOOST_CHECK_EQUAL(map.getOffset(500), lk::BinnedOffsetMap::EMPTY_BIN);
+	BOOST_CHECK_THROW(map.setOffset(1000,0), lk::RuntimeError);
+}
+
+BOOST_AUTO_TEST_CASE( shouldCopyDataOnWrite ) {
+	lk::BinnedData data(*grid);
+	for(int k = 0; k < 4; ++k) data.setData(3*k,k);
+	lk::CovarianceMatrixPtr cov(new lk::CovarianceMatrix(4));
+	for(int k = 0; k < 4; ++k) cov->setCovariance(k,k,1+k);
+	data.setCovarianceMatrix(cov);
+	data.finalize();
+	lk::BinnedDataPtr copy(data.clone());
+	BOOST_CHECK(copy->isCongruent(data));
+	// Changes to the copy do not affect the original.
+	copy->setData(6,10);
+	BOOST_CHECK_EQUAL(data.getData(6), 2);
+	BOOST_CHECK_EQUAL(copy->getData(6), 10);
+	BOOST_CHECK_CLOSE(copy->getData(9,true), 3./4., 1e-8);
+	BOOST_CHECK_EQUAL(data.getData(9), 3);
+	lk::BinnedData unfinalized(*grid);
+	for(int k = 0; k < 4; ++k) unfinalized.setData(k,k);
+	lk::BinnedData other(unfinalized);
+	other.setData(20,1);
+	std::set<int> keep;
+	keep.insert(1);
+	keep.insert(20);
+	other.prune(keep);
+	BOOST_CHECK_EQUAL(unfinalized.getNBinsWithData(), 4);
+	BOOST_CHECK_EQUAL(unfinalized.getOffsetForIndex(3), 3);
+	BOOST_CHECK_EQUAL(other.getNBinsWithData(), 2);
+	BOOST_CHECK_EQUAL(other.getOffsetForIndex(20), 1);
+	BOOST_CHECK(!other.hasData(3));
+	// An empty dataset that adds another starts with the other's bins.
+	lk::BinnedData sum(*grid);
+	sum.add(data,2);
+	BOOST_CHECK(sum.isCongruent(data));
+	BOOST_CHECK_CLOSE(sum.getData(9), 3, 1e-8);
+	sum.add(*copy);
+	BOOST_CHECK_CLOSE(sum.getData(6), 14./3., 1e-8);
+	BOOST_CHECK_EQUAL(data.getData(6), 2);
+}
+
+BOOST_AUTO_TEST_CASE( shouldUpdateChiSquareIncrementally ) {
+	lk::RandomPtr random(new lk::Random());
+	random->setSeed(19);
+	int size(48);
+	lk::AbsBinningCPtr axis(new lk::UniformBinning(0.,1.,size));
+	lk::BinnedDataPtr data(new lk::BinnedData((lk::BinnedGrid(axis))));
+	for(int k = 0; k < size; ++k) data->setData(k,random->getNormal());
+	data->setCovarianceMatrix(lk::generateRandomCovariance(size,1,random));
+	data->finalize();
+	lk::IncrementalChiSquare evaluator(data,5);
+	std::vector<double> pred(size);
+	for(int k = 0; k < size; ++k) pred[k] = random->getNormal();
+	BOOST_CHECK_CLOSE(evaluator.chiSquare(pred), data->chiSquare(pred), 1e-8);
+	for(int n = 0; n < 12; ++n) {
+		// Change a few bins, with one change repeated.
+		std::vector<int> offsets;
+		std::vector<double> values;
+		for(int m = 0; m < 3; ++m) {
+			offsets.push_back((7*n + 5*m) % size);
+			values.push_back(random->getNormal());
+			pred[offsets.back()] = values.back();
+		}
+		offsets.push_back(offsets[0]);
+		values.push_back(values[0] + 1);
+		pred[offsets[0]] += 1;
+		double chi2 = (n % 2) ? evaluator.update(offsets,values) : evaluator.chiSquare(pred);
+		BOOST_CHECK_CLOSE(chi2, data->chiSquare(pred), 1e-6);
+	}
+	BOOST_CHECK_EQUAL(evaluator.getNFullEvaluations(), 3);
+	BOOST_CHECK_EQUAL(evaluator.getNIncrementalUpdates(), 10);
+	// Changing most bins triggers a full recalculation.
+	for(int k = 0; k < size; ++k) pred[k] += 0.1;
+	BOOST_CHECK_CLOSE(evaluator.chiSquare(pred), data->chiSquare(pred), 1e-8);
+	BOOST_CHECK_EQUAL(evaluator.getNFullEvaluations(), 4);
+	BOOST_CHECK_THROW(evaluator.update(std::vector<int>(1,size),std::vector<double>(1,0.)),
+		lk::RuntimeError);
+	// Data without a covariance uses its scalar weight.
+	lk::BinnedDataPtr unweighted(new lk::BinnedData((lk::BinnedGrid(axis))));
+	for(int k = 0; k < size; ++k) unweighted->setData(k,k);
+	unweighted->dropCovariance(0.5);
+	lk::IncrementalChiSquare scalar(unweighted);
+	scalar.chiSquare(pred);
+	pred[3] = 7;
+	BOOST_CHECK_CLOSE(scalar.chiSquare(pred), unweighted->chiSquare(pred), 1e-8);
+	// Changing more bins reads more columns of the inverse covariance. This includes the change
+	// to pred[3] above.
+	for(int k = 1; k < 6; ++k) pred[8*k + 1] -= 0.3;
+	BOOST_CHECK_CLOSE(evaluator.chiSquare(pred), data->chiSquare(pred), 1e-6);
+	BOOST_CHECK_EQUAL(evaluator.getNIncrementalUpdates(), 11);
+	// A structured covariance is updated without being unpacked.
+	std::vector<double> row(size);
+	for(int k = 0; k < size; ++k) row[k] = 2*std::exp(-k/4.);
+	boost::shared_ptr<lk::ToeplitzCovarianceMatrix> toeplitz(new lk::ToeplitzCovarianceMatrix(row));
+	lk::BinnedDataPtr dense(new lk::BinnedData((lk::BinnedGrid(axis)))),
+		structured(new lk::BinnedData((lk::BinnedGrid(axis))));
+	for(int k = 0; k < size; ++k) {
+		dense->setData(k,data->getData(k));
+		structured->setData(k,data->getData(k));
+	}
+	dense->setCovarianceMatrix(lk::CovarianceMatrixPtr(new lk::CovarianceMatrix(*toeplitz)));
+	structured->setCovarianceMatrix(toeplitz);
+	lk::IncrementalChiSquare stationary(structured);
+	stationary.chiSquare(pred);
+	pred[10] += 1;
+	pred[30] -= 2;
+	BOOST_CHECK_CLOSE(stationary.chiSquare(pred), dense->chiSquare(pred), 1e-6);
+	BOOST_CHECK_EQUAL(stationary.getNIncrementalUpdates(), 1);
+	BOOST_CHECK(toeplitz->isToeplitz());
+}
+
+BOOST_AUTO_TEST_CASE( shouldCalculateChiSquareGradient ) {
+	lk::RandomPtr random(new lk::Random());
+	random->setSeed(20);
+	int size(30), npar(3);
+	lk::AbsBinningCPtr axis(new lk::UniformBinning(0.,1.,size));
+	lk::BinnedData data((lk::BinnedGrid(axis)));
+	for(int k = 0; k < size; ++k) data.setData(k,random->getNormal());
+	data.setCovarianceMatrix(lk::generateRandomCovariance(size,1,random));
+	// Use a prediction that is linear in its parameters, so the Gauss-Newton Hessian is exact.
+	std::vector<double> jacobian(npar*size), params(npar), pred(size,0);
+	for(int k = 0; k < npar*size; ++k) jacobian[k] = random->getNormal();
+	for(int p = 0; p < npar; ++p) params[p] = random->getNormal();
+	for(int p = 0; p < npar; ++p) {
+		for(int k = 0; k < size; ++k) pred[k] += params[p]*jacobian[p*size+k];
+	}
+	std::vector<double> gradient, hessian;
+	double chi2 = data.chiSquare(pred,jacobian,gradient,&hessian);
+	BOOST_CHECK_CLOSE(chi2, data.chiSquare(pred), 1e-8);
+	BOOST_REQUIRE_EQUAL(gradient.size(), npar);
+	BOOST_REQUIRE_EQUAL(hessian.size(), (npar*(npar+1))/2);
+	// Compare with central differences, which are exact for a quadratic chi-square.
+	double eps(1e-3);
+	for(int p = 0; p < npar; ++p) {
+		std::vector<double> plus(pred), minus(pred);
+		for(int k = 0; k < size; ++k) {
+			plus[k] += eps*jacobian[p*size+k];
+			minus[k] -= eps*jacobian[p*size+k];
+		}
+		BOOST_CHECK_CLOSE(gradient[p], (data.chiSquare(plus) - data.chiSquare(minus))/(2*eps), 1e-5);
+		std::vector<double> gplus, gminus;
+		data.chiSquare(plus,jacobian,gplus);
+		data.chiSquare(minus,jacobian,gminus);
+		for(int q = 0; q <= p; ++q) {
+			BOOST_CHECK_CLOSE(hessian[q + (p*(p+1))/2], (gplus[q] - gminus[q])/(2*eps), 1e-5);
+		}
+	}
+	// Without a covariance, the scalar weight is used.
+	lk::BinnedData unweighted((lk::BinnedGrid(axis)));
+	for(int k = 0; k < size; ++k) unweighted.setData(k,k);
+	unweighted.dropCovariance(2);
+	unweighted.chiSquare(pred,jacobian,gradient);
+	double expected(0);
+	for(int k = 0; k < size; ++k) expected += 2*2*(pred[k]-k)*jacobian[k];
+	BOOST_CHECK_CLOSE(gradient[0], expected, 1e-8);
+	BOOST_CHECK_THROW(data.chiSquare(pred,std::vector<double>(size+1),gradient), lk::RuntimeError);
+}
+
+BOOST_AUTO_TEST_CASE( shouldAdoptDataAndCovariance ) {
+	lk::RandomPtr random(new lk::Random());
+	random->setSeed(21);
+	int size(5);
+	int order[5] = { 4, 17, 2, 9, 11 };
+	lk::CovarianceMatrixPtr cov = lk::generateRandomCovariance(size,1,random);
+	// Build the same dataset one element at a time and in bulk.
+	lk::BinnedData expected(*grid), adopted(*grid);
+	std::vector<int> indices(order,order+size);
+	std::vector<double> values, packed;
+	for(int k = 0; k < size; ++k) {
+		values.push_back(random->getNormal());
+		expected.setData(order[k],values.back());
+	}
+	for(int col = 0; col < size; ++col) {
+		for(int row = 0; row <= col; ++row) {
+			expected.setInverseCovariance(order[row],order[col],cov->getInverseCovariance(row,col));
+			packed.push_back(cov->getInverseCovariance(row,col));
+		}
+	}
+	// A duplicate index is detected without changing anything.
+	std::vector<int> duplicate(indices);
+	duplicate[3] = duplicate[0];
+	BOOST_CHECK_THROW(adopted.adoptData(duplicate,values), lk::RuntimeError);
+	BOOST_CHECK_EQUAL(adopted.getNBinsWithData(), 0);
+	BOOST_CHECK_EQUAL(values.size(), size);
+	adopted.adoptData(indices,values);
+	BOOST_CHECK(indices.empty());
+	BOOST_CHECK(values.empty());
+	adopted.adoptCovariance(packed,true);
+	BOOST_CHECK(packed.empty());
+	BOOST_CHECK(adopted.isCongruent(expected));
+	std::vector<double> pred(size,0.5);
+	BOOST_CHECK_CLOSE(adopted.chiSquare(pred), expected.chiSquare(pred), 1e-8);
+	BOOST_CHECK_CLOSE(adopted.getCovariance(9,2), expected.getCovariance(9,2), 1e-8);
+	BOOST_CHECK_THROW(adopted.adoptData(indices,values), lk::RuntimeError);
+	// Adopting replaces any compressed representation.
+	lk::CovarianceMatrix matrix(*cov);
+	BOOST_CHECK(matrix.compress());
+	std::vector<double> diagonal((size*(size+1))/2,0), bad(diagonal);
+	for(int k = 0; k < size; ++k) diagonal[(k*(k+3))/2] = 2;
+	BOOST_CHECK_THROW(matrix.adoptCovariance(bad), lk::RuntimeError);
+	BOOST_CHECK(matrix.isCompressed());
+	matrix.adoptCovariance(diagonal);
+	BOOST_CHECK(!matrix.isCompressed());
+	BOOST_CHECK_CLOSE(matrix.getInverseCovariance(3,3), 0.5, 1e-8);
+	BOOST_CHECK_CLOSE(matrix.getLogDeterminant(), size*std::log(2.), 1e-8);
+}
+
+BOOST_AUTO_TEST_CASE( shouldViewSubsetOfBins ) {
+	lk::RandomPtr random(new lk::Random());
+	random->setSeed(22);
+	int size(8);
+	int order[8] = { 13, 4, 22, 9, 0, 17, 26, 5 };
+	lk::CovarianceMatrixPtr cov = lk::generateRandomCovariance(size,1,random);
+	lk::BinnedDataPtr parent(new lk::BinnedData(*grid));
+	for(int k = 0; k < size; ++k) parent->setData(order[k],random->getNormal());
+	for(int col = 0; col < size; ++col) {
+		for(int row = 0; row <= col; ++row) {
+			parent->setInverseCovariance(order[row],order[col],cov->getInverseCovariance(row,col));
+		}
+	}
+	// A view must give the same results as a pruned copy, in the same index order.
+	std::set<int> keep;
+	keep.insert(22); keep.insert(4); keep.insert(17); keep.insert(5);
+	lk::BinnedDataView view(parent,keep);
+	lk::BinnedData pruned(*parent);
+	pruned.prune(keep);
+	BOOST_CHECK_EQUAL(view.getNBinsWithData(), pruned.getNBinsWithData());
+	BOOST_CHECK(std::equal(view.begin(),view.end(),pruned.begin()));
+	std::vector<double> pred, parentPred;
+	for(int k = 0; k < view.getNBinsWithData(); ++k) {
+		BOOST_CHECK_EQUAL(view.getData(k), pruned.getData(pruned.getIndexAtOffset(k)));
+		pred.push_back(0.1*k);
+	}
+	BOOST_CHECK_CLOSE(view.chiSquare(pred), pruned.chiSquare(pred), 1e-8);
+	BOOST_CHECK_CLOSE(view.getLogDeterminant(), pruned.getCovarianceMatrix()->getLogDeterminant(), 1e-8);
+	// Predictions can also use the parent's index sequence.
+	for(lk::BinnedData::IndexIterator iter = parent->begin(); iter != parent->end(); ++iter) {
+		lk::BinnedDataView::IndexIterator found = std::find(view.begin(),view.end(),*iter);
+		parentPred.push_back(found == view.end() ? 99 : pred[found - view.begin()]);
+	}
+	BOOST_CHECK_CLOSE(view.chiSquare(parentPred,true), pruned.chiSquare(pred), 1e-8);
+	BOOST_CHECK_THROW(view.chiSquare(parentPred), lk::RuntimeError);
+	// Slice along the first axis, whose bin index is index/9.
+	lk::BinnedDataView slice(parent,0,1,1);
+	BOOST_CHECK_EQUAL(slice.getNBinsWithData(), 3);
+	for(lk::BinnedDataView::IndexIterator iter = slice.begin(); iter != slice.end(); ++iter) {
+		BOOST_CHECK_EQUAL(*iter/9, 1);
+	}
+	// A view keeps its own copy of the parent's data.
+	double viewed(view.getData(0));
+	parent->setData(*view.begin(),viewed+1);
+	BOOST_CHECK_EQUAL(view.getData(0), viewed);
+	// Bins without data cannot be viewed.
+	keep.insert(1);
+	BOOST_CHECK_THROW(lk::BinnedDataView(parent,keep), lk::RuntimeError);
+	BOOST_CHECK_THROW(lk::BinnedDataView(parent,1,3,3), lk::RuntimeError);
+}
+
+BOOST_AUTO_TEST_CASE( shouldViewStructuredCovariance ) {
+	lk::RandomPtr random(new lk::Random());
+	random->setSeed(23);
+	int size(12);
+	lk::AbsBinningCPtr axis(new lk::UniformBinning(0.,1.,size));
+	lk::BinnedDataPtr parent(new lk::BinnedData(lk::BinnedGrid(axis)));
+	std::vector<double> row(size);
+	for(int k = 0; k < size; ++k) {
+		parent->setData(k,random->getNormal());
+		row[k] = 2*std::exp(-k/3.);
+	}
+	boost::shared_ptr<lk::ToeplitzCovarianceMatrix> toeplitz(new lk::ToeplitzCovarianceMatrix(row));
+	lk::CovarianceMatrix dense(*toeplitz);
+	parent->setCovarianceMatrix(toeplitz);
+	// Reading a view's covariance does not unpack its parent's structured representation.
+	lk::BinnedDataView slice(parent,0,3,8);
+	lk::CovarianceMatrixCPtr cov = slice.getCovarianceMatrix();
+	BOOST_CHECK(toeplitz->isToeplitz());
+	BOOST_REQUIRE_EQUAL(cov->getSize(), 6);
+	for(int col = 0; col < 6; ++col) {
+		for(int row = 0; row <= col; ++row) {
+			BOOST_CHECK_CLOSE(cov->getCovariance(row,col), dense.getCovariance(row+3,col+3), 1e-8);
+		}
+	}
+}
+
+BOOST_AUTO_TEST_CASE( shouldResampleInParallel ) {
+	lk::RandomPtr random(new lk::Random());
+	random->setSeed(24);
+	int size(6), nobs(7);
+	lk::AbsBinningCPtr axis(new lk::UniformBinning(0.,1.,size));
+	lk::BinnedGrid line(axis);
+	lk::BinnedDataResampler resampler(false,random), scalar(true,random);
+	for(int obs = 0; obs < nobs; ++obs) {
+		lk::BinnedDataPtr data(new lk::BinnedData(line));
+		for(int k = 0; k < size; ++k) data->setData(k,random->getNormal());
+		data->setCovarianceMatrix(lk::generateRandomCovariance(size,1,random));
+		resampler.addObservation(data);
+		scalar.addObservation(data);
+	}
+	// Bootstrap results only depend on the seed, using enough samples to need several chunks
+	// of work for each thread.
+	int nSamples(150);
+	lk::CovarianceAccumulatorPtr serial = resampler.accumulateBootstrap(nSamples,7,1);
+	lk::CovarianceAccumulatorPtr parallel = resampler.accumulateBootstrap(nSamples,7,4);
+	BOOST_CHECK_EQUAL(serial->count(), nSamples);
+	BOOST_CHECK_EQUAL(parallel->count(), nSamples);
+	lk::CovarianceMatrixPtr C1 = serial->getCovariance(), C2 = parallel->getCovariance();
+	for(int k = 0; k < size; ++k) {
+		for(int j = 0; j <= k; ++j) BOOST_CHECK_EQUAL(C1->getCovariance(k,j), C2->getCovariance(k,j));
+	}
+	BOOST_CHECK(resampler.accumulateBootstrap(nSamples,8)->getCovariance()->getCovariance(0,0) !=
+		C1->getCovariance(0,0));
+	// Jackknife results match the serial jackknife samples.
+	lk::CovarianceAccumulatorPtr jackknife = resampler.accumulateJackknife(2,0,4);
+	lk::CovarianceAccumulator expected(size);
+	lk::BinnedDataPtr sample;
+	unsigned long seqno(0);
+	while((sample = resampler.jackknife(2,seqno++))) expected.accumulate(sample);
+	BOOST_CHECK_EQUAL(jackknife->count(), 21);
+	BOOST_CHECK_EQUAL(expected.count(), 21);
+	lk::CovarianceMatrixPtr C3 = jackknife->getCovariance(), C4 = expected.getCovariance();
+	for(int k = 0; k < size; ++k) BOOST_CHECK_CLOSE(C3->getCovariance(k,size-1), C4->getCovariance(k,size-1), 1e-6);
+	BOOST_CHECK_EQUAL(resampler.accumulateJackknife(1,3)->count(), 3);
+	// Observations stored with scalar weights are also added concurrently, even after one
+	// of them has been unweighted by reading its data.
+	BOOST_CHECK(scalar.getObservation(0)->getData(0) != 0);
+	lk::CovarianceMatrixPtr C5 = scalar.accumulateBootstrap(nSamples,7,1)->getCovariance();
+	lk::CovarianceMatrixPtr C6 = scalar.accumulateBootstrap(nSamples,7,4)->getCovariance();
+	for(int k = 0; k < size; ++k) BOOST_CHECK_EQUAL(C5->getCovariance(k,0), C6->getCovariance(k,0));
+	lk::CovarianceMatrixPtr C7 = scalar.accumulateJackknife(1,0,4)->getCovariance();
+	BOOST_CHECK_EQUAL(scalar.accumulateJackknife(1,0,1)->getCovariance()->getCovariance(2,1),
+		C7->getCovariance(2,1));
+	BOOST_CHECK_THROW(resampler.accumulateJackknife(nobs), lk::RuntimeError);
+	BOOST_CHECK_THROW(resampler.accumulateBootstrap(0,1), lk::RuntimeError);
+}
+
+BOOST_AUTO_TEST_CASE( shouldJackknifeBySubtraction ) {
+	lk::RandomPtr random(new lk::Random());
+	random->setSeed(25);
+	int size(5), nobs(6);
+	lk::AbsBinningCPtr axis(new lk::UniformBinning(0.,1.,size));
+	lk::BinnedGrid line(axis);
+	lk::BinnedDataResampler resampler(false,random);
+	for(int obs = 0; obs < nobs; ++obs) {
+		lk::BinnedDataPtr data(new lk::BinnedData(line));
+		for(int k = 0; k < size; ++k) data->setData(k,random->getNormal());
+		data->setCovarianceMatrix(lk::generateRandomCovariance(size,1,random));
+		resampler.addObservation(data);
+	}
+	// Compare each delete-one sample with the sum of the observations that it keeps.
+	for(int seqno = 0; seqno < nobs; ++seqno) {
+		lk::BinnedDataPtr sample = resampler.jackknife(1,seqno);
+		std::vector<int> subset(nobs-1);
+		BOOST_REQUIRE(lk::getSubset(nobs,seqno,subset));
+		lk::BinnedData expected(line);
+		for(int k = 0; k < nobs-1; ++k) expected += *resampler.getObservation(subset[k]);
+		for(int k = 0; k < size; ++k) {
+			BOOST_CHECK_CLOSE(sample->getData(k), expected.getData(k), 1e-6);
+			BOOST_CHECK_CLOSE(sample->getInverseCovariance(k,0), expected.getInverseCovariance(k,0), 1e-6);
+		}
+	}
+	// Dropping most observations adds the kept ones instead.
+	lk::BinnedDataPtr single = resampler.jackknife(nobs-1,2);
+	BOOST_CHECK_CLOSE(single->getData(3), resampler.getObservation(2)->getData(3), 1e-6);
+	// Subtracting the same covariance that was added restores the original inverse.
+	lk::CovarianceMatrixPtr A = lk::generateRandomCovariance(size,1,random);
+	lk::CovarianceMatrix sum(*A);
+	sum.addInverse(*A,3);
+	sum.subtractInverse(*A,2);
+	BOOST_CHECK_CLOSE(sum.getInverseCovariance(1,4), 2*A->getInverseCovariance(1,4), 1e-8);
+	BOOST_CHECK_CLOSE(sum.getLogDeterminant(), A->getLogDeterminant() - size*std::log(2.), 1e-8);
+	BOOST_CHECK_THROW(sum.addInverse(*A,-1), lk::RuntimeError);
+	// Subtracting too much is detected by the next decomposition.
+	sum.subtractInverse(*A,2);
+	BOOST_CHECK(!sum.isPositiveDefinite());
+	lk::BinnedDataPtr first = resampler.getObservationCopy(0,false);
+	first->cloneCovariance();
+	first->add(*resampler.getObservation(0),-2);
+	BOOST_CHECK_THROW(first->getData(0), lk::RuntimeError);
+	BOOST_CHECK_THROW(lk::BinnedData(line).add(*first,-1), lk::RuntimeError);
+	// A subtracted sample has already been checked, which leaves its covariance and inverse
+	// covariance both available.
+	BOOST_CHECK_EQUAL(resampler.jackknife(1,0)->getCovarianceMatrix()->getMemoryState().substr(0,3), "[MI");
+}
+
 // clone, =, swap
 // +=, add
 // isCongruent
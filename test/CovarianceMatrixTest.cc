@@ -7,6 +7,11 @@
 #include "likely/likely.h"
 namespace lk = likely;
 
+#include <cstdio>
+#include <cmath>
+#include <algorithm>
+#include <sstream>
+
 struct CovarianceMatrixFixture
 {
     CovarianceMatrixFixture() {
@@ -70,4 +75,697 @@ BOOST_AUTO_TEST_CASE( shouldMultiplyVectorByCovaraianceMatrix ) {
 	
 }
 
+BOOST_AUTO_TEST_CASE( shouldAddInverseColumns ) {
+	int bigSize(40);
+	lk::RandomPtr random(new lk::Random());
+	random->setSeed(19);
+	lk::CovarianceMatrixPtr big = lk::generateRandomCovariance(bigSize,1,random);
+	// Adding weighted columns matches multiplying a sparse vector, including a repeated column.
+	std::vector<int> offsets;
+	std::vector<double> weights, vec(bigSize,1), sparse(bigSize,0);
+	offsets.push_back(0); offsets.push_back(17); offsets.push_back(39); offsets.push_back(17);
+	for(int a = 0; a < offsets.size(); ++a) {
+		weights.push_back(random->getNormal());
+		sparse[offsets[a]] += weights[a];
+	}
+	big->addInverseColumns(offsets,weights,vec);
+	big->multiplyByInverseCovariance(sparse);
+	for(int j = 0; j < bigSize; ++j) BOOST_CHECK_CLOSE(vec[j], 1 + sparse[j], 1e-8);
+	offsets[0] = bigSize;
+	BOOST_CHECK_THROW(big->addInverseColumns(offsets,weights,vec), lk::RuntimeError);
+}
+
+BOOST_AUTO_TEST_CASE( shouldCalculateBatchedChiSquare ) {
+	// Use a size that spans several blocks of the triangular solver.
+	int bigSize(150), nvec(5);
+	lk::RandomPtr random(new lk::Random());
+	random->setSeed(123);
+	lk::CovarianceMatrixPtr big = lk::generateRandomCovariance(bigSize,1,random);
+	std::vector<double> deltas(nvec*bigSize), chi2;
+	for(int k = 0; k < deltas.size(); ++k) deltas[k] = random->getNormal();
+	big->chiSquare(deltas,chi2);
+	BOOST_REQUIRE_EQUAL(chi2.size(), nvec);
+	for(int n = 0; n < nvec; ++n) {
+		std::vector<double> delta(deltas.begin()+n*bigSize,deltas.begin()+(n+1)*bigSize);
+		BOOST_CHECK_CLOSE(chi2[n], big->chiSquare(delta), 1e-6);
+	}
+	BOOST_CHECK_THROW(big->chiSquare(std::vector<double>(bigSize+1),chi2), lk::RuntimeError);
+}
+
+BOOST_AUTO_TEST_CASE( shouldMatchPackedAndBlockedDecompositions ) {
+	int bigSize(100);
+	lk::RandomPtr random(new lk::Random());
+	random->setSeed(321);
+	lk::CovarianceMatrixPtr big = lk::generateRandomCovariance(bigSize,1,random);
+	std::vector<double> packed;
+	for(int col = 0; col < bigSize; ++col) {
+		for(int row = 0; row <= col; ++row) packed.push_back(big->getCovariance(row,col));
+	}
+	int saveThreshold = lk::getBlockedDecompositionThreshold();
+	std::vector<double> unblocked(packed), blocked(packed);
+	lk::setBlockedDecompositionThreshold(0);
+	double logdet1 = lk::choleskyDecompose(unblocked);
+	lk::invertCholesky(unblocked);
+	lk::setBlockedDecompositionThreshold(bigSize);
+	double logdet2 = lk::choleskyDecompose(blocked);
+	lk::invertCholesky(blocked);
+	lk::setBlockedDecompositionThreshold(saveThreshold);
+	BOOST_CHECK_SMALL(logdet1 - logdet2, 1e-8);
+	for(int index = 0; index < packed.size(); ++index) {
+		BOOST_CHECK_SMALL(unblocked[index] - blocked[index], 1e-8);
+	}
+	BOOST_CHECK_THROW(lk::setBlockedDecompositionThreshold(-1), lk::RuntimeError);
+}
+
+BOOST_AUTO_TEST_CASE( shouldUpdateCholeskyForLowRankInverseChanges ) {
+	int bigSize(20), rank(2);
+	lk::RandomPtr random(new lk::Random());
+	random->setSeed(456);
+	lk::CovarianceMatrixPtr big = lk::generateRandomCovariance(bigSize,1,random);
+	std::vector<double> W(rank*bigSize), delta(bigSize), chi2;
+	for(int k = 0; k < W.size(); ++k) W[k] = 0.1*random->getNormal();
+	for(int k = 0; k < bigSize; ++k) delta[k] = random->getNormal();
+	// Build the expected result from scratch.
+	lk::CovarianceMatrix expected(bigSize);
+	for(int col = 0; col < bigSize; ++col) {
+		for(int row = 0; row <= col; ++row) {
+			double value = big->getInverseCovariance(row,col);
+			for(int k = 0; k < rank; ++k) value += W[k*bigSize+row]*W[k*bigSize+col];
+			expected.setInverseCovariance(row,col,value);
+		}
+	}
+	// Make sure that the covariance, its Cholesky decomposition and determinant are cached.
+	big->getLogDeterminant();
+	big->chiSquare(delta,chi2);
+	big->addInverseLowRank(W);
+	BOOST_CHECK_CLOSE(big->getLogDeterminant(), expected.getLogDeterminant(), 1e-6);
+	big->chiSquare(delta,chi2);
+	BOOST_CHECK_CLOSE(chi2[0], expected.chiSquare(delta), 1e-6);
+	BOOST_CHECK_SMALL(big->getCovariance(3,7) - expected.getCovariance(3,7), 1e-10);
+	// Subtracting the same vectors should restore the original matrix.
+	big->addInverseLowRank(W,true);
+	BOOST_CHECK_SMALL(big->getLogDeterminant(), 1e-8);
+	// Subtracting too much should fail without changing anything.
+	for(int k = 0; k < W.size(); ++k) W[k] *= 100;
+	BOOST_CHECK_THROW(big->addInverseLowRank(W,true), lk::RuntimeError);
+	BOOST_CHECK_SMALL(big->getLogDeterminant(), 1e-8);
+	// The same applies to a matrix that only has an inverse covariance.
+	lk::CovarianceMatrix inverse(bigSize);
+	for(int col = 0; col < bigSize; ++col) {
+		for(int row = 0; row <= col; ++row) {
+			inverse.setInverseCovariance(row,col,expected.getInverseCovariance(row,col));
+		}
+	}
+	BOOST_CHECK_THROW(inverse.addInverseLowRank(W,true), lk::RuntimeError);
+	for(int k = 0; k < bigSize; ++k) {
+		BOOST_CHECK_EQUAL(inverse.getInverseCovariance(k,3), expected.getInverseCovariance(k,3));
+	}
+	for(int k = 0; k < W.size(); ++k) W[k] /= 100;
+	inverse.addInverseLowRank(W,true);
+	BOOST_CHECK_SMALL(inverse.getLogDeterminant(), 1e-8);
+}
+
+BOOST_AUTO_TEST_CASE( shouldPruneCachedRepresentations ) {
+	int bigSize(30);
+	lk::RandomPtr random(new lk::Random());
+	random->setSeed(789);
+	lk::CovarianceMatrixPtr big = lk::generateRandomCovariance(bigSize,2,random);
+	std::set<int> keep;
+	for(int k = 0; k < bigSize; k += 3) keep.insert(k);
+	keep.insert(bigSize-1);
+	int newSize(keep.size());
+	// Build the expected pruned matrix from scratch.
+	lk::CovarianceMatrix expected(newSize);
+	int newCol(0);
+	for(std::set<int>::const_iterator col = keep.begin(); col != keep.end(); ++col, ++newCol) {
+		int newRow(0);
+		for(std::set<int>::const_iterator row = keep.begin(); row != col; ++row, ++newRow) {
+			expected.setCovariance(newRow,newCol,big->getCovariance(*row,*col));
+		}
+		expected.setCovariance(newCol,newCol,big->getCovariance(*col,*col));
+	}
+	// Prune a copy that only has its inverse covariance in memory.
+	lk::CovarianceMatrix inverseOnly(bigSize);
+	for(int col = 0; col < bigSize; ++col) {
+		for(int row = 0; row <= col; ++row) {
+			inverseOnly.setInverseCovariance(row,col,big->getInverseCovariance(row,col));
+		}
+	}
+	inverseOnly.getLogDeterminant();
+	inverseOnly.prune(keep);
+	// Prune the original with its covariance, inverse and Cholesky decomposition in memory.
+	std::vector<double> delta(newSize), chi2;
+	for(int k = 0; k < newSize; ++k) delta[k] = random->getNormal();
+	big->getLogDeterminant();
+	big->sample(1,random);
+	big->prune(keep);
+	BOOST_REQUIRE_EQUAL(big->getSize(), newSize);
+	BOOST_CHECK_CLOSE(big->getLogDeterminant(), expected.getLogDeterminant(), 1e-6);
+	BOOST_CHECK_CLOSE(inverseOnly.getLogDeterminant(), expected.getLogDeterminant(), 1e-6);
+	big->chiSquare(delta,chi2);
+	BOOST_CHECK_CLOSE(chi2[0], expected.chiSquare(delta), 1e-6);
+	for(int col = 0; col < newSize; ++col) {
+		for(int row = 0; row <= col; ++row) {
+			double value = expected.getInverseCovariance(row,col);
+			BOOST_CHECK_SMALL(big->getInverseCovariance(row,col) - value, 1e-8);
+			BOOST_CHECK_SMALL(inverseOnly.getInverseCovariance(row,col) - value, 1e-8);
+		}
+	}
+	std::set<int> bad;
+	bad.insert(newSize);
+	BOOST_CHECK_THROW(big->prune(bad), lk::RuntimeError);
+}
+
+BOOST_AUTO_TEST_CASE( shouldRecordTelemetry ) {
+	typedef lk::CovarianceTelemetry T;
+	int size(20);
+	lk::RandomPtr random(new lk::Random());
+	random->setSeed(975);
+	lk::CovarianceMatrix matrix(*lk::generateRandomCovariance(size,1,random));
+	matrix.resetTelemetry();
+	long global(lk::getGlobalCovarianceTelemetry().getTotalCount());
+	// Reading the inverse decomposes and inverts the covariance, but only once.
+	matrix.getInverseCovariance(0,1);
+	matrix.getInverseCovariance(1,2);
+	matrix.getLogDeterminant();
+	T telemetry = matrix.getTelemetry();
+	BOOST_CHECK_EQUAL(telemetry.getCount(T::Inversion), 1);
+	BOOST_CHECK_EQUAL(telemetry.getCount(T::Decomposition), 0);
+	BOOST_CHECK(telemetry.getBytesAllocated(T::Inversion) >= sizeof(double)*(size*(size+1))/2);
+	// Going back to the covariance after compression requires decompressing and inverting.
+	BOOST_CHECK(matrix.compress());
+	matrix.getCovariance(0,1);
+	std::vector<double> values, vectors;
+	matrix.getEigenModes(2,values,vectors);
+	telemetry = matrix.getTelemetry();
+	BOOST_CHECK_EQUAL(telemetry.getCount(T::Compression), 1);
+	BOOST_CHECK_EQUAL(telemetry.getCount(T::Decompression), 1);
+	BOOST_CHECK_EQUAL(telemetry.getCount(T::Inversion), 2);
+	BOOST_CHECK_EQUAL(telemetry.getCount(T::EigenSolve), 1);
+	BOOST_CHECK_EQUAL(telemetry.getTotalCount(), 5);
+	BOOST_CHECK(telemetry.getTotalSeconds() >= 0);
+	BOOST_CHECK(lk::getGlobalCovarianceTelemetry().getTotalCount() >= global + 5);
+	std::ostringstream dump;
+	telemetry.printToStream(dump);
+	BOOST_CHECK(dump.str().find("decompression") != std::string::npos);
+	matrix.resetTelemetry();
+	BOOST_CHECK_EQUAL(matrix.getTelemetry().getTotalCount(), 0);
+	BOOST_CHECK_THROW(telemetry.getCount(T::NTransitions), lk::RuntimeError);
+}
+
+BOOST_AUTO_TEST_CASE( shouldMatchPackedKernels ) {
+	// Use an odd size so that every kernel has a remainder loop.
+	int size(37), nvec(3);
+	lk::RandomPtr random(new lk::Random());
+	random->setSeed(135);
+	lk::CovarianceMatrixPtr cov = lk::generateRandomCovariance(size,1,random);
+	std::vector<double> packed((size*(size+1))/2), cholesky;
+	for(int col = 0; col < size; ++col) {
+		for(int row = 0; row <= col; ++row) {
+			packed[lk::symmetricMatrixIndex(row,col,size)] = cov->getCovariance(row,col);
+		}
+	}
+	cholesky = packed;
+	lk::choleskyDecompose(cholesky,size);
+	std::vector<double> x(nvec*size), solved(x), product(size), full(size*size), repacked(packed);
+	for(int k = 0; k < nvec*size; ++k) x[k] = random->getNormal();
+	std::vector<double> vector(x.begin(),x.begin()+size);
+	cov->multiplyByCovariance(vector);
+	lk::SimdLevel best = lk::getSimdLevel();
+	for(int level = lk::NoSimd; level <= best; ++level) {
+		BOOST_CHECK_EQUAL(lk::setSimdLevel((lk::SimdLevel)level), level);
+		BOOST_CHECK_CLOSE(lk::dotProduct(&x[0],&x[size],size), lk::dotProduct(&x[size],&x[0],size), 1e-10);
+		lk::packedSymmetricMultiply(&packed[0],&x[0],&product[0],size);
+		for(int j = 0; j < size; ++j) BOOST_CHECK_SMALL(product[j] - vector[j], 1e-10);
+		// Solving Ut.U.y = x then multiplying by C should recover x.
+		solved = x;
+		lk::packedTriangularSolve(&cholesky[0],&solved[0],nvec,true,size);
+		lk::packedTriangularSolve(&cholesky[0],&solved[0],nvec,false,size);
+		for(int n = 0; n < nvec; ++n) {
+			lk::packedSymmetricMultiply(&packed[0],&solved[n*size],&product[0],size);
+			for(int j = 0; j < size; ++j) BOOST_CHECK_SMALL(product[j] - x[n*size+j], 1e-8);
+		}
+		lk::unpackSymmetricMatrix(&packed[0],&full[0],size);
+		BOOST_CHECK_EQUAL(full[3*size+5], full[5*size+3]);
+		lk::packSymmetricMatrix(&full[0],&repacked[0],size);
+		BOOST_CHECK(repacked == packed);
+	}
+	BOOST_CHECK_EQUAL(lk::setSimdLevel(lk::SimdAVX512), best);
+}
+
+BOOST_AUTO_TEST_CASE( shouldCacheEigenModes ) {
+	int size(40), nmodes(5);
+	lk::RandomPtr random(new lk::Random());
+	random->setSeed(246);
+	lk::CovarianceMatrixPtr cov = lk::generateRandomCovariance(size,2,random);
+	lk::CovarianceMatrix copy(*cov);
+	std::vector<double> values, vectors, cached, unused, partial, partialVectors;
+	// Partial solutions are consistent with a full solution.
+	copy.getEigenModes(nmodes,partial,partialVectors);
+	BOOST_REQUIRE_EQUAL(partial.size(), nmodes);
+	BOOST_REQUIRE_EQUAL(partialVectors.size(), nmodes*size);
+	BOOST_CHECK_EQUAL(copy.getMemoryState()[8], 'E');
+	cov->getEigenModes(values,vectors);
+	for(int k = 0; k < nmodes; ++k) {
+		BOOST_CHECK_CLOSE(partial[k], values[k], 1e-8);
+		// Eigenvectors are only defined up to a sign.
+		double dotprod(0);
+		for(int j = 0; j < size; ++j) dotprod += partialVectors[k*size+j]*vectors[k*size+j];
+		BOOST_CHECK_CLOSE(std::fabs(dotprod), 1, 1e-6);
+	}
+	copy.getEigenModes(-nmodes,partial,partialVectors);
+	for(int k = 0; k < nmodes; ++k) BOOST_CHECK_CLOSE(partial[k], values[size-nmodes+k], 1e-8);
+	BOOST_CHECK_THROW(copy.getEigenModes(size+1,partial,partialVectors), lk::RuntimeError);
+	// Cached modes are updated by a scale factor and dropped by any other change.
+	cov->applyScaleFactor(2);
+	cov->getEigenModes(cached,unused);
+	for(int k = 0; k < size; ++k) BOOST_CHECK_CLOSE(cached[k], values[k]/2, 1e-8);
+	cov->setCovariance(0,0,cov->getCovariance(0,0));
+	BOOST_CHECK_EQUAL(cov->getMemoryState()[8], '-');
+	// Rescaled eigenvalues are cached in order and match a new solution.
+	std::vector<double> scales(size);
+	for(int k = 0; k < size; ++k) scales[k] = 1 + 0.5*random->getUniform();
+	copy.rescaleEigenvalues(scales);
+	copy.getEigenModes(cached,unused);
+	lk::CovarianceMatrix rescaled(copy);
+	rescaled.setInverseCovariance(0,0,rescaled.getInverseCovariance(0,0));
+	rescaled.getEigenModes(values,vectors);
+	for(int k = 0; k < size; ++k) BOOST_CHECK_CLOSE(cached[k], values[k], 1e-6);
+	std::vector<double> delta(size), chi2modes;
+	for(int k = 0; k < size; ++k) delta[k] = random->getNormal();
+	BOOST_CHECK_CLOSE(copy.chiSquareModes(delta,values,vectors,chi2modes), copy.chiSquare(delta), 1e-6);
+}
+
+BOOST_AUTO_TEST_CASE( shouldUseLowRankRepresentation ) {
+	int size(60), rank(3);
+	lk::RandomPtr random(new lk::Random());
+	random->setSeed(5);
+	std::vector<double> diagonal(size), modes(size*rank), delta(size);
+	for(int j = 0; j < size; ++j) diagonal[j] = 0.5 + random->getUniform();
+	for(int k = 0; k < size*rank; ++k) modes[k] = random->getNormal();
+	for(int j = 0; j < size; ++j) delta[j] = random->getNormal();
+	lk::LowRankCovarianceMatrix lowRank(diagonal,modes);
+	BOOST_REQUIRE_EQUAL(lowRank.getRank(), rank);
+	// Copying into a plain CovarianceMatrix creates an equivalent dense matrix.
+	lk::CovarianceMatrix dense(lowRank);
+	BOOST_REQUIRE(lowRank.isLowRank());
+	BOOST_CHECK_CLOSE(lowRank.getLogDeterminant(), dense.getLogDeterminant(), 1e-8);
+	BOOST_CHECK_CLOSE(lowRank.chiSquare(delta), dense.chiSquare(delta), 1e-8);
+	std::vector<double> v1(delta), v2(delta);
+	lowRank.multiplyByInverseCovariance(v1);
+	dense.multiplyByInverseCovariance(v2);
+	for(int j = 0; j < size; ++j) BOOST_CHECK_SMALL(v1[j] - v2[j], 1e-10);
+	v1 = delta; v2 = delta;
+	lowRank.multiplyByCovariance(v1);
+	dense.multiplyByCovariance(v2);
+	for(int j = 0; j < size; ++j) BOOST_CHECK_SMALL(v1[j] - v2[j], 1e-10);
+	std::vector<double> sampled;
+	double nll = lowRank.sample(sampled,random);
+	BOOST_CHECK_CLOSE(2*nll, dense.chiSquare(sampled), 1e-8);
+	// A BinnedData chi-square uses the low-rank representation.
+	lk::AbsBinningCPtr axis(new lk::UniformBinning(0.,1.,size));
+	lk::BinnedData data((lk::BinnedGrid(axis)));
+	for(int j = 0; j < size; ++j) data.setData(j,0);
+	lk::CovarianceMatrixPtr shared(lowRank.clone());
+	data.setCovarianceMatrix(shared);
+	BOOST_CHECK_CLOSE(data.chiSquare(delta), dense.chiSquare(delta), 1e-8);
+	BOOST_CHECK(boost::dynamic_pointer_cast<lk::LowRankCovarianceMatrix>(shared)->isLowRank());
+	// Changing an element switches to the dense representation.
+	double value = dense.getCovariance(0,0) + 1;
+	lowRank.setCovariance(0,0,value);
+	BOOST_CHECK(!lowRank.isLowRank());
+	dense.setCovariance(0,0,value);
+	BOOST_CHECK_CLOSE(lowRank.chiSquare(delta), dense.chiSquare(delta), 1e-8);
+}
+
+BOOST_AUTO_TEST_CASE( shouldUseBlockDiagonalRepresentation ) {
+	lk::RandomPtr random(new lk::Random());
+	random->setSeed(6);
+	int sizes[3] = { 20, 35, 10 }, size(65);
+	// Build an equivalent dense matrix with three uncorrelated blocks.
+	lk::CovarianceMatrix dense(size);
+	int start(0);
+	for(int b = 0; b < 3; ++b) {
+		lk::CovarianceMatrixPtr block = lk::generateRandomCovariance(sizes[b],1+b,random);
+		for(int col = 0; col < sizes[b]; ++col) {
+			for(int row = 0; row <= col; ++row) {
+				dense.setCovariance(start+row,start+col,block->getCovariance(row,col));
+			}
+		}
+		start += sizes[b];
+	}
+	std::vector<int> found;
+	dense.getBlockSizes(found);
+	BOOST_REQUIRE_EQUAL(found.size(), 3);
+	for(int b = 0; b < 3; ++b) BOOST_CHECK_EQUAL(found[b], sizes[b]);
+	lk::BlockDiagonalCovarianceMatrix blocks(dense);
+	BOOST_REQUIRE_EQUAL(blocks.getNBlocks(), 3);
+	// Compare with the dense results.
+	int nvec(4);
+	std::vector<double> deltas(nvec*size), chi2, expected;
+	for(int k = 0; k < nvec*size; ++k) deltas[k] = random->getNormal();
+	std::vector<double> delta(deltas.begin(),deltas.begin()+size);
+	BOOST_CHECK_CLOSE(blocks.getLogDeterminant(), dense.getLogDeterminant(), 1e-8);
+	blocks.chiSquare(deltas,chi2);
+	dense.chiSquare(deltas,expected);
+	for(int n = 0; n < nvec; ++n) BOOST_CHECK_CLOSE(chi2[n], expected[n], 1e-8);
+	std::vector<double> v1(delta), v2(delta);
+	blocks.multiplyByInverseCovariance(v1);
+	dense.multiplyByInverseCovariance(v2);
+	for(int j = 0; j < size; ++j) BOOST_CHECK_CLOSE(v1[j], v2[j], 1e-4);
+	std::vector<double> values1, vectors1, values2, vectors2;
+	blocks.getEigenModes(values1,vectors1);
+	dense.getEigenModes(values2,vectors2);
+	for(int j = 0; j < size; ++j) BOOST_CHECK_CLOSE(values1[j], values2[j], 1e-8);
+	std::vector<double> sampled;
+	double nll = blocks.sample(sampled,random);
+	BOOST_CHECK_CLOSE(2*nll, dense.chiSquare(sampled), 1e-8);
+	BOOST_CHECK(blocks.isBlockDiagonal());
+	// Compressing the dense matrix stores each block without indices.
+	BOOST_CHECK(dense.compress());
+	BOOST_CHECK_EQUAL(dense.getMemoryState().substr(0,8), "[---LD-V");
+	dense.getBlockSizes(found);
+	BOOST_CHECK_EQUAL(found.size(), 3);
+	lk::CovarianceMatrix sum(size);
+	for(int k = 0; k < size; ++k) sum.setInverseCovariance(k,k,1);
+	sum.addInverse(dense);
+	// Blocks can also be extracted from a decompressed inverse covariance.
+	lk::BlockDiagonalCovarianceMatrix fromInverse(dense);
+	BOOST_CHECK_CLOSE(fromInverse.chiSquare(delta), blocks.chiSquare(delta), 1e-8);
+	BOOST_CHECK_CLOSE(sum.getInverseCovariance(3,7), dense.getInverseCovariance(3,7), 1e-8);
+	BOOST_CHECK_CLOSE(sum.getInverseCovariance(8,8), 1 + dense.getInverseCovariance(8,8), 1e-8);
+	BOOST_CHECK_EQUAL(sum.getInverseCovariance(3,30), 0);
+}
+
+BOOST_AUTO_TEST_CASE( shouldReadMappedBinaryFile ) {
+	int size(80);
+	lk::RandomPtr random(new lk::Random());
+	random->setSeed(7);
+	lk::CovarianceMatrixPtr original = lk::generateRandomCovariance(size,2,random);
+	std::vector<double> delta(size);
+	for(int k = 0; k < size; ++k) delta[k] = random->getNormal();
+	double chi2 = original->chiSquare(delta);
+	std::string filename("likelycheck-mapped.bin");
+	original->saveBinary(filename);
+	{
+		lk::CovarianceMatrixPtr mapped = lk::createMappedCovariance(filename);
+		BOOST_CHECK(boost::dynamic_pointer_cast<lk::MappedCovarianceMatrix>(mapped)->isMapped());
+		BOOST_CHECK_CLOSE(mapped->chiSquare(delta), chi2, 1e-8);
+		BOOST_CHECK_CLOSE(mapped->getLogDeterminant(), original->getLogDeterminant(), 1e-8);
+		std::vector<double> v1(delta), v2(delta);
+		mapped->multiplyByCovariance(v1);
+		original->multiplyByCovariance(v2);
+		for(int k = 0; k < size; ++k) BOOST_CHECK_CLOSE(v1[k], v2[k], 1e-8);
+		// Changes are made to a private copy of the mapped elements.
+		mapped->setCovariance(0,0,2*original->getCovariance(0,0));
+		BOOST_CHECK(!boost::dynamic_pointer_cast<lk::MappedCovarianceMatrix>(mapped)->isMapped());
+		BOOST_CHECK_CLOSE(mapped->getCovariance(0,1), original->getCovariance(0,1), 1e-8);
+	}
+	// A file with only the inverse covariance still supports chi-square calculations.
+	lk::CovarianceMatrix inverse(size);
+	for(int col = 0; col < size; ++col) {
+		for(int row = 0; row <= col; ++row) {
+			inverse.setInverseCovariance(row,col,original->getInverseCovariance(row,col));
+		}
+	}
+	inverse.saveBinary(filename);
+	lk::CovarianceMatrixPtr mapped = lk::createMappedCovariance(filename);
+	BOOST_CHECK_CLOSE(mapped->chiSquare(delta), chi2, 1e-6);
+	BOOST_CHECK_CLOSE(mapped->getLogDeterminant(), original->getLogDeterminant(), 1e-6);
+	// Saving a structured matrix does not replace its structured representation.
+	std::vector<lk::CovarianceMatrixCPtr> factors;
+	factors.push_back(lk::generateRandomCovariance(4,1,random));
+	factors.push_back(lk::generateRandomCovariance(5,1,random));
+	lk::KroneckerCovarianceMatrix kron(factors);
+	lk::MappedFile open(filename);
+	kron.saveBinary(filename);
+	BOOST_CHECK(kron.isKronecker());
+	std::vector<double> small(delta.begin(),delta.begin()+20);
+	BOOST_CHECK_CLOSE(lk::createMappedCovariance(filename)->chiSquare(small), kron.chiSquare(small), 1e-6);
+	// Replacing a file does not change existing mappings of it.
+	BOOST_CHECK_EQUAL(open.getContents().size, size);
+	BOOST_CHECK_EQUAL(open.getContents().inverseCovariance[0], inverse.getInverseCovariance(0,0));
+	BOOST_CHECK_CLOSE(mapped->chiSquare(delta), chi2, 1e-6);
+	std::remove(filename.c_str());
+}
+
+BOOST_AUTO_TEST_CASE( shouldUseSinglePrecisionRepresentation ) {
+	int size(100), nvec(3);
+	lk::RandomPtr random(new lk::Random());
+	random->setSeed(8);
+	lk::CovarianceMatrixPtr original = lk::generateRandomCovariance(size,2,random);
+	lk::SinglePrecisionCovarianceMatrix single(*original);
+	BOOST_REQUIRE(single.isSinglePrecision());
+	BOOST_CHECK(single.getRoundingError() > 0 && single.getRoundingError() < 1e-7);
+	BOOST_CHECK(single.getMemoryUsage() < original->getMemoryUsage());
+	// Refined results agree with a dense matrix using the same rounded elements.
+	lk::CovarianceMatrix dense(single);
+	std::vector<double> deltas(nvec*size), chi2, expected;
+	for(int k = 0; k < nvec*size; ++k) deltas[k] = random->getNormal();
+	std::vector<double> delta(deltas.begin(),deltas.begin()+size);
+	single.chiSquare(deltas,chi2);
+	dense.chiSquare(deltas,expected);
+	for(int n = 0; n < nvec; ++n) BOOST_CHECK_CLOSE(chi2[n], expected[n], 1e-8);
+	BOOST_CHECK_CLOSE(single.getLogDeterminant(), dense.getLogDeterminant(), 1e-8);
+	std::vector<double> v1(delta), v2(delta);
+	single.multiplyByInverseCovariance(v1);
+	dense.multiplyByInverseCovariance(v2);
+	double vmax(0);
+	for(int j = 0; j < size; ++j) vmax = std::max(vmax,std::fabs(v2[j]));
+	for(int j = 0; j < size; ++j) BOOST_CHECK_SMALL(v1[j] - v2[j], 1e-8*vmax);
+	v1 = delta; v2 = delta;
+	single.multiplyByCovariance(v1);
+	dense.multiplyByCovariance(v2);
+	for(int j = 0; j < size; ++j) BOOST_CHECK_SMALL(v1[j] - v2[j], 1e-10);
+	std::vector<double> sampled;
+	double nll = single.sample(sampled,random);
+	BOOST_CHECK_CLOSE(2*nll, dense.chiSquare(sampled), 1e-3);
+	// A sparse matrix is compressed to its non-zero elements.
+	lk::CovarianceMatrix banded(size);
+	for(int k = 0; k < size; ++k) {
+		banded.setCovariance(k,k,2);
+		if(k > 0) banded.setCovariance(k-1,k,0.5);
+	}
+	lk::SinglePrecisionCovarianceMatrix sparse(banded);
+	std::size_t before(sparse.getMemoryUsage());
+	BOOST_CHECK(sparse.compress());
+	BOOST_CHECK(sparse.getMemoryUsage() < before/10);
+	BOOST_CHECK_CLOSE(sparse.chiSquare(delta), banded.chiSquare(delta), 1e-8);
+	// Elements outside the single-precision range are rejected.
+	BOOST_CHECK_THROW(lk::SinglePrecisionCovarianceMatrix(*lk::createDiagonalCovariance(size,1e40)),
+		lk::RuntimeError);
+	// Changing an element switches to the dense representation.
+	single.setCovariance(0,0,2*dense.getCovariance(0,0));
+	BOOST_CHECK(!single.isSinglePrecision());
+	dense.setCovariance(0,0,2*dense.getCovariance(0,0));
+	BOOST_CHECK_CLOSE(single.chiSquare(delta), dense.chiSquare(delta), 1e-8);
+}
+
+BOOST_AUTO_TEST_CASE( shouldUseToeplitzRepresentation ) {
+	int size(150);
+	lk::RandomPtr random(new lk::Random());
+	random->setSeed(9);
+	// Exponentially correlated stationary noise.
+	std::vector<double> row(size), delta(size);
+	for(int k = 0; k < size; ++k) row[k] = 2*std::exp(-k/5.);
+	for(int k = 0; k < size; ++k) delta[k] = random->getNormal();
+	lk::ToeplitzCovarianceMatrix toeplitz(row);
+	BOOST_REQUIRE(toeplitz.isToeplitz());
+	BOOST_CHECK_EQUAL(toeplitz.getEmbeddingSize(), 512);
+	BOOST_CHECK(toeplitz.canSample());
+	lk::CovarianceMatrix dense(toeplitz);
+	BOOST_CHECK_CLOSE(dense.getCovariance(3,10), row[7], 1e-12);
+	BOOST_CHECK_CLOSE(toeplitz.getLogDeterminant(), dense.getLogDeterminant(), 1e-8);
+	BOOST_CHECK_CLOSE(toeplitz.chiSquare(delta), dense.chiSquare(delta), 1e-6);
+	std::vector<double> v1(delta), v2(delta);
+	toeplitz.multiplyByInverseCovariance(v1);
+	dense.multiplyByInverseCovariance(v2);
+	for(int j = 0; j < size; ++j) BOOST_CHECK_SMALL(v1[j] - v2[j], 1e-6);
+	v1 = delta; v2 = delta;
+	toeplitz.multiplyByCovariance(v1);
+	dense.multiplyByCovariance(v2);
+	for(int j = 0; j < size; ++j) BOOST_CHECK_SMALL(v1[j] - v2[j], 1e-10);
+	std::vector<double> sampled;
+	double nll = toeplitz.sample(sampled,random);
+	BOOST_CHECK_CLOSE(2*nll, dense.chiSquare(sampled), 1e-6);
+	// Check the variance and nearest-neighbor covariance of many samples.
+	int nsample(4000);
+	boost::shared_array<double> samples = toeplitz.sample(nsample,random);
+	double var(0), cov1(0);
+	for(int n = 0; n < nsample; ++n) {
+		double const *s(samples.get() + n*size);
+		var += s[20]*s[20]/nsample;
+		cov1 += s[20]*s[21]/nsample;
+	}
+	BOOST_CHECK_SMALL(var - row[0], 0.3);
+	BOOST_CHECK_SMALL(cov1 - row[1], 0.3);
+	// A clone keeps the Toeplitz representation and changes switch to a dense representation.
+	lk::CovarianceMatrixPtr copy(toeplitz.clone());
+	BOOST_CHECK(boost::dynamic_pointer_cast<lk::ToeplitzCovarianceMatrix>(copy)->isToeplitz());
+	toeplitz.setCovariance(0,0,2*row[0]);
+	BOOST_CHECK(!toeplitz.isToeplitz());
+	BOOST_CHECK_THROW(lk::ToeplitzCovarianceMatrix(std::vector<double>()), lk::RuntimeError);
+}
+
+BOOST_AUTO_TEST_CASE( shouldUseSparseRepresentation ) {
+	int size(300);
+	lk::RandomPtr random(new lk::Random());
+	random->setSeed(12);
+	std::vector<double> delta(size);
+	for(int k = 0; k < size; ++k) delta[k] = random->getNormal();
+	// Build a tridiagonal inverse covariance and compress it.
+	lk::CovarianceMatrix dense(size);
+	for(int k = 0; k < size; ++k) {
+		dense.setInverseCovariance(k,k,2+0.01*k);
+		if(k > 0) dense.setInverseCovariance(k-1,k,-0.9);
+	}
+	double chi2 = dense.chiSquare(delta), logdet = dense.getLogDeterminant();
+	std::vector<double> expected(delta);
+	dense.multiplyByCovariance(expected);
+	BOOST_REQUIRE(dense.compress());
+	// The sparse matrix is built without uncompressing.
+	lk::SparseCovarianceMatrix sparse(dense);
+	BOOST_CHECK(dense.isCompressed());
+	BOOST_REQUIRE(sparse.isSparse());
+	BOOST_CHECK(sparse.isInverse());
+	BOOST_CHECK_EQUAL(sparse.getNNonZero(), 3*size-2);
+	BOOST_CHECK_CLOSE(sparse.chiSquare(delta), chi2, 1e-8);
+	std::vector<double> v1(delta);
+	sparse.multiplyByCovariance(v1);
+	for(int j = 0; j < size; ++j) BOOST_CHECK_SMALL(v1[j] - expected[j], 1e-7);
+	BOOST_CHECK_CLOSE(sparse.getLogDeterminant(), logdet, 1e-8);
+	BOOST_CHECK(sparse.getMemoryUsage() < sizeof(double)*size*size/10);
+	// A sparse covariance uses conjugate gradients for chi-squares.
+	std::vector<int> rows, cols;
+	std::vector<double> values;
+	lk::CovarianceMatrix banded(size);
+	for(int k = 0; k < size; ++k) {
+		rows.push_back(k); cols.push_back(k); values.push_back(1+0.1*(k%3));
+		banded.setCovariance(k,k,values.back());
+		if(k >= 2) {
+			rows.push_back(k-2); cols.push_back(k); values.push_back(0.3);
+			banded.setCovariance(k-2,k,0.3);
+		}
+	}
+	lk::SparseCovarianceMatrix sparseCov(size,rows,cols,values,false);
+	BOOST_CHECK(!sparseCov.isInverse());
+	BOOST_CHECK_CLOSE(sparseCov.chiSquare(delta), banded.chiSquare(delta), 1e-6);
+	BOOST_CHECK_CLOSE(sparseCov.getLogDeterminant(), banded.getLogDeterminant(), 1e-8);
+	// Iterations are capped.
+	lk::SparseCovarianceMatrix capped(size,rows,cols,values,false,1e-10,2);
+	BOOST_CHECK_THROW(capped.chiSquare(delta), lk::RuntimeError);
+	rows.push_back(size);
+	cols.push_back(0);
+	values.push_back(1);
+	BOOST_CHECK_THROW(lk::SparseCovarianceMatrix(size,rows,cols,values,false), lk::RuntimeError);
+	// Large products are split across threads.
+	int large(20000);
+	rows.clear(); cols.clear(); values.clear();
+	for(int k = 0; k < large; ++k) {
+		rows.push_back(k); cols.push_back(k); values.push_back(2+0.001*k);
+		if(k > 0) { rows.push_back(k-1); cols.push_back(k); values.push_back(-0.9); }
+	}
+	lk::SparseCovarianceMatrix parallel(large,rows,cols,values,true);
+	std::vector<double> x(large), y;
+	for(int k = 0; k < large; ++k) x[k] = random->getNormal();
+	y = x;
+	parallel.multiplyByInverseCovariance(y);
+	for(int k = 0; k < large; k += 997) {
+		double expectedk = (2+0.001*k)*x[k] - (k > 0 ? 0.9*x[k-1] : 0) - (k < large-1 ? 0.9*x[k+1] : 0);
+		BOOST_CHECK_CLOSE(y[k], expectedk, 1e-8);
+	}
+}
+
+BOOST_AUTO_TEST_CASE( shouldUseKroneckerRepresentation ) {
+	lk::RandomPtr random(new lk::Random());
+	random->setSeed(16);
+	int sizes[3] = { 4, 5, 3 }, size(60);
+	std::vector<lk::CovarianceMatrixCPtr> factors;
+	for(int k = 0; k < 3; ++k) factors.push_back(lk::generateRandomCovariance(sizes[k],1+k,random));
+	lk::KroneckerCovarianceMatrix kron(factors);
+	BOOST_REQUIRE(kron.isKronecker());
+	BOOST_CHECK_EQUAL(kron.getSize(), size);
+	BOOST_CHECK_EQUAL(kron.getNFactors(), 3);
+	// The copy constructor builds the equivalent dense matrix, with the last factor's
+	// index increasing fastest.
+	lk::CovarianceMatrix dense(kron);
+	BOOST_CHECK(kron.isKronecker());
+	BOOST_CHECK_CLOSE(dense.getCovariance(17,42), factors[0]->getCovariance(1,2)*
+		factors[1]->getCovariance(0,4)*factors[2]->getCovariance(2,0), 1e-8);
+	// Compare with the dense results.
+	int nvec(3);
+	std::vector<double> deltas(nvec*size), chi2, expected;
+	for(int k = 0; k < nvec*size; ++k) deltas[k] = random->getNormal();
+	std::vector<double> delta(deltas.begin(),deltas.begin()+size);
+	BOOST_CHECK_CLOSE(kron.getLogDeterminant(), dense.getLogDeterminant(), 1e-8);
+	kron.chiSquare(deltas,chi2);
+	dense.chiSquare(deltas,expected);
+	for(int n = 0; n < nvec; ++n) BOOST_CHECK_CLOSE(chi2[n], expected[n], 1e-8);
+	std::vector<double> v1(delta), v2(delta);
+	kron.multiplyByInverseCovariance(v1);
+	dense.multiplyByInverseCovariance(v2);
+	for(int j = 0; j < size; ++j) BOOST_CHECK_SMALL(v1[j] - v2[j], 1e-8);
+	std::vector<double> batch1(deltas), batch2(deltas);
+	kron.multiplyByInverseCovariance(&batch1[0],nvec);
+	dense.multiplyByInverseCovariance(&batch2[0],nvec);
+	for(int j = 0; j < nvec*size; ++j) BOOST_CHECK_SMALL(batch1[j] - batch2[j], 1e-8);
+	for(int j = 0; j < size; ++j) BOOST_CHECK_SMALL(batch2[j] - v2[j], 1e-8);
+	v1 = delta;
+	v2 = delta;
+	kron.multiplyByCovariance(v1);
+	dense.multiplyByCovariance(v2);
+	for(int j = 0; j < size; ++j) BOOST_CHECK_SMALL(v1[j] - v2[j], 1e-8);
+	std::vector<double> sampled;
+	double nll = kron.sample(sampled,random);
+	BOOST_CHECK_CLOSE(2*nll, dense.chiSquare(sampled), 1e-8);
+	boost::shared_array<double> samples = kron.sample(2000,random);
+	double sum(0);
+	for(int n = 0; n < 2000; ++n) sum += samples[n*size+17]*samples[n*size+42];
+	double error = std::sqrt(dense.getCovariance(17,17)*dense.getCovariance(42,42)/2000);
+	BOOST_CHECK_SMALL(sum/2000 - dense.getCovariance(17,42), 5*error);
+	BOOST_CHECK(!kron.compress());
+	BOOST_CHECK(kron.getMemoryUsage() < dense.getMemoryUsage());
+	lk::CovarianceMatrixPtr copy(kron.clone());
+	BOOST_CHECK(boost::dynamic_pointer_cast<lk::KroneckerCovarianceMatrix>(copy)->isKronecker());
+	BOOST_CHECK_EQUAL(copy->getLogDeterminant(), kron.getLogDeterminant());
+	BOOST_CHECK_EQUAL(copy->chiSquare(delta), kron.chiSquare(delta));
+	BOOST_CHECK_EQUAL(kron.getFactor(1)->getCovariance(0,4), factors[1]->getCovariance(0,4));
+	BOOST_CHECK_THROW(kron.getFactor(3), lk::RuntimeError);
+	// Binned data on a complete grid can use the factors directly.
+	std::vector<lk::AbsBinningCPtr> axes;
+	for(int k = 0; k < 3; ++k) axes.push_back(lk::AbsBinningCPtr(new lk::UniformBinning(0.,1.,sizes[k])));
+	lk::BinnedData data((lk::BinnedGrid(axes)));
+	for(int index = 0; index < size; ++index) data.setData(index,delta[index]);
+	std::vector<lk::CovarianceMatrixCPtr> wrong(factors.begin(),factors.begin()+2);
+	BOOST_CHECK_THROW(data.setSeparableCovariance(wrong), lk::RuntimeError);
+	data.setSeparableCovariance(factors);
+	std::vector<double> zero(size,0);
+	BOOST_CHECK_CLOSE(data.chiSquare(zero), expected[0], 1e-8);
+}
+
+BOOST_AUTO_TEST_CASE( shouldAddInverseCovariance ) {
+	lk::RandomPtr random(new lk::Random());
+	random->setSeed(23);
+	int size(12);
+	lk::CovarianceMatrixPtr A = lk::generateRandomCovariance(size,1,random);
+	lk::CovarianceMatrixPtr B = lk::generateRandomCovariance(size,1,random);
+	// Add a dense inverse, an inverse that must first be calculated, and a compressed inverse.
+	lk::CovarianceMatrix sum(*A), fromCov(size), compressed(*B);
+	for(int col = 0; col < size; ++col) {
+		for(int row = 0; row <= col; ++row) fromCov.setCovariance(row,col,B->getCovariance(row,col));
+	}
+	BOOST_CHECK(compressed.compress());
+	sum.addInverse(*B,2);
+	sum.addInverse(fromCov,0.5);
+	sum.addInverse(compressed,1.5);
+	BOOST_CHECK(compressed.isCompressed());
+	for(int col = 0; col < size; ++col) {
+		for(int row = 0; row <= col; ++row) {
+			double expected = A->getInverseCovariance(row,col) + 4*B->getInverseCovariance(row,col);
+			BOOST_CHECK_CLOSE(sum.getInverseCovariance(row,col), expected, 1e-8);
+		}
+	}
+	BOOST_CHECK_THROW(sum.addInverse(*B,0), lk::RuntimeError);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
\ No newline at end of file
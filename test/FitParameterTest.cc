@@ -52,6 +52,39 @@ BOOST_AUTO_TEST_CASE( shouldFormatAnyMagnitude ) {
 	BOOST_REQUIRE_EQUAL(lk::roundValueWithError(987654.321, errors), "987654 +/- 500 +/- 12");
 }
 
-
+BOOST_AUTO_TEST_CASE( shouldSetBatchedRandomParameters ) {
+	lk::FitParameters params;
+	params.push_back(lk::FitParameter("a",1,0.1));
+	params.push_back(lk::FitParameter("fixed",2));
+	params.push_back(lk::FitParameter("b",3,0.2));
+	lk::CovarianceMatrixPtr cov(new lk::CovarianceMatrix(2));
+	cov->setCovariance(0,0,0.01).setCovariance(1,1,0.04).setCovariance(0,1,0.012);
+	lk::FunctionMinimum fmin(0,params,cov);
+	lk::Parameters from(fmin.getParameters());
+	int nsample(5);
+	std::vector<lk::Parameters> to;
+	std::vector<double> nlWeights;
+	lk::Random::instance()->setSeed(10);
+	fmin.setRandomParameters(from,nsample,to,nlWeights);
+	BOOST_REQUIRE_EQUAL(to.size(), nsample);
+	BOOST_REQUIRE_EQUAL(nlWeights.size(), nsample);
+	// The same seed gives the same samples as repeated single-sample calls.
+	lk::Random::instance()->setSeed(10);
+	for(int k = 0; k < nsample; ++k) {
+		lk::Parameters single;
+		double nlWeight = fmin.setRandomParameters(from,single);
+		BOOST_CHECK_CLOSE(nlWeights[k], nlWeight, 1e-10);
+		for(int j = 0; j < 3; ++j) BOOST_CHECK_CLOSE(to[k][j], single[j], 1e-10);
+		// Only floating parameters are moved.
+		BOOST_CHECK_EQUAL(to[k][1], from[1]);
+		BOOST_CHECK(to[k][0] != from[0] && to[k][2] != from[2]);
+		// Each weight is half the chi-square of its offset.
+		std::vector<double> offset;
+		offset.push_back(to[k][0] - from[0]);
+		offset.push_back(to[k][2] - from[2]);
+		BOOST_CHECK_CLOSE(nlWeights[k], cov->chiSquare(offset)/2, 1e-8);
+	}
+	BOOST_CHECK_THROW(fmin.setRandomParameters(from,0,to,nlWeights), lk::RuntimeError);
+}
 
 BOOST_AUTO_TEST_SUITE_END() // FitParameter
\ No newline at end of file